@@ -1,245 +1,1062 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <curl/curl.h>
-#include "ai.h"
 #include <json-c/json.h>
+#include "ai.h"
+#include "http_pool.h"
+#include "metrics.h"
+#include "response_parser.h"
+#include "response_cache.h"
+#include "context_cache.h"
+#include "singleflight.h"
+#include "sse.h"
+#include "upstream.h"
+#include "router.h"
+#include "logger.h"
 
-#define CHAT_INPUT_MAX 20480 // Max input size
-#define MAX_HISTORY 40000 // Max history size
-#define API_MAX_TOKENS 307200 // API max tokens
+#define STREAM_ERROR_MAX 65536 // Max bytes of a non-SSE error body kept while streaming
+#define DEFAULT_API_BASE "https://generativelanguage.googleapis.com" // Upstream host
+#define SUMMARY_HEADING "Summary of the earlier conversation:\\n" // Leads the summary part (JSON-escaped)
+#define SUMMARY_MAX_TOKENS 512 // Output cap for a rolling summary
+#define SUMMARY_INSTRUCTION "You maintain the running summary of a chat between a user and an assistant. " \
+    "Merge the new messages into the summary so far. Keep names, facts, decisions, preferences and " \
+    "open questions; drop small talk. Reply with the updated summary only, in the conversation's language."
 
 
-// Define the struct completely in the source file
+// Scanner over a generateContent body plus the time spent in it
+struct BodyState {
+    struct ResponseParser parser;
+    uint64_t parse_ns; // Summed across write callbacks
+    char *dump; // Head of the raw body when the request's payloads are sampled, else NULL
+    size_t dump_len;
+    size_t received; // Bytes of the whole body
+};
 
+// Feed each chunk of a generateContent body to the response scanner; the raw
+// body is only kept (up to LOG_PAYLOAD_MAX bytes) for a sampled payload dump
 size_t write_callback(void *contents, size_t size, size_t nmemb, void *userp) {
     size_t realsize = size *nmemb;
-    struct ResponseData *resp = (struct ResponseData *)userp;
-    
-    char *ptr = realloc(resp->data, resp->size + realsize + 1);
-    if(!ptr) {
-        printf("Memory allocation failed!\n");
-        return 0;
+    struct BodyState *body = (struct BodyState *)userp;
+
+    if (body->dump && body->dump_len < LOG_PAYLOAD_MAX) {
+        size_t n = LOG_PAYLOAD_MAX - body->dump_len < realsize ? LOG_PAYLOAD_MAX - body->dump_len : realsize;
+        memcpy(body->dump + body->dump_len, contents, n);
+        body->dump_len += n;
     }
-    
-    resp->data = ptr;
-    memcpy(&(resp->data[resp->size]), contents, realsize);
-    resp->size += realsize;
-    resp->data[resp->size] = 0;
-    
+    body->received += realsize;
+    uint64_t start = metrics_now_ns();
+    response_parser_feed(&body->parser, contents, realsize); // A malformed body is reported by response_parser_finish
+    body->parse_ns += metrics_now_ns() - start;
     return realsize;
 }
 
-// Runtime configuration state
-static char current_model[128] = "gemini-1.5-pro";
-static double current_temperature = 0.7;
-static double current_top_p = 1.0;
-static int current_top_k = 64;
-static int current_max_output_tokens = 2048;
-static char *system_prompt = NULL;
+static char api_base[256] = DEFAULT_API_BASE; // Set once at startup
 
-void ai_set_model(const char *model_name) {
-    if (!model_name) return;
-    strncpy(current_model, model_name, sizeof(current_model) - 1);
-    current_model[sizeof(current_model) - 1] = '\0';
+void ai_set_api_base(const char *base_url) {
+    if (!base_url || base_url[0] == '\0') base_url = DEFAULT_API_BASE;
+    strncpy(api_base, base_url, sizeof(api_base) - 1);
+    api_base[sizeof(api_base) - 1] = '\0';
+    // Drop a trailing slash so URLs can be joined with "/v1beta/..."
+    size_t len = strlen(api_base);
+    if (len > 0 && api_base[len - 1] == '/') api_base[len - 1] = '\0';
 }
 
-void ai_set_generation_params(double temperature, double top_p, int top_k, int max_output_tokens) {
-    if (temperature < 0.0) temperature = 0.0;
-    if (temperature > 2.0) temperature = 2.0;
-    if (top_p < 0.0) top_p = 0.0;
-    if (top_p > 1.0) top_p = 1.0;
-    if (top_k < 1) top_k = 1;
-    if (max_output_tokens < 1) max_output_tokens = 1;
-    if (max_output_tokens > API_MAX_TOKENS) max_output_tokens = API_MAX_TOKENS;
+const char* ai_get_api_base() { return api_base; }
 
-    current_temperature = temperature;
-    current_top_p = top_p;
-    current_top_k = top_k;
-    current_max_output_tokens = max_output_tokens;
+// Function to get user input
+void get_user_input(char *buffer, int max_size) {
+    printf("You: ");
+    fgets(buffer, max_size, stdin);
+    buffer[strcspn(buffer, "\n")] = 0;
 }
 
-void ai_set_system_prompt(const char *prompt_text) {
-    if (system_prompt) {
-        free(system_prompt);
-        system_prompt = NULL;
+// A run of consecutive turns with one role, sent as a single content with several parts
+struct ContentGroup {
+    int role; // enum ChatRole
+    size_t first; // Index of the first turn
+    size_t count; // Turns in the run
+};
+
+// The turns of one request, oldest first, ending with the new input. Roles
+// alternate across groups and group 0 is always the user's.
+struct Conversation {
+    const struct AiConfig *config; // Settings the request is sent with
+    struct ChatTurn *turns; // History turns followed by the input
+    size_t turn_count;
+    struct ContentGroup *groups;
+    size_t group_count;
+    const char *summary; // Summary of the turns before the window, NULL if none
+    size_t summary_len;
+    size_t estimated_tokens; // Uncalibrated estimate of the whole prompt
+};
+
+static int conversation_init(struct Conversation *conv, struct Arena *arena, const struct AiConfig *config,
+                             const char *input, const struct HistoryWindow *history) {
+    size_t n = history ? history->count : 0;
+    conv->config = config;
+    conv->turns = arena_alloc(arena, (n + 1) * sizeof(struct ChatTurn));
+    conv->groups = arena_alloc(arena, (n + 1) * sizeof(struct ContentGroup));
+    if (!conv->turns || !conv->groups) return 0;
+
+    conv->turn_count = 0;
+    for (size_t i = 0; i < n; i++) {
+        const struct ChatTurn *turn = &history->turns[i];
+        if (turn->len == 0) continue; // The API rejects empty parts
+        if (conv->turn_count == 0 && turn->role != ROLE_USER) continue; // A window may open mid-exchange
+        conv->turns[conv->turn_count++] = *turn;
     }
-    if (prompt_text && prompt_text[0] != '\0') {
-        system_prompt = strdup(prompt_text);
+    struct ChatTurn *last = &conv->turns[conv->turn_count++];
+    last->role = ROLE_USER;
+    last->text = input ? input : "";
+    last->len = strlen(last->text);
+
+    // A user turn left without a reply merges with the next one instead of breaking alternation
+    conv->summary = history && history->summary_len ? history->summary : NULL;
+    conv->summary_len = conv->summary ? history->summary_len : 0;
+    conv->estimated_tokens = history_estimate_tokens(conv->summary, conv->summary_len);
+    conv->estimated_tokens += history_estimate_tokens(config->system_prompt,
+                                                      config->system_prompt ? strlen(config->system_prompt) : 0);
+
+    conv->group_count = 0;
+    for (size_t i = 0; i < conv->turn_count; i++) {
+        conv->estimated_tokens += history_estimate_tokens(conv->turns[i].text, conv->turns[i].len);
+        struct ContentGroup *group = conv->group_count ? &conv->groups[conv->group_count - 1] : NULL;
+        if (group && group->role == conv->turns[i].role) {
+            group->count++;
+        } else {
+            group = &conv->groups[conv->group_count++];
+            group->role = conv->turns[i].role;
+            group->first = i;
+            group->count = 1;
+        }
     }
+    return 1;
 }
 
-void ai_clear_system_prompt() {
+static int has_system_instruction(const struct Conversation *conv) {
+    return conv->config->system_prompt || conv->summary;
+}
+
+// The system prompt, then the summary of older turns as a second part
+static void append_system_instruction(struct ArenaBuf *buf, const struct Conversation *conv) {
+    const char *system_prompt = conv->config->system_prompt;
+    arena_buf_puts(buf, "\"systemInstruction\":{\"parts\":[");
     if (system_prompt) {
-        free(system_prompt);
-        system_prompt = NULL;
+        arena_buf_puts(buf, "{\"text\":");
+        arena_buf_json_string(buf, system_prompt, strlen(system_prompt));
+        arena_buf_puts(buf, conv->summary ? "}," : "}");
+    }
+    if (conv->summary) {
+        arena_buf_puts(buf, "{\"text\":\"" SUMMARY_HEADING);
+        arena_buf_json_escape(buf, conv->summary, conv->summary_len);
+        arena_buf_puts(buf, "\"}");
     }
+    arena_buf_puts(buf, "]}");
 }
 
-const char* ai_get_model() { return current_model; }
-double ai_get_temperature() { return current_temperature; }
-double ai_get_top_p() { return current_top_p; }
-int ai_get_top_k() { return current_top_k; }
-int ai_get_max_output_tokens() { return current_max_output_tokens; }
-const char* ai_get_system_prompt() { return system_prompt ? system_prompt : ""; }
-
-// Function to get user input
-void get_user_input(char *buffer, int max_size) {
-    printf("You: ");
-    fgets(buffer, max_size, stdin);
-    buffer[strcspn(buffer, "\n")] = 0;
+// Groups [from, to) as a "contents" array
+static void append_contents(struct ArenaBuf *buf, const struct Conversation *conv, size_t from, size_t to) {
+    arena_buf_puts(buf, "\"contents\":[");
+    for (size_t g = from; g < to; g++) {
+        const struct ContentGroup *group = &conv->groups[g];
+        arena_buf_puts(buf, g > from ? ",{\"role\":" : "{\"role\":");
+        arena_buf_puts(buf, group->role == ROLE_USER ? "\"user\",\"parts\":[" : "\"model\",\"parts\":[");
+        for (size_t t = group->first; t < group->first + group->count; t++) {
+            arena_buf_puts(buf, t > group->first ? ",{\"text\":" : "{\"text\":");
+            arena_buf_json_string(buf, conv->turns[t].text, conv->turns[t].len);
+            arena_buf_puts(buf, "}");
+        }
+        arena_buf_puts(buf, "]}");
+    }
+    arena_buf_puts(buf, "]");
 }
 
-// Build JSON payload with optional history and system prompt and generationConfig
-static char* create_json_payload(const char *input, const char *history) {
-    // Create JSON objects
-    struct json_object *root = json_object_new_object();
-
-    // contents array
-    struct json_object *contents = json_object_new_array();
-
-    // If system prompt is set, add as the first part
-    if (system_prompt && system_prompt[0] != '\0') {
-        struct json_object *sys_content = json_object_new_object();
-        struct json_object *sys_parts = json_object_new_array();
-        struct json_object *sys_text_part = json_object_new_object();
-        json_object_object_add(sys_text_part, "text", json_object_new_string(system_prompt));
-        json_object_array_add(sys_parts, sys_text_part);
-        json_object_object_add(sys_content, "role", json_object_new_string("user"));
-        json_object_object_add(sys_content, "parts", sys_parts);
-        json_object_array_add(contents, sys_content);
-    }
-
-    // Add combined history + current input as a single content
-    char *combined_text = NULL;
-    size_t hist_len = history ? strlen(history) : 0;
-    size_t input_len = input ? strlen(input) : 0;
-    size_t combined_len = hist_len + input_len + 64;
-    combined_text = (char*)malloc(combined_len);
-    if (!combined_text) {
-        json_object_put(root);
-        return strdup("Memory allocation error");
-    }
-    if (hist_len > MAX_HISTORY) {
-        history = history + hist_len - MAX_HISTORY;
-        hist_len = strlen(history);
+// Build the generateContent payload: systemInstruction plus alternating
+// user/model contents, or a cachedContent reference replacing the system
+// instruction and the first prefix groups. The payload is written straight
+// into the request arena instead of building a json-c tree.
+static char* create_json_payload(struct Arena *arena, const struct Conversation *conv, const char *cached_name,
+                                 size_t prefix) {
+    const struct AiConfig *config = conv->config;
+    struct ArenaBuf buf;
+    size_t text_len = (config->system_prompt ? strlen(config->system_prompt) : 0) + conv->summary_len;
+    for (size_t i = 0; i < conv->turn_count; i++) text_len += conv->turns[i].len + 32;
+    arena_buf_init(&buf, arena, text_len + 256);
+
+    arena_buf_puts(&buf, "{");
+    if (cached_name) {
+        arena_buf_puts(&buf, "\"cachedContent\":");
+        arena_buf_json_string(&buf, cached_name, strlen(cached_name));
+        arena_buf_puts(&buf, ",");
+    } else {
+        prefix = 0;
+        if (has_system_instruction(conv)) {
+            append_system_instruction(&buf, conv);
+            arena_buf_puts(&buf, ",");
+        }
     }
-    snprintf(combined_text, combined_len, "Previous conversation:\n%s\nUser: %s", history ? history : "", input ? input : "");
+    append_contents(&buf, conv, prefix, conv->group_count);
+
+    // generationConfig
+    arena_buf_printf(&buf, ",\"generationConfig\":{\"temperature\":%g,\"topP\":%g,\"topK\":%d,\"maxOutputTokens\":%d}}",
+                     config->temperature, config->top_p, config->top_k, config->max_output_tokens);
 
-    struct json_object *user_content = json_object_new_object();
-    struct json_object *user_parts = json_object_new_array();
-    struct json_object *user_text_part = json_object_new_object();
-    json_object_object_add(user_text_part, "text", json_object_new_string(combined_text));
-    json_object_array_add(user_parts, user_text_part);
-    json_object_object_add(user_content, "parts", user_parts);
-    json_object_array_add(contents, user_content);
-    free(combined_text);
+    return buf.data;
+}
 
-    json_object_object_add(root, "contents", contents);
+// Leading groups worth serving from an upstream cache: an even count (so the
+// prefix ends on a model reply) rounded down to CONTEXT_CACHE_BLOCK so it stays
+// stable for several exchanges, and large enough to meet the minimum. Returns
+// -1 when the request should be sent inline.
+static long context_prefix(const struct Conversation *conv) {
+    size_t prefix = (conv->group_count - 1) / CONTEXT_CACHE_BLOCK * CONTEXT_CACHE_BLOCK;
+    const char *system_prompt = conv->config->system_prompt;
+    size_t tokens = history_estimate_tokens(conv->summary, conv->summary_len);
+    if (system_prompt) tokens += history_estimate_tokens(system_prompt, strlen(system_prompt));
+    if (prefix == 0 && tokens == 0) return -1;
+    for (size_t g = 0; g < prefix; g++) {
+        const struct ContentGroup *group = &conv->groups[g];
+        for (size_t t = group->first; t < group->first + group->count; t++) {
+            tokens += history_estimate_tokens(conv->turns[t].text, conv->turns[t].len);
+        }
+    }
+    return history_calibrated(tokens) >= (size_t)context_cache_min_tokens() ? (long)prefix : -1;
+}
 
-    // generationConfig
-    struct json_object *gen = json_object_new_object();
-    json_object_object_add(gen, "temperature", json_object_new_double(current_temperature));
-    json_object_object_add(gen, "topP", json_object_new_double(current_top_p));
-    json_object_object_add(gen, "topK", json_object_new_int(current_top_k));
-    json_object_object_add(gen, "maxOutputTokens", json_object_new_int(current_max_output_tokens));
-    json_object_object_add(root, "generationConfig", gen);
-
-    const char *json_c_str = json_object_to_json_string(root);
-    char *json_payload = strdup(json_c_str);
-    json_object_put(root);
-    return json_payload;
+// Exact identity of a cached prefix; any change to it needs a new cache
+static void build_context_key(struct CacheKey *key, const struct Conversation *conv, size_t prefix) {
+    const struct AiConfig *config = conv->config;
+    cache_key_init(key);
+    cache_key_add(key, config->model, strlen(config->model));
+    cache_key_add(key, config->system_prompt ? config->system_prompt : "",
+                  config->system_prompt ? strlen(config->system_prompt) : 0);
+    cache_key_add(key, conv->summary ? conv->summary : "", conv->summary_len);
+    size_t turns = prefix ? conv->groups[prefix - 1].first + conv->groups[prefix - 1].count : 0;
+    for (size_t t = 0; t < turns; t++) {
+        char role = (char)conv->turns[t].role;
+        cache_key_add(key, &role, 1);
+        cache_key_add(key, conv->turns[t].text, conv->turns[t].len);
+    }
+}
+
+// Fingerprint everything that shapes the reply: model, sampling config,
+// system prompt and the whitespace-normalized conversation
+static void build_cache_key(struct CacheKey *key, const struct AiConfig *config, const char *input,
+                            const struct HistoryWindow *history) {
+    cache_key_init(key);
+    cache_key_add(key, config->model, strlen(config->model));
+    cache_key_add(key, (const char *)&config->temperature, sizeof(config->temperature));
+    cache_key_add(key, (const char *)&config->top_p, sizeof(config->top_p));
+    cache_key_add(key, (const char *)&config->top_k, sizeof(config->top_k));
+    cache_key_add(key, (const char *)&config->max_output_tokens, sizeof(config->max_output_tokens));
+    cache_key_add_text(key, config->system_prompt);
+    cache_key_add_text(key, history ? history->summary : NULL);
+    for (size_t i = 0; history && i < history->count; i++) {
+        char role = (char)history->turns[i].role;
+        cache_key_add(key, &role, 1);
+        cache_key_add_text(key, history->turns[i].text);
+    }
+    cache_key_add_text(key, input);
 }
 
 void init_ai() {
-    curl_global_init(CURL_GLOBAL_ALL); // Initialize CURL
+    http_pool_init(HTTP_POOL_MAX_IDLE); // Shared DNS/TLS/connection cache, set up on first use
+    ai_set_api_base(getenv("GEMINI_API_BASE")); // e.g. http://127.0.0.1:9090 for a local stand-in
 }
 
 void cleanup_ai() {
-    curl_global_cleanup(); // Cleanup CURL
-    ai_clear_system_prompt();
+    http_pool_cleanup(); // Close pooled handles and connections, then clean up curl
+}
+
+// Describe a failed upstream call for the client; never stored in history
+static void describe_failure(const struct AiResponse *r, int error, char *out, size_t size) {
+    if (r->error_code) {
+        snprintf(out, size, "API error %d %s: %s", r->error_code, r->error_status, r->error_message);
+    } else if (r->block_reason[0]) {
+        snprintf(out, size, "Prompt blocked: %s", r->block_reason);
+    } else if (error == UPSTREAM_TRANSPORT || error == UPSTREAM_TIMEOUT) {
+        snprintf(out, size, "Could not reach the Gemini API: %s", r->error_message[0] ? r->error_message : "transfer failed");
+    } else if (error == UPSTREAM_RATE_LIMITED || error == UPSTREAM_UNAVAILABLE || error == UPSTREAM_REJECTED) {
+        snprintf(out, size, "Gemini API answered HTTP %d", r->http_status);
+    } else if (error == UPSTREAM_CIRCUIT_OPEN) {
+        snprintf(out, size, "Gemini API is failing, not retrying for %lds", r->retry_after);
+    } else if (error == UPSTREAM_OVERLOADED) {
+        snprintf(out, size, "Too many Gemini API calls in flight, try again");
+    } else {
+        snprintf(out, size, "Empty response from API");
+    }
 }
 
-// Update get_ai_response to use history
-char* get_ai_response(const char* input, const char* history) {
-    CURL *curl;
-    CURLcode res;
-    struct ResponseData resp;
+static void sleep_ms(long ms) {
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+    while (nanosleep(&ts, &ts) != 0) {}
+}
+
+// HTTP status and Retry-After of a finished transfer
+static void read_status(CURL *curl, struct AiResponse *r) {
+    long status = 0;
+    curl_off_t retry_after = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+    curl_easy_getinfo(curl, CURLINFO_RETRY_AFTER, &retry_after);
+    r->http_status = (int)status;
+    r->retry_after = (long)retry_after;
+}
+
+// Record curl's timing breakdown and transfer sizes for one upstream call
+static void record_transfer(CURL *curl, size_t payload_len) {
+    curl_off_t connect_us = 0, tls_us = 0, ttfb_us = 0, total_us = 0, received = 0;
+    long new_connections = 0;
+    curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect_us);
+    curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &tls_us);
+    curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &ttfb_us);
+    curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total_us);
+    curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &received);
+    curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &new_connections);
+
+    metrics_add(M_UPSTREAM_REQUESTS, 1);
+    metrics_add(M_UPSTREAM_BYTES_OUT, payload_len);
+    metrics_add(M_UPSTREAM_BYTES_IN, (uint64_t)received);
+    uint64_t start = metrics_now_ns() - (uint64_t)total_us * 1000; // curl times are offsets from the start
+    if (new_connections > 0) {
+        // Reused connections skip connect and handshake; only fresh ones are timed
+        metrics_observe(H_UPSTREAM_CONNECT, (uint64_t)connect_us * 1000);
+        log_span(H_UPSTREAM_CONNECT, start, (uint64_t)connect_us * 1000);
+        if (tls_us > connect_us) {
+            metrics_observe(H_UPSTREAM_TLS, (uint64_t)(tls_us - connect_us) * 1000);
+            log_span(H_UPSTREAM_TLS, start + (uint64_t)connect_us * 1000, (uint64_t)(tls_us - connect_us) * 1000);
+        }
+    }
+    if (ttfb_us > 0) {
+        metrics_observe(H_UPSTREAM_TTFB, (uint64_t)ttfb_us * 1000);
+        log_span(H_UPSTREAM_TTFB, start, (uint64_t)ttfb_us * 1000);
+    }
+    metrics_observe(H_UPSTREAM_TOTAL, (uint64_t)total_us * 1000);
+    log_span(H_UPSTREAM_TOTAL, start, (uint64_t)total_us * 1000);
+}
+
+// Count token usage of an answered call (failures are counted by upstream_classify)
+static void record_usage(const struct AiResponse *r) {
+    if (!r->candidates) return;
+    metrics_add(M_TOKENS_PROMPT, (uint64_t)r->prompt_tokens);
+    metrics_add(M_TOKENS_CANDIDATE, (uint64_t)r->candidate_tokens);
+    metrics_add(M_TOKENS_TOTAL, (uint64_t)r->total_tokens);
+    metrics_add(M_TOKENS_CACHED, (uint64_t)r->cached_tokens);
+}
+
+// Key for coalescing: identical model and payload means an identical upstream call
+static void build_flight_key(struct CacheKey *key, const char *model, const char *json_data) {
+    cache_key_init(key);
+    cache_key_add(key, model, strlen(model));
+    cache_key_add(key, json_data, strlen(json_data));
+}
+
+// Options of one POST of json_data to url, scanned into body
+static void setup_post(CURL *curl, const char *url, struct curl_slist *headers, const char *json_data,
+                       struct BodyState *body) {
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, json_data);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)body);
+    upstream_apply_timeouts(curl, 0);
+    body->dump = log_payload_sampled() ? malloc(LOG_PAYLOAD_MAX) : NULL;
+    body->dump_len = 0;
+    body->received = 0;
+}
+
+static void dump_request(const char *json_data) {
+    if (!log_payload_sampled()) return;
+    size_t len = strlen(json_data);
+    log_payload("upstream_request", json_data, len, len);
+}
+
+// Log the kept head of a body under event (NULL to drop it) and free it
+static void finish_dump(struct BodyState *body, const char *event) {
+    if (body->dump && event) log_payload(event, body->dump, body->dump_len, body->received);
+    free(body->dump);
+    body->dump = NULL;
+}
+
+// POST json_data to url, scanning the reply into body
+static CURLcode post_json(const char *url, const char *json_data, struct BodyState *body) {
+    CURL *curl = http_pool_acquire();
+    if (!curl) return CURLE_FAILED_INIT;
+
+    struct curl_slist *headers = NULL;
+    headers = curl_slist_append(headers, "Content-Type: application/json");
+    setup_post(curl, url, headers, json_data, body);
+    dump_request(json_data);
+
+    CURLcode res = curl_easy_perform(curl);
+    finish_dump(body, "upstream_response");
+
+    record_transfer(curl, strlen(json_data));
+    curl_slist_free_all(headers);
+    http_pool_release(curl);
+    return res;
+}
+
+// One attempt at a generateContent call, hedged with a second copy when the
+// controller says so. Fills r and returns its enum UpstreamError.
+static int generate_once(struct Arena *arena, const char *url, const char *json_data, struct AiResponse *r) {
+    struct BodyState bodies[2];
+    CURL *handles[2] = { http_pool_acquire(), NULL };
+    memset(r, 0, sizeof(*r));
+    if (!handles[0]) return UPSTREAM_TRANSPORT;
+    if (upstream_hedging()) handles[1] = http_pool_acquire();
+
+    struct curl_slist *headers = NULL;
+    headers = curl_slist_append(headers, "Content-Type: application/json");
+    for (int i = 0; i < 2; i++) {
+        if (!handles[i]) continue;
+        // Text is allocated after the payload so it grows in place; a hedge
+        // uses malloc so the two bodies do not interleave in the arena
+        response_parser_init(&bodies[i].parser, i == 0 ? arena : NULL);
+        bodies[i].parse_ns = 0;
+        setup_post(handles[i], url, headers, json_data, &bodies[i]);
+    }
+
+    int winner = 0;
+    dump_request(json_data);
+    CURLcode res = upstream_perform(handles[0], handles[1], &winner);
+    for (int i = 0; i < 2; i++) {
+        if (handles[i]) finish_dump(&bodies[i], i == winner ? "upstream_response" : NULL);
+    }
+
+    struct BodyState *body = &bodies[winner];
+    record_transfer(handles[winner], strlen(json_data));
+    int parsed = 0;
+    if (res == CURLE_OK) {
+        metrics_observe(H_RESPONSE_PARSE, body->parse_ns);
+        // Scanning is spread over the transfer; the trace shows its sum as one span after it
+        log_span(H_RESPONSE_PARSE, metrics_now_ns() - body->parse_ns, body->parse_ns);
+        parsed = response_parser_finish(&body->parser);
+        *r = body->parser.result; // Error fields are kept even from a partial body
+        if (winner == 1 && r->text) r->text = arena_strndup(arena, r->text, r->text_len);
+    } else {
+        snprintf(r->error_message, sizeof(r->error_message), "%s", curl_easy_strerror(res));
+    }
+    read_status(handles[winner], r);
+    int error = upstream_classify(res, r->http_status, r, parsed);
+    if (error == UPSTREAM_OK) record_usage(r);
+
+    if (handles[1]) response_parser_free(&bodies[1].parser);
+    curl_slist_free_all(headers);
+    http_pool_release(handles[0]);
+    http_pool_release(handles[1]);
+    return error;
+}
+
+// One generateContent call to the route's current model under the upstream
+// controller: transient failures are retried with jittered backoff, honoring
+// Retry-After, unless the route has another model to fail over to. Returns
+// the text in arena, or an error message with r->upstream_error set.
+static char* call_generate(struct Arena *arena, struct Route *route, const char *json_data, struct AiResponse *r) {
     const char *api_key_env = getenv("GEMINI_API_KEY");
     const char *api_key = api_key_env ? api_key_env : ""; // API key from env
-    char url[256];
-    
-    resp.data = malloc(1);
-    resp.size = 0;
+    const char *model = router_model(route);
+    char url[512];
 
     snprintf(url, sizeof(url), 
-        "https://generativelanguage.googleapis.com/v1beta/models/%s:generateContent?key=%s",
-        current_model, api_key);
-    
-    curl = curl_easy_init();
-    if(!curl) {
-        free(resp.data);
-        return strdup("Error initializing CURL");
+        "%s/v1beta/models/%s:generateContent?key=%s",
+        api_base, model, api_key);
+
+    uint64_t start = metrics_now_ns();
+    int error;
+    for (int attempt = 0;; attempt++) {
+        error = upstream_acquire();
+        if (error == UPSTREAM_OK) {
+            uint64_t sent = metrics_now_ns();
+            error = generate_once(arena, url, json_data, r);
+            uint64_t latency = metrics_now_ns() - sent;
+            upstream_release(error, latency);
+            router_report(route, error, latency, r);
+            if (error == UPSTREAM_OK) {
+                upstream_observe_latency(latency);
+                snprintf(r->model, sizeof(r->model), "%s", model);
+                return r->text ? r->text : arena_strdup(arena, "");
+            }
+        } else {
+            memset(r, 0, sizeof(*r));
+            r->retry_after = upstream_retry_after();
+        }
+        r->upstream_error = error;
+        if (router_can_fail_over(route, r)) break; // Another model beats waiting on this one
+        long delay = upstream_retry_delay_ms(attempt, error, r->retry_after, (metrics_now_ns() - start) / 1000000ULL);
+        if (delay < 0) break;
+        sleep_ms(delay);
+    }
+
+    char message[sizeof(r->error_message) + 128];
+    r->upstream_error = error;
+    snprintf(r->model, sizeof(r->model), "%s", model);
+    describe_failure(r, error, message, sizeof(message));
+    r->text = arena_strdup(arena, message);
+    r->text_len = r->text ? strlen(r->text) : 0;
+    return r->text;
+}
+
+// Create a cachedContent holding the system instruction and the first prefix
+// groups. Copies its resource name into name and returns 1 on success.
+static int create_context_cache(struct Arena *arena, const struct Conversation *conv, size_t prefix,
+                                char *name, size_t size) {
+    struct ArenaBuf buf;
+    struct BodyState body;
+    const char *api_key_env = getenv("GEMINI_API_KEY");
+    const char *api_key = api_key_env ? api_key_env : ""; // API key from env
+    char url[512];
+
+    arena_buf_init(&buf, arena, 1024);
+    arena_buf_puts(&buf, "{\"model\":\"models/");
+    arena_buf_json_escape(&buf, conv->config->model, strlen(conv->config->model));
+    arena_buf_puts(&buf, "\"");
+    if (has_system_instruction(conv)) {
+        arena_buf_puts(&buf, ",");
+        append_system_instruction(&buf, conv);
+    }
+    if (prefix > 0) {
+        arena_buf_puts(&buf, ",");
+        append_contents(&buf, conv, 0, prefix);
+    }
+    arena_buf_printf(&buf, ",\"ttl\":\"%ds\"}", context_cache_ttl());
+    if (!buf.data) return 0;
+
+    snprintf(url, sizeof(url), "%s/v1beta/cachedContents?key=%s", api_base, api_key);
+    response_parser_init(&body.parser, arena);
+    body.parse_ns = 0;
+
+    CURLcode res = post_json(url, buf.data, &body);
+    int ok = res == CURLE_OK && response_parser_finish(&body.parser) &&
+             !body.parser.result.error_code && body.parser.result.name[0];
+    if (!ok) {
+        metrics_add(M_CONTEXT_CACHE_FAILURES, 1); // The request still goes out inline
+        return 0;
+    }
+    metrics_add(M_CONTEXT_CACHE_CREATES, 1);
+    strncpy(name, body.parser.result.name, size - 1);
+    name[size - 1] = '\0';
+    return 1;
+}
+
+// What build_request decided about one upstream payload
+struct RequestPlan {
+    int uses_context; // The payload references a cachedContent
+    struct CacheKey context_key; // Identity of that cachedContent
+    size_t estimated_tokens; // Uncalibrated estimate of the prompt
+};
+
+// Build the upstream payload for input after history. When allow_context is
+// set and the prefix is large enough, the payload references a cachedContent
+// (created on first use) and plan->context_key identifies it.
+static char* build_request(struct Arena *arena, const struct AiConfig *config, const char *input,
+                           const struct HistoryWindow *history, int allow_context, struct RequestPlan *plan) {
+    struct Conversation conv;
+    char name[CONTEXT_CACHE_NAME_MAX] = "";
+    long prefix = -1;
+
+    plan->uses_context = 0;
+    if (!conversation_init(&conv, arena, config, input, history)) return NULL;
+    plan->estimated_tokens = conv.estimated_tokens;
+    if (allow_context && context_cache_enabled()) prefix = context_prefix(&conv);
+    if (prefix >= 0) {
+        build_context_key(&plan->context_key, &conv, (size_t)prefix);
+        if (context_cache_get(&plan->context_key, name, sizeof(name))) {
+            metrics_add(M_CONTEXT_CACHE_HITS, 1);
+        } else if (create_context_cache(arena, &conv, (size_t)prefix, name, sizeof(name))) {
+            context_cache_put(&plan->context_key, name);
+        }
+        plan->uses_context = name[0] != '\0';
+    }
+
+    uint64_t build_start = metrics_now_ns();
+    char *json_data = create_json_payload(arena, &conv, plan->uses_context ? name : NULL, prefix > 0 ? (size_t)prefix : 0);
+    uint64_t build_ns = metrics_now_ns() - build_start;
+    metrics_observe(H_PAYLOAD_BUILD, build_ns);
+    log_span(H_PAYLOAD_BUILD, build_start, build_ns);
+    return json_data;
+}
+
+// The upstream cache behind a rejected reference may have expired or been
+// deleted; forget it so the caller can resend the request inline
+static int context_rejected(const struct RequestPlan *plan, const struct AiResponse *r) {
+    if (!plan->uses_context || !r->error_code) return 0;
+    context_cache_invalidate(&plan->context_key);
+    metrics_add(M_CONTEXT_CACHE_FAILURES, 1);
+    return 1;
+}
+
+// Calibrated size of the prompt, for routing before the payload is built
+static size_t estimate_prompt(const struct AiConfig *config, const char *input, const struct HistoryWindow *history) {
+    size_t raw = history_estimate_tokens(input, strlen(input));
+    if (config->system_prompt) raw += history_estimate_tokens(config->system_prompt, strlen(config->system_prompt));
+    return (history ? history->tokens : 0) + history_calibrated(raw);
+}
+
+// After a failed call, decide whether to go again: inline when a context
+// reference was rejected, or on the route's next model. Rebuilds *json_data
+// when the old payload no longer applies; returns 0 when done.
+static int next_attempt(struct Arena *arena, struct AiConfig *routed, const char *input,
+                        const struct HistoryWindow *history, struct Route *route, struct RequestPlan *plan,
+                        const struct AiResponse *r, char **json_data) {
+    if (context_rejected(plan, r)) {
+        // Resend inline below
+    } else if (r->upstream_error && router_can_fail_over(route, r)) {
+        router_fail_over(route);
+        routed->model = router_model(route);
+        if (!plan->uses_context) return 1; // The payload does not name the model
+    } else {
+        return 0;
+    }
+    // A cachedContent belongs to one model; the fallback gets the prompt inline
+    char *rebuilt = build_request(arena, routed, input, history, 0, plan);
+    if (!rebuilt) return 0;
+    *json_data = rebuilt;
+    return 1;
+}
+
+// Update get_ai_response to use history.
+// The returned text lives in arena and is released with it.
+char* get_ai_response(struct Arena *arena, const struct AiConfig *config, const char* input,
+                      const struct HistoryWindow *history, struct AiResponse *info) {
+    struct AiResponse r;
+    if (info) memset(info, 0, sizeof(*info));
+
+    struct CacheKey key;
+    int cacheable = response_cache_applies(config->temperature);
+    if (cacheable) {
+        build_cache_key(&key, config, input, history);
+        char *cached = response_cache_get(&key, arena);
+        if (cached) return cached;
+    }
+
+    // The router picks the model; the caches above stay keyed on the one requested
+    struct Route route;
+    struct AiConfig routed = *config;
+    router_plan(&route, config, estimate_prompt(config, input, history), 0, router_default_policy());
+    routed.model = router_model(&route);
+
+    struct RequestPlan plan;
+    char *json_data = build_request(arena, &routed, input, history, 1, &plan);
+    if (!json_data) {
+        return arena_strdup(arena, "Memory allocation error");
+    }
+
+    // Identical requests already in flight share one upstream call
+    int leader = 1;
+    struct Flight *flight = NULL;
+    if (singleflight_enabled()) {
+        struct CacheKey flight_key;
+        build_flight_key(&flight_key, config->model, json_data);
+        flight = singleflight_join(&flight_key, &leader);
+    }
+    if (!leader) {
+        char *shared = singleflight_wait(flight, NULL, NULL, &r);
+        singleflight_release(flight);
+        char *result = arena_strdup(arena, shared ? shared : "Memory allocation error");
+        free(shared);
+        if (info) {
+            *info = r;
+            info->text = result;
+        }
+        return result;
+    }
+
+    char *result = call_generate(arena, &route, json_data, &r);
+    while (next_attempt(arena, &routed, input, history, &route, &plan, &r, &json_data)) {
+        result = call_generate(arena, &route, json_data, &r);
+    }
+    history_calibrate(plan.estimated_tokens, r.prompt_tokens);
+    if (flight) {
+        singleflight_complete(flight, result, &r);
+        singleflight_release(flight);
+    }
+    if (info) *info = r;
+
+    if (cacheable && !r.upstream_error && r.text_len > 0) {
+        response_cache_put(&key, r.text, r.text_len);
+    }
+    return result;
+}
+
+char* ai_summarize(const struct AiConfig *config, const struct HistoryWindow *old) {
+    struct Arena arena;
+    struct ArenaBuf buf;
+    struct AiResponse r;
+
+    arena_init(&arena);
+    arena_buf_init(&buf, &arena, old->bytes + old->summary_len + 1024);
+    arena_buf_puts(&buf, "{\"systemInstruction\":{\"parts\":[{\"text\":\"" SUMMARY_INSTRUCTION "\"}]},"
+                         "\"contents\":[{\"role\":\"user\",\"parts\":[{\"text\":\"");
+    if (old->summary) {
+        arena_buf_puts(&buf, "Summary so far:\\n");
+        arena_buf_json_escape(&buf, old->summary, old->summary_len);
+        arena_buf_puts(&buf, "\\n\\n");
+    }
+    arena_buf_puts(&buf, "New messages:\\n");
+    for (size_t i = 0; i < old->count; i++) {
+        arena_buf_puts(&buf, old->turns[i].role == ROLE_USER ? "User: " : "Assistant: ");
+        arena_buf_json_escape(&buf, old->turns[i].text, old->turns[i].len);
+        arena_buf_puts(&buf, "\\n");
+    }
+    arena_buf_printf(&buf, "\"}]}],\"generationConfig\":{\"temperature\":0.2,\"maxOutputTokens\":%d}}",
+                     SUMMARY_MAX_TOKENS);
+
+    char *summary = NULL;
+    if (buf.data) {
+        // Summaries go to the cheapest model that fits, falling back like chats
+        struct Route route;
+        router_plan(&route, config, history_calibrated(history_estimate_tokens(buf.data, buf.len)), 0, ROUTER_COST);
+        char *text = call_generate(&arena, &route, buf.data, &r);
+        while (r.upstream_error && router_can_fail_over(&route, &r)) {
+            router_fail_over(&route);
+            text = call_generate(&arena, &route, buf.data, &r);
+        }
+        if (!r.upstream_error && r.text_len > 0) summary = strdup(text);
+    }
+    metrics_add(summary ? M_SUMMARIES : M_SUMMARY_FAILURES, 1);
+    arena_free(&arena);
+    return summary;
+}
+
+// State shared with the curl callbacks of a streaming request
+struct StreamState {
+    struct SseParser parser; // Incremental SSE parser over the upstream body
+    struct ResponseParser response; // Fields of every event; text accumulates across events
+    ai_delta_cb on_delta; // Caller's delta callback
+    void *userdata; // Caller's callback data
+    struct Flight *flight; // Coalesced call the deltas are also published to, if any
+    struct ResponseData raw; // Body prefix, used when upstream answers with plain JSON
+    int events; // Number of SSE events seen
+    size_t delivered; // Text bytes passed to on_delta
+    uint64_t first_delta_ns; // When the first text arrived
+    uint64_t parse_ns; // Time spent scanning events
+};
+
+static int append_bytes(struct ResponseData *buf, const char *bytes, size_t len) {
+    char *ptr = realloc(buf->data, buf->size + len + 1);
+    if (!ptr) return 0;
+    buf->data = ptr;
+    memcpy(buf->data + buf->size, bytes, len);
+    buf->size += len;
+    buf->data[buf->size] = 0;
+    return 1;
+}
+
+// Each SSE event carries a full GenerateContentResponse holding the next text delta
+static void stream_event(const char *data, size_t len, void *userdata) {
+    struct StreamState *state = (struct StreamState *)userdata;
+    state->events++;
+
+    size_t before = state->response.result.text_len;
+    uint64_t start = metrics_now_ns();
+    response_parser_reset(&state->response); // A malformed event does not poison the next one
+    response_parser_feed(&state->response, data, len);
+    state->parse_ns += metrics_now_ns() - start;
+
+    size_t after = state->response.result.text_len;
+    if (after > before) {
+        const char *delta = state->response.result.text + before;
+        if (!state->delivered) state->first_delta_ns = metrics_now_ns();
+        state->on_delta(delta, after - before, state->userdata);
+        if (state->flight) singleflight_publish(state->flight, delta, after - before);
+        state->delivered += after - before;
+    }
+}
+
+static size_t stream_write_callback(void *contents, size_t size, size_t nmemb, void *userp) {
+    size_t realsize = size * nmemb;
+    struct StreamState *state = (struct StreamState *)userp;
+
+    if (state->events == 0 && state->raw.size < STREAM_ERROR_MAX) {
+        append_bytes(&state->raw, contents, realsize);
+    }
+    if (!sse_parser_feed(&state->parser, contents, realsize)) return 0;
+    return realsize;
+}
+
+// Pick the error fields out of a plain JSON body that replaced the event
+// stream; returns whether it was a complete document
+static int scan_error_body(const char *data, size_t len, struct AiResponse *r) {
+    struct ResponseParser parser;
+    response_parser_init(&parser, NULL);
+    response_parser_feed(&parser, data, len);
+    int parsed = response_parser_finish(&parser);
+    if (parsed) {
+        *r = parser.result;
+        r->text = NULL;
+        r->text_len = 0;
+    }
+    response_parser_free(&parser);
+    return parsed;
+}
+
+// One streamGenerateContent attempt. Fills r (upstream_error included) and
+// returns the malloc'd text on success, NULL on failure; *delivered counts
+// the text bytes already passed to on_delta, the first at *first_delta_ns.
+static char* stream_once(const char *url, const char *json_data, ai_delta_cb on_delta, void *userdata,
+                         struct Flight *flight, struct AiResponse *r, size_t *delivered, uint64_t *first_delta_ns) {
+    struct StreamState state;
+
+    memset(r, 0, sizeof(*r));
+    memset(&state, 0, sizeof(state));
+    state.on_delta = on_delta;
+    state.userdata = userdata;
+    state.flight = flight;
+    sse_parser_init(&state.parser, stream_event, &state);
+    response_parser_init(&state.response, NULL);
+
+    CURL *curl = http_pool_acquire();
+    if (!curl) {
+        sse_parser_free(&state.parser);
+        r->upstream_error = UPSTREAM_TRANSPORT;
+        *delivered = 0;
+        *first_delta_ns = 0;
+        return NULL;
     }
 
     struct curl_slist *headers = NULL;
     headers = curl_slist_append(headers, "Content-Type: application/json");
-    
-    char *json_data = create_json_payload(input, history);
-    
+    headers = curl_slist_append(headers, "Accept: text/event-stream");
+
     curl_easy_setopt(curl, CURLOPT_URL, url);
     curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
     curl_easy_setopt(curl, CURLOPT_POSTFIELDS, json_data);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&resp);
-    
-    res = curl_easy_perform(curl);
-    
-    
-    printf("Raw API Response:\n%s\n", resp.data);
-    
-    free(json_data);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, stream_write_callback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&state);
+    upstream_apply_timeouts(curl, 1);
+
+    dump_request(json_data);
+    CURLcode res = curl_easy_perform(curl);
+    sse_parser_finish(&state.parser);
+
+    record_transfer(curl, strlen(json_data));
+    struct AiResponse *parsed = &state.response.result;
+    int complete = 0;
+    if (res == CURLE_OK && state.events > 0) {
+        metrics_observe(H_RESPONSE_PARSE, state.parse_ns);
+        log_span(H_RESPONSE_PARSE, metrics_now_ns() - state.parse_ns, state.parse_ns);
+        *r = *parsed;
+        complete = 1;
+    } else if (res == CURLE_OK && state.raw.data) {
+        complete = scan_error_body(state.raw.data, state.raw.size, r); // Plain (error) body instead of SSE
+    } else if (res != CURLE_OK) {
+        snprintf(r->error_message, sizeof(r->error_message), "%s", curl_easy_strerror(res));
+    }
+    read_status(curl, r);
+    r->upstream_error = upstream_classify(res, r->http_status, r, complete);
     curl_slist_free_all(headers);
-    curl_easy_cleanup(curl);
+    http_pool_release(curl);
 
-    if(res != CURLE_OK) {
-        char *error = strdup(curl_easy_strerror(res));
-        free(resp.data);
-        return error;
+    char *result = NULL;
+    if (r->upstream_error == UPSTREAM_OK) {
+        record_usage(r);
+        result = parsed->text ? parsed->text : strdup("");
+        parsed->text = NULL; // Ownership moves to the caller
     }
+    r->text = result;
+    r->text_len = result ? strlen(result) : 0;
+    *delivered = state.delivered;
+    *first_delta_ns = state.first_delta_ns;
+
+    free(state.raw.data);
+    response_parser_free(&state.response);
+    sse_parser_free(&state.parser);
+    return result;
+}
+
+// One streamGenerateContent call to the route's current model under the
+// upstream controller. A failure is retried (or left to fail over) only while
+// nothing has reached the client; *delivered says whether something did.
+// Returns the malloc'd text, or an error message with r->upstream_error set.
+static char* call_stream(struct Route *route, const char *json_data, ai_delta_cb on_delta, void *userdata,
+                         struct Flight *flight, struct AiResponse *r, size_t *delivered) {
+    const char *api_key_env = getenv("GEMINI_API_KEY");
+    const char *api_key = api_key_env ? api_key_env : ""; // API key from env
+    const char *model = router_model(route);
+    char url[512];
+
+    snprintf(url, sizeof(url),
+        "%s/v1beta/models/%s:streamGenerateContent?alt=sse&key=%s",
+        api_base, model, api_key);
 
-    // Parse the JSON response to extract the actual message
-    struct json_object *parsed_json = json_tokener_parse(resp.data);
-    if (!parsed_json) {
-        free(resp.data);
-        return strdup("Error parsing JSON response");
+    uint64_t start = metrics_now_ns();
+    int error;
+    for (int attempt = 0;; attempt++) {
+        uint64_t first_delta_ns = 0;
+        *delivered = 0;
+        error = upstream_acquire();
+        if (error == UPSTREAM_OK) {
+            uint64_t sent = metrics_now_ns();
+            char *result = stream_once(url, json_data, on_delta, userdata, flight, r, delivered, &first_delta_ns);
+            error = r->upstream_error;
+            uint64_t finished = metrics_now_ns();
+            upstream_release(error, finished - sent);
+            router_report(route, error, (first_delta_ns ? first_delta_ns : finished) - sent, r);
+            if (result) {
+                snprintf(r->model, sizeof(r->model), "%s", model);
+                return result;
+            }
+        } else {
+            memset(r, 0, sizeof(*r));
+            r->retry_after = upstream_retry_after();
+        }
+        r->upstream_error = error;
+        // Text already shown to the client cannot be taken back
+        if (*delivered || router_can_fail_over(route, r)) break;
+        long delay = upstream_retry_delay_ms(attempt, error, r->retry_after, (metrics_now_ns() - start) / 1000000ULL);
+        if (delay < 0) break;
+        sleep_ms(delay);
     }
 
-    // Navigate through the JSON structure
-    struct json_object *candidates = NULL, *first_candidate = NULL, *content = NULL, *parts = NULL, *first_part = NULL, *text = NULL;
-    
-    if (!json_object_object_get_ex(parsed_json, "candidates", &candidates) ||
-        json_object_get_type(candidates) != json_type_array ||
-        json_object_array_length(candidates) == 0) {
-        const char *err = json_object_to_json_string_ext(parsed_json, JSON_C_TO_STRING_PRETTY);
-        json_object_put(parsed_json);
-        free(resp.data);
-        return strdup(err);
+    char message[sizeof(r->error_message) + 128];
+    r->upstream_error = error;
+    snprintf(r->model, sizeof(r->model), "%s", model);
+    describe_failure(r, error, message, sizeof(message));
+    r->text = strdup(message);
+    r->text_len = r->text ? strlen(r->text) : 0;
+    return r->text;
+}
+
+// Streaming variant of get_ai_response using :streamGenerateContent?alt=sse
+char* get_ai_response_stream(const struct AiConfig *config, const char* input, const struct HistoryWindow *history,
+                             ai_delta_cb on_delta, void *userdata, struct AiResponse *info) {
+    struct AiResponse r;
+    if (info) memset(info, 0, sizeof(*info));
+
+    // A cached reply is delivered as a single delta
+    struct CacheKey key;
+    int cacheable = response_cache_applies(config->temperature);
+    if (cacheable) {
+        build_cache_key(&key, config, input, history);
+        char *cached = response_cache_get(&key, NULL);
+        if (cached) {
+            if (cached[0]) on_delta(cached, strlen(cached), userdata);
+            return cached;
+        }
+    }
+
+    struct Route route;
+    struct AiConfig routed = *config;
+    router_plan(&route, config, estimate_prompt(config, input, history), 1, router_default_policy());
+    routed.model = router_model(&route);
+
+    struct Arena arena;
+    arena_init(&arena);
+    struct RequestPlan plan;
+    char *json_data = build_request(&arena, &routed, input, history, 1, &plan);
+    if (!json_data) {
+        arena_free(&arena);
+        return strdup("Memory allocation error");
     }
 
-    first_candidate = json_object_array_get_idx(candidates, 0);
-    json_object_object_get_ex(first_candidate, "content", &content);
-    json_object_object_get_ex(content, "parts", &parts);
-    first_part = json_object_array_get_idx(parts, 0);
-    json_object_object_get_ex(first_part, "text", &text);
+    // Followers replay the leader's token stream as it arrives
+    int leader = 1;
+    struct Flight *flight = NULL;
+    if (singleflight_enabled()) {
+        struct CacheKey flight_key;
+        build_flight_key(&flight_key, config->model, json_data);
+        flight = singleflight_join(&flight_key, &leader);
+    }
+
+    char *result;
+    if (!leader) {
+        result = singleflight_wait(flight, on_delta, userdata, &r);
+        singleflight_release(flight);
+    } else {
+        size_t delivered = 0;
+        result = call_stream(&route, json_data, on_delta, userdata, flight, &r, &delivered);
+        // A rejected reference fails before any text was streamed; a fallback model only helps before it
+        while (!delivered && next_attempt(&arena, &routed, input, history, &route, &plan, &r, &json_data)) {
+            free(result);
+            result = call_stream(&route, json_data, on_delta, userdata, flight, &r, &delivered);
+        }
+        history_calibrate(plan.estimated_tokens, r.prompt_tokens);
+        if (flight) {
+            singleflight_complete(flight, result, &r);
+            singleflight_release(flight);
+        }
+        if (cacheable && !r.upstream_error && r.text_len > 0) response_cache_put(&key, result, r.text_len);
+    }
+    arena_free(&arena);
 
-    // Get the actual response text
-    const char *response_text = json_object_get_string(text);
-    char *final_response = strdup(response_text ? response_text : "");
+    if (info) *info = r;
+    return result;
+}
+
+static size_t collect_callback(void *contents, size_t size, size_t nmemb, void *userp) {
+    size_t realsize = size * nmemb;
+    return append_bytes((struct ResponseData *)userp, contents, realsize) ? realsize : 0;
+}
 
-    // Cleanup
-    json_object_put(parsed_json);
-    free(resp.data);
+// Copy embedding.values (exactly dim numbers) out of an embedContent reply,
+// or the error code of an error body; returns whether the body was JSON
+static int parse_embedding(const char *data, size_t len, int dim, float *out, struct AiResponse *r) {
+    struct json_tokener *tok = json_tokener_new();
+    struct json_object *root = tok ? json_tokener_parse_ex(tok, data, (int)len) : NULL;
+    if (tok) json_tokener_free(tok);
+    if (!root) return 0;
 
-    return final_response;
-}
\ No newline at end of file
+    struct json_object *embedding, *values, *error, *code;
+    if (json_object_object_get_ex(root, "error", &error)) {
+        r->error_code = json_object_object_get_ex(error, "code", &code) ? json_object_get_int(code) : 400;
+    } else if (json_object_object_get_ex(root, "embedding", &embedding) &&
+               json_object_object_get_ex(embedding, "values", &values) &&
+               json_object_is_type(values, json_type_array) && (int)json_object_array_length(values) == dim) {
+        for (int i = 0; i < dim; i++) out[i] = (float)json_object_get_double(json_object_array_get_idx(values, i));
+        r->candidates = 1; // The embedding is the answer
+    }
+    json_object_put(root);
+    return 1;
+}
+
+// One embedContent call under the upstream controller. Retrieval is an
+// optional extra, so a failure is not retried: the chat goes ahead without it.
+int ai_embed(const char *model, const char *text, size_t len, int document, int dim, float *out) {
+    const char *api_key_env = getenv("GEMINI_API_KEY");
+    const char *api_key = api_key_env ? api_key_env : ""; // API key from env
+    char url[512];
+    snprintf(url, sizeof(url), "%s/v1beta/models/%s:embedContent?key=%s", api_base, model, api_key);
+
+    struct Arena arena;
+    struct ArenaBuf buf;
+    arena_init(&arena);
+    arena_buf_init(&buf, &arena, len + 256);
+    arena_buf_printf(&buf, "{\"model\":\"models/%s\",\"content\":{\"parts\":[{\"text\":", model);
+    arena_buf_json_string(&buf, text, len);
+    arena_buf_printf(&buf, "}]},\"taskType\":\"%s\",\"outputDimensionality\":%d}",
+                     document ? "RETRIEVAL_DOCUMENT" : "RETRIEVAL_QUERY", dim);
+
+    struct AiResponse r;
+    struct ResponseData body = { NULL, 0 };
+    memset(&r, 0, sizeof(r));
+    int error = buf.data ? upstream_acquire() : UPSTREAM_TRANSPORT;
+    CURL *curl = error == UPSTREAM_OK ? http_pool_acquire() : NULL;
+    if (curl) {
+        struct curl_slist *headers = NULL;
+        headers = curl_slist_append(headers, "Content-Type: application/json");
+        curl_easy_setopt(curl, CURLOPT_URL, url);
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, buf.data);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, collect_callback);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&body);
+        upstream_apply_timeouts(curl, 0);
+
+        uint64_t sent = metrics_now_ns();
+        CURLcode res = curl_easy_perform(curl);
+        record_transfer(curl, buf.len);
+        read_status(curl, &r);
+        int parsed = res == CURLE_OK && body.data && parse_embedding(body.data, body.size, dim, out, &r);
+        error = upstream_classify(res, r.http_status, &r, parsed);
+        upstream_release(error, metrics_now_ns() - sent);
+        curl_slist_free_all(headers);
+        http_pool_release(curl);
+    } else if (error == UPSTREAM_OK) {
+        upstream_release(UPSTREAM_TRANSPORT, 0);
+        error = UPSTREAM_TRANSPORT;
+    }
+    free(body.data);
+    arena_free(&arena);
+    return error == UPSTREAM_OK;
+}
@@ -2,6 +2,12 @@
 #define AI_H
 
 #include <curl/curl.h>
+#include "arena.h"
+#include "config.h"
+#include "history.h"
+#include "response_parser.h"
+
+#define CHAT_INPUT_MAX 20480 // Longest user message accepted, in bytes
 
 // Define the struct completely in the header
 struct ResponseData {
@@ -9,23 +15,27 @@ struct ResponseData {
     size_t size; // Size of the response data
 };
 
-// Update function declaration to include history parameter
-char* get_ai_response(const char* input, const char* history); // Function to get AI response
+// config is the caller's resolved snapshot, read inside its read section.
+// history holds the earlier turns, sent as alternating user/model contents.
+// info (may be NULL) receives finishReason and token usage.
+char* get_ai_response(struct Arena *arena, const struct AiConfig *config, const char* input,
+                      const struct HistoryWindow *history, struct AiResponse *info); // Function to get AI response (allocated in arena)
+// Called with each text delta as it arrives from a streaming request
+typedef void (*ai_delta_cb)(const char *text, size_t len, void *userdata);
+
+// Streaming variant; deltas go to on_delta and the full text is returned
+char* get_ai_response_stream(const struct AiConfig *config, const char* input, const struct HistoryWindow *history,
+                             ai_delta_cb on_delta, void *userdata, struct AiResponse *info);
+// Fold old turns (and old->summary) into a new rolling summary; malloc'd, NULL on failure
+char* ai_summarize(const struct AiConfig *config, const struct HistoryWindow *old);
+// Embed text with the embedContent model into out (dim floats); document picks the
+// RETRIEVAL_DOCUMENT task over RETRIEVAL_QUERY. Returns 0 on failure.
+int ai_embed(const char *model, const char *text, size_t len, int document, int dim, float *out);
 void cleanup_ai(); // Function to cleanup AI resources
 void init_ai(); // Function to initialize AI resources
 
-// Configuration setters
-void ai_set_model(const char *model_name);
-void ai_set_generation_params(double temperature, double top_p, int top_k, int max_output_tokens);
-void ai_set_system_prompt(const char *prompt_text);
-void ai_clear_system_prompt();
-
-// Configuration getters
-const char* ai_get_model();
-double ai_get_temperature();
-double ai_get_top_p();
-int ai_get_top_k();
-int ai_get_max_output_tokens();
-const char* ai_get_system_prompt();
+// Generation settings live in config.h snapshots
+void ai_set_api_base(const char *base_url); // Upstream base URL, defaults to the googleapis host
+const char* ai_get_api_base();
 
 #endif
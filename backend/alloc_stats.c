@@ -0,0 +1,135 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <malloc.h>
+#include "alloc_stats.h"
+
+static unsigned long count_mallocs = 0;
+static unsigned long count_reallocs = 0;
+static unsigned long count_frees = 0;
+static size_t live_bytes = 0;
+static size_t peak_bytes = 0;
+
+#ifdef ALLOC_STATS
+#include <dlfcn.h>
+
+// Interpose the allocator so allocations made inside libcurl, json-c and
+// libmicrohttpd are counted too. dlsym itself may call calloc before the
+// real functions are known, so those early requests come from a static pool.
+static void* (*real_malloc)(size_t) = NULL;
+static void* (*real_calloc)(size_t, size_t) = NULL;
+static void* (*real_realloc)(void *, size_t) = NULL;
+static void (*real_free)(void *) = NULL;
+
+static char bootstrap_pool[8192] __attribute__((aligned(16)));
+static size_t bootstrap_used = 0;
+static int resolving = 0;
+
+static int from_bootstrap(void *ptr) {
+    return (char *)ptr >= bootstrap_pool && (char *)ptr < bootstrap_pool + sizeof(bootstrap_pool);
+}
+
+static void* bootstrap_alloc(size_t size) {
+    size_t rounded = (size + 15) & ~(size_t)15;
+    if (bootstrap_used + rounded > sizeof(bootstrap_pool)) return NULL;
+    void *ptr = bootstrap_pool + bootstrap_used;
+    bootstrap_used += rounded;
+    return ptr; // Static storage is already zeroed
+}
+
+static void track_alloc(void *ptr) {
+    if (!ptr) return;
+    size_t live = __atomic_add_fetch(&live_bytes, malloc_usable_size(ptr), __ATOMIC_RELAXED);
+    size_t peak = __atomic_load_n(&peak_bytes, __ATOMIC_RELAXED);
+    while (live > peak && !__atomic_compare_exchange_n(&peak_bytes, &peak, live, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+static void track_free(void *ptr) {
+    if (ptr) __atomic_fetch_sub(&live_bytes, malloc_usable_size(ptr), __ATOMIC_RELAXED);
+}
+
+static void resolve_allocator() {
+    resolving = 1;
+    real_malloc = dlsym(RTLD_NEXT, "malloc");
+    real_calloc = dlsym(RTLD_NEXT, "calloc");
+    real_realloc = dlsym(RTLD_NEXT, "realloc");
+    real_free = dlsym(RTLD_NEXT, "free");
+    resolving = 0;
+}
+
+void* malloc(size_t size) {
+    if (!real_malloc) {
+        if (resolving) return bootstrap_alloc(size);
+        resolve_allocator();
+    }
+    __atomic_fetch_add(&count_mallocs, 1, __ATOMIC_RELAXED);
+    void *ptr = real_malloc(size);
+    track_alloc(ptr);
+    return ptr;
+}
+
+void* calloc(size_t nmemb, size_t size) {
+    if (!real_calloc) {
+        if (resolving) return bootstrap_alloc(nmemb * size);
+        resolve_allocator();
+    }
+    __atomic_fetch_add(&count_mallocs, 1, __ATOMIC_RELAXED);
+    void *ptr = real_calloc(nmemb, size);
+    track_alloc(ptr);
+    return ptr;
+}
+
+void* realloc(void *ptr, size_t size) {
+    if (!real_realloc) resolve_allocator();
+    if (from_bootstrap(ptr)) {
+        void *moved = real_malloc(size);
+        if (moved) memcpy(moved, ptr, size); // Bootstrap blocks are few and small
+        track_alloc(moved);
+        return moved;
+    }
+    __atomic_fetch_add(&count_reallocs, 1, __ATOMIC_RELAXED);
+    size_t old_size = ptr ? malloc_usable_size(ptr) : 0;
+    void *grown = real_realloc(ptr, size);
+    if (grown || size == 0) __atomic_fetch_sub(&live_bytes, old_size, __ATOMIC_RELAXED);
+    track_alloc(grown);
+    return grown;
+}
+
+void free(void *ptr) {
+    if (!ptr || from_bootstrap(ptr)) return;
+    if (!real_free) resolve_allocator();
+    __atomic_fetch_add(&count_frees, 1, __ATOMIC_RELAXED);
+    track_free(ptr);
+    real_free(ptr);
+}
+#endif
+
+void alloc_stats_reset_peak() {
+    __atomic_store_n(&peak_bytes, __atomic_load_n(&live_bytes, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+}
+
+void alloc_stats_get(struct AllocStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+#ifdef ALLOC_STATS
+    stats->counting = 1;
+#endif
+    stats->mallocs = __atomic_load_n(&count_mallocs, __ATOMIC_RELAXED);
+    stats->reallocs = __atomic_load_n(&count_reallocs, __ATOMIC_RELAXED);
+    stats->frees = __atomic_load_n(&count_frees, __ATOMIC_RELAXED);
+    stats->live_bytes = __atomic_load_n(&live_bytes, __ATOMIC_RELAXED);
+    stats->peak_bytes = __atomic_load_n(&peak_bytes, __ATOMIC_RELAXED);
+
+    struct mallinfo2 info = mallinfo2();
+    stats->heap_in_use = info.uordblks + info.hblkhd;
+
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm) {
+        unsigned long size_pages = 0, resident_pages = 0;
+        if (fscanf(statm, "%lu %lu", &size_pages, &resident_pages) == 2) {
+            stats->rss_bytes = resident_pages * (size_t)sysconf(_SC_PAGESIZE);
+        }
+        fclose(statm);
+    }
+}
@@ -0,0 +1,22 @@
+#ifndef ALLOC_STATS_H
+#define ALLOC_STATS_H
+
+#include <stddef.h>
+
+// Process memory counters. Heap call counts are only collected when built
+// with ALLOC_STATS=1, which interposes malloc/calloc/realloc/free.
+struct AllocStats {
+    int counting; // Whether heap calls are being counted
+    unsigned long mallocs; // malloc + calloc calls
+    unsigned long reallocs; // realloc calls
+    unsigned long frees; // free calls with a non-NULL pointer
+    size_t live_bytes; // Usable bytes currently allocated through the interposer
+    size_t peak_bytes; // High-water mark of live_bytes since start or the last reset
+    size_t heap_in_use; // Bytes in use according to mallinfo2
+    size_t rss_bytes; // Resident set size from /proc/self/statm
+};
+
+void alloc_stats_get(struct AllocStats *stats); // Function to sample the counters
+void alloc_stats_reset_peak(); // Function to restart the high-water mark from the current live bytes
+
+#endif
@@ -0,0 +1,223 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "arena.h"
+
+#define ARENA_ALIGN 16
+
+// Standard-size blocks handed back by finished requests
+static struct ArenaBlock *block_cache = NULL;
+static int block_cache_count = 0;
+static pthread_mutex_t block_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long stat_blocks_malloced = 0;
+static unsigned long stat_blocks_reused = 0;
+static unsigned long stat_allocations = 0;
+static unsigned long stat_bytes = 0;
+
+void arena_init(struct Arena *arena) {
+    arena->current = NULL;
+    arena->last = NULL;
+    arena->last_size = 0;
+}
+
+static struct ArenaBlock* block_new(size_t min_size) {
+    struct ArenaBlock *block = NULL;
+    if (min_size <= ARENA_BLOCK_SIZE) {
+        pthread_mutex_lock(&block_cache_lock);
+        if (block_cache) {
+            block = block_cache;
+            block_cache = block->next;
+            block_cache_count--;
+        }
+        pthread_mutex_unlock(&block_cache_lock);
+        if (block) {
+            __atomic_fetch_add(&stat_blocks_reused, 1, __ATOMIC_RELAXED);
+        }
+        min_size = ARENA_BLOCK_SIZE;
+    }
+    if (!block) {
+        block = malloc(sizeof(struct ArenaBlock) + min_size);
+        if (!block) return NULL;
+        block->size = min_size;
+        __atomic_fetch_add(&stat_blocks_malloced, 1, __ATOMIC_RELAXED);
+    }
+    block->used = 0;
+    block->next = NULL;
+    return block;
+}
+
+static void block_release(struct ArenaBlock *block) {
+    if (block->size == ARENA_BLOCK_SIZE) {
+        pthread_mutex_lock(&block_cache_lock);
+        if (block_cache_count < ARENA_CACHED_BLOCKS) {
+            block->next = block_cache;
+            block_cache = block;
+            block_cache_count++;
+            block = NULL;
+        }
+        pthread_mutex_unlock(&block_cache_lock);
+    }
+    free(block);
+}
+
+void* arena_alloc(struct Arena *arena, size_t size) {
+    size_t rounded = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (rounded == 0) rounded = ARENA_ALIGN;
+
+    struct ArenaBlock *block = arena->current;
+    if (!block || block->size - block->used < rounded) {
+        block = block_new(rounded);
+        if (!block) return NULL;
+        block->next = arena->current;
+        arena->current = block;
+    }
+    void *ptr = block->data + block->used;
+    block->used += rounded;
+    arena->last = ptr;
+    arena->last_size = rounded;
+
+    __atomic_fetch_add(&stat_allocations, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stat_bytes, rounded, __ATOMIC_RELAXED);
+    return ptr;
+}
+
+void* arena_realloc(struct Arena *arena, void *ptr, size_t old_size, size_t new_size) {
+    if (!ptr) return arena_alloc(arena, new_size);
+    if (new_size <= old_size) return ptr;
+
+    struct ArenaBlock *block = arena->current;
+    if (ptr == arena->last && block) {
+        // Bump the last allocation if the block still has room
+        size_t offset = (size_t)((char *)ptr - block->data);
+        size_t rounded = (new_size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+        if (offset + rounded <= block->size) {
+            __atomic_fetch_add(&stat_bytes, rounded - arena->last_size, __ATOMIC_RELAXED);
+            block->used = offset + rounded;
+            arena->last_size = rounded;
+            return ptr;
+        }
+    }
+    // Move it to a spot with twice the room, then hand back the unused half so
+    // repeated growth (e.g. a response body) keeps bumping in place
+    void *grown = arena_alloc(arena, new_size * 2);
+    if (!grown) return NULL;
+    size_t rounded = (new_size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    __atomic_fetch_sub(&stat_bytes, arena->last_size - rounded, __ATOMIC_RELAXED);
+    arena->current->used -= arena->last_size - rounded;
+    arena->last_size = rounded;
+    memcpy(grown, ptr, old_size);
+    return grown;
+}
+
+char* arena_strndup(struct Arena *arena, const char *s, size_t len) {
+    char *copy = arena_alloc(arena, len + 1);
+    if (!copy) return NULL;
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+char* arena_strdup(struct Arena *arena, const char *s) {
+    return arena_strndup(arena, s, strlen(s));
+}
+
+void arena_free(struct Arena *arena) {
+    struct ArenaBlock *block = arena->current;
+    while (block) {
+        struct ArenaBlock *next = block->next;
+        block_release(block);
+        block = next;
+    }
+    arena_init(arena);
+}
+
+void arena_get_stats(struct ArenaStats *stats) {
+    stats->blocks_malloced = __atomic_load_n(&stat_blocks_malloced, __ATOMIC_RELAXED);
+    stats->blocks_reused = __atomic_load_n(&stat_blocks_reused, __ATOMIC_RELAXED);
+    stats->allocations = __atomic_load_n(&stat_allocations, __ATOMIC_RELAXED);
+    stats->bytes = __atomic_load_n(&stat_bytes, __ATOMIC_RELAXED);
+}
+
+void arena_buf_init(struct ArenaBuf *buf, struct Arena *arena, size_t initial) {
+    buf->arena = arena;
+    buf->len = 0;
+    buf->cap = initial ? initial : 256;
+    buf->data = arena_alloc(arena, buf->cap + 1);
+    if (buf->data) buf->data[0] = '\0';
+    else buf->cap = 0;
+}
+
+static int arena_buf_reserve(struct ArenaBuf *buf, size_t extra) {
+    if (buf->len + extra <= buf->cap && buf->data) return 1;
+    size_t new_cap = buf->cap ? buf->cap * 2 : 256;
+    while (new_cap < buf->len + extra) new_cap *= 2;
+    char *data = arena_realloc(buf->arena, buf->data, buf->data ? buf->cap + 1 : 0, new_cap + 1);
+    if (!data) return 0;
+    buf->data = data;
+    buf->cap = new_cap;
+    return 1;
+}
+
+int arena_buf_append(struct ArenaBuf *buf, const char *bytes, size_t len) {
+    if (!arena_buf_reserve(buf, len)) return 0;
+    memcpy(buf->data + buf->len, bytes, len);
+    buf->len += len;
+    buf->data[buf->len] = '\0';
+    return 1;
+}
+
+int arena_buf_puts(struct ArenaBuf *buf, const char *s) {
+    return arena_buf_append(buf, s, strlen(s));
+}
+
+int arena_buf_printf(struct ArenaBuf *buf, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int needed = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+    if (needed < 0 || !arena_buf_reserve(buf, (size_t)needed)) return 0;
+
+    va_start(args, fmt);
+    vsnprintf(buf->data + buf->len, buf->cap - buf->len + 1, fmt, args);
+    va_end(args);
+    buf->len += (size_t)needed;
+    return 1;
+}
+
+int arena_buf_json_escape(struct ArenaBuf *buf, const char *s, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    // Worst case every byte becomes \u00XX
+    if (!arena_buf_reserve(buf, len * 6)) return 0;
+
+    char *out = buf->data + buf->len;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)s[i];
+        switch (c) {
+            case '"': *out++ = '\\'; *out++ = '"'; break;
+            case '\\': *out++ = '\\'; *out++ = '\\'; break;
+            case '\n': *out++ = '\\'; *out++ = 'n'; break;
+            case '\r': *out++ = '\\'; *out++ = 'r'; break;
+            case '\t': *out++ = '\\'; *out++ = 't'; break;
+            default:
+                if (c < 0x20) {
+                    *out++ = '\\'; *out++ = 'u'; *out++ = '0'; *out++ = '0';
+                    *out++ = hex[c >> 4]; *out++ = hex[c & 0xf];
+                } else {
+                    *out++ = (char)c;
+                }
+        }
+    }
+    buf->len = (size_t)(out - buf->data);
+    buf->data[buf->len] = '\0';
+    return 1;
+}
+
+int arena_buf_json_string(struct ArenaBuf *buf, const char *s, size_t len) {
+    return arena_buf_append(buf, "\"", 1) &&
+           arena_buf_json_escape(buf, s, len) &&
+           arena_buf_append(buf, "\"", 1);
+}
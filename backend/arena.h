@@ -0,0 +1,53 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_BLOCK_SIZE 16384 // Standard block size; larger requests get their own block
+#define ARENA_CACHED_BLOCKS 64 // Standard blocks kept for reuse across requests
+
+struct ArenaBlock {
+    struct ArenaBlock *next; // Previously filled block
+    size_t size; // Usable bytes in data
+    size_t used; // Bytes handed out
+    char data[]; // Block storage
+};
+
+// Bump allocator for one request; everything is released at once by arena_free
+struct Arena {
+    struct ArenaBlock *current; // Block being filled
+    void *last; // Most recent allocation, which may grow in place
+    size_t last_size; // Size of the most recent allocation
+};
+
+// Growable string built inside an arena
+struct ArenaBuf {
+    struct Arena *arena; // Owning arena
+    char *data; // NUL-terminated contents
+    size_t len; // Bytes used, excluding the terminator
+    size_t cap; // Bytes available, excluding the terminator
+};
+
+struct ArenaStats {
+    unsigned long blocks_malloced; // Blocks obtained from malloc
+    unsigned long blocks_reused; // Blocks taken from the block cache
+    unsigned long allocations; // Allocations served by arenas
+    unsigned long bytes; // Bytes served by arenas
+};
+
+void arena_init(struct Arena *arena); // Function to set up an empty arena
+void* arena_alloc(struct Arena *arena, size_t size); // Function to allocate (16-byte aligned)
+void* arena_realloc(struct Arena *arena, void *ptr, size_t old_size, size_t new_size); // Function to grow, in place when ptr is the last allocation
+char* arena_strdup(struct Arena *arena, const char *s); // Function to copy a string
+char* arena_strndup(struct Arena *arena, const char *s, size_t len); // Function to copy len bytes and terminate
+void arena_free(struct Arena *arena); // Function to release every block
+void arena_get_stats(struct ArenaStats *stats); // Function to read process-wide arena counters
+
+void arena_buf_init(struct ArenaBuf *buf, struct Arena *arena, size_t initial); // Function to start an empty buffer
+int arena_buf_append(struct ArenaBuf *buf, const char *bytes, size_t len); // Function to append bytes, 0 on failure
+int arena_buf_puts(struct ArenaBuf *buf, const char *s); // Function to append a C string
+int arena_buf_printf(struct ArenaBuf *buf, const char *fmt, ...) __attribute__((format(printf, 2, 3))); // Function to append formatted text
+int arena_buf_json_escape(struct ArenaBuf *buf, const char *s, size_t len); // Function to append s escaped for a JSON string body
+int arena_buf_json_string(struct ArenaBuf *buf, const char *s, size_t len); // Function to append s as a quoted JSON string
+
+#endif
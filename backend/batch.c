@@ -0,0 +1,466 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <json-c/json.h>
+#include "batch.h"
+#include "ai.h"
+#include "config.h"
+#include "history.h"
+#include "logger.h"
+#include "rate_limit.h"
+#include "router.h"
+#include "upstream.h"
+
+// One non-blank line of the body, NUL-terminated in place
+struct BatchLine {
+    size_t start;
+    size_t len;
+};
+
+struct Batch {
+    char *body; // Request body, owned
+    struct BatchLine *lines;
+    size_t line_count;
+    size_t next; // Next line to start
+    int lanes; // Jobs still taking lines
+    int stopped; // The reader went away
+    char **done_ids; // Sorted ids already in the checkpoint
+    size_t done_count;
+    int checkpoint_fd; // -1 without a checkpoint
+    uint64_t client; // Rate limit key the items are charged to
+    uint64_t request_id; // Log id of the /batch request
+    batch_emit_fn emit;
+    batch_done_fn done;
+    void *userdata;
+    pthread_mutex_t lock; // Guards the fields above from next on, emits and checkpoint writes
+};
+
+static char *checkpoint_dir = NULL;
+static struct WorkerPool *pool = NULL;
+static int shutting_down = 0;
+static unsigned long active = 0, items_ok = 0, items_failed = 0, items_resumed = 0; // Atomic
+
+static void batch_lane(void *arg);
+
+void batch_init(const char *dir, struct WorkerPool *workers) {
+    free(checkpoint_dir);
+    checkpoint_dir = dir && dir[0] ? strdup(dir) : NULL;
+    if (checkpoint_dir) mkdir(checkpoint_dir, 0700);
+    pool = workers;
+    __atomic_store_n(&shutting_down, 0, __ATOMIC_RELAXED);
+}
+
+void batch_shutdown() {
+    __atomic_store_n(&shutting_down, 1, __ATOMIC_RELAXED);
+}
+
+static int valid_name(const char *name) {
+    size_t len = strlen(name);
+    if (len == 0 || len > BATCH_NAME_MAX) return 0;
+    for (size_t i = 0; i < len; i++) {
+        char c = name[i];
+        if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '_')) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int compare_ids(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static int already_done(const struct Batch *batch, const char *id) {
+    return batch->done_count > 0 &&
+           bsearch(&id, batch->done_ids, batch->done_count, sizeof(char *), compare_ids) != NULL;
+}
+
+// The id of a parsed item: its "id" member as a string, else its position
+static const char* item_id(struct json_object *item, size_t index, char *fallback, size_t size) {
+    struct json_object *id = NULL;
+    if (item && json_object_is_type(item, json_type_object) && json_object_object_get_ex(item, "id", &id) &&
+        (json_object_is_type(id, json_type_string) || json_object_is_type(id, json_type_int))) {
+        return json_object_get_string(id);
+    }
+    snprintf(fallback, size, "%zu", index + 1);
+    return fallback;
+}
+
+static void write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return; // The result still reached the client; a rerun repeats it
+        data += n;
+        len -= (size_t)n;
+    }
+}
+
+// Send one result line (out holds it plus a trailing newline) and, when it
+// would come out the same on a rerun, record it in the checkpoint
+static void publish(struct Batch *batch, const struct ArenaBuf *out, int durable) {
+    pthread_mutex_lock(&batch->lock);
+    if (!batch->stopped && !batch->emit(out->data, out->len - 1, batch->userdata)) batch->stopped = 1;
+    if (durable && batch->checkpoint_fd >= 0) write_all(batch->checkpoint_fd, out->data, out->len);
+    pthread_mutex_unlock(&batch->lock);
+}
+
+// Replay the results in the checkpoint and remember their ids. A torn last
+// line (a crash mid-write) is cut off so appends start on a line boundary.
+static void load_checkpoint(struct Batch *batch) {
+    struct stat st;
+    if (fstat(batch->checkpoint_fd, &st) != 0 || st.st_size == 0) return;
+    char *data = malloc((size_t)st.st_size + 1);
+    if (!data) return;
+    ssize_t got = pread(batch->checkpoint_fd, data, (size_t)st.st_size, 0);
+    if (got <= 0) {
+        free(data);
+        return;
+    }
+    data[got] = '\0';
+
+    size_t lines = 0;
+    for (ssize_t i = 0; i < got; i++) lines += data[i] == '\n';
+    batch->done_ids = calloc(lines ? lines : 1, sizeof(char *));
+    size_t good_end = 0;
+    char *line = data;
+    char *newline;
+    while (batch->done_ids && (newline = strchr(line, '\n')) != NULL) {
+        *newline = '\0';
+        struct json_object *result = json_tokener_parse(line);
+        struct json_object *id = NULL;
+        if (result && json_object_object_get_ex(result, "id", &id)) {
+            batch->done_ids[batch->done_count] = strdup(json_object_get_string(id));
+            if (batch->done_ids[batch->done_count]) batch->done_count++;
+            if (!batch->stopped && !batch->emit(line, (size_t)(newline - line), batch->userdata)) batch->stopped = 1;
+            __atomic_add_fetch(&items_resumed, 1, __ATOMIC_RELAXED);
+        }
+        json_object_put(result);
+        line = newline + 1;
+        good_end = (size_t)(line - data);
+    }
+    if (good_end < (size_t)got && ftruncate(batch->checkpoint_fd, (off_t)good_end) != 0) {
+        log_msg(LOG_WARN, "batch_checkpoint", "Could not trim batch checkpoint: %s", strerror(errno));
+    }
+    free(data);
+    qsort(batch->done_ids, batch->done_count, sizeof(char *), compare_ids);
+}
+
+// Turn an item's "history" array (and optional "summary") into a window
+static struct HistoryWindow* item_history(struct Arena *arena, struct json_object *item) {
+    struct json_object *turns = NULL, *summary = NULL;
+    json_object_object_get_ex(item, "summary", &summary);
+    if (!json_object_object_get_ex(item, "history", &turns) || !json_object_is_type(turns, json_type_array)) {
+        turns = NULL;
+    }
+    size_t count = turns ? json_object_array_length(turns) : 0;
+    if (count == 0 && !summary) return NULL;
+
+    struct HistoryWindow *window = arena_alloc(arena, sizeof(struct HistoryWindow) + count * sizeof(struct ChatTurn));
+    if (!window) return NULL;
+    memset(window, 0, sizeof(*window));
+    window->turns = (struct ChatTurn *)(window + 1);
+    size_t raw = 0;
+    if (summary && json_object_is_type(summary, json_type_string)) {
+        window->summary = json_object_get_string(summary);
+        window->summary_len = strlen(window->summary);
+        raw += history_estimate_tokens(window->summary, window->summary_len);
+    }
+    for (size_t i = 0; i < count; i++) {
+        struct json_object *turn = json_object_array_get_idx(turns, i);
+        struct json_object *role = NULL, *text = NULL;
+        if (!json_object_object_get_ex(turn, "text", &text) || !json_object_is_type(text, json_type_string)) continue;
+        json_object_object_get_ex(turn, "role", &role);
+        const char *name = role ? json_object_get_string(role) : "user";
+        struct ChatTurn *t = &window->turns[window->count++];
+        t->role = strcmp(name, "model") == 0 || strcmp(name, "assistant") == 0 ? ROLE_MODEL : ROLE_USER;
+        t->text = json_object_get_string(text);
+        t->len = strlen(t->text);
+        window->bytes += t->len;
+        raw += history_estimate_tokens(t->text, t->len);
+    }
+    window->tokens = history_calibrated(raw);
+    window->last_seq = window->count;
+    return window;
+}
+
+// An item's "config" object as override fields, like POST /config takes them
+static unsigned item_config(struct json_object *item, struct AiConfig *values) {
+    struct json_object *config = NULL, *value = NULL;
+    unsigned fields = 0;
+    memset(values, 0, sizeof(*values));
+    if (!json_object_object_get_ex(item, "config", &config) || !json_object_is_type(config, json_type_object)) {
+        return 0;
+    }
+    if (json_object_object_get_ex(config, "model", &value) && router_valid_model(json_object_get_string(value))) {
+        values->model = json_object_get_string(value);
+        fields |= CONFIG_MODEL;
+    }
+    if (json_object_object_get_ex(config, "temperature", &value)) {
+        values->temperature = json_object_get_double(value);
+        fields |= CONFIG_TEMPERATURE;
+    }
+    if (json_object_object_get_ex(config, "top_p", &value)) {
+        values->top_p = json_object_get_double(value);
+        fields |= CONFIG_TOP_P;
+    }
+    if (json_object_object_get_ex(config, "top_k", &value)) {
+        values->top_k = json_object_get_int(value);
+        fields |= CONFIG_TOP_K;
+    }
+    if (json_object_object_get_ex(config, "max_output_tokens", &value)) {
+        values->max_output_tokens = json_object_get_int(value);
+        fields |= CONFIG_MAX_OUTPUT;
+    }
+    if (json_object_object_get_ex(config, "system_prompt", &value)) {
+        values->system_prompt = json_object_get_string(value);
+        fields |= CONFIG_SYSTEM_PROMPT;
+    }
+    return fields;
+}
+
+// Wait for the rate limits to let an item through, up to BATCH_RATE_WAIT_MS;
+// the verdict, with *retry_after_ms set when it is still a refusal
+static int admit_item(struct Batch *batch, long *retry_after_ms) {
+    long waited = 0;
+    for (;;) {
+        int verdict = rate_admit(batch->client, RATE_BULK, retry_after_ms);
+        if (verdict == RATE_OK || waited + *retry_after_ms > BATCH_RATE_WAIT_MS ||
+            __atomic_load_n(&batch->stopped, __ATOMIC_RELAXED) || __atomic_load_n(&shutting_down, __ATOMIC_RELAXED)) {
+            return verdict;
+        }
+        long nap = *retry_after_ms < 1000 ? *retry_after_ms : 1000; // Notice a stop within a second
+        if (nap < 1) nap = 1;
+        usleep((useconds_t)nap * 1000);
+        waited += nap;
+    }
+}
+
+// Run line index and publish its result; 0 if the checkpoint already had it
+static int run_item(struct Batch *batch, size_t index) {
+    struct BatchLine *line = &batch->lines[index];
+    struct json_object *item = json_tokener_parse(batch->body + line->start);
+    char fallback[32];
+    const char *id = item_id(item, index, fallback, sizeof(fallback));
+    if (already_done(batch, id)) {
+        json_object_put(item);
+        return 0;
+    }
+    // Items run in parallel, so each is traced as a request of its own
+    uint64_t request_id = log_request_id(NULL);
+    log_set_request(batch->request_id);
+    log_msg(LOG_DEBUG, "batch_item", "Line %zu runs as request %016llx", index + 1, (unsigned long long)request_id);
+    log_set_request(request_id);
+
+    struct Arena arena;
+    struct ArenaBuf out;
+    arena_init(&arena);
+    arena_buf_init(&out, &arena, 1024);
+    arena_buf_puts(&out, "{\"id\":");
+    arena_buf_json_string(&out, id, strlen(id));
+
+    struct json_object *message = NULL;
+    int ok = 0;
+    int durable = 1;
+    long retry_after_ms = 0;
+    int verdict = RATE_OK;
+    if (!item || !json_object_is_type(item, json_type_object) ||
+        !json_object_object_get_ex(item, "message", &message) || !json_object_is_type(message, json_type_string)) {
+        arena_buf_puts(&out, ",\"error\":\"Each line needs a JSON object with a string \\\"message\\\"\","
+                             "\"type\":\"invalid\"");
+    } else if (json_object_get_string_len(message) > CHAT_INPUT_MAX) {
+        arena_buf_printf(&out, ",\"error\":\"Message is over %d bytes\",\"type\":\"too_large\"", CHAT_INPUT_MAX);
+    } else if ((verdict = admit_item(batch, &retry_after_ms)) != RATE_OK) {
+        arena_buf_puts(&out, ",\"error\":");
+        arena_buf_json_string(&out, rate_verdict_name(verdict), strlen(rate_verdict_name(verdict)));
+        arena_buf_printf(&out, ",\"type\":\"rate_limited\",\"retry_after\":%ld", (retry_after_ms + 999) / 1000);
+        durable = 0; // A resumed batch runs it again
+    } else {
+        struct AiConfig values, config;
+        struct AiResponse info;
+        struct ConfigSnapshot *override = NULL;
+        unsigned fields = item_config(item, &values);
+        struct HistoryWindow *history = item_history(&arena, item);
+        if (fields) config_override_update(&override, fields, &values);
+
+        int copied = config_resolve_copy(&config, &override, &arena);
+        char *response = get_ai_response(&arena, &config, json_object_get_string(message), history, &info);
+        if (!copied) config_read_end();
+        config_override_free(&override);
+        rate_charge(batch->client, info.total_tokens);
+
+        if (info.upstream_error) {
+            arena_buf_puts(&out, ",\"error\":");
+            arena_buf_json_string(&out, response, strlen(response));
+            arena_buf_printf(&out, ",\"type\":\"%s\"", upstream_error_name(info.upstream_error));
+            if (info.retry_after > 0) arena_buf_printf(&out, ",\"retry_after\":%ld", info.retry_after);
+            // Transient failures are left out of the checkpoint so a resumed batch retries them
+            durable = info.upstream_error == UPSTREAM_REJECTED || info.upstream_error == UPSTREAM_BLOCKED;
+        } else {
+            ok = 1;
+            arena_buf_puts(&out, ",\"response\":");
+            arena_buf_json_string(&out, response, strlen(response));
+            if (info.model[0]) {
+                arena_buf_puts(&out, ",\"model\":");
+                arena_buf_json_string(&out, info.model, strlen(info.model));
+            }
+            if (info.finish_reason[0]) {
+                arena_buf_puts(&out, ",\"finish_reason\":");
+                arena_buf_json_string(&out, info.finish_reason, strlen(info.finish_reason));
+            }
+            if (info.total_tokens > 0) {
+                arena_buf_printf(&out, ",\"usage\":{\"prompt_tokens\":%ld,\"candidate_tokens\":%ld,\"total_tokens\":%ld}",
+                                 info.prompt_tokens, info.candidate_tokens, info.total_tokens);
+            }
+        }
+    }
+    json_object_put(item); // id, message and history point into it until here
+
+    if (arena_buf_puts(&out, "}\n")) publish(batch, &out, durable);
+    __atomic_add_fetch(ok ? &items_ok : &items_failed, 1, __ATOMIC_RELAXED);
+    arena_free(&arena);
+    log_set_request(0);
+    return 1;
+}
+
+static int take_line(struct Batch *batch, size_t *index) {
+    pthread_mutex_lock(&batch->lock);
+    int more = !batch->stopped && !__atomic_load_n(&shutting_down, __ATOMIC_RELAXED) &&
+               batch->next < batch->line_count;
+    if (more) *index = batch->next++;
+    pthread_mutex_unlock(&batch->lock);
+    return more;
+}
+
+static void batch_free(struct Batch *batch) {
+    if (batch->checkpoint_fd >= 0) close(batch->checkpoint_fd); // Also drops the lock
+    for (size_t i = 0; i < batch->done_count; i++) free(batch->done_ids[i]);
+    free(batch->done_ids);
+    free(batch->lines);
+    free(batch->body);
+    pthread_mutex_destroy(&batch->lock);
+    free(batch);
+}
+
+// The last lane out reports the end and frees the batch
+static void lane_finished(struct Batch *batch) {
+    pthread_mutex_lock(&batch->lock);
+    int last = --batch->lanes == 0;
+    pthread_mutex_unlock(&batch->lock);
+    if (!last) return;
+    log_set_request(batch->request_id);
+    log_msg(LOG_INFO, "batch", "%zu lines %s", batch->line_count, batch->stopped ? "stopped" : "done");
+    log_set_request(0);
+    batch->done(batch->userdata);
+    batch_free(batch);
+    __atomic_sub_fetch(&active, 1, __ATOMIC_RELAXED);
+}
+
+// One lane runs a line, then queues itself behind other work so concurrent
+// batches take turns; when the queue is full it just keeps going
+static void batch_lane(void *arg) {
+    struct Batch *batch = (struct Batch *)arg;
+    size_t index;
+    while (take_line(batch, &index)) {
+        if (run_item(batch, index) && worker_pool_submit(pool, batch_lane, batch)) return;
+    }
+    lane_finished(batch);
+}
+
+// First job of a batch: replay the checkpoint, then fan out into lanes
+static void batch_begin(void *arg) {
+    struct Batch *batch = (struct Batch *)arg;
+    if (batch->checkpoint_fd >= 0) {
+        pthread_mutex_lock(&batch->lock);
+        load_checkpoint(batch);
+        pthread_mutex_unlock(&batch->lock);
+    }
+    int extra = batch->lanes - 1;
+    for (int i = 0; i < extra; i++) {
+        if (!worker_pool_submit(pool, batch_lane, batch)) {
+            pthread_mutex_lock(&batch->lock);
+            batch->lanes--; // This lane is still running, so it never reaches 0 here
+            pthread_mutex_unlock(&batch->lock);
+        }
+    }
+    batch_lane(batch);
+}
+
+int batch_start(char *body, size_t len, int parallel, const char *checkpoint, uint64_t client, batch_emit_fn emit,
+                batch_done_fn done, void *userdata) {
+    int fd = -1;
+    if (checkpoint) {
+        if (!checkpoint_dir) return BATCH_NO_CHECKPOINTS;
+        if (!valid_name(checkpoint)) return BATCH_BAD_NAME;
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s.jsonl", checkpoint_dir, checkpoint);
+        fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+        if (fd < 0) return BATCH_FAILED;
+        if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+            close(fd);
+            return BATCH_BUSY;
+        }
+    }
+
+    struct Batch *batch = calloc(1, sizeof(struct Batch));
+    size_t lines = 1;
+    for (size_t i = 0; i < len; i++) lines += body[i] == '\n';
+    if (batch) batch->lines = calloc(lines, sizeof(struct BatchLine));
+    if (!batch || !batch->lines) {
+        if (fd >= 0) close(fd);
+        if (batch) free(batch->lines);
+        free(batch);
+        return BATCH_FAILED;
+    }
+
+    // Split in place; blank lines are skipped
+    size_t start = 0;
+    for (size_t i = 0; i <= len; i++) {
+        if (i < len && body[i] != '\n') continue;
+        size_t end = i;
+        if (end > start && body[end - 1] == '\r') end--;
+        if (i < len) body[i] = '\0';
+        if (end < len) body[end] = '\0';
+        size_t first = start;
+        while (first < end && (body[first] == ' ' || body[first] == '\t')) first++;
+        if (first < end) {
+            batch->lines[batch->line_count].start = first;
+            batch->lines[batch->line_count].len = end - first;
+            batch->line_count++;
+        }
+        start = i + 1;
+    }
+
+    if (parallel < 1) parallel = BATCH_PARALLEL_DEFAULT;
+    if (parallel > BATCH_PARALLEL_MAX) parallel = BATCH_PARALLEL_MAX;
+    batch->body = body;
+    batch->lanes = parallel;
+    batch->checkpoint_fd = fd;
+    batch->client = client;
+    batch->request_id = log_request(); // Set by the server for this request
+    batch->emit = emit;
+    batch->done = done;
+    batch->userdata = userdata;
+    pthread_mutex_init(&batch->lock, NULL);
+    __atomic_add_fetch(&active, 1, __ATOMIC_RELAXED); // Before the submit: the batch may finish first
+    if (!worker_pool_submit(pool, batch_begin, batch)) {
+        __atomic_sub_fetch(&active, 1, __ATOMIC_RELAXED);
+        batch->body = NULL; // Still the caller's
+        batch_free(batch);
+        return BATCH_FAILED;
+    }
+    return BATCH_STARTED;
+}
+
+void batch_get_stats(struct BatchStats *stats) {
+    stats->active = __atomic_load_n(&active, __ATOMIC_RELAXED);
+    stats->items_ok = __atomic_load_n(&items_ok, __ATOMIC_RELAXED);
+    stats->items_failed = __atomic_load_n(&items_failed, __ATOMIC_RELAXED);
+    stats->items_resumed = __atomic_load_n(&items_resumed, __ATOMIC_RELAXED);
+}
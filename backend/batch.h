@@ -0,0 +1,47 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "worker_pool.h"
+
+#define BATCH_PARALLEL_DEFAULT 4 // Items of one batch in flight at once
+#define BATCH_PARALLEL_MAX 64 // Largest parallelism a client may ask for
+#define BATCH_NAME_MAX 64 // Longest checkpoint name
+#define BATCH_RATE_WAIT_MS 30000 // Longest an item waits for rate limits before it fails
+
+// Receives each result as one JSON line (no newline), one call at a time;
+// returns 0 once nobody is reading, which stops the batch
+typedef int (*batch_emit_fn)(const char *line, size_t len, void *userdata);
+typedef void (*batch_done_fn)(void *userdata); // Called once, after the last emit
+
+enum BatchStartError {
+    BATCH_STARTED = 0,
+    BATCH_NO_CHECKPOINTS, // A checkpoint was named but BATCH_CHECKPOINT_DIR is unset
+    BATCH_BAD_NAME, // Checkpoint name outside [A-Za-z0-9_-]
+    BATCH_BUSY, // Another batch holds the checkpoint
+    BATCH_FAILED // Out of memory or the checkpoint could not be opened
+};
+
+struct BatchStats {
+    unsigned long active; // Batches running
+    unsigned long items_ok; // Items answered
+    unsigned long items_failed; // Items that failed (invalid lines included)
+    unsigned long items_resumed; // Results replayed from checkpoints
+};
+
+// Directory checkpoints live in (NULL disables them) and the pool items run on
+void batch_init(const char *checkpoint_dir, struct WorkerPool *pool);
+void batch_shutdown(); // Function to stop starting items; running ones finish
+
+// Run every line of body (JSONL; on success the batch owns and frees it) with up to
+// parallel items in flight. Results already in the named checkpoint are
+// replayed first and not run again. Items are admitted as bulk work of
+// client (see rate_limit.h) and their tokens billed to it. On success
+// emit/done are called from worker threads and the batch frees itself after done.
+int batch_start(char *body, size_t len, int parallel, const char *checkpoint, uint64_t client, batch_emit_fn emit,
+                batch_done_fn done, void *userdata);
+
+void batch_get_stats(struct BatchStats *stats); // Function to read batch counters
+
+#endif
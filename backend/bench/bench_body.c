@@ -0,0 +1,347 @@
+// Request body ingestion: a differential fuzz of the incremental JSON path
+// followed by timings. Every generated body, valid or mutated, must give the
+// same verdict and document whether it arrives whole, in random chunks or one
+// byte at a time, and valid ones must match json_tokener_parse. The timings
+// compare parsing as chunks arrive with buffering then parsing, and doubling
+// a raw body's buffer with growing it by each chunk.
+// Usage: bench_body [fuzz cases] [seed]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <json-c/json.h>
+#include "request_body.h"
+
+#define BENCH_BODY_MAX (256 * 1024) // Largest fuzzed body
+#define BENCH_SEGMENT 1460 // Chunk size of the timed runs, about one TCP segment
+#define BENCH_MESSAGE 20000 // Bytes of the timed chat message
+#define BENCH_RAW_BYTES (32 * 1024 * 1024) // Bytes of the timed raw body
+#define BENCH_ROUNDS 200 // Timed parses per method
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t next_random() {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static size_t pick(size_t n) { return n ? (size_t)(next_random() % n) : 0; }
+
+// Append-only text buffer for building bodies
+struct Text {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+static void put(struct Text *t, const char *s, size_t len) {
+    if (t->len + len + 1 > t->cap) {
+        while (t->len + len + 1 > t->cap) t->cap = t->cap ? t->cap * 2 : 1024;
+        t->data = realloc(t->data, t->cap);
+        if (!t->data) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+    memcpy(t->data + t->len, s, len);
+    t->len += len;
+    t->data[t->len] = '\0';
+}
+
+static void puts_text(struct Text *t, const char *s) { put(t, s, strlen(s)); }
+
+static void space(struct Text *t) {
+    static const char *blanks[] = { "", "", "", " ", "\n", "\t ", "\r\n  " };
+    puts_text(t, blanks[pick(sizeof(blanks) / sizeof(blanks[0]))]);
+}
+
+static void random_string(struct Text *t) {
+    static const char *pieces[] = { "a", "hello", " ", "\\n", "\\\"", "\\\\", "\\/", "\\u00e9", "\\ud83d\\ude00",
+                                    "\xc3\xa9", "\xe2\x82\xac", "0", "{", "]", ":", "," };
+    puts_text(t, "\"");
+    for (size_t n = pick(24); n > 0; n--) puts_text(t, pieces[pick(sizeof(pieces) / sizeof(pieces[0]))]);
+    puts_text(t, "\"");
+}
+
+static void random_value(struct Text *t, int depth) {
+    char number[48];
+    switch (pick(depth > 6 ? 4 : 6)) {
+    case 0:
+        random_string(t);
+        break;
+    case 1:
+        snprintf(number, sizeof(number), "%s%llu", pick(2) ? "-" : "", (unsigned long long)(next_random() >> pick(64)));
+        puts_text(t, number);
+        break;
+    case 2:
+        snprintf(number, sizeof(number), "%.*g", 1 + (int)pick(17), ((double)next_random() / 3.0e15) * (pick(2) ? 1 : -1));
+        puts_text(t, number);
+        break;
+    case 3: {
+        static const char *literals[] = { "true", "false", "null" };
+        puts_text(t, literals[pick(3)]);
+        break;
+    }
+    case 4:
+        puts_text(t, "[");
+        for (size_t i = 0, n = pick(6); i < n; i++) {
+            if (i) puts_text(t, ",");
+            space(t);
+            random_value(t, depth + 1);
+            space(t);
+        }
+        puts_text(t, "]");
+        break;
+    default:
+        puts_text(t, "{");
+        for (size_t i = 0, n = pick(6); i < n; i++) {
+            if (i) puts_text(t, ",");
+            space(t);
+            random_string(t);
+            space(t);
+            puts_text(t, ":");
+            space(t);
+            random_value(t, depth + 1);
+        }
+        space(t);
+        puts_text(t, "}");
+    }
+}
+
+// A chat-shaped object, sometimes with a long message
+static void random_body(struct Text *t) {
+    t->len = 0;
+    space(t);
+    puts_text(t, "{\"message\":");
+    random_string(t);
+    if (pick(4) == 0) {
+        t->len--; // Reopen the string
+        for (size_t n = pick(4000); n > 0; n--) puts_text(t, pick(8) ? "word " : "\\u00e9\\n");
+        puts_text(t, "\"");
+    }
+    for (size_t i = 0, n = pick(5); i < n; i++) {
+        puts_text(t, ",");
+        random_string(t);
+        puts_text(t, ":");
+        random_value(t, 1);
+    }
+    puts_text(t, "}");
+    space(t);
+}
+
+static void mutate(struct Text *t) {
+    switch (pick(6)) {
+    case 0: // Truncate
+        t->len = pick(t->len);
+        t->data[t->len] = '\0';
+        break;
+    case 1: // Flip a byte
+        if (t->len) t->data[pick(t->len)] ^= (char)(1 << pick(8));
+        break;
+    case 2: { // Insert a structural byte
+        static const char bytes[] = "{}[]\":,\\ x0";
+        size_t at = pick(t->len + 1);
+        put(t, " ", 1);
+        memmove(t->data + at + 1, t->data + at, t->len - at - 1);
+        t->data[at] = bytes[pick(sizeof(bytes) - 1)];
+        break;
+    }
+    case 3: // Trailing garbage
+        puts_text(t, pick(2) ? " x" : "{}");
+        break;
+    case 4: // A second document
+        puts_text(t, "{\"a\":1}");
+        break;
+    default: // Not an object at all
+        t->len = 0;
+        random_value(t, 5);
+    }
+}
+
+// Feed body in chunks: whole (step 0), one byte at a time (step 1) or random sizes (step -1)
+static int ingest(const struct Text *body, size_t limit, int step, struct json_object **json) {
+    struct RequestBody rb;
+    int state = request_body_begin(&rb, BODY_JSON, limit, NULL);
+    for (size_t off = 0; state == BODY_OK && off < body->len;) {
+        size_t n = step == 0 ? body->len : step == 1 ? 1 : 1 + pick(pick(2) ? 16 : 4096);
+        if (n > body->len - off) n = body->len - off;
+        state = request_body_feed(&rb, body->data + off, n);
+        off += n;
+    }
+    *json = request_body_json(&rb);
+    state = rb.state;
+    request_body_free(&rb);
+    return state;
+}
+
+static int same(struct json_object *a, struct json_object *b) {
+    if (!a || !b) return a == b;
+    return strcmp(json_object_to_json_string_ext(a, JSON_C_TO_STRING_PLAIN),
+                  json_object_to_json_string_ext(b, JSON_C_TO_STRING_PLAIN)) == 0;
+}
+
+static int fail(const char *what, const struct Text *body) {
+    fprintf(stderr, "%s for a %zu byte body:\n%.*s\n", what, body->len, body->len > 2000 ? 2000 : (int)body->len,
+            body->data);
+    return 0;
+}
+
+static int fuzz_case(struct Text *body, int valid) {
+    struct json_object *whole, *split, *bytes = NULL, *reference = NULL;
+    int whole_state = ingest(body, BENCH_BODY_MAX, 0, &whole);
+    int split_state = ingest(body, BENCH_BODY_MAX, -1, &split);
+    int bytes_state = body->len <= 4096 ? ingest(body, BENCH_BODY_MAX, 1, &bytes) : whole_state;
+    int ok = 1;
+    if (split_state != whole_state || !same(whole, split)) ok = fail("Random chunks disagree with one chunk", body);
+    if (body->len <= 4096 && (bytes_state != whole_state || !same(whole, bytes))) {
+        ok = fail("Single bytes disagree with one chunk", body);
+    }
+    if (valid) {
+        reference = json_tokener_parse(body->data);
+        if (whole_state != BODY_OK || !same(whole, reference)) ok = fail("Valid body not parsed like json_tokener_parse", body);
+    }
+
+    // An accepted body again, with a limit it does not fit in
+    if (whole_state == BODY_OK && body->len > 1) {
+        struct json_object *cut;
+        if (ingest(body, body->len - 1, -1, &cut) != BODY_TOO_LARGE) ok = fail("Limit not enforced", body);
+        json_object_put(cut);
+    }
+    json_object_put(whole);
+    json_object_put(split);
+    json_object_put(bytes);
+    json_object_put(reference);
+    return ok;
+}
+
+// Old path: grow by exactly each chunk, then parse the whole text
+static double buffered_parse(const struct Text *body, double *after_last) {
+    double start = now_seconds();
+    char *buffer = NULL;
+    size_t size = 0;
+    for (size_t off = 0; off < body->len; off += BENCH_SEGMENT) {
+        size_t n = body->len - off < BENCH_SEGMENT ? body->len - off : BENCH_SEGMENT;
+        buffer = realloc(buffer, size + n + 1);
+        memcpy(buffer + size, body->data + off, n);
+        size += n;
+        buffer[size] = '\0';
+    }
+    double last = now_seconds();
+    struct json_object *json = json_tokener_parse(buffer);
+    double end = now_seconds();
+    json_object_put(json);
+    free(buffer);
+    *after_last = end - last;
+    return end - start;
+}
+
+static double incremental_parse(const struct Text *body, double *after_last) {
+    double start = now_seconds();
+    struct RequestBody rb;
+    request_body_begin(&rb, BODY_JSON, BENCH_BODY_MAX, NULL);
+    for (size_t off = 0; off < body->len; off += BENCH_SEGMENT) {
+        size_t n = body->len - off < BENCH_SEGMENT ? body->len - off : BENCH_SEGMENT;
+        request_body_feed(&rb, body->data + off, n);
+    }
+    double last = now_seconds();
+    struct json_object *json = request_body_json(&rb);
+    double end = now_seconds();
+    json_object_put(json);
+    request_body_free(&rb);
+    *after_last = end - last;
+    return end - start;
+}
+
+// Raw bodies: growing by exactly each chunk against doubling; grows counts reallocs
+static double raw_ingest(int doubling, const char *chunk, size_t *grows) {
+    double start = now_seconds();
+    *grows = 0;
+    if (doubling) {
+        struct RequestBody rb;
+        request_body_begin(&rb, BODY_RAW, BENCH_RAW_BYTES, NULL); // Chunked: no length to reserve from
+        for (size_t off = 0; off < BENCH_RAW_BYTES; off += BENCH_SEGMENT) {
+            size_t n = BENCH_RAW_BYTES - off < BENCH_SEGMENT ? BENCH_RAW_BYTES - off : BENCH_SEGMENT;
+            size_t cap = rb.cap;
+            request_body_feed(&rb, chunk, n);
+            *grows += rb.cap != cap;
+        }
+        size_t len;
+        free(request_body_take(&rb, &len));
+        request_body_free(&rb);
+    } else {
+        char *buffer = NULL;
+        size_t size = 0;
+        for (size_t off = 0; off < BENCH_RAW_BYTES; off += BENCH_SEGMENT) {
+            size_t n = BENCH_RAW_BYTES - off < BENCH_SEGMENT ? BENCH_RAW_BYTES - off : BENCH_SEGMENT;
+            buffer = realloc(buffer, size + n + 1);
+            ++*grows;
+            memcpy(buffer + size, chunk, n);
+            size += n;
+        }
+        free(buffer);
+    }
+    return now_seconds() - start;
+}
+
+int main(int argc, char **argv) {
+    long cases = argc > 1 ? atol(argv[1]) : 20000;
+    if (argc > 2) rng_state = strtoull(argv[2], NULL, 10) | 1;
+    if (cases < 0) {
+        fprintf(stderr, "Usage: %s [fuzz cases] [seed]\n", argv[0]);
+        return 1;
+    }
+
+    struct Text body = { 0 };
+    long valid = 0, accepted = 0;
+    double start = now_seconds();
+    for (long i = 0; i < cases; i++) {
+        random_body(&body);
+        int mutated = pick(2);
+        if (mutated) mutate(&body);
+        else valid++;
+        if (!fuzz_case(&body, !mutated)) return 1;
+        struct json_object *json;
+        accepted += ingest(&body, BENCH_BODY_MAX, 0, &json) == BODY_OK;
+        json_object_put(json);
+    }
+    double fuzz_s = now_seconds() - start;
+
+    // A chat body with a long escaped message, arriving in segments
+    body.len = 0;
+    puts_text(&body, "{\"message\":\"");
+    while (body.len < BENCH_MESSAGE) puts_text(&body, "Tell me more about the \\\"second\\\" point \\u00e9\\n");
+    puts_text(&body, "\",\"stream\":true,\"model\":\"gemini-2.0-flash\"}");
+    double buffered = 0, incremental = 0, buffered_tail = 0, incremental_tail = 0, tail;
+    for (int i = 0; i < BENCH_ROUNDS; i++) {
+        buffered += buffered_parse(&body, &tail);
+        buffered_tail += tail;
+        incremental += incremental_parse(&body, &tail);
+        incremental_tail += tail;
+    }
+
+    char *chunk = malloc(BENCH_SEGMENT);
+    if (!chunk) return 1;
+    memset(chunk, 'x', BENCH_SEGMENT);
+    size_t exact_grows, doubling_grows;
+    double exact_s = raw_ingest(0, chunk, &exact_grows);
+    double doubling_s = raw_ingest(1, chunk, &doubling_grows);
+    free(chunk);
+
+    printf("{\"bench\":\"body\",\"fuzz\":{\"cases\":%ld,\"valid\":%ld,\"accepted\":%ld,\"seconds\":%.2f},"
+           "\"json\":{\"bytes\":%zu,\"buffered_us\":%.1f,\"incremental_us\":%.1f,"
+           "\"buffered_after_last_byte_us\":%.1f,\"incremental_after_last_byte_us\":%.1f},"
+           "\"raw\":{\"bytes\":%d,\"exact_ms\":%.2f,\"exact_grows\":%zu,\"doubling_ms\":%.2f,\"doubling_grows\":%zu}}\n",
+           cases, valid, accepted, fuzz_s, body.len, buffered / BENCH_ROUNDS * 1e6, incremental / BENCH_ROUNDS * 1e6,
+           buffered_tail / BENCH_ROUNDS * 1e6, incremental_tail / BENCH_ROUNDS * 1e6, BENCH_RAW_BYTES, exact_s * 1e3,
+           exact_grows, doubling_s * 1e3, doubling_grows);
+    free(body.data);
+    return 0;
+}
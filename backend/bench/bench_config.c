@@ -0,0 +1,204 @@
+// Hammers the config snapshots: readers resolve and check the settings in a
+// loop while writers publish global updates and per-session overrides. Every
+// publish derives all fields from one counter, so a torn read or a freed
+// string shows up as an inconsistency. Readers copy the strings out as the
+// server does before an upstream call; a mutex-guarded config copied the same
+// way is the baseline.
+// Usage: bench_config [readers] [writers] [seconds]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "config.h"
+
+#define OVERRIDE_SLOTS 16 // Sessions carrying overrides
+#define PROMPT_PAD 512 // Filler after the prompt's tag, checked by readers
+
+struct BenchArgs {
+    int thread_id; // Index of this thread
+    int use_mutex; // Baseline mode
+    unsigned long ops; // Reads or publishes done, set by the thread
+    unsigned long bad; // Inconsistent reads, set by the thread
+};
+
+// Baseline: one config copied in place under a lock
+static struct {
+    pthread_mutex_t lock;
+    char model[CONFIG_MODEL_MAX];
+    double temperature;
+    double top_p;
+    int top_k;
+    char *system_prompt;
+} locked = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static struct ConfigSnapshot *overrides[OVERRIDE_SLOTS];
+static int running = 1; // Cleared to stop the threads (atomic)
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char* make_prompt(const char *tag, unsigned long n) {
+    char *prompt = malloc(PROMPT_PAD + 64);
+    if (!prompt) return NULL;
+    int len = snprintf(prompt, 64, "%s-%lu:", tag, n);
+    memset(prompt + len, 'a' + (int)(n % 26), PROMPT_PAD);
+    prompt[len + PROMPT_PAD] = '\0';
+    return prompt;
+}
+
+// Whether prompt is tag-n followed by the filler for n
+static int prompt_matches(const char *prompt, const char *tag, unsigned long n) {
+    char head[64];
+    int len = snprintf(head, sizeof(head), "%s-%lu:", tag, n);
+    if (!prompt || strncmp(prompt, head, len) != 0 || strlen(prompt) != (size_t)len + PROMPT_PAD) return 0;
+    return prompt[len] == 'a' + (int)(n % 26) && prompt[len + PROMPT_PAD - 1] == prompt[len];
+}
+
+// Model "model-n" carries the counter every other field was derived from
+static int config_consistent(const struct AiConfig *c) {
+    unsigned long n = strtoul(c->model + 6, NULL, 10);
+    if (c->top_k != (int)(n % 200) + 1 || c->temperature != (double)(n % 200) / 100.0) return 0;
+    if (c->system_prompt && strncmp(c->system_prompt, "override-", 9) == 0) {
+        unsigned long m = strtoul(c->system_prompt + 9, NULL, 10);
+        return c->top_p == (double)(m % 100) / 100.0 && prompt_matches(c->system_prompt, "override", m);
+    }
+    return c->top_p == (double)(n % 100) / 100.0 && prompt_matches(c->system_prompt, "prompt", n);
+}
+
+static void* reader_thread(void *arg) {
+    struct BenchArgs *args = (struct BenchArgs *)arg;
+    unsigned int seed = (unsigned int)args->thread_id * 2654435761u;
+    struct Arena arena;
+    arena_init(&arena);
+    while (__atomic_load_n(&running, __ATOMIC_RELAXED)) {
+        struct AiConfig c;
+        if (args->use_mutex) {
+            pthread_mutex_lock(&locked.lock);
+            c = (struct AiConfig){ 0, arena_strdup(&arena, locked.model), locked.temperature, locked.top_p,
+                                   locked.top_k, 0, arena_strdup(&arena, locked.system_prompt), 0 };
+            pthread_mutex_unlock(&locked.lock);
+        } else {
+            int slot = rand_r(&seed) % (OVERRIDE_SLOTS * 2); // Half the reads have no session
+            if (!config_resolve_copy(&c, slot < OVERRIDE_SLOTS ? &overrides[slot] : NULL, &arena)) {
+                config_read_end();
+                arena_free(&arena);
+                continue;
+            }
+        }
+        // Checked after the lock or read section has ended, like a reply built from the copy
+        int ok = c.model && config_consistent(&c);
+        arena_free(&arena);
+        args->ops++;
+        if (!ok) args->bad++;
+    }
+    return NULL;
+}
+
+static void* writer_thread(void *arg) {
+    struct BenchArgs *args = (struct BenchArgs *)arg;
+    unsigned long n = (unsigned long)args->thread_id * 1000000000UL;
+    char model[32];
+    while (__atomic_load_n(&running, __ATOMIC_RELAXED)) {
+        n++;
+        snprintf(model, sizeof(model), "model-%lu", n);
+        char *prompt = make_prompt(!args->use_mutex && n % 2 ? "override" : "prompt", n);
+        if (!prompt) continue;
+        if (args->use_mutex) {
+            pthread_mutex_lock(&locked.lock);
+            strcpy(locked.model, model);
+            locked.temperature = (double)(n % 200) / 100.0;
+            locked.top_k = (int)(n % 200) + 1;
+            locked.top_p = (double)(n % 100) / 100.0;
+            char *old = locked.system_prompt;
+            locked.system_prompt = prompt;
+            prompt = old; // Freed below
+            pthread_mutex_unlock(&locked.lock);
+        } else if (n % 2) {
+            // A session override: prompt and top_p together, layered on any global model
+            struct AiConfig values = { .top_p = (double)(n % 100) / 100.0, .system_prompt = prompt };
+            config_override_update(&overrides[n % OVERRIDE_SLOTS], n % 7 ? CONFIG_TOP_P | CONFIG_SYSTEM_PROMPT : 0,
+                                   &values);
+        } else {
+            struct AiConfig values = {
+                .model = model,
+                .temperature = (double)(n % 200) / 100.0,
+                .top_p = (double)(n % 100) / 100.0,
+                .top_k = (int)(n % 200) + 1,
+                .max_output_tokens = 1024,
+                .system_prompt = prompt,
+            };
+            config_update(CONFIG_ALL, &values);
+        }
+        free(prompt);
+        args->ops++;
+    }
+    return NULL;
+}
+
+// Run readers and writers for seconds; returns reads per second
+static double run(int readers, int writers, double seconds, int use_mutex, unsigned long *publishes,
+                  unsigned long *bad) {
+    int threads = readers + writers;
+    pthread_t *tids = calloc(threads, sizeof(pthread_t));
+    struct BenchArgs *args = calloc(threads, sizeof(struct BenchArgs));
+    __atomic_store_n(&running, 1, __ATOMIC_RELAXED);
+    for (int i = 0; i < threads; i++) {
+        args[i].thread_id = i + 1;
+        args[i].use_mutex = use_mutex;
+        pthread_create(&tids[i], NULL, i < readers ? reader_thread : writer_thread, &args[i]);
+    }
+    double start = now_seconds();
+    struct timespec pause = { (time_t)seconds, (long)((seconds - (time_t)seconds) * 1e9) };
+    nanosleep(&pause, NULL);
+    __atomic_store_n(&running, 0, __ATOMIC_RELAXED);
+    unsigned long reads = 0;
+    *publishes = *bad = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+        if (i < readers) reads += args[i].ops;
+        else *publishes += args[i].ops;
+        *bad += args[i].bad;
+    }
+    double elapsed = now_seconds() - start;
+    free(tids);
+    free(args);
+    return reads / elapsed;
+}
+
+int main(int argc, char **argv) {
+    int readers = argc > 1 ? atoi(argv[1]) : 8;
+    int writers = argc > 2 ? atoi(argv[2]) : 2;
+    double seconds = argc > 3 ? atof(argv[3]) : 1.0;
+    if (readers < 1) readers = 1;
+    if (writers < 1) writers = 1;
+
+    // Seed both modes with a consistent config for counter 0
+    char *prompt = make_prompt("prompt", 0);
+    struct AiConfig values = { .model = "model-0", .temperature = 0.0, .top_p = 0.0, .top_k = 1,
+                               .max_output_tokens = 1024, .system_prompt = prompt };
+    config_init();
+    config_update(CONFIG_ALL, &values);
+    strcpy(locked.model, "model-0");
+    locked.top_k = 1;
+    locked.system_prompt = prompt;
+
+    unsigned long publishes, bad, mutex_publishes, mutex_bad;
+    double snapshot_reads = run(readers, writers, seconds, 0, &publishes, &bad);
+    size_t pending = config_retired_pending();
+    double mutex_reads = run(readers, writers, seconds, 1, &mutex_publishes, &mutex_bad);
+
+    printf("{\"bench\":\"config\",\"readers\":%d,\"writers\":%d,\"seconds\":%.1f,"
+           "\"snapshot\":{\"reads_per_sec\":%.0f,\"publishes\":%lu,\"inconsistent\":%lu,\"retired_pending\":%zu},"
+           "\"mutex\":{\"reads_per_sec\":%.0f,\"publishes\":%lu,\"inconsistent\":%lu}}\n",
+           readers, writers, seconds, snapshot_reads, publishes, bad, pending, mutex_reads, mutex_publishes,
+           mutex_bad);
+
+    for (int i = 0; i < OVERRIDE_SLOTS; i++) config_override_free(&overrides[i]);
+    config_cleanup();
+    free(locked.system_prompt);
+    return bad || mutex_bad ? 1 : 0;
+}
@@ -0,0 +1,83 @@
+// Compares the ring-buffer history against the old linked list.
+// For each size it times appending N messages and assembling the latest
+// 10-message context. The list has to walk from head to reach the newest
+// messages and strcat them into a fixed buffer, as get_chat_history does.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "history.h"
+#include "linked_list.h"
+
+#define WINDOW 10 // Messages per assembled context
+#define MESSAGE "What is the tallest mountain in the solar system, and how tall is it?"
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Latest-N context from the linked list, mirroring get_chat_history's strcat loop
+static char* list_latest(struct LinkedList *list, int max_messages) {
+    char *history = malloc(10000);
+    history[0] = '\0';
+    int total = 0;
+    for (struct ListNode *node = list->head; node; node = node->next) total++;
+
+    int skip = total > max_messages ? total - max_messages : 0;
+    int index = 0;
+    for (struct ListNode *node = list->head; node; node = node->next, index++) {
+        if (index < skip) continue;
+        strcat(history, index % 2 == 0 ? "User: " : "Assistant: ");
+        strcat(history, node->message);
+        strcat(history, "\n");
+    }
+    return history;
+}
+
+static void run(int messages, int rounds) {
+    struct LinkedList *list = create_list();
+    struct ChatHistory *ring = history_create(HISTORY_CAPACITY);
+    size_t checksum = 0;
+
+    double start = now_seconds();
+    for (int i = 0; i < messages; i++) add_message(list, MESSAGE);
+    double list_append = now_seconds() - start;
+
+    start = now_seconds();
+    for (int i = 0; i < messages; i++) history_append(ring, i % 2 == 0 ? ROLE_USER : ROLE_MODEL, MESSAGE);
+    double ring_append = now_seconds() - start;
+
+    start = now_seconds();
+    for (int r = 0; r < rounds; r++) {
+        char *context = list_latest(list, WINDOW);
+        checksum += strlen(context);
+        free(context);
+    }
+    double list_context = now_seconds() - start;
+
+    start = now_seconds();
+    for (int r = 0; r < rounds; r++) {
+        char *context = history_render(ring, WINDOW, HISTORY_MAX_BYTES, NULL);
+        checksum += strlen(context);
+        free(context);
+    }
+    double ring_context = now_seconds() - start;
+
+    printf("{\"bench\":\"history\",\"messages\":%d,"
+           "\"list_append_ns\":%.1f,\"ring_append_ns\":%.1f,"
+           "\"list_context_ns\":%.1f,\"ring_context_ns\":%.1f,\"checksum\":%zu}\n",
+           messages, list_append * 1e9 / messages, ring_append * 1e9 / messages,
+           list_context * 1e9 / rounds, ring_context * 1e9 / rounds, checksum);
+
+    free_list(list);
+    history_free(ring);
+}
+
+int main() {
+    run(10, 100000);
+    run(1000, 20000);
+    run(100000, 200);
+    return 0;
+}
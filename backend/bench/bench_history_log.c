@@ -0,0 +1,142 @@
+// Appends messages through the session store with the history log on, then
+// times the final sync and a recovery into an empty store, and checks that
+// every session comes back with the same messages.
+// Usage: bench_history_log [threads] [sessions] [messages] [compact_mb] [dir]
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "session_store.h"
+
+struct BenchArgs {
+    int thread_id; // Index of this thread
+    int sessions; // Distinct session ids to spread messages over
+    long messages; // Messages to add
+};
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void* bench_thread(void *arg) {
+    struct BenchArgs *args = (struct BenchArgs *)arg;
+    unsigned int seed = (unsigned int)args->thread_id * 2654435761u;
+    char id[32], text[96];
+    for (long i = 0; i < args->messages; i++) {
+        snprintf(id, sizeof(id), "bench-%d", rand_r(&seed) % args->sessions);
+        snprintf(text, sizeof(text), "Message %ld from thread %d: how far is the moon from the earth?", i,
+                 args->thread_id);
+        struct Session *session = session_acquire(id);
+        if (!session) continue;
+        session_add_message(session, i % 2 ? ROLE_MODEL : ROLE_USER, text);
+        session_release(session);
+    }
+    return NULL;
+}
+
+// FNV-1a over every session's retained messages, in id order
+static uint64_t store_fingerprint(int sessions) {
+    uint64_t hash = 1469598103934665603ULL;
+    char id[32];
+    for (int i = 0; i < sessions; i++) {
+        snprintf(id, sizeof(id), "bench-%d", i);
+        struct Session *session = session_acquire(id);
+        if (!session) continue;
+        struct HistoryWindow *window = session_get_history(session, SIZE_MAX, NULL);
+        session_release(session);
+        if (!window) continue;
+        for (size_t t = 0; t < window->count; t++) {
+            hash = (hash ^ (uint64_t)window->turns[t].role) * 1099511628211ULL;
+            for (size_t c = 0; c < window->turns[t].len; c++) {
+                hash = (hash ^ (unsigned char)window->turns[t].text[c]) * 1099511628211ULL;
+            }
+        }
+        hash = (hash ^ window->last_seq) * 1099511628211ULL;
+        free(window);
+    }
+    return hash;
+}
+
+static void remove_dir(const char *dir) {
+    char command[4200];
+    snprintf(command, sizeof(command), "rm -rf '%s'", dir);
+    if (system(command) != 0) fprintf(stderr, "Could not remove %s\n", dir);
+}
+
+int main(int argc, char **argv) {
+    int threads = argc > 1 ? atoi(argv[1]) : 8;
+    int sessions = argc > 2 ? atoi(argv[2]) : 10000;
+    long messages = argc > 3 ? atol(argv[3]) : 1000000;
+    int compact_mb = argc > 4 ? atoi(argv[4]) : 16;
+    char dir[4096] = "/tmp/bench_history_log.XXXXXX";
+    int own_dir = argc <= 5;
+    if (threads < 1) threads = 1;
+    if (sessions < 1) sessions = 1;
+    if (own_dir ? mkdtemp(dir) == NULL : snprintf(dir, sizeof(dir), "%s", argv[5]) < 0) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    // Large enough that nothing is evicted, so memory and the log hold the same sessions
+    size_t memory = 4096UL * 1024 * 1024;
+    session_store_init(SESSION_TTL_DEFAULT, memory);
+    if (!history_log_open(dir, HISTORY_LOG_FSYNC_MS_DEFAULT, (size_t)compact_mb << 20, session_store_restore,
+                          session_store_dump)) {
+        fprintf(stderr, "Could not open history log in %s\n", dir);
+        return 1;
+    }
+    struct HistoryLogStats opened;
+    history_log_get_stats(&opened);
+
+    pthread_t *tids = calloc(threads, sizeof(pthread_t));
+    struct BenchArgs *args = calloc(threads, sizeof(struct BenchArgs));
+    double start = now_seconds();
+    for (int i = 0; i < threads; i++) {
+        args[i].thread_id = i + 1;
+        args[i].sessions = sessions;
+        args[i].messages = messages / threads + (i < messages % threads ? 1 : 0);
+        pthread_create(&tids[i], NULL, bench_thread, &args[i]);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    double append_seconds = now_seconds() - start;
+
+    uint64_t before = store_fingerprint(sessions);
+    start = now_seconds();
+    history_log_close(); // Writes and syncs what is still queued
+    double close_seconds = now_seconds() - start;
+    struct HistoryLogStats written;
+    history_log_get_stats(&written);
+    session_store_cleanup();
+
+    // Recover into an empty store
+    session_store_init(SESSION_TTL_DEFAULT, memory);
+    start = now_seconds();
+    int reopened = history_log_open(dir, HISTORY_LOG_FSYNC_MS_DEFAULT, (size_t)compact_mb << 20,
+                                    session_store_restore, session_store_dump);
+    double recover_seconds = now_seconds() - start;
+    struct HistoryLogStats recovered;
+    history_log_get_stats(&recovered);
+    uint64_t after = store_fingerprint(sessions);
+    history_log_close();
+    session_store_cleanup();
+
+    printf("{\"bench\":\"history_log\",\"threads\":%d,\"sessions\":%d,\"messages\":%ld,"
+           "\"append_seconds\":%.3f,\"appends_per_sec\":%.0f,\"close_seconds\":%.3f,"
+           "\"bytes_written\":%lu,\"fsyncs\":%lu,\"compactions\":%lu,\"dropped\":%lu,"
+           "\"recover_seconds\":%.3f,\"replayed\":%lu,\"match\":%s}\n",
+           threads, sessions, messages, append_seconds, messages / append_seconds, close_seconds,
+           written.bytes_written, written.fsyncs, written.compactions, written.dropped, recover_seconds,
+           recovered.replayed - opened.replayed, reopened && before == after ? "true" : "false");
+
+    if (own_dir) remove_dir(dir);
+    free(tids);
+    free(args);
+    return reopened && before == after ? 0 : 1;
+}
@@ -0,0 +1,156 @@
+// Logging from request threads. Each thread plays chats: one info line, a few
+// stage spans and, for sampled requests, a 4 KB payload dump. A paced run
+// must write every record once and intact; lines are then parsed back. An
+// unpaced run compares the caller's cost per chat with synchronous stdio to
+// one shared file, the way raw responses used to be echoed to stdout.
+// Usage: bench_log [threads] [chats] [dir]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "logger.h"
+
+#define PAYLOAD_BYTES 4096 // Size of a dumped upstream body
+#define SPANS_PER_CHAT 4
+
+struct BenchArgs {
+    int thread_id;
+    int chats;
+    int paced; // Leave the writer time to keep up
+    int use_stdio; // Baseline mode
+    FILE *file; // Baseline output
+    uint64_t *latency; // Per-chat cost in ns, set by the thread
+};
+
+static char payload[PAYLOAD_BYTES];
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void* chat_thread(void *arg) {
+    struct BenchArgs *args = (struct BenchArgs *)arg;
+    for (int i = 0; i < args->chats; i++) {
+        uint64_t start = metrics_now_ns();
+        if (args->use_stdio) {
+            fprintf(args->file, "{\"event\":\"chat\",\"msg\":\"thread %d chat %d answered in %.1f ms, %d tokens\"}\n",
+                    args->thread_id, i, 12.5, 321);
+            if (i % 100 == 0) fwrite(payload, 1, sizeof(payload), args->file);
+        } else {
+            log_set_request(log_request_id(NULL));
+            for (int s = 0; s < SPANS_PER_CHAT; s++) log_span(H_UPSTREAM_TOTAL + s % 2, start, 1000);
+            if (log_payload_sampled()) log_payload("upstream_response", payload, sizeof(payload), sizeof(payload));
+            log_msg(LOG_INFO, "chat", "thread %d chat %d answered in %.1f ms, %d tokens", args->thread_id, i, 12.5, 321);
+            log_set_request(0);
+        }
+        args->latency[i] = metrics_now_ns() - start;
+        if (args->paced && i % 16 == 15) {
+            struct timespec pause = { 0, 2000000 };
+            nanosleep(&pause, NULL);
+        }
+    }
+    return NULL;
+}
+
+// Run threads x chats; returns mean and p99 cost per chat in ns
+static void run(int threads, int chats, int paced, int use_stdio, FILE *file, double *mean, double *p99) {
+    pthread_t *tids = calloc(threads, sizeof(pthread_t));
+    struct BenchArgs *args = calloc(threads, sizeof(struct BenchArgs));
+    uint64_t *latency = calloc((size_t)threads * chats, sizeof(uint64_t));
+    for (int i = 0; i < threads; i++) {
+        args[i] = (struct BenchArgs){ i, chats, paced, use_stdio, file, latency + (size_t)i * chats };
+        pthread_create(&tids[i], NULL, chat_thread, &args[i]);
+    }
+    for (int i = 0; i < threads; i++) pthread_join(tids[i], NULL);
+    size_t n = (size_t)threads * chats;
+    double sum = 0;
+    for (size_t i = 0; i < n; i++) sum += (double)latency[i];
+    qsort(latency, n, sizeof(uint64_t), compare_u64);
+    *mean = sum / (double)n;
+    *p99 = (double)latency[n * 99 / 100];
+    free(latency);
+    free(args);
+    free(tids);
+}
+
+// Every line must be one JSON object; chat lines are counted per thread
+static int check_lines(const char *path, int threads, int chats, unsigned long *lines, unsigned long *payloads) {
+    FILE *f = fopen(path, "r");
+    if (!f) return 0;
+    int *seen = calloc(threads, sizeof(int));
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    int ok = 1;
+    *lines = *payloads = 0;
+    while ((len = getline(&line, &cap, f)) > 0) {
+        (*lines)++;
+        if (len < 3 || line[0] != '{' || strcmp(line + len - 2, "}\n") != 0) ok = 0;
+        int thread, chat;
+        const char *msg = strstr(line, "\"msg\":\"thread ");
+        if (strstr(line, "\"event\":\"upstream_response\"")) (*payloads)++;
+        if (msg && sscanf(msg, "\"msg\":\"thread %d chat %d", &thread, &chat) == 2 && thread < threads) {
+            if (chat != seen[thread]++) ok = 0; // One thread's lines stay in order
+        }
+    }
+    for (int i = 0; i < threads; i++) ok = ok && seen[i] == chats;
+    free(line);
+    free(seen);
+    fclose(f);
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    int threads = argc > 1 ? atoi(argv[1]) : 8;
+    int chats = argc > 2 ? atoi(argv[2]) : 20000;
+    const char *dir = argc > 3 ? argv[3] : "/tmp";
+    if (threads < 1) threads = 1;
+    if (chats < 1) chats = 1;
+    memset(payload, 'x', sizeof(payload));
+    char path[4096], trace_path[4096];
+    snprintf(path, sizeof(path), "%s/bench_log.jsonl", dir);
+    snprintf(trace_path, sizeof(trace_path), "%s/bench_log.trace.json", dir);
+
+    // Paced: nothing may be dropped, and the trace must close as a JSON array
+    remove(path);
+    struct LogSettings settings = { LOG_DEBUG, path, trace_path, 1.0, 0.01 };
+    if (!log_init(&settings)) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return 1;
+    }
+    double mean, p99;
+    run(threads, chats, 1, 0, NULL, &mean, &p99);
+    log_cleanup();
+    struct LogStats stats;
+    log_get_stats(&stats);
+    unsigned long lines = 0, payloads = 0;
+    int intact = check_lines(path, threads, chats, &lines, &payloads);
+    int ok = intact && stats.dropped == 0 && stats.spans == (unsigned long)threads * chats * SPANS_PER_CHAT &&
+             lines == stats.lines && lines == (unsigned long)threads * chats + payloads;
+
+    // Unpaced: the caller's cost when the writer falls behind, against stdio
+    remove(path);
+    settings.trace_file = NULL;
+    log_init(&settings);
+    double log_mean, log_p99;
+    run(threads, chats, 0, 0, NULL, &log_mean, &log_p99);
+    log_cleanup();
+    log_get_stats(&stats);
+    unsigned long flood_dropped = stats.dropped;
+
+    FILE *file = fopen(path, "w");
+    double stdio_mean, stdio_p99;
+    run(threads, chats, 0, 1, file, &stdio_mean, &stdio_p99);
+    fclose(file);
+    remove(path);
+    remove(trace_path);
+
+    printf("{\"bench\":\"log\",\"threads\":%d,\"chats\":%d,\"paced_lines\":%lu,\"paced_payloads\":%lu,"
+           "\"paced_ok\":%s,\"log_ns\":%.0f,\"log_p99_ns\":%.0f,\"flood_dropped\":%lu,"
+           "\"stdio_ns\":%.0f,\"stdio_p99_ns\":%.0f}\n",
+           threads, chats, lines, payloads, ok ? "true" : "false", log_mean, log_p99, flood_dropped,
+           stdio_mean, stdio_p99);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,136 @@
+// Compares the streaming response scanner against the old parse path on
+// large multi-part generateContent bodies. The old path accumulates the body
+// with realloc, builds a json-c DOM with json_tokener_parse and walks it; the
+// scanner is fed the same 16 KiB chunks curl would deliver. Peak heap comes
+// from the ALLOC_STATS interposer this benchmark is linked with.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <json-c/json.h>
+#include "alloc_stats.h"
+#include "response_parser.h"
+
+#define CHUNK 16384 // Bytes per simulated curl write callback
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Body with parts text parts of part_len bytes each, including escapes
+static char* build_body(int parts, size_t part_len, size_t *out_len) {
+    static const char pattern[] = "The quick brown fox \\\"jumps\\\" over the lazy dog.\\n Caf\\u00e9 ";
+    size_t pattern_len = sizeof(pattern) - 1;
+    size_t cap = (size_t)parts * (part_len + 64) + 512;
+    char *body = malloc(cap);
+    size_t len = (size_t)snprintf(body, cap, "{\"candidates\":[{\"content\":{\"parts\":[");
+    for (int i = 0; i < parts; i++) {
+        len += (size_t)snprintf(body + len, cap - len, "%s{\"text\":\"", i ? "," : "");
+        for (size_t n = 0; n + pattern_len <= part_len; n += pattern_len) {
+            memcpy(body + len, pattern, pattern_len);
+            len += pattern_len;
+        }
+        len += (size_t)snprintf(body + len, cap - len, "\"}");
+    }
+    len += (size_t)snprintf(body + len, cap - len,
+                            "],\"role\":\"model\"},\"finishReason\":\"STOP\",\"index\":0}],"
+                            "\"usageMetadata\":{\"promptTokenCount\":10,\"candidatesTokenCount\":%d,\"totalTokenCount\":%d}}",
+                            parts * 100, parts * 100 + 10);
+    *out_len = len;
+    return body;
+}
+
+// The previous get_ai_response: buffer everything, parse a DOM, then join every part
+static size_t dom_parse(const char *body, size_t len) {
+    char *data = NULL;
+    size_t size = 0;
+    for (size_t off = 0; off < len; off += CHUNK) {
+        size_t n = len - off < CHUNK ? len - off : CHUNK;
+        data = realloc(data, size + n + 1);
+        memcpy(data + size, body + off, n);
+        size += n;
+        data[size] = '\0';
+    }
+
+    struct json_object *parsed = json_tokener_parse(data);
+    struct json_object *candidates = NULL, *content = NULL, *parts = NULL;
+    json_object_object_get_ex(parsed, "candidates", &candidates);
+    json_object_object_get_ex(json_object_array_get_idx(candidates, 0), "content", &content);
+    json_object_object_get_ex(content, "parts", &parts);
+
+    size_t count = json_object_array_length(parts), text_len = 0;
+    for (size_t i = 0; i < count; i++) {
+        struct json_object *text = NULL;
+        if (json_object_object_get_ex(json_object_array_get_idx(parts, i), "text", &text)) {
+            text_len += (size_t)json_object_get_string_len(text);
+        }
+    }
+    char *joined = malloc(text_len + 1), *p = joined;
+    for (size_t i = 0; i < count; i++) {
+        struct json_object *text = NULL;
+        if (json_object_object_get_ex(json_object_array_get_idx(parts, i), "text", &text)) {
+            size_t n = (size_t)json_object_get_string_len(text);
+            memcpy(p, json_object_get_string(text), n);
+            p += n;
+        }
+    }
+    *p = '\0';
+
+    json_object_put(parsed);
+    free(data);
+    free(joined);
+    return text_len;
+}
+
+static size_t stream_parse(const char *body, size_t len) {
+    struct ResponseParser parser;
+    response_parser_init(&parser, NULL);
+    for (size_t off = 0; off < len; off += CHUNK) {
+        response_parser_feed(&parser, body + off, len - off < CHUNK ? len - off : CHUNK);
+    }
+    size_t text_len = response_parser_finish(&parser) ? parser.result.text_len : 0;
+    response_parser_free(&parser);
+    return text_len;
+}
+
+// Time rounds runs of fn and report the peak heap of one run above the baseline
+static void measure(size_t (*fn)(const char *, size_t), const char *body, size_t len, int rounds,
+                    double *ns, size_t *peak, size_t *text_len) {
+    struct AllocStats stats;
+    alloc_stats_get(&stats);
+    size_t baseline = stats.live_bytes;
+    alloc_stats_reset_peak();
+    *text_len = fn(body, len);
+    alloc_stats_get(&stats);
+    *peak = stats.peak_bytes - baseline;
+
+    double start = now_seconds();
+    for (int r = 0; r < rounds; r++) fn(body, len);
+    *ns = (now_seconds() - start) * 1e9 / rounds;
+}
+
+static void run(int parts, size_t part_len, int rounds) {
+    size_t len = 0;
+    char *body = build_body(parts, part_len, &len);
+
+    double dom_ns, stream_ns;
+    size_t dom_peak, stream_peak, dom_text, stream_text;
+    measure(dom_parse, body, len, rounds, &dom_ns, &dom_peak, &dom_text);
+    measure(stream_parse, body, len, rounds, &stream_ns, &stream_peak, &stream_text);
+
+    printf("{\"bench\":\"parse\",\"parts\":%d,\"body_bytes\":%zu,"
+           "\"dom_ns\":%.0f,\"stream_ns\":%.0f,\"dom_mb_s\":%.1f,\"stream_mb_s\":%.1f,"
+           "\"dom_peak_bytes\":%zu,\"stream_peak_bytes\":%zu,\"text_match\":%s}\n",
+           parts, len, dom_ns, stream_ns, len / dom_ns * 1e3, len / stream_ns * 1e3,
+           dom_peak, stream_peak, dom_text == stream_text ? "true" : "false");
+    free(body);
+}
+
+int main() {
+    run(4, 1024, 20000);
+    run(64, 16384, 200);
+    run(256, 65536, 10);
+    return 0;
+}
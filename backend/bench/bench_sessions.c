@@ -0,0 +1,79 @@
+// Drives many sessions in parallel against the sharded session store.
+// Usage: bench_sessions [threads] [sessions] [ops_per_thread]
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include "session_store.h"
+
+struct BenchArgs {
+    int thread_id; // Index of this thread
+    int sessions; // Distinct session ids to spread operations over
+    int ops; // Operations to run
+    double seconds; // Elapsed time, set by the thread
+};
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void* bench_thread(void *arg) {
+    struct BenchArgs *args = (struct BenchArgs *)arg;
+    unsigned int seed = (unsigned int)args->thread_id * 2654435761u;
+    char id[32];
+
+    double start = now_seconds();
+    for (int i = 0; i < args->ops; i++) {
+        snprintf(id, sizeof(id), "bench-%d", rand_r(&seed) % args->sessions);
+        struct Session *session = session_acquire(id);
+        if (!session) continue;
+        // One chat turn: read the window, then store the user and model messages
+        struct HistoryWindow *history = session_get_history(session, HISTORY_TOKEN_BUDGET, NULL);
+        session_add_message(session, ROLE_USER, "How far is the moon from the earth?");
+        session_add_message(session, ROLE_MODEL, "About 384,400 km on average.");
+        free(history);
+        session_release(session);
+    }
+    args->seconds = now_seconds() - start;
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    int threads = argc > 1 ? atoi(argv[1]) : 8;
+    int sessions = argc > 2 ? atoi(argv[2]) : 10000;
+    int ops = argc > 3 ? atoi(argv[3]) : 100000;
+    if (threads < 1) threads = 1;
+    if (sessions < 1) sessions = 1;
+
+    session_store_init(SESSION_TTL_DEFAULT, 64UL * 1024 * 1024);
+
+    pthread_t *tids = calloc(threads, sizeof(pthread_t));
+    struct BenchArgs *args = calloc(threads, sizeof(struct BenchArgs));
+    double start = now_seconds();
+    for (int i = 0; i < threads; i++) {
+        args[i].thread_id = i + 1;
+        args[i].sessions = sessions;
+        args[i].ops = ops;
+        pthread_create(&tids[i], NULL, bench_thread, &args[i]);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    double elapsed = now_seconds() - start;
+
+    struct SessionStoreStats stats;
+    session_store_get_stats(&stats);
+    double total = (double)threads * ops;
+    printf("{\"bench\":\"sessions\",\"threads\":%d,\"sessions\":%d,\"turns\":%.0f,"
+           "\"seconds\":%.3f,\"turns_per_sec\":%.0f,\"live_sessions\":%lu,"
+           "\"evictions\":%lu,\"bytes\":%zu}\n",
+           threads, sessions, total, elapsed, total / elapsed, stats.sessions,
+           stats.evictions, stats.bytes);
+
+    session_store_cleanup();
+    free(tids);
+    free(args);
+    return 0;
+}
@@ -0,0 +1,485 @@
+// Open-loop load generator for the chat server. Requests start on a fixed
+// schedule at the target rate whatever the server does, and latency is taken
+// from the scheduled start, so queueing inside the server is not hidden by
+// the generator slowing down. Prints one JSON line to diff between builds.
+//
+//   loadgen [--url http://127.0.0.1:8080] [--rps 100] [--duration 10]
+//           [--sessions 1000] [--mix chat=60,stream=20,config=10,static=10,set_config=0]
+//           [--max-inflight 4096] [--pid N] [--label name] [--wait 10]
+//   loadgen --coalesce N [--expect-upstream M] [--mock-url http://127.0.0.1:9090]
+//
+// --pid reads the server's current and peak RSS from /proc after the run.
+// --coalesce sends N identical prompts at once instead, half streamed and half
+// JSON, and counts the upstream calls they cost on the mock's GET /stats; the
+// exit status is 1 when that is not --expect-upstream.
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <curl/curl.h>
+
+enum RequestKind {
+    K_CHAT, // POST /chat, JSON reply
+    K_STREAM, // POST /chat, text/event-stream reply
+    K_CONFIG, // GET /config
+    K_STATIC, // GET /
+    K_SET_CONFIG, // POST /config, alternating global updates and session overrides
+    K_COUNT
+};
+
+static const char *kind_names[K_COUNT] = { "chat", "stream", "config", "static", "set_config" };
+
+// Latencies of one series in nanoseconds
+struct Samples {
+    uint64_t *values;
+    size_t count;
+    size_t cap;
+};
+
+// A request on the multi handle
+struct InFlight {
+    int kind; // enum RequestKind
+    uint64_t scheduled_ns; // When the schedule said it should start
+    struct curl_slist *headers;
+    char *body;
+};
+
+struct Options {
+    const char *url;
+    double rps;
+    double duration;
+    int sessions;
+    int mix[K_COUNT]; // Relative weights
+    int max_inflight;
+    int pid;
+    const char *label;
+    int wait_seconds;
+    int coalesce; // Identical prompts sent at once, 0 for a rate-driven run
+    int expect_upstream; // Upstream calls they should cost, -1 to only report
+    const char *mock_url;
+};
+
+static struct Samples latencies[K_COUNT];
+static struct Samples all_latencies;
+static struct Samples stream_ttfb;
+static unsigned long sent = 0, completed = 0, dropped = 0;
+static unsigned long transport_errors = 0, http_4xx = 0, http_5xx = 0, bytes_received = 0;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void samples_add(struct Samples *samples, uint64_t value) {
+    if (samples->count == samples->cap) {
+        size_t cap = samples->cap ? samples->cap * 2 : 4096;
+        uint64_t *p = realloc(samples->values, cap * sizeof(uint64_t));
+        if (!p) return;
+        samples->values = p;
+        samples->cap = cap;
+    }
+    samples->values[samples->count++] = value;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double quantile_ms(const struct Samples *samples, double q) {
+    if (samples->count == 0) return 0.0;
+    size_t rank = (size_t)(q * (double)samples->count);
+    if (rank >= samples->count) rank = samples->count - 1;
+    return (double)samples->values[rank] / 1e6;
+}
+
+static void print_series(const char *name, struct Samples *samples, int comma) {
+    qsort(samples->values, samples->count, sizeof(uint64_t), compare_u64);
+    printf("\"%s\":{\"count\":%zu,\"p50\":%.3f,\"p99\":%.3f,\"p999\":%.3f,\"max\":%.3f}%s", name, samples->count,
+           quantile_ms(samples, 0.5), quantile_ms(samples, 0.99), quantile_ms(samples, 0.999),
+           samples->count ? (double)samples->values[samples->count - 1] / 1e6 : 0.0, comma ? "," : "");
+}
+
+static size_t discard_body(void *contents, size_t size, size_t nmemb, void *userp) {
+    (void)contents;
+    (void)userp;
+    bytes_received += size * nmemb;
+    return size * nmemb;
+}
+
+static int pick_kind(const struct Options *options) {
+    int total = 0;
+    for (int k = 0; k < K_COUNT; k++) total += options->mix[k];
+    int r = rand() % (total > 0 ? total : 1);
+    for (int k = 0; k < K_COUNT; k++) {
+        if (r < options->mix[k]) return k;
+        r -= options->mix[k];
+    }
+    return K_CHAT;
+}
+
+static void start_request(CURLM *multi, const struct Options *options, uint64_t scheduled_ns) {
+    struct InFlight *request = calloc(1, sizeof(struct InFlight));
+    CURL *easy = curl_easy_init();
+    if (!request || !easy) {
+        free(request);
+        if (easy) curl_easy_cleanup(easy);
+        dropped++;
+        return;
+    }
+    request->kind = pick_kind(options);
+    request->scheduled_ns = scheduled_ns;
+
+    char url[512];
+    if (request->kind == K_CHAT || request->kind == K_STREAM) {
+        char header[96];
+        int session = rand() % options->sessions;
+        snprintf(header, sizeof(header), "X-Session-Id: load-%d", session);
+        request->headers = curl_slist_append(request->headers, header);
+        request->headers = curl_slist_append(request->headers, "Content-Type: application/json");
+        request->body = malloc(192);
+        if (request->body) {
+            snprintf(request->body, 192, "{\"message\":\"Load test message %lu from session %d\",\"stream\":%s}",
+                     sent, session, request->kind == K_STREAM ? "true" : "false");
+        }
+        snprintf(url, sizeof(url), "%s/chat", options->url);
+        curl_easy_setopt(easy, CURLOPT_POSTFIELDS, request->body ? request->body : "{}");
+        curl_easy_setopt(easy, CURLOPT_HTTPHEADER, request->headers);
+    } else if (request->kind == K_SET_CONFIG) {
+        // Changes settings under running chats; every value is valid so replies stay comparable
+        char header[96];
+        snprintf(header, sizeof(header), "X-Session-Id: load-%d", rand() % options->sessions);
+        request->headers = curl_slist_append(request->headers, header);
+        request->headers = curl_slist_append(request->headers, "Content-Type: application/json");
+        request->body = malloc(160);
+        if (request->body) {
+            snprintf(request->body, 160, "{\"temperature\":%.2f,\"top_k\":%lu,\"system_prompt\":\"Load test prompt %lu\"%s}",
+                     (double)(sent % 100) / 100.0, sent % 64 + 1, sent, sent % 2 ? ",\"scope\":\"session\"" : "");
+        }
+        snprintf(url, sizeof(url), "%s/config", options->url);
+        curl_easy_setopt(easy, CURLOPT_POSTFIELDS, request->body ? request->body : "{}");
+        curl_easy_setopt(easy, CURLOPT_HTTPHEADER, request->headers);
+    } else {
+        snprintf(url, sizeof(url), "%s%s", options->url, request->kind == K_CONFIG ? "/config" : "/");
+        request->headers = curl_slist_append(request->headers, "Accept-Encoding: gzip, br");
+        curl_easy_setopt(easy, CURLOPT_HTTPHEADER, request->headers);
+    }
+
+    curl_easy_setopt(easy, CURLOPT_URL, url);
+    curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, discard_body);
+    curl_easy_setopt(easy, CURLOPT_PRIVATE, request);
+    curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(easy, CURLOPT_TIMEOUT, 120L);
+    curl_multi_add_handle(multi, easy);
+    sent++;
+}
+
+static void finish_request(CURLM *multi, CURL *easy, CURLcode result) {
+    struct InFlight *request = NULL;
+    long status = 0;
+    curl_easy_getinfo(easy, CURLINFO_PRIVATE, (char **)&request);
+    curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &status);
+
+    uint64_t latency = now_ns() - request->scheduled_ns;
+    completed++;
+    if (result != CURLE_OK) {
+        transport_errors++;
+    } else if (status >= 500) {
+        http_5xx++;
+    } else if (status >= 400) {
+        http_4xx++;
+    } else {
+        samples_add(&latencies[request->kind], latency);
+        samples_add(&all_latencies, latency);
+        if (request->kind == K_STREAM) {
+            // Time from the schedule to the start of the transfer counts too, as in the totals
+            curl_off_t ttfb_us = 0, total_us = 0;
+            curl_easy_getinfo(easy, CURLINFO_STARTTRANSFER_TIME_T, &ttfb_us);
+            curl_easy_getinfo(easy, CURLINFO_TOTAL_TIME_T, &total_us);
+            uint64_t transfer = (uint64_t)total_us * 1000;
+            uint64_t waited = latency > transfer ? latency - transfer : 0;
+            samples_add(&stream_ttfb, waited + (uint64_t)ttfb_us * 1000);
+        }
+    }
+
+    curl_multi_remove_handle(multi, easy);
+    curl_easy_cleanup(easy);
+    curl_slist_free_all(request->headers);
+    free(request->body);
+    free(request);
+}
+
+// Poll GET /health until the server answers or the timeout passes
+static int wait_for_server(const struct Options *options) {
+    char url[512];
+    snprintf(url, sizeof(url), "%s/health", options->url);
+    for (int i = 0; i < options->wait_seconds * 10; i++) {
+        CURL *easy = curl_easy_init();
+        long status = 0;
+        curl_easy_setopt(easy, CURLOPT_URL, url);
+        curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, discard_body);
+        curl_easy_setopt(easy, CURLOPT_TIMEOUT, 1L);
+        if (curl_easy_perform(easy) == CURLE_OK) curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &status);
+        curl_easy_cleanup(easy);
+        if (status == 200) return 1;
+        usleep(100000);
+    }
+    return 0;
+}
+
+// Body of a small reply
+struct Reply {
+    char data[512];
+    size_t len;
+};
+
+static size_t keep_body(void *contents, size_t size, size_t nmemb, void *userp) {
+    struct Reply *reply = (struct Reply *)userp;
+    size_t n = size * nmemb;
+    size_t room = sizeof(reply->data) - 1 - reply->len;
+    memcpy(reply->data + reply->len, contents, n < room ? n : room);
+    reply->len += n < room ? n : room;
+    reply->data[reply->len] = '\0';
+    return n;
+}
+
+// Model calls the mock has answered, from its GET /stats; -1 when unavailable
+static long mock_requests(const struct Options *options) {
+    char url[512];
+    struct Reply reply = { { 0 }, 0 };
+    long status = 0;
+    snprintf(url, sizeof(url), "%s/stats", options->mock_url);
+    CURL *easy = curl_easy_init();
+    curl_easy_setopt(easy, CURLOPT_URL, url);
+    curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, keep_body);
+    curl_easy_setopt(easy, CURLOPT_WRITEDATA, &reply);
+    curl_easy_setopt(easy, CURLOPT_TIMEOUT, 5L);
+    if (curl_easy_perform(easy) == CURLE_OK) curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &status);
+    curl_easy_cleanup(easy);
+    const char *count = strstr(reply.data, "\"requests\":");
+    return status == 200 && count ? strtol(count + 11, NULL, 10) : -1;
+}
+
+// Send options->coalesce identical prompts at once, each from a new session so their upstream
+// payloads match, and check how many upstream calls they cost. The server needs at least that
+// many UPSTREAM_CONCURRENCY threads, or queued chats start after the shared call is over.
+static int run_coalesce(const struct Options *options) {
+    int n = options->coalesce;
+    long before = mock_requests(options);
+    if (before < 0) {
+        fprintf(stderr, "Mock upstream at %s did not answer /stats\n", options->mock_url);
+        return 1;
+    }
+
+    CURLM *multi = curl_multi_init();
+    struct InFlight *requests = calloc((size_t)n, sizeof(struct InFlight));
+    if (!multi || !requests) return 1;
+    char url[512], body[160];
+    snprintf(url, sizeof(url), "%s/chat", options->url);
+    uint64_t start = now_ns();
+    for (int i = 0; i < n; i++) {
+        char header[96];
+        struct InFlight *request = &requests[i];
+        CURL *easy = curl_easy_init();
+        request->kind = i % 2 ? K_STREAM : K_CHAT;
+        request->scheduled_ns = start;
+        snprintf(header, sizeof(header), "X-Session-Id: coalesce-%d-%d", (int)getpid(), i);
+        request->headers = curl_slist_append(request->headers, header);
+        request->headers = curl_slist_append(request->headers, "Content-Type: application/json");
+        snprintf(body, sizeof(body), "{\"message\":\"Coalescing check %d\",\"stream\":%s}", (int)getpid(),
+                 request->kind == K_STREAM ? "true" : "false");
+        curl_easy_setopt(easy, CURLOPT_URL, url);
+        curl_easy_setopt(easy, CURLOPT_COPYPOSTFIELDS, body);
+        curl_easy_setopt(easy, CURLOPT_HTTPHEADER, request->headers);
+        curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, discard_body);
+        curl_easy_setopt(easy, CURLOPT_PRIVATE, request);
+        curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1L);
+        curl_easy_setopt(easy, CURLOPT_TIMEOUT, 120L);
+        curl_multi_add_handle(multi, easy);
+        sent++;
+    }
+
+    int running = 1;
+    while (running) {
+        curl_multi_perform(multi, &running);
+        CURLMsg *msg;
+        int queued;
+        while ((msg = curl_multi_info_read(multi, &queued))) {
+            if (msg->msg != CURLMSG_DONE) continue;
+            long status = 0;
+            CURL *easy = msg->easy_handle;
+            struct InFlight *request = NULL;
+            curl_easy_getinfo(easy, CURLINFO_PRIVATE, (char **)&request);
+            curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &status);
+            completed++;
+            if (msg->data.result != CURLE_OK) transport_errors++;
+            else if (status >= 500) http_5xx++;
+            else if (status >= 400) http_4xx++;
+            else samples_add(&latencies[request->kind], now_ns() - start);
+            curl_multi_remove_handle(multi, easy);
+            curl_easy_cleanup(easy);
+            curl_slist_free_all(request->headers);
+        }
+        if (running) curl_multi_poll(multi, NULL, 0, 100, NULL);
+    }
+    long calls = mock_requests(options) - before;
+    int failed = transport_errors + http_4xx + http_5xx > 0 ||
+                 (options->expect_upstream >= 0 && calls != options->expect_upstream);
+
+    printf("{\"bench\":\"coalesce\",\"label\":\"%s\",\"requests\":%d,\"ok\":%lu,\"transport_errors\":%lu,"
+           "\"http_4xx\":%lu,\"http_5xx\":%lu,\"upstream_calls\":%ld,\"expected_upstream_calls\":%d,\"latency_ms\":{",
+           options->label, n, completed - transport_errors - http_4xx - http_5xx, transport_errors, http_4xx, http_5xx,
+           calls, options->expect_upstream);
+    print_series("chat", &latencies[K_CHAT], 1);
+    print_series("stream", &latencies[K_STREAM], 0);
+    printf("},\"result\":\"%s\"}\n", failed ? "fail" : "pass");
+    if (failed) {
+        fprintf(stderr, "Coalescing check failed: %ld upstream calls for %d identical prompts (expected %d), "
+                        "%lu failed replies\n", calls, n, options->expect_upstream,
+                transport_errors + http_4xx + http_5xx);
+    }
+    free(requests);
+    curl_multi_cleanup(multi);
+    return failed;
+}
+
+// VmRSS and VmHWM of pid in bytes, 0 when unavailable
+static void read_rss(int pid, unsigned long *rss, unsigned long *peak) {
+    char path[64], line[256];
+    *rss = *peak = 0;
+    if (pid <= 0) return;
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    FILE *f = fopen(path, "r");
+    if (!f) return;
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, "VmRSS:", 6) == 0) *rss = strtoul(line + 6, NULL, 10) * 1024;
+        if (strncmp(line, "VmHWM:", 6) == 0) *peak = strtoul(line + 6, NULL, 10) * 1024;
+    }
+    fclose(f);
+}
+
+// "chat=60,stream=20,config=10,static=10"; unnamed kinds get weight 0
+static int parse_mix(const char *text, int *mix) {
+    for (int k = 0; k < K_COUNT; k++) mix[k] = 0;
+    char *copy = strdup(text);
+    int ok = copy != NULL;
+    for (char *item = copy ? strtok(copy, ",") : NULL; item; item = strtok(NULL, ",")) {
+        char *eq = strchr(item, '=');
+        int found = 0;
+        if (eq) {
+            *eq = '\0';
+            for (int k = 0; k < K_COUNT; k++) {
+                if (strcmp(item, kind_names[k]) == 0) {
+                    mix[k] = atoi(eq + 1);
+                    found = 1;
+                }
+            }
+        }
+        if (!found) ok = 0;
+    }
+    free(copy);
+    return ok;
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s [--url U] [--rps N] [--duration S] [--sessions N] [--mix chat=60,stream=20,...]\n"
+                    "          [--max-inflight N] [--pid N] [--label NAME] [--wait S]\n"
+                    "       %s --coalesce N [--expect-upstream M] [--mock-url U] [--url U] [--label NAME]\n", argv0, argv0);
+}
+
+int main(int argc, char **argv) {
+    struct Options options = { "http://127.0.0.1:8080", 100.0, 10.0, 1000, { 60, 20, 10, 10 }, 4096, 0, "", 10,
+                               0, -1, "http://127.0.0.1:9090" };
+    for (int i = 1; i < argc; i++) {
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (!value) {
+            usage(argv[0]);
+            return 1;
+        }
+        if (strcmp(argv[i], "--url") == 0) options.url = value;
+        else if (strcmp(argv[i], "--rps") == 0) options.rps = atof(value);
+        else if (strcmp(argv[i], "--duration") == 0) options.duration = atof(value);
+        else if (strcmp(argv[i], "--sessions") == 0) options.sessions = atoi(value);
+        else if (strcmp(argv[i], "--max-inflight") == 0) options.max_inflight = atoi(value);
+        else if (strcmp(argv[i], "--pid") == 0) options.pid = atoi(value);
+        else if (strcmp(argv[i], "--label") == 0) options.label = value;
+        else if (strcmp(argv[i], "--wait") == 0) options.wait_seconds = atoi(value);
+        else if (strcmp(argv[i], "--coalesce") == 0) options.coalesce = atoi(value);
+        else if (strcmp(argv[i], "--expect-upstream") == 0) options.expect_upstream = atoi(value);
+        else if (strcmp(argv[i], "--mock-url") == 0) options.mock_url = value;
+        else if (strcmp(argv[i], "--mix") != 0 || !parse_mix(value, options.mix)) {
+            usage(argv[0]);
+            return 1;
+        }
+        i++;
+    }
+    if (options.rps <= 0 || options.duration <= 0 || options.sessions < 1 || options.max_inflight < 1 ||
+        options.coalesce < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    curl_global_init(CURL_GLOBAL_ALL);
+    if (options.wait_seconds > 0 && !wait_for_server(&options)) {
+        fprintf(stderr, "Server at %s did not answer /health\n", options.url);
+        return 1;
+    }
+    if (options.coalesce > 0) {
+        int failed = run_coalesce(&options);
+        curl_global_cleanup();
+        return failed;
+    }
+    srand(42); // Same request mix and sessions on every run
+
+    CURLM *multi = curl_multi_init();
+    curl_multi_setopt(multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, (long)options.max_inflight);
+
+    uint64_t interval = (uint64_t)(1e9 / options.rps);
+    uint64_t start = now_ns();
+    uint64_t deadline = start + (uint64_t)(options.duration * 1e9);
+    uint64_t next_due = start;
+    int running = 0;
+
+    for (;;) {
+        uint64_t now = now_ns();
+        while (next_due <= now && next_due < deadline) {
+            if ((int)(sent - completed) < options.max_inflight) start_request(multi, &options, next_due);
+            else dropped++;
+            next_due += interval;
+        }
+        curl_multi_perform(multi, &running);
+
+        CURLMsg *msg;
+        int queued;
+        while ((msg = curl_multi_info_read(multi, &queued))) {
+            if (msg->msg == CURLMSG_DONE) finish_request(multi, msg->easy_handle, msg->data.result);
+        }
+        if (next_due >= deadline && sent == completed) break;
+
+        now = now_ns();
+        int timeout_ms = next_due < deadline ? (next_due > now ? (int)((next_due - now) / 1000000) : 0) : 100;
+        curl_multi_poll(multi, NULL, 0, timeout_ms, NULL);
+    }
+    double elapsed = (double)(now_ns() - start) / 1e9;
+
+    unsigned long rss = 0, peak = 0;
+    read_rss(options.pid, &rss, &peak);
+
+    printf("{\"bench\":\"load\",\"label\":\"%s\",\"target_rps\":%.1f,\"duration_s\":%.2f,\"sessions\":%d,"
+           "\"sent\":%lu,\"completed\":%lu,\"dropped\":%lu,\"transport_errors\":%lu,\"http_4xx\":%lu,\"http_5xx\":%lu,"
+           "\"throughput_rps\":%.1f,\"bytes_received\":%lu,\"latency_ms\":{",
+           options.label, options.rps, elapsed, options.sessions, sent, completed, dropped, transport_errors,
+           http_4xx, http_5xx, (double)(completed - transport_errors - http_4xx - http_5xx) / elapsed,
+           bytes_received);
+    print_series("all", &all_latencies, 1);
+    for (int k = 0; k < K_COUNT; k++) print_series(kind_names[k], &latencies[k], 1);
+    print_series("stream_ttfb", &stream_ttfb, 0);
+    printf("},\"server_rss_bytes\":%lu,\"server_peak_rss_bytes\":%lu}\n", rss, peak);
+
+    curl_multi_cleanup(multi);
+    curl_global_cleanup();
+    return 0;
+}
@@ -0,0 +1,299 @@
+// Stand-in for the Gemini API used by the load harness. It answers
+// :generateContent with one JSON body and :streamGenerateContent?alt=sse with
+// timed SSE events, plus /v1beta/cachedContents. Latency, token rate, reply
+// size and injected errors are set on the command line:
+//
+//   mock_upstream [--port 9090] [--latency-ms 200] [--jitter-ms 0]
+//                 [--tokens 100] [--token-rate 0] [--chunk-tokens 5]
+//                 [--payload-bytes 0] [--error-rate 0] [--error-status 503]
+//
+// --token-rate is generated tokens per second (0 = no generation delay);
+// --payload-bytes overrides --tokens with a reply of that many bytes.
+// GET /stats returns the request counters as JSON.
+#include <microhttpd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define WORD "lorem " // One generated token
+#define WORD_LEN (sizeof(WORD) - 1)
+
+struct MockConfig {
+    int port;
+    int latency_ms; // Time to the first byte
+    int jitter_ms; // Uniform extra latency
+    int tokens; // Tokens per reply
+    int token_rate; // Tokens per second, 0 for no generation delay
+    int chunk_tokens; // Tokens per SSE event
+    int payload_bytes; // Reply size override
+    double error_rate; // Fraction of calls answered with error_status
+    int error_status; // HTTP status of injected errors
+};
+
+static struct MockConfig config = { 9090, 200, 0, 100, 0, 5, 0, 0.0, 503 };
+static char *reply_text = NULL; // Generated text shared by every reply
+static size_t reply_len = 0;
+
+static unsigned long stat_requests = 0, stat_streams = 0, stat_errors = 0, stat_caches = 0;
+
+// Per-request state while the body is drained
+struct MockRequest {
+    size_t body_bytes; // Request body size, reported as promptTokenCount / 4
+};
+
+// An SSE reply in progress
+struct MockStream {
+    size_t sent; // Bytes of reply_text already emitted
+    size_t chunk; // Bytes of reply_text per event
+    long event_ns; // Delay between events
+    long prompt_tokens;
+    int finished; // Final event (with usage) emitted
+    char *pending; // Formatted event not yet copied out
+    size_t pending_len;
+    size_t pending_off;
+};
+
+static void sleep_ns(long ns) {
+    if (ns <= 0) return;
+    struct timespec ts = { ns / 1000000000L, ns % 1000000000L };
+    nanosleep(&ts, NULL);
+}
+
+static void sleep_first_byte() {
+    long ms = config.latency_ms;
+    if (config.jitter_ms > 0) ms += rand() % (config.jitter_ms + 1);
+    sleep_ns(ms * 1000000L);
+}
+
+static long tokens_ns(size_t tokens) {
+    return config.token_rate > 0 ? (long)(tokens * 1000000000.0 / config.token_rate) : 0;
+}
+
+static void bump(unsigned long *counter) {
+    __atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+}
+
+static enum MHD_Result queue_body(struct MHD_Connection *connection, unsigned int status, const char *type,
+                                  char *body, size_t len) {
+    struct MHD_Response *response = MHD_create_response_from_buffer(len, body, MHD_RESPMEM_MUST_FREE);
+    if (!response) {
+        free(body);
+        return MHD_NO;
+    }
+    MHD_add_response_header(response, "Content-Type", type);
+    if (status == 429) MHD_add_response_header(response, "Retry-After", "1");
+    enum MHD_Result ret = MHD_queue_response(connection, status, response);
+    MHD_destroy_response(response);
+    return ret;
+}
+
+// {"candidates":[...]} carrying text[0..len), with finishReason and usage when final
+static char* format_response(const char *text, size_t len, int final, long prompt_tokens, size_t *out_len) {
+    size_t cap = len + 512;
+    char *body = malloc(cap);
+    if (!body) return NULL;
+    size_t n = (size_t)snprintf(body, cap, "{\"candidates\":[{\"content\":{\"parts\":[{\"text\":\"");
+    memcpy(body + n, text, len); // Generated text needs no escaping
+    n += len;
+    if (final) {
+        long candidate_tokens = (long)(reply_len / WORD_LEN);
+        n += (size_t)snprintf(body + n, cap - n,
+                              "\"}],\"role\":\"model\"},\"finishReason\":\"STOP\",\"index\":0}],"
+                              "\"usageMetadata\":{\"promptTokenCount\":%ld,\"candidatesTokenCount\":%ld,"
+                              "\"totalTokenCount\":%ld}}",
+                              prompt_tokens, candidate_tokens, prompt_tokens + candidate_tokens);
+    } else {
+        n += (size_t)snprintf(body + n, cap - n, "\"}],\"role\":\"model\"},\"index\":0}]}");
+    }
+    *out_len = n;
+    return body;
+}
+
+static ssize_t stream_reader(void *cls, uint64_t pos, char *buf, size_t max) {
+    struct MockStream *stream = (struct MockStream *)cls;
+    (void)pos;
+
+    if (stream->pending_off == stream->pending_len) {
+        free(stream->pending);
+        stream->pending = NULL;
+        if (stream->finished) return MHD_CONTENT_READER_END_OF_STREAM;
+
+        // Thread-per-connection, so pacing the events can simply sleep
+        if (stream->sent > 0) sleep_ns(stream->event_ns);
+        size_t n = reply_len - stream->sent < stream->chunk ? reply_len - stream->sent : stream->chunk;
+        int final = stream->sent + n >= reply_len;
+        size_t json_len = 0;
+        char *json = format_response(reply_text + stream->sent, n, final, stream->prompt_tokens, &json_len);
+        if (!json) return MHD_CONTENT_READER_END_WITH_ERROR;
+        stream->pending = malloc(json_len + 16);
+        if (!stream->pending) {
+            free(json);
+            return MHD_CONTENT_READER_END_WITH_ERROR;
+        }
+        stream->pending_len = (size_t)sprintf(stream->pending, "data: %s\r\n\r\n", json);
+        stream->pending_off = 0;
+        free(json);
+        stream->sent += n;
+        stream->finished = final;
+    }
+
+    size_t n = stream->pending_len - stream->pending_off < max ? stream->pending_len - stream->pending_off : max;
+    memcpy(buf, stream->pending + stream->pending_off, n);
+    stream->pending_off += n;
+    return (ssize_t)n;
+}
+
+static void stream_free(void *cls) {
+    struct MockStream *stream = (struct MockStream *)cls;
+    free(stream->pending);
+    free(stream);
+}
+
+static enum MHD_Result queue_error(struct MHD_Connection *connection) {
+    bump(&stat_errors);
+    const char *status = config.error_status == 429 ? "RESOURCE_EXHAUSTED"
+                       : config.error_status >= 500 ? "UNAVAILABLE" : "INVALID_ARGUMENT";
+    char *body = malloc(256);
+    if (!body) return MHD_NO;
+    int n = snprintf(body, 256, "{\"error\":{\"code\":%d,\"message\":\"Injected failure\",\"status\":\"%s\"}}",
+                     config.error_status, status);
+    return queue_body(connection, (unsigned int)config.error_status, "application/json", body, (size_t)n);
+}
+
+static enum MHD_Result handle_model_call(struct MHD_Connection *connection, const char *url, long prompt_tokens) {
+    bump(&stat_requests);
+    sleep_first_byte();
+    if (config.error_rate > 0 && (double)rand() / RAND_MAX < config.error_rate) return queue_error(connection);
+
+    if (strstr(url, ":streamGenerateContent")) {
+        bump(&stat_streams);
+        struct MockStream *stream = calloc(1, sizeof(struct MockStream));
+        if (!stream) return MHD_NO;
+        stream->chunk = (size_t)config.chunk_tokens * WORD_LEN;
+        stream->event_ns = tokens_ns((size_t)config.chunk_tokens);
+        stream->prompt_tokens = prompt_tokens;
+        struct MHD_Response *response = MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, 16384, stream_reader,
+                                                                          stream, stream_free);
+        if (!response) {
+            free(stream);
+            return MHD_NO;
+        }
+        MHD_add_response_header(response, "Content-Type", "text/event-stream");
+        enum MHD_Result ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+        MHD_destroy_response(response);
+        return ret;
+    }
+
+    sleep_ns(tokens_ns(reply_len / WORD_LEN)); // The whole reply is generated before it is sent
+    size_t len = 0;
+    char *body = format_response(reply_text, reply_len, 1, prompt_tokens, &len);
+    if (!body) return MHD_NO;
+    return queue_body(connection, MHD_HTTP_OK, "application/json", body, len);
+}
+
+static enum MHD_Result handle_request(void *cls, struct MHD_Connection *connection, const char *url,
+                                      const char *method, const char *version, const char *upload_data,
+                                      size_t *upload_data_size, void **con_cls) {
+    (void)cls;
+    (void)version;
+    (void)upload_data;
+
+    if (strcmp(method, "GET") == 0 && strcmp(url, "/stats") == 0) {
+        char *body = malloc(256);
+        if (!body) return MHD_NO;
+        int n = snprintf(body, 256, "{\"requests\":%lu,\"streams\":%lu,\"errors\":%lu,\"caches\":%lu}",
+                         stat_requests, stat_streams, stat_errors, stat_caches);
+        return queue_body(connection, MHD_HTTP_OK, "application/json", body, (size_t)n);
+    }
+    if (strcmp(method, "POST") != 0) {
+        return queue_body(connection, MHD_HTTP_NOT_FOUND, "application/json", strdup("{}"), 2);
+    }
+
+    // Drain the body; only its size matters
+    struct MockRequest *request = *con_cls;
+    if (!request) {
+        request = calloc(1, sizeof(struct MockRequest));
+        if (!request) return MHD_NO;
+        *con_cls = request;
+        return MHD_YES;
+    }
+    if (*upload_data_size > 0) {
+        request->body_bytes += *upload_data_size;
+        *upload_data_size = 0;
+        return MHD_YES;
+    }
+    long prompt_tokens = (long)(request->body_bytes / 4);
+
+    if (strncmp(url, "/v1beta/cachedContents", 22) == 0) {
+        unsigned long id = __atomic_add_fetch(&stat_caches, 1, __ATOMIC_RELAXED);
+        char *body = malloc(128);
+        if (!body) return MHD_NO;
+        int n = snprintf(body, 128, "{\"name\":\"cachedContents/mock-%lu\"}", id);
+        return queue_body(connection, MHD_HTTP_OK, "application/json", body, (size_t)n);
+    }
+    if (strncmp(url, "/v1beta/models/", 15) == 0) return handle_model_call(connection, url, prompt_tokens);
+    return queue_body(connection, MHD_HTTP_NOT_FOUND, "application/json", strdup("{}"), 2);
+}
+
+static void request_completed(void *cls, struct MHD_Connection *connection, void **con_cls,
+                              enum MHD_RequestTerminationCode toe) {
+    (void)cls;
+    (void)connection;
+    (void)toe;
+    free(*con_cls);
+    *con_cls = NULL;
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s [--port N] [--latency-ms N] [--jitter-ms N] [--tokens N] [--token-rate N]\n"
+                    "          [--chunk-tokens N] [--payload-bytes N] [--error-rate F] [--error-status N]\n", argv0);
+}
+
+int main(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (!value) {
+            usage(argv[0]);
+            return 1;
+        }
+        if (strcmp(argv[i], "--port") == 0) config.port = atoi(value);
+        else if (strcmp(argv[i], "--latency-ms") == 0) config.latency_ms = atoi(value);
+        else if (strcmp(argv[i], "--jitter-ms") == 0) config.jitter_ms = atoi(value);
+        else if (strcmp(argv[i], "--tokens") == 0) config.tokens = atoi(value);
+        else if (strcmp(argv[i], "--token-rate") == 0) config.token_rate = atoi(value);
+        else if (strcmp(argv[i], "--chunk-tokens") == 0) config.chunk_tokens = atoi(value);
+        else if (strcmp(argv[i], "--payload-bytes") == 0) config.payload_bytes = atoi(value);
+        else if (strcmp(argv[i], "--error-rate") == 0) config.error_rate = atof(value);
+        else if (strcmp(argv[i], "--error-status") == 0) config.error_status = atoi(value);
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+        i++;
+    }
+    if (config.chunk_tokens < 1) config.chunk_tokens = 1;
+
+    size_t tokens = config.payload_bytes > 0 ? ((size_t)config.payload_bytes + WORD_LEN - 1) / WORD_LEN
+                                             : (size_t)(config.tokens > 0 ? config.tokens : 1);
+    reply_len = tokens * WORD_LEN;
+    reply_text = malloc(reply_len);
+    if (!reply_text) return 1;
+    for (size_t i = 0; i < tokens; i++) memcpy(reply_text + i * WORD_LEN, WORD, WORD_LEN);
+    srand((unsigned int)time(NULL));
+
+    struct MHD_Daemon *daemon = MHD_start_daemon(MHD_USE_THREAD_PER_CONNECTION | MHD_USE_INTERNAL_POLLING_THREAD,
+                                                 (uint16_t)config.port, NULL, NULL, &handle_request, NULL,
+                                                 MHD_OPTION_NOTIFY_COMPLETED, request_completed, NULL,
+                                                 MHD_OPTION_CONNECTION_TIMEOUT, 120,
+                                                 MHD_OPTION_END);
+    if (!daemon) {
+        fprintf(stderr, "Could not listen on port %d\n", config.port);
+        return 1;
+    }
+    printf("Mock upstream on port %d\n", config.port);
+    fflush(stdout);
+    for (;;) pause(); // Stopped with a signal by the harness
+}
@@ -0,0 +1,18 @@
+#!/bin/sh
+# Start the mock upstream and the server, drive load and print the loadgen
+# JSON line. Run from backend/ (make loadtest). Extra arguments go to loadgen;
+# MOCK_ARGS goes to mock_upstream, e.g.
+#   MOCK_ARGS="--latency-ms 500 --token-rate 80 --error-rate 0.01" make loadtest
+# The server takes its settings from the environment, e.g. UPSTREAM_COALESCE=0.
+set -e
+MOCK_PORT=${MOCK_PORT:-9090}
+SERVER_URL=${SERVER_URL:-http://127.0.0.1:8080}
+
+./bench/mock_upstream --port "$MOCK_PORT" $MOCK_ARGS >/dev/null &
+mock=$!
+GEMINI_API_BASE="http://127.0.0.1:$MOCK_PORT" GEMINI_API_KEY=bench ./server >/dev/null &
+server=$!
+# SIGTERM drains the server; wait so the port is free for the next run
+trap 'kill $server $mock 2>/dev/null; wait $server 2>/dev/null || true' EXIT INT TERM
+
+./bench/loadgen --url "$SERVER_URL" --mock-url "http://127.0.0.1:$MOCK_PORT" --pid "$server" "$@"
@@ -0,0 +1,281 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "config.h"
+
+// One published config. Never modified once visible; replaced by swapping
+// the pointer that holds it and freed once no reader can still see it.
+struct ConfigSnapshot {
+    unsigned fields; // enum ConfigField bits present in values
+    struct AiConfig values; // Strings point into text
+    uint64_t retired_epoch; // Epoch it was replaced in (writer lock)
+    struct ConfigSnapshot *next_retired; // Replaced snapshots awaiting readers (writer lock)
+    char text[]; // Model name and system prompt
+};
+
+// Epoch a thread's read section started in, 0 outside one. Only the owner
+// writes it; a publish scans every slot before freeing what it replaced.
+struct ConfigReader {
+    uint64_t epoch;
+    struct ConfigReader *next; // Every slot ever created (registry lock)
+    struct ConfigReader *next_free; // Slots of exited threads, reused by new ones
+} __attribute__((aligned(64)));
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ConfigReader *readers = NULL;
+static struct ConfigReader *free_readers = NULL;
+static pthread_key_t thread_key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static __thread struct ConfigReader *local = NULL;
+static __thread int depth = 0; // Nesting of this thread's read sections
+static __thread int holds_writer = 0; // Section fell back to the writer lock
+
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER; // Serializes publishes
+static struct ConfigSnapshot *current = NULL; // Global settings (atomic)
+static uint64_t global_epoch = 1; // Advanced by every replacement (atomic)
+static uint64_t next_version = 1; // writer lock
+static struct ConfigSnapshot *retired = NULL; // writer lock
+static size_t retired_count = 0; // writer lock
+
+// A finished thread's slot goes back to the pool
+static void retire_reader(void *ptr) {
+    struct ConfigReader *reader = (struct ConfigReader *)ptr;
+    __atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&registry_lock);
+    reader->next_free = free_readers;
+    free_readers = reader;
+    pthread_mutex_unlock(&registry_lock);
+}
+
+static void make_key() {
+    pthread_key_create(&thread_key, retire_reader);
+}
+
+static struct ConfigReader* local_reader() {
+    if (local) return local;
+    pthread_once(&key_once, make_key);
+
+    pthread_mutex_lock(&registry_lock);
+    struct ConfigReader *reader = free_readers;
+    if (reader) {
+        free_readers = reader->next_free;
+    } else {
+        reader = aligned_alloc(64, sizeof(struct ConfigReader));
+        if (reader) {
+            memset(reader, 0, sizeof(*reader));
+            reader->next = readers;
+            readers = reader;
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+
+    if (reader) pthread_setspecific(thread_key, reader);
+    local = reader;
+    return reader;
+}
+
+void config_read_begin() {
+    if (depth++ > 0) return;
+    struct ConfigReader *reader = local_reader();
+    if (!reader) {
+        // No slot to announce ourselves in; keep writers out instead
+        pthread_mutex_lock(&writer_lock);
+        holds_writer = 1;
+        return;
+    }
+    // Sequentially consistent so the snapshot loads that follow cannot move
+    // ahead of the store a publishing thread scans for
+    __atomic_store_n(&reader->epoch, __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+}
+
+void config_read_end() {
+    if (--depth > 0) return;
+    if (holds_writer) {
+        holds_writer = 0;
+        pthread_mutex_unlock(&writer_lock);
+        return;
+    }
+    __atomic_store_n(&local->epoch, 0, __ATOMIC_RELEASE);
+}
+
+static void apply_override(struct AiConfig *out, const struct ConfigSnapshot *o) {
+    if (o->fields & CONFIG_MODEL) {
+        out->model = o->values.model;
+        out->model_explicit = 1;
+    }
+    if (o->fields & CONFIG_TEMPERATURE) out->temperature = o->values.temperature;
+    if (o->fields & CONFIG_TOP_P) out->top_p = o->values.top_p;
+    if (o->fields & CONFIG_TOP_K) out->top_k = o->values.top_k;
+    if (o->fields & CONFIG_MAX_OUTPUT) out->max_output_tokens = o->values.max_output_tokens;
+    if (o->fields & CONFIG_SYSTEM_PROMPT) out->system_prompt = o->values.system_prompt;
+}
+
+void config_resolve(struct AiConfig *out, struct ConfigSnapshot *const *override) {
+    const struct ConfigSnapshot *global = __atomic_load_n(&current, __ATOMIC_SEQ_CST);
+    *out = global->values;
+    const struct ConfigSnapshot *o = override ? __atomic_load_n(override, __ATOMIC_SEQ_CST) : NULL;
+    if (o) apply_override(out, o);
+}
+
+int config_resolve_copy(struct AiConfig *out, struct ConfigSnapshot *const *override, struct Arena *arena) {
+    config_read_begin();
+    config_resolve(out, override);
+    const char *model = arena_strdup(arena, out->model);
+    const char *prompt = out->system_prompt ? arena_strdup(arena, out->system_prompt) : NULL;
+    if (!model || (out->system_prompt && !prompt)) return 0;
+    out->model = model;
+    out->system_prompt = prompt;
+    config_read_end();
+    return 1;
+}
+
+unsigned config_override_fields(struct ConfigSnapshot *const *override) {
+    const struct ConfigSnapshot *o = __atomic_load_n(override, __ATOMIC_SEQ_CST);
+    return o ? o->fields : 0;
+}
+
+static void clamp_values(struct AiConfig *v) {
+    if (v->temperature < 0.0) v->temperature = 0.0;
+    if (v->temperature > 2.0) v->temperature = 2.0;
+    if (v->top_p < 0.0) v->top_p = 0.0;
+    if (v->top_p > 1.0) v->top_p = 1.0;
+    if (v->top_k < 1) v->top_k = 1;
+    if (v->max_output_tokens < 1) v->max_output_tokens = 1;
+    if (v->max_output_tokens > CONFIG_MAX_OUTPUT_TOKENS) v->max_output_tokens = CONFIG_MAX_OUTPUT_TOKENS;
+}
+
+// base (may be NULL) with fields replaced from values, in one allocation
+static struct ConfigSnapshot* snapshot_build(const struct ConfigSnapshot *base, unsigned fields,
+                                             const struct AiConfig *values) {
+    if ((fields & CONFIG_MODEL) && (!values->model || values->model[0] == '\0')) fields &= ~CONFIG_MODEL;
+
+    struct AiConfig merged;
+    memset(&merged, 0, sizeof(merged));
+    if (base) merged = base->values;
+    if (fields & CONFIG_MODEL) merged.model = values->model;
+    if (fields & CONFIG_TEMPERATURE) merged.temperature = values->temperature;
+    if (fields & CONFIG_TOP_P) merged.top_p = values->top_p;
+    if (fields & CONFIG_TOP_K) merged.top_k = values->top_k;
+    if (fields & CONFIG_MAX_OUTPUT) merged.max_output_tokens = values->max_output_tokens;
+    if (fields & CONFIG_SYSTEM_PROMPT) merged.system_prompt = values->system_prompt;
+    clamp_values(&merged);
+    if (merged.system_prompt && merged.system_prompt[0] == '\0') merged.system_prompt = NULL;
+
+    size_t model_len = merged.model ? strnlen(merged.model, CONFIG_MODEL_MAX - 1) : 0;
+    size_t prompt_len = merged.system_prompt ? strlen(merged.system_prompt) : 0;
+    struct ConfigSnapshot *snap = malloc(sizeof(struct ConfigSnapshot) + model_len + prompt_len + 2);
+    if (!snap) return NULL;
+
+    snap->fields = (base ? base->fields : 0) | fields;
+    snap->values = merged;
+    snap->retired_epoch = 0;
+    snap->next_retired = NULL;
+    char *model = snap->text;
+    memcpy(model, merged.model ? merged.model : "", model_len);
+    model[model_len] = '\0';
+    snap->values.model = model;
+    if (merged.system_prompt) {
+        char *prompt = model + model_len + 1;
+        memcpy(prompt, merged.system_prompt, prompt_len + 1);
+        snap->values.system_prompt = prompt;
+    }
+    snap->values.version = next_version++;
+    return snap;
+}
+
+// Free replaced snapshots older than every active read section (writer lock held)
+static void reclaim() {
+    uint64_t oldest = UINT64_MAX;
+    pthread_mutex_lock(&registry_lock);
+    for (struct ConfigReader *reader = readers; reader; reader = reader->next) {
+        uint64_t epoch = __atomic_load_n(&reader->epoch, __ATOMIC_SEQ_CST);
+        if (epoch && epoch < oldest) oldest = epoch;
+    }
+    pthread_mutex_unlock(&registry_lock);
+
+    struct ConfigSnapshot **link = &retired;
+    while (*link) {
+        struct ConfigSnapshot *snap = *link;
+        if (snap->retired_epoch < oldest) {
+            *link = snap->next_retired;
+            free(snap);
+            retired_count--;
+        } else {
+            link = &snap->next_retired;
+        }
+    }
+}
+
+// Swap snap into *slot and retire what it replaced (writer lock held).
+// A reader that entered at or before the replacement's epoch may still hold
+// the old snapshot; one that entered after loads the new one.
+static void publish(struct ConfigSnapshot **slot, struct ConfigSnapshot *snap) {
+    struct ConfigSnapshot *old = __atomic_exchange_n(slot, snap, __ATOMIC_SEQ_CST);
+    if (old) {
+        old->retired_epoch = __atomic_fetch_add(&global_epoch, 1, __ATOMIC_SEQ_CST);
+        old->next_retired = retired;
+        retired = old;
+        retired_count++;
+    }
+    reclaim();
+}
+
+int config_update(unsigned fields, const struct AiConfig *values) {
+    pthread_mutex_lock(&writer_lock);
+    struct ConfigSnapshot *snap = snapshot_build(current, fields | (current ? 0 : CONFIG_ALL), values);
+    if (snap) publish(&current, snap);
+    pthread_mutex_unlock(&writer_lock);
+    return snap != NULL;
+}
+
+int config_override_update(struct ConfigSnapshot **override, unsigned fields, const struct AiConfig *values) {
+    pthread_mutex_lock(&writer_lock);
+    struct ConfigSnapshot *snap = NULL;
+    int ok = 1;
+    if (fields) {
+        snap = snapshot_build(*override, fields & CONFIG_ALL, values);
+        ok = snap != NULL;
+    }
+    if (ok) publish(override, snap);
+    pthread_mutex_unlock(&writer_lock);
+    return ok;
+}
+
+void config_override_free(struct ConfigSnapshot **override) {
+    if (!__atomic_load_n(override, __ATOMIC_RELAXED)) return;
+    pthread_mutex_lock(&writer_lock);
+    publish(override, NULL);
+    pthread_mutex_unlock(&writer_lock);
+}
+
+void config_init() {
+    struct AiConfig defaults = {
+        .model = "gemini-1.5-pro",
+        .temperature = 0.7,
+        .top_p = 1.0,
+        .top_k = 64,
+        .max_output_tokens = 2048,
+        .system_prompt = NULL,
+    };
+    config_update(CONFIG_ALL, &defaults);
+}
+
+void config_cleanup() {
+    pthread_mutex_lock(&writer_lock);
+    free(current);
+    current = NULL;
+    while (retired) {
+        struct ConfigSnapshot *next = retired->next_retired;
+        free(retired);
+        retired = next;
+    }
+    retired_count = 0;
+    pthread_mutex_unlock(&writer_lock);
+}
+
+size_t config_retired_pending() {
+    pthread_mutex_lock(&writer_lock);
+    size_t count = retired_count;
+    pthread_mutex_unlock(&writer_lock);
+    return count;
+}
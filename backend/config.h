@@ -0,0 +1,67 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "arena.h"
+
+#define CONFIG_MODEL_MAX 128 // Longest model name, including the terminator
+#define CONFIG_MAX_OUTPUT_TOKENS 307200 // API max tokens
+
+// Fields of a snapshot; an override sets only some of them
+enum ConfigField {
+    CONFIG_MODEL = 1 << 0,
+    CONFIG_TEMPERATURE = 1 << 1,
+    CONFIG_TOP_P = 1 << 2,
+    CONFIG_TOP_K = 1 << 3,
+    CONFIG_MAX_OUTPUT = 1 << 4,
+    CONFIG_SYSTEM_PROMPT = 1 << 5,
+    CONFIG_ALL = (1 << 6) - 1
+};
+
+// Generation settings for one request. Strings point into published
+// snapshots and stay valid until config_read_end, or into the arena given
+// to config_resolve_copy.
+struct AiConfig {
+    uint64_t version; // Version of the global snapshot it was resolved from
+    const char *model;
+    double temperature;
+    double top_p;
+    int top_k;
+    int max_output_tokens;
+    const char *system_prompt; // NULL when unset
+    int model_explicit; // The session or request chose model, so routing tries it first
+};
+
+// An immutable published config: the global one, or a session's overrides
+struct ConfigSnapshot;
+
+// Readers pin the snapshots they load between begin and end. Sections nest
+// and take no locks. Keep them short: snapshots replaced meanwhile are freed
+// only by a publish after the section ends. Each thread reads on its own.
+void config_read_begin();
+void config_read_end();
+
+// Global settings layered with the overrides in *override (may be NULL);
+// call inside a read section
+void config_resolve(struct AiConfig *out, struct ConfigSnapshot *const *override);
+// Same in a read section of its own, with the strings copied into arena so an
+// upstream call can use them without pinning anything. Returns 0 when the copy
+// fails; the section is then left open and out points into the snapshots, so
+// call config_read_end once done with it.
+int config_resolve_copy(struct AiConfig *out, struct ConfigSnapshot *const *override, struct Arena *arena);
+
+// Publish a new global snapshot with the given fields taken from values
+// (out-of-range values are clamped; a NULL or empty prompt clears it)
+int config_update(unsigned fields, const struct AiConfig *values);
+// Same for the overrides at *override; fields == 0 drops them all
+int config_override_update(struct ConfigSnapshot **override, unsigned fields, const struct AiConfig *values);
+// Retire the overrides of a session being freed
+void config_override_free(struct ConfigSnapshot **override);
+unsigned config_override_fields(struct ConfigSnapshot *const *override); // Fields set, call inside a read section
+
+void config_init(); // Function to publish the defaults
+void config_cleanup(); // Function to free every snapshot (no readers left)
+size_t config_retired_pending(); // Replaced snapshots still waiting for readers
+
+#endif
@@ -0,0 +1,102 @@
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "context_cache.h"
+
+// Caches are reused until shortly before their upstream expiry
+#define CONTEXT_CACHE_EXPIRY_MARGIN 30
+
+struct ContextSlot {
+    struct CacheKey key;
+    char name[CONTEXT_CACHE_NAME_MAX]; // Empty when the slot is free
+    time_t expires; // Last second the name is handed out
+};
+
+static pthread_mutex_t context_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ContextSlot slots[CONTEXT_CACHE_SLOTS];
+static int context_enabled = 0;
+static int context_min_tokens = CONTEXT_CACHE_MIN_TOKENS_DEFAULT;
+static int context_ttl = CONTEXT_CACHE_TTL_DEFAULT;
+
+void context_cache_init(int enabled, int min_tokens, int ttl_seconds) {
+    pthread_mutex_lock(&context_lock);
+    context_enabled = enabled;
+    context_min_tokens = min_tokens > 0 ? min_tokens : CONTEXT_CACHE_MIN_TOKENS_DEFAULT;
+    context_ttl = ttl_seconds > CONTEXT_CACHE_EXPIRY_MARGIN * 2 ? ttl_seconds : CONTEXT_CACHE_TTL_DEFAULT;
+    memset(slots, 0, sizeof(slots));
+    pthread_mutex_unlock(&context_lock);
+}
+
+void context_cache_cleanup() {
+    // Upstream caches are left to expire on their own
+    pthread_mutex_lock(&context_lock);
+    context_enabled = 0;
+    memset(slots, 0, sizeof(slots));
+    pthread_mutex_unlock(&context_lock);
+}
+
+int context_cache_enabled() {
+    pthread_mutex_lock(&context_lock);
+    int enabled = context_enabled;
+    pthread_mutex_unlock(&context_lock);
+    return enabled;
+}
+
+int context_cache_min_tokens() {
+    pthread_mutex_lock(&context_lock);
+    int tokens = context_min_tokens;
+    pthread_mutex_unlock(&context_lock);
+    return tokens;
+}
+
+int context_cache_ttl() {
+    pthread_mutex_lock(&context_lock);
+    int ttl = context_ttl;
+    pthread_mutex_unlock(&context_lock);
+    return ttl;
+}
+
+static struct ContextSlot* slot_for(const struct CacheKey *key) {
+    return &slots[key->h1 % CONTEXT_CACHE_SLOTS];
+}
+
+static int slot_matches(const struct ContextSlot *slot, const struct CacheKey *key) {
+    return slot->name[0] && slot->key.h1 == key->h1 && slot->key.h2 == key->h2;
+}
+
+int context_cache_get(const struct CacheKey *key, char *name, size_t size) {
+    int found = 0;
+    pthread_mutex_lock(&context_lock);
+    struct ContextSlot *slot = slot_for(key);
+    if (context_enabled && slot_matches(slot, key)) {
+        if (slot->expires > time(NULL)) {
+            strncpy(name, slot->name, size - 1);
+            name[size - 1] = '\0';
+            found = 1;
+        } else {
+            slot->name[0] = '\0';
+        }
+    }
+    pthread_mutex_unlock(&context_lock);
+    return found;
+}
+
+void context_cache_put(const struct CacheKey *key, const char *name) {
+    if (!name || !name[0] || strlen(name) >= CONTEXT_CACHE_NAME_MAX) return;
+    pthread_mutex_lock(&context_lock);
+    if (context_enabled) {
+        // A colliding prefix simply replaces the older entry
+        struct ContextSlot *slot = slot_for(key);
+        slot->key = *key;
+        strcpy(slot->name, name);
+        slot->expires = time(NULL) + context_ttl - CONTEXT_CACHE_EXPIRY_MARGIN;
+    }
+    pthread_mutex_unlock(&context_lock);
+}
+
+void context_cache_invalidate(const struct CacheKey *key) {
+    pthread_mutex_lock(&context_lock);
+    struct ContextSlot *slot = slot_for(key);
+    if (slot_matches(slot, key)) slot->name[0] = '\0';
+    pthread_mutex_unlock(&context_lock);
+}
@@ -0,0 +1,26 @@
+#ifndef CONTEXT_CACHE_H
+#define CONTEXT_CACHE_H
+
+#include <stddef.h>
+#include "response_cache.h"
+
+#define CONTEXT_CACHE_SLOTS 256 // Remembered cachedContents, direct-mapped by prefix key
+#define CONTEXT_CACHE_NAME_MAX 128 // Longest cachedContents/... resource name kept
+#define CONTEXT_CACHE_MIN_TOKENS_DEFAULT 4096 // Smaller prefixes are sent inline
+#define CONTEXT_CACHE_TTL_DEFAULT 600 // Seconds a created cache lives upstream
+#define CONTEXT_CACHE_BLOCK 4 // Cached prefixes end on a multiple of this many contents
+
+// Upstream cachedContents for long, repeated request prefixes (system
+// instruction plus leading turns). This is only the local registry of
+// prefix key -> resource name; ai.c creates the resources.
+void context_cache_init(int enabled, int min_tokens, int ttl_seconds); // Function to configure the registry
+void context_cache_cleanup(); // Function to forget every entry
+int context_cache_enabled(); // Function to check whether prefixes may be cached
+int context_cache_min_tokens(); // Function to get the smallest prefix worth caching
+int context_cache_ttl(); // Function to get the TTL requested for new caches
+
+int context_cache_get(const struct CacheKey *key, char *name, size_t size); // Function to copy a live name, 1 if found
+void context_cache_put(const struct CacheKey *key, const char *name); // Function to remember a created cache
+void context_cache_invalidate(const struct CacheKey *key); // Function to forget a cache upstream rejected
+
+#endif
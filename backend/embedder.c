@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "embedder.h"
+#include "ai.h"
+
+#define EMBEDDER_MODEL_MAX 128 // Longest model name kept
+#define HASH_PAIR_WEIGHT 0.5f // Word pairs count half as much as single words
+
+static int hash_embed(const char *text, size_t len, int purpose, int dim, float *out);
+static int gemini_embed(const char *text, size_t len, int purpose, int dim, float *out);
+
+static const struct Embedder embedders[] = {
+    { "hash", 0.15, hash_embed }, // Few shared words already mean a lot
+    { "gemini", 0.6, gemini_embed }, // Unrelated texts still score around 0.4
+};
+
+static const struct Embedder *selected = &embedders[0];
+static char model_name[EMBEDDER_MODEL_MAX] = EMBEDDER_MODEL_DEFAULT;
+static int width = EMBEDDER_DIM_DEFAULT;
+
+static uint64_t fnv1a(uint64_t h, const char *s, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+int embedder_init(const char *name, const char *model, int dim) {
+    if (dim <= 0 || dim % 16 != 0 || dim > 4096) return 0;
+    const struct Embedder *found = NULL;
+    for (size_t i = 0; i < sizeof(embedders) / sizeof(embedders[0]); i++) {
+        if (strcmp(embedders[i].name, name && name[0] ? name : "hash") == 0) found = &embedders[i];
+    }
+    if (!found) return 0;
+    selected = found;
+    width = dim;
+    snprintf(model_name, sizeof(model_name), "%s", model && model[0] ? model : EMBEDDER_MODEL_DEFAULT);
+    return 1;
+}
+
+const char* embedder_name() { return selected->name; }
+const char* embedder_model() { return model_name; }
+int embedder_dim() { return width; }
+double embedder_min_score() { return selected->min_score; }
+
+uint32_t embedder_id() {
+    char id[EMBEDDER_MODEL_MAX + 64];
+    int n = snprintf(id, sizeof(id), "%s:%s:%d", selected->name, selected == &embedders[0] ? "" : model_name, width);
+    uint64_t h = fnv1a(14695981039346656037ULL, id, (size_t)n);
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+int embedder_embed(const char *text, size_t len, int purpose, float *out) {
+    return selected->embed(text, len, purpose, width, out);
+}
+
+// Add weight to the signed bucket a feature hashes to
+static void add_feature(float *out, int dim, uint64_t h, float weight) {
+    h ^= h >> 29; // Low bits pick the bucket, so fold the well-mixed high ones in
+    out[h % (uint64_t)dim] += (h >> 63) ? -weight : weight;
+}
+
+static int word_byte(unsigned char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c >= 0x80;
+}
+
+// Signed feature hashing of lowercased words and adjacent word pairs with
+// log-scaled counts, L2-normalized; queries and documents embed alike
+static int hash_embed(const char *text, size_t len, int purpose, int dim, float *out) {
+    (void)purpose;
+    memset(out, 0, (size_t)dim * sizeof(float));
+    uint64_t prev = 0;
+    int words = 0;
+    for (size_t i = 0; i < len;) {
+        if (!word_byte((unsigned char)text[i])) {
+            i++;
+            continue;
+        }
+        uint64_t h = 14695981039346656037ULL;
+        for (; i < len && word_byte((unsigned char)text[i]); i++) {
+            char c = text[i] >= 'A' && text[i] <= 'Z' ? (char)(text[i] + 32) : text[i];
+            h = fnv1a(h, &c, 1);
+        }
+        add_feature(out, dim, h, 1.0f);
+        if (words++) add_feature(out, dim, (prev * 31) ^ h, HASH_PAIR_WEIGHT);
+        prev = h;
+    }
+    if (words == 0) return 0;
+
+    double norm = 0;
+    for (int i = 0; i < dim; i++) {
+        out[i] = out[i] < 0 ? -log1pf(-out[i]) : log1pf(out[i]); // A repeated word should not drown the rest
+        norm += (double)out[i] * out[i];
+    }
+    if (norm <= 0) return 0;
+    float inv = (float)(1.0 / sqrt(norm));
+    for (int i = 0; i < dim; i++) out[i] *= inv;
+    return 1;
+}
+
+static int gemini_embed(const char *text, size_t len, int purpose, int dim, float *out) {
+    return ai_embed(model_name, text, len, purpose == EMBED_DOCUMENT, dim, out);
+}
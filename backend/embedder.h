@@ -0,0 +1,36 @@
+#ifndef EMBEDDER_H
+#define EMBEDDER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define EMBEDDER_DIM_DEFAULT 256 // Components per embedding
+#define EMBEDDER_MODEL_DEFAULT "text-embedding-004" // embedContent model for the "gemini" embedder
+
+// What a text is embedded for; the API embeds queries and passages differently
+enum EmbedPurpose {
+    EMBED_QUERY = 0,
+    EMBED_DOCUMENT
+};
+
+// Turns text into a dim-component vector. "hash" is local feature hashing of
+// words and word pairs: free and instant, matching on shared vocabulary only.
+// "gemini" calls embedContent on the upstream and matches on meaning.
+struct Embedder {
+    const char *name;
+    double min_score; // Cosine similarity above which its texts are usually related
+    // Fill out (dim floats); returns 0 when the text could not be embedded
+    int (*embed)(const char *text, size_t len, int purpose, int dim, float *out);
+};
+
+// Function to select an embedder by name (NULL for "hash") and its model and
+// dimension; returns 0 for an unknown name or a dim that is not a multiple of 16
+int embedder_init(const char *name, const char *model, int dim);
+const char* embedder_name(); // Function to get the selected embedder's name
+const char* embedder_model(); // Function to get the embedContent model in use
+int embedder_dim(); // Function to get the embedding width
+double embedder_min_score(); // Function to get the selected embedder's usual relatedness threshold
+uint32_t embedder_id(); // Function to fingerprint embedder, model and dim; index files built by another are rebuilt
+int embedder_embed(const char *text, size_t len, int purpose, float *out); // Function to embed with the selected embedder
+
+#endif
@@ -0,0 +1,109 @@
+#include <stdlib.h>
+#include <string.h>
+#include "encoding.h"
+
+// Streams keep zlib state for their whole life: a 4 KB window and smaller
+// hash tables hold it near 48 KB instead of 256 KB per open stream
+#define ENCODER_WINDOW_BITS 12
+#define ENCODER_MEM_LEVEL 6
+
+static int level = ENCODING_LEVEL_DEFAULT;
+
+void encoding_init(int new_level) {
+    level = new_level < 0 ? 0 : new_level > 9 ? 9 : new_level;
+}
+
+int encoding_enabled() {
+    return level > 0;
+}
+
+int encoding_accepts(const char *header, const char *token) {
+    size_t len = strlen(token);
+    for (const char *p = header; p && *p;) {
+        while (*p == ' ' || *p == ',') p++;
+        if (strncmp(p, token, len) == 0 && (p[len] == '\0' || p[len] == ',' || p[len] == ';' || p[len] == ' ')) {
+            const char *q = strstr(p + len, "q=");
+            const char *next = strchr(p, ',');
+            return !(q && (!next || q < next) && atof(q + 2) <= 0.0);
+        }
+        p = strchr(p, ',');
+    }
+    return 0;
+}
+
+int encoding_negotiate(const char *accept_encoding) {
+    if (level == 0 || !accept_encoding) return ENCODING_IDENTITY;
+    if (encoding_accepts(accept_encoding, "gzip")) return ENCODING_GZIP;
+    if (encoding_accepts(accept_encoding, "deflate")) return ENCODING_DEFLATE;
+    return ENCODING_IDENTITY;
+}
+
+const char* encoding_name(int encoding) {
+    switch (encoding) {
+        case ENCODING_GZIP: return "gzip";
+        case ENCODING_DEFLATE: return "deflate";
+        default: return "identity";
+    }
+}
+
+// zlib windowBits selecting the gzip or zlib wrapper
+static int window_bits(int encoding, int bits) {
+    return encoding == ENCODING_GZIP ? bits + 16 : bits;
+}
+
+char* encoding_compress(int encoding, const char *data, size_t len, size_t *out_len) {
+    if (encoding == ENCODING_IDENTITY) return NULL;
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, level, Z_DEFLATED, window_bits(encoding, 15), 8, Z_DEFAULT_STRATEGY) != Z_OK) return NULL;
+
+    uLong bound = deflateBound(&zs, (uLong)len);
+    char *out = malloc(bound);
+    if (out) {
+        zs.next_in = (Bytef *)data;
+        zs.avail_in = (uInt)len;
+        zs.next_out = (Bytef *)out;
+        zs.avail_out = (uInt)bound;
+        if (deflate(&zs, Z_FINISH) == Z_STREAM_END && zs.total_out < len) {
+            *out_len = zs.total_out;
+        } else {
+            free(out);
+            out = NULL;
+        }
+    }
+    deflateEnd(&zs);
+    return out;
+}
+
+int encoder_init(struct Encoder *encoder, int encoding) {
+    memset(encoder, 0, sizeof(*encoder));
+    return deflateInit2(&encoder->zs, level, Z_DEFLATED, window_bits(encoding, ENCODER_WINDOW_BITS),
+                        ENCODER_MEM_LEVEL, Z_DEFAULT_STRATEGY) == Z_OK;
+}
+
+size_t encoder_run(struct Encoder *encoder, const char *in, size_t *in_len, char *out, size_t out_cap, int finish) {
+    if (encoder->finished) {
+        *in_len = 0;
+        return 0;
+    }
+    encoder->zs.next_in = (Bytef *)in;
+    encoder->zs.avail_in = (uInt)*in_len;
+    encoder->zs.next_out = (Bytef *)out;
+    encoder->zs.avail_out = (uInt)out_cap;
+    int ret = deflate(&encoder->zs, finish ? Z_FINISH : Z_SYNC_FLUSH);
+    *in_len -= encoder->zs.avail_in;
+    size_t produced = out_cap - encoder->zs.avail_out;
+
+    // Z_BUF_ERROR only means there was nothing to do
+    if (ret == Z_STREAM_END) {
+        encoder->finished = 1;
+    } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+        encoder->finished = encoder->failed = 1;
+    }
+    encoder->pending = !encoder->finished && encoder->zs.avail_out == 0;
+    return produced;
+}
+
+void encoder_free(struct Encoder *encoder) {
+    deflateEnd(&encoder->zs);
+}
@@ -0,0 +1,45 @@
+#ifndef ENCODING_H
+#define ENCODING_H
+
+#include <stddef.h>
+#include <zlib.h>
+
+#define ENCODING_MIN_BYTES 1024 // Smaller bodies are sent as is; a few packets either way
+#define ENCODING_LEVEL_DEFAULT 5 // zlib level for dynamic responses (static assets are precompressed)
+
+// Content-Encoding of a dynamic response
+enum Encoding {
+    ENCODING_IDENTITY = 0,
+    ENCODING_GZIP,
+    ENCODING_DEFLATE // zlib-wrapped, as RFC 9110 defines "deflate"
+};
+
+void encoding_init(int level); // Function to set the zlib level, 0 turns compression off
+int encoding_enabled(); // Function to check whether dynamic responses may be compressed
+
+// True when a comma-separated header lists token (ignoring ;q= parameters, q=0 excluded)
+int encoding_accepts(const char *header, const char *token);
+// Pick gzip, then deflate, from an Accept-Encoding header; identity when off or not accepted
+int encoding_negotiate(const char *accept_encoding);
+const char* encoding_name(int encoding); // Function to map an encoding to its Content-Encoding token
+
+// Compress a whole body; returns a malloc'd buffer, or NULL when it would not come out smaller
+char* encoding_compress(int encoding, const char *data, size_t len, size_t *out_len);
+
+// Compressor for a streamed reply. Every call flushes, so each event reaches
+// the client as soon as it is produced rather than when a block fills up.
+struct Encoder {
+    z_stream zs;
+    int pending; // The last call filled its buffer; more flushed output may be waiting
+    int finished; // Trailer written, or zlib failed
+    int failed; // zlib reported an error
+};
+
+int encoder_init(struct Encoder *encoder, int encoding); // Function to start a stream, 0 on failure
+// Compress the first *in_len bytes of in into at most out_cap bytes of out and
+// set *in_len to the bytes consumed. With finish the stream is ended once all
+// of in is consumed. Returns the bytes written to out.
+size_t encoder_run(struct Encoder *encoder, const char *in, size_t *in_len, char *out, size_t out_cap, int finish);
+void encoder_free(struct Encoder *encoder); // Function to release zlib state
+
+#endif
@@ -0,0 +1,300 @@
+#include <stdlib.h>
+#include <string.h>
+#include "history.h"
+
+#define USER_PREFIX "User: "
+#define MODEL_PREFIX "Assistant: "
+
+struct ChatHistory* history_create(size_t capacity) {
+    if (capacity == 0) capacity = HISTORY_CAPACITY;
+    struct ChatHistory *history = calloc(1, sizeof(struct ChatHistory));
+    if (!history) return NULL;
+    history->entries = calloc(capacity, sizeof(struct HistoryEntry));
+    if (!history->entries) {
+        free(history);
+        return NULL;
+    }
+    history->capacity = capacity;
+    return history;
+}
+
+void history_clear(struct ChatHistory *history) {
+    for (size_t i = 0; i < history->capacity; i++) {
+        free(history->entries[i].text);
+    }
+    memset(history->entries, 0, history->capacity * sizeof(struct HistoryEntry));
+    history->head = history->count = 0;
+    history->total_bytes = history->total_tokens = 0;
+    free(history->summary);
+    history->summary = NULL;
+    history->summary_len = history->summary_tokens = 0;
+    history->summarized_seq = history->next_seq; // A summary still being produced is discarded
+}
+
+void history_restore(struct ChatHistory *history, uint64_t next_seq, uint64_t summarized_seq, const char *summary) {
+    history_clear(history);
+    history->next_seq = next_seq;
+    history->summarized_seq = 0;
+    if (summary && summary[0] && summarized_seq > 0) {
+        // Installs the summary and sets summarized_seq to through_seq + 1
+        history_finish_compaction(history, summary, summarized_seq - 1);
+    }
+    history->summarized_seq = summarized_seq;
+}
+
+void history_free(struct ChatHistory *history) {
+    if (!history) return;
+    history_clear(history);
+    free(history->entries);
+    free(history);
+}
+
+// Scale applied to raw estimates, learned from promptTokenCount (HISTORY_SCALE_ONE = 1.0)
+static unsigned int token_scale = HISTORY_SCALE_ONE;
+
+// Byte length of a letter at p (ASCII, two-byte UTF-8 such as accented Latin
+// or Cyrillic, or Latin Extended Additional as used by Vietnamese), 0 otherwise
+static size_t letter_len(const unsigned char *p, const unsigned char *end) {
+    if ((*p | 0x20) >= 'a' && (*p | 0x20) <= 'z') return 1;
+    if (*p >= 0xC2 && *p <= 0xDF && end - p >= 2) return 2;
+    if (*p == 0xE1 && end - p >= 3 && p[1] >= 0xB8 && p[1] <= 0xBB) return 3;
+    return 0;
+}
+
+// Approximates a subword tokenizer without a vocabulary: a run of letters
+// costs one token plus one per eight bytes (most words are a single token),
+// digits one per three, each punctuation mark one, and other non-ASCII
+// characters (CJK, symbols, emoji) one each. Whitespace rides along with
+// the next word. history_calibrate corrects the overall level.
+size_t history_estimate_tokens(const char *text, size_t len) {
+    if (!text) return 0;
+    const unsigned char *p = (const unsigned char *)text, *end = p + len;
+    size_t tokens = 0;
+    while (p < end) {
+        size_t n = letter_len(p, end);
+        if (n) {
+            const unsigned char *start = p;
+            while (p < end && (n = letter_len(p, end)) != 0) p += n;
+            tokens += 1 + (size_t)(p - start) / 8;
+        } else if (*p >= '0' && *p <= '9') {
+            const unsigned char *start = p;
+            while (p < end && *p >= '0' && *p <= '9') p++;
+            tokens += ((size_t)(p - start) + 2) / 3;
+        } else if (*p == ' ' || *p == '\n' || *p == '\t' || *p == '\r') {
+            p++;
+        } else if (*p < 0x80) {
+            tokens++;
+            p++;
+        } else {
+            // One token per remaining character; continuation bytes are skipped
+            tokens++;
+            p++;
+            while (p < end && (*p & 0xC0) == 0x80) p++;
+        }
+    }
+    return tokens;
+}
+
+// Moves the scale an eighth of the way towards the observed ratio; concurrent
+// updates may overwrite each other, which only slows convergence
+void history_calibrate(size_t estimated, long actual) {
+    if (estimated < 16 || actual <= 0) return;
+    uint64_t ratio = (uint64_t)actual * HISTORY_SCALE_ONE / estimated;
+    if (ratio < HISTORY_SCALE_ONE / 4) ratio = HISTORY_SCALE_ONE / 4;
+    if (ratio > HISTORY_SCALE_ONE * 4) ratio = HISTORY_SCALE_ONE * 4;
+    unsigned int scale = __atomic_load_n(&token_scale, __ATOMIC_RELAXED);
+    scale = (unsigned int)(((uint64_t)scale * 7 + ratio) / 8);
+    __atomic_store_n(&token_scale, scale, __ATOMIC_RELAXED);
+}
+
+size_t history_calibrated(size_t estimated) {
+    if (estimated == 0) return 0;
+    size_t scaled = estimated * __atomic_load_n(&token_scale, __ATOMIC_RELAXED) / HISTORY_SCALE_ONE;
+    return scaled ? scaled : 1;
+}
+
+// Double the ring, oldest message first; 0 when at HISTORY_CAPACITY_MAX or out of memory
+static int grow(struct ChatHistory *history) {
+    if (history->capacity >= HISTORY_CAPACITY_MAX) return 0;
+    size_t capacity = history->capacity * 2 < HISTORY_CAPACITY_MAX ? history->capacity * 2 : HISTORY_CAPACITY_MAX;
+    struct HistoryEntry *entries = calloc(capacity, sizeof(struct HistoryEntry));
+    if (!entries) return 0;
+    for (size_t i = 0; i < history->count; i++) {
+        entries[i] = *history_recent(history, history->count - 1 - i);
+    }
+    free(history->entries);
+    history->entries = entries;
+    history->capacity = capacity;
+    history->head = history->count;
+    return 1;
+}
+
+void history_append(struct ChatHistory *history, int role, const char *message) {
+    size_t len = strlen(message);
+    char *copy = malloc(len + 1);
+    if (!copy) return;
+    memcpy(copy, message, len + 1);
+
+    // The oldest message is only dropped once the summary stands in for it
+    if (history->count == history->capacity && history->entries[history->head].seq >= history->summarized_seq) {
+        grow(history);
+    }
+
+    struct HistoryEntry *slot = &history->entries[history->head];
+    if (history->count == history->capacity) {
+        // Overwrite the oldest message
+        history->total_bytes -= slot->len;
+        history->total_tokens -= slot->tokens;
+        free(slot->text);
+    } else {
+        history->count++;
+    }
+    slot->text = copy;
+    slot->len = len;
+    slot->tokens = history_estimate_tokens(copy, len);
+    slot->role = role;
+    slot->seq = history->next_seq++;
+    history->total_bytes += len;
+    history->total_tokens += slot->tokens;
+    history->head = (history->head + 1) % history->capacity;
+}
+
+const struct HistoryEntry* history_recent(const struct ChatHistory *history, size_t i) {
+    if (i >= history->count) return NULL;
+    size_t idx = (history->head + history->capacity - 1 - i) % history->capacity;
+    return &history->entries[idx];
+}
+
+static size_t rendered_len(const struct HistoryEntry *entry) {
+    size_t prefix = entry->role == ROLE_USER ? sizeof(USER_PREFIX) - 1 : sizeof(MODEL_PREFIX) - 1;
+    return prefix + entry->len + 1;
+}
+
+char* history_render(const struct ChatHistory *history, int max_messages, size_t max_bytes, struct Arena *arena) {
+    // Walk back from the newest message to find how many whole messages fit
+    size_t take = 0, total = 0;
+    size_t limit = max_messages > 0 ? (size_t)max_messages : 0;
+    while (take < limit && take < history->count) {
+        size_t len = rendered_len(history_recent(history, take));
+        if (max_bytes && total + len > max_bytes) break;
+        total += len;
+        take++;
+    }
+
+    char *out = arena ? arena_alloc(arena, total + 1) : malloc(total + 1);
+    if (!out) return NULL;
+    char *p = out;
+    for (size_t i = take; i-- > 0;) {
+        const struct HistoryEntry *entry = history_recent(history, i);
+        const char *prefix = entry->role == ROLE_USER ? USER_PREFIX : MODEL_PREFIX;
+        size_t prefix_len = entry->role == ROLE_USER ? sizeof(USER_PREFIX) - 1 : sizeof(MODEL_PREFIX) - 1;
+        memcpy(p, prefix, prefix_len);
+        p += prefix_len;
+        memcpy(p, entry->text, entry->len);
+        p += entry->len;
+        *p++ = '\n';
+    }
+    *p = '\0';
+    return out;
+}
+
+// Copy take messages, oldest first, that precede the newer most recent ones,
+// together with the current summary
+static struct HistoryWindow* copy_window(const struct ChatHistory *history, size_t newer, size_t take,
+                                         struct Arena *arena) {
+    size_t total = 0, tokens = 0;
+    for (size_t i = newer; i < newer + take; i++) {
+        const struct HistoryEntry *entry = history_recent(history, i);
+        total += entry->len;
+        tokens += history_calibrated(entry->tokens);
+    }
+
+    // Header, turn array, NUL-terminated texts and the summary share one block
+    size_t head = sizeof(struct HistoryWindow) + take * sizeof(struct ChatTurn);
+    size_t size = head + total + take + history->summary_len + 1;
+    struct HistoryWindow *window = arena ? arena_alloc(arena, size) : malloc(size);
+    if (!window) return NULL;
+    window->turns = (struct ChatTurn *)(window + 1);
+    window->count = take;
+    window->bytes = total;
+    window->tokens = tokens + history_calibrated(history->summary_tokens);
+    window->last_seq = take ? history_recent(history, newer)->seq : 0;
+
+    char *p = (char *)window + head;
+    for (size_t i = 0; i < take; i++) {
+        const struct HistoryEntry *entry = history_recent(history, newer + take - 1 - i);
+        memcpy(p, entry->text, entry->len);
+        p[entry->len] = '\0';
+        window->turns[i].role = entry->role;
+        window->turns[i].text = p;
+        window->turns[i].len = entry->len;
+        p += entry->len + 1;
+    }
+    window->summary = history->summary ? p : NULL;
+    window->summary_len = history->summary_len;
+    if (history->summary) memcpy(p, history->summary, history->summary_len + 1);
+    return window;
+}
+
+struct HistoryWindow* history_window(const struct ChatHistory *history, size_t max_tokens, struct Arena *arena) {
+    size_t summary_tokens = history_calibrated(history->summary_tokens);
+    size_t budget = max_tokens > summary_tokens ? max_tokens - summary_tokens : 0;
+
+    // Walk back from the newest message to find how many whole messages fit
+    size_t take = 0, tokens = 0;
+    while (take < history->count) {
+        const struct HistoryEntry *entry = history_recent(history, take);
+        if (entry->seq < history->summarized_seq) break; // Already in the summary
+        size_t cost = history_calibrated(entry->tokens);
+        if (tokens + cost > budget) break;
+        tokens += cost;
+        take++;
+    }
+    return copy_window(history, 0, take, arena);
+}
+
+struct HistoryWindow* history_begin_compaction(struct ChatHistory *history, size_t max_tokens) {
+    if (history->compacting) return NULL;
+
+    // Retained messages the summary does not cover yet
+    size_t pending = 0, tokens = history_calibrated(history->summary_tokens);
+    while (pending < history->count) {
+        const struct HistoryEntry *entry = history_recent(history, pending);
+        if (entry->seq < history->summarized_seq) break;
+        tokens += history_calibrated(entry->tokens);
+        pending++;
+    }
+    // Short turns fill the ring long before the budget; fold them before it has to grow
+    if (tokens <= max_tokens && pending <= HISTORY_CAPACITY - HISTORY_CAPACITY / 4) return NULL;
+
+    // Keep the newest messages within half the budget and half the slots so the next
+    // compaction is several exchanges away, starting on a user message so exchanges stay whole
+    size_t keep = 0, kept = 0;
+    while (keep < pending && keep < HISTORY_CAPACITY / 2) {
+        size_t cost = history_calibrated(history_recent(history, keep)->tokens);
+        if (kept + cost > max_tokens / 2) break;
+        kept += cost;
+        keep++;
+    }
+    while (keep > 0 && history_recent(history, keep - 1)->role != ROLE_USER) keep--;
+    if (pending - keep < HISTORY_COMPACT_MIN) return NULL;
+
+    struct HistoryWindow *window = copy_window(history, keep, pending - keep, NULL);
+    if (window) history->compacting = 1;
+    return window;
+}
+
+void history_finish_compaction(struct ChatHistory *history, const char *summary, uint64_t through_seq) {
+    history->compacting = 0;
+    if (!summary || through_seq < history->summarized_seq) return; // Failed, or the history was cleared meanwhile
+
+    size_t len = strlen(summary);
+    char *copy = malloc(len + 1);
+    if (!copy) return;
+    memcpy(copy, summary, len + 1);
+    free(history->summary);
+    history->summary = copy;
+    history->summary_len = len;
+    history->summary_tokens = history_estimate_tokens(copy, len);
+    history->summarized_seq = through_seq + 1;
+}
@@ -0,0 +1,97 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "arena.h"
+
+#define HISTORY_CAPACITY 64 // Messages retained per conversation
+#define HISTORY_CAPACITY_MAX 1024 // The ring grows up to this rather than drop messages no summary covers
+#define HISTORY_MAX_BYTES 40000 // Max rendered history (history_render)
+#define HISTORY_TOKEN_BUDGET 8192 // Default tokens of summary plus recent turns sent upstream
+#define HISTORY_COMPACT_MIN 2 // Fewest turns folded into the summary at once
+#define HISTORY_SCALE_ONE 1024 // Calibration scale meaning "estimate is exact"
+
+enum ChatRole {
+    ROLE_USER = 0, // Message typed by the user
+    ROLE_MODEL = 1 // Reply from the model
+};
+
+struct HistoryEntry {
+    char *text; // Message content
+    size_t len; // Length of text
+    size_t tokens; // Estimated tokens in text (uncalibrated)
+    uint64_t seq; // Position in the conversation, increasing
+    int role; // enum ChatRole
+};
+
+// One message of a HistoryWindow
+struct ChatTurn {
+    int role; // enum ChatRole
+    const char *text; // Message content (inside the window's allocation)
+    size_t len; // Length of text
+};
+
+// Copy of consecutive messages, oldest first, in a single allocation
+struct HistoryWindow {
+    struct ChatTurn *turns; // count turns, oldest first
+    size_t count; // Number of turns
+    size_t bytes; // Sum of len over turns
+    size_t tokens; // Calibrated token estimate of turns and summary
+    const char *summary; // Summary of the messages before turns, NULL if none
+    size_t summary_len; // Length of summary
+    uint64_t last_seq; // seq of the newest turn
+};
+
+// Fixed-size ring of the most recent messages with running totals, plus a
+// rolling summary standing in for the messages before summarized_seq
+struct ChatHistory {
+    struct HistoryEntry *entries; // Ring storage
+    size_t capacity; // Slots in the ring
+    size_t head; // Slot the next message goes into
+    size_t count; // Messages currently retained
+    size_t total_bytes; // Sum of len over retained messages
+    size_t total_tokens; // Sum of tokens over retained messages
+    uint64_t next_seq; // seq of the next message
+    char *summary; // Rolling summary, NULL if none
+    size_t summary_len; // Length of summary
+    size_t summary_tokens; // Estimated tokens in summary (uncalibrated)
+    uint64_t summarized_seq; // Messages before this seq are covered by summary
+    int compacting; // A summary of older messages is being produced
+};
+
+struct ChatHistory* history_create(size_t capacity); // Function to create an empty history
+void history_free(struct ChatHistory *history); // Function to free the history
+// Function to add a message. A full ring drops its oldest message once the summary covers it, and
+// grows (up to HISTORY_CAPACITY_MAX) while it does not.
+void history_append(struct ChatHistory *history, int role, const char *message);
+void history_clear(struct ChatHistory *history); // Function to drop every message and the summary
+// Function to reset to an empty history whose next message gets next_seq, with summary (may be NULL)
+// covering the messages before summarized_seq; used to rebuild a history from a snapshot
+void history_restore(struct ChatHistory *history, uint64_t next_seq, uint64_t summarized_seq, const char *summary);
+
+// Function to get the i-th most recent message (0 = newest), NULL when out of range
+const struct HistoryEntry* history_recent(const struct ChatHistory *history, size_t i);
+
+// Function to render the latest messages that fit both limits, oldest first, as "User: ...\nAssistant: ...\n".
+// The result is allocated in arena, or with malloc when arena is NULL.
+char* history_render(const struct ChatHistory *history, int max_messages, size_t max_bytes, struct Arena *arena);
+
+// Function to copy the summary and the latest whole messages it does not cover that fit in max_tokens.
+// The window is one block allocated in arena, or with malloc (release with free) when arena is NULL.
+struct HistoryWindow* history_window(const struct ChatHistory *history, size_t max_tokens, struct Arena *arena);
+
+// Once the unsummarized messages outgrow max_tokens, or fill three quarters of HISTORY_CAPACITY
+// slots, copy the oldest of them (with the current summary) to be folded into a new summary,
+// leaving about half the budget and half the slots, and mark the history as compacting.
+// Returns a malloc'd window, or NULL when no compaction is due.
+struct HistoryWindow* history_begin_compaction(struct ChatHistory *history, size_t max_tokens);
+
+// Function to install the summary covering messages up to through_seq (NULL when summarizing failed)
+void history_finish_compaction(struct ChatHistory *history, const char *summary, uint64_t through_seq);
+
+size_t history_estimate_tokens(const char *text, size_t len); // Function to approximate token count
+void history_calibrate(size_t estimated, long actual); // Function to fold a reported prompt size into the estimate scale
+size_t history_calibrated(size_t estimated); // Function to scale a raw estimate by the calibration
+
+#endif
@@ -0,0 +1,523 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "history_log.h"
+
+#define LOG_FILE_MAGIC "GHL1" // On-disk format tag, shared by logs and snapshots
+#define LOG_MAX_PAYLOAD (64UL * 1024 * 1024) // Records larger than this are treated as corruption
+#define LOG_REPLAY_THREADS 8 // Shards recovered in parallel
+
+// On-disk record header; the id, a NUL, the text and a NUL follow it.
+// crc covers everything after the crc field, so a torn write fails the check.
+struct LogRecordHeader {
+    uint32_t len; // Bytes after the header
+    uint32_t crc;
+    uint8_t type;
+    uint8_t role;
+    uint16_t id_len;
+    uint32_t reserved;
+    uint64_t seq;
+    uint64_t arg;
+    uint64_t arg2;
+} __attribute__((packed));
+
+// One log file and the records queued for it. Callers only touch pending;
+// the writer thread owns the file.
+struct LogShard {
+    pthread_mutex_t lock;
+    struct HistoryLogBuf pending; // Encoded records not yet written (lock)
+    uint64_t gen; // Generation of the open log (writer)
+    int fd; // Open log (writer)
+    size_t log_bytes; // Size of the open log (writer)
+    int dirty; // Written since the last sync (writer)
+} __attribute__((aligned(64)));
+
+static struct LogShard shards[HISTORY_LOG_SHARDS];
+static char *log_dir = NULL;
+static int log_enabled = 0;
+static int fsync_interval_ms = HISTORY_LOG_FSYNC_MS_DEFAULT;
+static size_t compact_threshold = HISTORY_LOG_COMPACT_DEFAULT;
+static history_log_dump_fn dump_shard = NULL;
+static uint64_t log_clock = 0; // Last seq handed out (atomic)
+
+static pthread_t writer_thread;
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_wake = PTHREAD_COND_INITIALIZER;
+static int writer_running = 0; // writer_lock
+
+// Counters (atomic)
+static unsigned long stat_records = 0;
+static unsigned long stat_bytes = 0;
+static unsigned long stat_fsyncs = 0;
+static unsigned long stat_compactions = 0;
+static unsigned long stat_dropped = 0;
+static unsigned long stat_write_errors = 0;
+static unsigned long stat_replayed = 0;
+static unsigned long stat_truncated = 0;
+static double replay_seconds = 0;
+
+static int buf_reserve(struct HistoryLogBuf *buf, size_t extra) {
+    if (buf->len + extra <= buf->cap) return 1;
+    size_t cap = buf->cap ? buf->cap * 2 : 65536;
+    while (cap < buf->len + extra) cap *= 2;
+    char *data = realloc(buf->data, cap);
+    if (!data) return 0;
+    buf->data = data;
+    buf->cap = cap;
+    return 1;
+}
+
+int history_log_encode(struct HistoryLogBuf *out, const struct HistoryLogRecord *record) {
+    size_t id_len = strlen(record->id);
+    size_t payload = id_len + 1 + record->len + 1;
+    if (!buf_reserve(out, sizeof(struct LogRecordHeader) + payload)) return 0;
+
+    struct LogRecordHeader header = {
+        .len = (uint32_t)payload,
+        .type = (uint8_t)record->type,
+        .role = (uint8_t)record->role,
+        .id_len = (uint16_t)id_len,
+        .seq = record->seq,
+        .arg = record->arg,
+        .arg2 = record->arg2,
+    };
+    char *p = out->data + out->len;
+    memcpy(p + sizeof(header), record->id, id_len + 1);
+    memcpy(p + sizeof(header) + id_len + 1, record->text ? record->text : "", record->len);
+    p[sizeof(header) + payload - 1] = '\0';
+
+    size_t skip = offsetof(struct LogRecordHeader, type);
+    uLong crc = crc32(0L, (const Bytef *)&header + skip, (uInt)(sizeof(header) - skip));
+    header.crc = (uint32_t)crc32(crc, (const Bytef *)p + sizeof(header), (uInt)payload);
+    memcpy(p, &header, sizeof(header));
+    out->len += sizeof(header) + payload;
+    return 1;
+}
+
+int history_log_enabled() {
+    return __atomic_load_n(&log_enabled, __ATOMIC_RELAXED);
+}
+
+int history_log_append(unsigned shard, struct HistoryLogRecord *record) {
+    struct LogShard *s = &shards[shard % HISTORY_LOG_SHARDS];
+    record->seq = __atomic_add_fetch(&log_clock, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&s->lock);
+    // Never wait for the disk: past the bound the writer has fallen behind, so drop
+    int ok = s->pending.len < HISTORY_LOG_BUFFER_MAX && history_log_encode(&s->pending, record);
+    pthread_mutex_unlock(&s->lock);
+
+    __atomic_fetch_add(ok ? &stat_records : &stat_dropped, 1, __ATOMIC_RELAXED);
+    return ok;
+}
+
+static int write_all(int fd, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 1;
+}
+
+static void shard_path(char *out, size_t size, unsigned shard, uint64_t gen, const char *ext) {
+    snprintf(out, size, "%s/shard-%u.%llu.%s", log_dir, shard, (unsigned long long)gen, ext);
+}
+
+// Open (creating if needed) the log for gen, positioned for appends
+static int open_log(unsigned shard, uint64_t gen, size_t *size) {
+    char path[4096];
+    shard_path(path, sizeof(path), shard, gen, "log");
+    int fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    struct stat st;
+    *size = fstat(fd, &st) == 0 ? (size_t)st.st_size : 0;
+    if (*size == 0) {
+        if (!write_all(fd, LOG_FILE_MAGIC, sizeof(LOG_FILE_MAGIC) - 1)) {
+            close(fd);
+            return -1;
+        }
+        *size = sizeof(LOG_FILE_MAGIC) - 1;
+    }
+    return fd;
+}
+
+static void sync_dir() {
+    int fd = open(log_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return;
+    fsync(fd);
+    close(fd);
+}
+
+// Apply every record of one file in order. A record that is cut short or
+// fails its checksum ends the file; with truncate set it is cut off there.
+static unsigned long replay_file(const char *path, int from_snapshot, int truncate, history_log_apply_fn apply,
+                                 uint64_t *max_seq) {
+    int fd = open(path, (truncate ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+    if (fd < 0) return 0;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    size_t size = (size_t)st.st_size;
+    size_t good = 0;
+    unsigned long count = 0;
+
+    char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+        madvise(map, size, MADV_SEQUENTIAL);
+        if (size >= sizeof(LOG_FILE_MAGIC) - 1 && memcmp(map, LOG_FILE_MAGIC, sizeof(LOG_FILE_MAGIC) - 1) == 0) {
+            size_t pos = good = sizeof(LOG_FILE_MAGIC) - 1;
+            size_t skip = offsetof(struct LogRecordHeader, type);
+            while (pos + sizeof(struct LogRecordHeader) <= size) {
+                struct LogRecordHeader header;
+                memcpy(&header, map + pos, sizeof(header));
+                const char *payload = map + pos + sizeof(header);
+                if (header.len > LOG_MAX_PAYLOAD || pos + sizeof(header) + header.len > size ||
+                    header.len < (size_t)header.id_len + 2) break;
+                uLong crc = crc32(0L, (const Bytef *)map + pos + skip, (uInt)(sizeof(header) - skip));
+                if ((uint32_t)crc32(crc, (const Bytef *)payload, header.len) != header.crc ||
+                    payload[header.id_len] != '\0' || payload[header.len - 1] != '\0') break;
+
+                struct HistoryLogRecord record = {
+                    .type = header.type,
+                    .role = header.role,
+                    .seq = header.seq,
+                    .arg = header.arg,
+                    .arg2 = header.arg2,
+                    .id = payload,
+                    .text = payload + header.id_len + 1,
+                    .len = header.len - header.id_len - 2,
+                    .from_snapshot = from_snapshot,
+                };
+                apply(&record);
+                if (header.seq > *max_seq) *max_seq = header.seq;
+                count++;
+                pos += sizeof(header) + header.len;
+                good = pos;
+            }
+        }
+        munmap(map, size);
+    }
+
+    if (truncate && good < size) {
+        // Torn tail from a crash (or a file that never got its header): keep the valid prefix
+        if (ftruncate(fd, (off_t)good) == 0) __atomic_fetch_add(&stat_truncated, size - good, __ATOMIC_RELAXED);
+    }
+    close(fd);
+    return count;
+}
+
+// Newest complete snapshot and the range of log generations found for each shard
+struct ShardFiles {
+    int has_snapshot;
+    uint64_t snapshot_gen;
+    int has_log;
+    uint64_t first_log;
+    uint64_t last_log;
+};
+
+static struct ShardFiles found[HISTORY_LOG_SHARDS];
+
+static void scan_dir() {
+    memset(found, 0, sizeof(found));
+    DIR *dir = opendir(log_dir);
+    if (!dir) return;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        unsigned shard;
+        unsigned long long gen;
+        char ext[8];
+        if (sscanf(ent->d_name, "shard-%u.%llu.%7s", &shard, &gen, ext) != 3 || shard >= HISTORY_LOG_SHARDS) continue;
+        struct ShardFiles *f = &found[shard];
+        if (strcmp(ext, "snap") == 0) {
+            if (!f->has_snapshot || gen > f->snapshot_gen) f->snapshot_gen = gen;
+            f->has_snapshot = 1;
+        } else if (strcmp(ext, "log") == 0) {
+            if (!f->has_log || gen < f->first_log) f->first_log = gen;
+            if (!f->has_log || gen > f->last_log) f->last_log = gen;
+            f->has_log = 1;
+        }
+    }
+    closedir(dir);
+}
+
+// Delete generations [from, gen) of shard. The snapshot goes first: a log
+// left behind by a crash makes the next start repeat the cleanup.
+static void remove_older(unsigned shard, uint64_t gen, uint64_t from) {
+    char path[4096];
+    for (uint64_t g = from; g < gen; g++) {
+        shard_path(path, sizeof(path), shard, g, "snap");
+        unlink(path);
+        shard_path(path, sizeof(path), shard, g, "log");
+        unlink(path);
+    }
+}
+
+struct ReplayJob {
+    history_log_apply_fn apply;
+    unsigned next_shard; // Next shard to claim (atomic)
+};
+
+static void* replay_main(void *arg) {
+    struct ReplayJob *job = (struct ReplayJob *)arg;
+    uint64_t max_seq = 0;
+    unsigned shard;
+    char path[4096];
+    while ((shard = __atomic_fetch_add(&job->next_shard, 1, __ATOMIC_RELAXED)) < HISTORY_LOG_SHARDS) {
+        struct ShardFiles *f = &found[shard];
+        unsigned long count = 0;
+        uint64_t gen = f->has_snapshot ? f->snapshot_gen : (f->has_log ? f->first_log : 0);
+        if (f->has_snapshot) {
+            shard_path(path, sizeof(path), shard, f->snapshot_gen, "snap");
+            count += replay_file(path, 1, 0, job->apply, &max_seq);
+        }
+        // Logs from the snapshot's generation on; older ones are already in it
+        for (uint64_t g = gen; f->has_log && g <= f->last_log; g++) {
+            shard_path(path, sizeof(path), shard, g, "log");
+            count += replay_file(path, 0, 1, job->apply, &max_seq);
+        }
+        __atomic_fetch_add(&stat_replayed, count, __ATOMIC_RELAXED);
+        if (f->has_log && f->first_log < gen) remove_older(shard, gen, f->first_log);
+        shards[shard].gen = f->has_log && f->last_log > gen ? f->last_log : gen;
+        shard_path(path, sizeof(path), shard, shards[shard].gen, "snap.tmp");
+        unlink(path); // Snapshot of an interrupted compaction
+    }
+    // Later changes must order after everything replayed
+    uint64_t clock = __atomic_load_n(&log_clock, __ATOMIC_RELAXED);
+    while (max_seq > clock && !__atomic_compare_exchange_n(&log_clock, &clock, max_seq, 1, __ATOMIC_RELAXED,
+                                                          __ATOMIC_RELAXED)) {
+    }
+    return NULL;
+}
+
+static void replay_all(history_log_apply_fn apply) {
+    struct ReplayJob job = { apply, 0 };
+    pthread_t threads[LOG_REPLAY_THREADS];
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int wanted = cpus > 1 ? (int)cpus : 1;
+    if (wanted > LOG_REPLAY_THREADS) wanted = LOG_REPLAY_THREADS;
+
+    int started = 0;
+    while (started < wanted - 1 && pthread_create(&threads[started], NULL, replay_main, &job) == 0) started++;
+    replay_main(&job); // This thread helps too
+    for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+}
+
+// Continue in the next generation (writer thread). Replay reads a log up to
+// its first bad record and then goes on with the next one.
+static void roll_log(struct LogShard *s) {
+    size_t size;
+    int fd = open_log((unsigned)(s - shards), s->gen + 1, &size);
+    if (fd < 0) return;
+    if (s->dirty) fdatasync(s->fd);
+    close(s->fd);
+    s->fd = fd;
+    s->gen++;
+    s->log_bytes = size;
+    s->dirty = 0;
+}
+
+// Move a shard's queued records into its log (writer thread)
+static void write_pending(struct LogShard *s, struct HistoryLogBuf *spare) {
+    pthread_mutex_lock(&s->lock);
+    struct HistoryLogBuf taken = s->pending;
+    s->pending = *spare;
+    s->pending.len = 0;
+    pthread_mutex_unlock(&s->lock);
+
+    if (taken.len > 0) {
+        if (s->fd >= 0 && write_all(s->fd, taken.data, taken.len)) {
+            s->log_bytes += taken.len;
+            s->dirty = 1;
+            __atomic_fetch_add(&stat_bytes, taken.len, __ATOMIC_RELAXED);
+        } else {
+            __atomic_fetch_add(&stat_write_errors, 1, __ATOMIC_RELAXED);
+            // A partial record would stop replay before every later one: cut it off, or
+            // leave it at the end of this generation
+            if (s->fd >= 0 && ftruncate(s->fd, (off_t)s->log_bytes) != 0) roll_log(s);
+        }
+    }
+    *spare = taken; // Reused, keeping its capacity
+}
+
+// Start a new log generation and fold the old one into a snapshot of the
+// shard's live sessions (writer thread). Records queued before the switch
+// land in the old log and are in the dump; later ones go to the new log and
+// are skipped on replay when the dump already holds them.
+static void compact_shard(unsigned shard, struct HistoryLogBuf *spare) {
+    struct LogShard *s = &shards[shard];
+    uint64_t old_gen = s->gen;
+    size_t new_size;
+    int new_fd = open_log(shard, old_gen + 1, &new_size);
+    if (new_fd < 0) return;
+
+    write_pending(s, spare);
+    fdatasync(s->fd);
+    close(s->fd);
+    s->fd = new_fd;
+    s->gen = old_gen + 1;
+    s->log_bytes = new_size;
+    s->dirty = 0;
+
+    // Without a snapshot for the new generation, replay keeps using the old one and both logs
+    struct HistoryLogBuf snap = { NULL, 0, 0 };
+    if (!buf_reserve(&snap, sizeof(LOG_FILE_MAGIC) - 1)) return;
+    memcpy(snap.data, LOG_FILE_MAGIC, sizeof(LOG_FILE_MAGIC) - 1);
+    snap.len = sizeof(LOG_FILE_MAGIC) - 1;
+    if (!dump_shard(shard, HISTORY_LOG_SHARDS, &snap)) {
+        free(snap.data);
+        return;
+    }
+
+    char tmp_path[4096], path[4096];
+    shard_path(tmp_path, sizeof(tmp_path), shard, s->gen, "snap.tmp");
+    shard_path(path, sizeof(path), shard, s->gen, "snap");
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    int ok = fd >= 0 && write_all(fd, snap.data, snap.len) && fsync(fd) == 0;
+    if (fd >= 0) close(fd);
+    if (ok && rename(tmp_path, path) == 0) {
+        sync_dir();
+        remove_older(shard, s->gen, old_gen); // The snapshot replaces the old log and snapshot
+        __atomic_fetch_add(&stat_compactions, 1, __ATOMIC_RELAXED);
+    } else {
+        unlink(tmp_path); // Replay still has the old generation
+    }
+    free(snap.data);
+}
+
+// One group commit: write every shard's queue, then sync each file written
+static void flush_all(struct HistoryLogBuf *spare) {
+    for (unsigned i = 0; i < HISTORY_LOG_SHARDS; i++) write_pending(&shards[i], spare);
+    for (unsigned i = 0; i < HISTORY_LOG_SHARDS; i++) {
+        struct LogShard *s = &shards[i];
+        if (!s->dirty) continue;
+        fdatasync(s->fd);
+        s->dirty = 0;
+        __atomic_fetch_add(&stat_fsyncs, 1, __ATOMIC_RELAXED);
+        if (s->log_bytes >= compact_threshold && dump_shard) compact_shard(i, spare);
+    }
+}
+
+static void* writer_main(void *arg) {
+    (void)arg;
+    struct HistoryLogBuf spare = { NULL, 0, 0 };
+    pthread_mutex_lock(&writer_lock);
+    while (writer_running) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (long)fsync_interval_ms * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&writer_wake, &writer_lock, &deadline);
+        pthread_mutex_unlock(&writer_lock);
+        flush_all(&spare);
+        pthread_mutex_lock(&writer_lock);
+    }
+    pthread_mutex_unlock(&writer_lock);
+    flush_all(&spare); // Whatever was queued before close
+    free(spare.data);
+    return NULL;
+}
+
+int history_log_open(const char *dir, int fsync_ms, size_t compact_bytes, history_log_apply_fn apply,
+                     history_log_dump_fn dump) {
+    if (!dir || !dir[0]) return 0;
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        perror(dir);
+        return 0;
+    }
+    log_dir = strdup(dir);
+    if (!log_dir) return 0;
+    fsync_interval_ms = fsync_ms > 0 ? fsync_ms : HISTORY_LOG_FSYNC_MS_DEFAULT;
+    compact_threshold = compact_bytes > 0 ? compact_bytes : HISTORY_LOG_COMPACT_DEFAULT;
+    dump_shard = dump;
+
+    for (unsigned i = 0; i < HISTORY_LOG_SHARDS; i++) {
+        memset(&shards[i], 0, sizeof(shards[i]));
+        pthread_mutex_init(&shards[i].lock, NULL);
+        shards[i].fd = -1;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    scan_dir();
+    replay_all(apply);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    replay_seconds = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+
+    for (unsigned i = 0; i < HISTORY_LOG_SHARDS; i++) {
+        shards[i].fd = open_log(i, shards[i].gen, &shards[i].log_bytes);
+        if (shards[i].fd < 0) {
+            for (unsigned j = 0; j < i; j++) close(shards[j].fd);
+            free(log_dir);
+            log_dir = NULL;
+            return 0;
+        }
+    }
+    sync_dir();
+
+    writer_running = 1;
+    if (pthread_create(&writer_thread, NULL, writer_main, NULL) != 0) {
+        writer_running = 0;
+        for (unsigned i = 0; i < HISTORY_LOG_SHARDS; i++) close(shards[i].fd);
+        free(log_dir);
+        log_dir = NULL;
+        return 0;
+    }
+    __atomic_store_n(&log_enabled, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+void history_log_close() {
+    if (!history_log_enabled()) return;
+    __atomic_store_n(&log_enabled, 0, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&writer_lock);
+    writer_running = 0;
+    pthread_cond_signal(&writer_wake);
+    pthread_mutex_unlock(&writer_lock);
+    pthread_join(writer_thread, NULL);
+
+    for (unsigned i = 0; i < HISTORY_LOG_SHARDS; i++) {
+        struct LogShard *s = &shards[i];
+        close(s->fd);
+        s->fd = -1;
+        free(s->pending.data);
+        s->pending.data = NULL;
+        s->pending.len = s->pending.cap = 0;
+        pthread_mutex_destroy(&s->lock);
+    }
+    free(log_dir);
+    log_dir = NULL;
+}
+
+void history_log_get_stats(struct HistoryLogStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    stats->enabled = history_log_enabled();
+    stats->records = __atomic_load_n(&stat_records, __ATOMIC_RELAXED);
+    stats->bytes_written = __atomic_load_n(&stat_bytes, __ATOMIC_RELAXED);
+    stats->fsyncs = __atomic_load_n(&stat_fsyncs, __ATOMIC_RELAXED);
+    stats->compactions = __atomic_load_n(&stat_compactions, __ATOMIC_RELAXED);
+    stats->dropped = __atomic_load_n(&stat_dropped, __ATOMIC_RELAXED);
+    stats->write_errors = __atomic_load_n(&stat_write_errors, __ATOMIC_RELAXED);
+    stats->replayed = __atomic_load_n(&stat_replayed, __ATOMIC_RELAXED);
+    stats->truncated_bytes = __atomic_load_n(&stat_truncated, __ATOMIC_RELAXED);
+    stats->replay_seconds = replay_seconds;
+}
@@ -0,0 +1,74 @@
+#ifndef HISTORY_LOG_H
+#define HISTORY_LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HISTORY_LOG_SHARDS 8 // Log files written in parallel; fixed so replay order holds across restarts
+#define HISTORY_LOG_FSYNC_MS_DEFAULT 20 // Group commit interval
+#define HISTORY_LOG_COMPACT_DEFAULT (64UL * 1024 * 1024) // Log bytes per shard before it is folded into a snapshot
+#define HISTORY_LOG_BUFFER_MAX (8UL * 1024 * 1024) // Unwritten bytes per shard before records are dropped
+
+// A durable change to one session's history
+enum HistoryLogType {
+    LOG_APPEND = 1, // role, text = message
+    LOG_CLEAR = 2, // Also written before the first change of a new session, as an evicted one may share its id
+    LOG_SUMMARY = 3, // text = summary, arg = last seq it covers
+    LOG_SESSION = 4, // Snapshot of a session: text = summary, arg = seq of its first message,
+                     // arg2 = summarized_seq; its messages follow as LOG_APPEND records
+};
+
+struct HistoryLogRecord {
+    int type; // enum HistoryLogType
+    int role; // enum ChatRole, for LOG_APPEND
+    uint64_t seq; // Global order of the change, assigned by history_log_append
+    uint64_t arg; // See enum HistoryLogType
+    uint64_t arg2;
+    const char *id; // Session id (NUL-terminated)
+    const char *text; // Message or summary (NUL-terminated), "" if none
+    size_t len; // Length of text
+    int from_snapshot; // Replayed from a snapshot, so already in order and not filtered by seq
+};
+
+// Growing byte buffer of encoded records
+struct HistoryLogBuf {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+// Apply one replayed record to the in-memory store. Records of one shard
+// arrive in order; different shards replay in parallel.
+typedef void (*history_log_apply_fn)(const struct HistoryLogRecord *record);
+// Encode the current state of every session in log shard `shard` of `shards`
+// (a LOG_SESSION record and its messages each) into out; 0 if it could not
+typedef int (*history_log_dump_fn)(unsigned shard, unsigned shards, struct HistoryLogBuf *out);
+
+struct HistoryLogStats {
+    int enabled; // Persistence is on
+    unsigned long records; // Records queued since start
+    unsigned long bytes_written; // Bytes written to logs
+    unsigned long fsyncs; // Group commits
+    unsigned long compactions; // Snapshots written
+    unsigned long dropped; // Records lost to a full buffer
+    unsigned long write_errors; // Batches lost to a failed write
+    unsigned long replayed; // Records applied at startup
+    unsigned long truncated_bytes; // Torn or corrupt tail bytes cut at startup
+    double replay_seconds; // Time spent recovering
+};
+
+// Replay dir's snapshots and logs through apply, then start the writer.
+// Changes are durable within fsync_ms; the caller never waits for disk.
+int history_log_open(const char *dir, int fsync_ms, size_t compact_bytes, history_log_apply_fn apply,
+                     history_log_dump_fn dump);
+void history_log_close(); // Function to write and sync what is queued, then stop the writer
+int history_log_enabled(); // Function to check whether changes should be logged
+
+// Queue a record for shard (taken modulo HISTORY_LOG_SHARDS); sets record->seq.
+// Returns 0 when the record was dropped.
+int history_log_append(unsigned shard, struct HistoryLogRecord *record);
+int history_log_encode(struct HistoryLogBuf *out, const struct HistoryLogRecord *record); // Function to append one encoded record
+
+void history_log_get_stats(struct HistoryLogStats *stats); // Function to read persistence counters
+
+#endif
@@ -0,0 +1,155 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include "http_pool.h"
+
+// Pool of reusable easy handles. Every handle is attached to one curl_share
+// object, so DNS results, TLS sessions and open connections survive between
+// chat turns instead of being rebuilt by curl_easy_init on every request.
+static CURL **idle_handles = NULL;
+static int idle_count = 0;
+static int idle_capacity = 0;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static CURLSH *share = NULL;
+static pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];
+
+static unsigned long handles_created = 0;
+static unsigned long handles_reused = 0;
+
+// curl_global_init loads the TLS library and its certificates, which takes a
+// while; it runs on the first upstream call, or on http_pool_warm, rather
+// than before the server listens
+static pthread_once_t setup_once = PTHREAD_ONCE_INIT;
+static int setup_done = 0; // Written inside setup_once
+static int max_idle_handles = HTTP_POOL_MAX_IDLE;
+static uint64_t setup_ns = 0;
+
+static void share_lock(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr) {
+    (void)handle;
+    (void)access;
+    (void)userptr;
+    pthread_mutex_lock(&share_locks[data]);
+}
+
+static void share_unlock(CURL *handle, curl_lock_data data, void *userptr) {
+    (void)handle;
+    (void)userptr;
+    pthread_mutex_unlock(&share_locks[data]);
+}
+
+void http_pool_init(int max_idle) {
+    max_idle_handles = max_idle < 1 ? HTTP_POOL_MAX_IDLE : max_idle;
+}
+
+static void setup() {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    curl_global_init(CURL_GLOBAL_ALL);
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+        pthread_mutex_init(&share_locks[i], NULL);
+    }
+
+    share = curl_share_init();
+    if (share) {
+        curl_share_setopt(share, CURLSHOPT_LOCKFUNC, share_lock);
+        curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    idle_handles = calloc(max_idle_handles, sizeof(CURL *));
+    idle_capacity = idle_handles ? max_idle_handles : 0;
+    idle_count = 0;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    setup_ns = (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000ULL + (uint64_t)end.tv_nsec - (uint64_t)start.tv_nsec;
+    pthread_mutex_unlock(&pool_lock);
+    setup_done = 1;
+}
+
+void http_pool_warm() {
+    pthread_once(&setup_once, setup);
+}
+
+void http_pool_cleanup() {
+    if (!setup_done) return; // No upstream call was ever made
+    pthread_mutex_lock(&pool_lock);
+    for (int i = 0; i < idle_count; i++) {
+        curl_easy_cleanup(idle_handles[i]);
+    }
+    free(idle_handles);
+    idle_handles = NULL;
+    idle_count = idle_capacity = 0;
+    pthread_mutex_unlock(&pool_lock);
+
+    if (share) {
+        curl_share_cleanup(share);
+        share = NULL;
+    }
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+        pthread_mutex_destroy(&share_locks[i]);
+    }
+    curl_global_cleanup();
+}
+
+// Options every upstream request gets, reapplied after curl_easy_reset
+static void apply_defaults(CURL *curl) {
+    if (share) curl_easy_setopt(curl, CURLOPT_SHARE, share);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L); // Required when used from several threads
+    curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+    curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L); // Prefer multiplexing on an existing h2 connection
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPIDLE, 60L);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPINTVL, 30L);
+    curl_easy_setopt(curl, CURLOPT_DNS_CACHE_TIMEOUT, 300L);
+}
+
+CURL* http_pool_acquire() {
+    CURL *curl = NULL;
+    pthread_once(&setup_once, setup);
+
+    pthread_mutex_lock(&pool_lock);
+    if (idle_count > 0) {
+        curl = idle_handles[--idle_count];
+        handles_reused++;
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    if (curl) {
+        curl_easy_reset(curl); // Keeps the handle's live connections and caches
+    } else {
+        curl = curl_easy_init();
+        if (!curl) return NULL;
+        pthread_mutex_lock(&pool_lock);
+        handles_created++;
+        pthread_mutex_unlock(&pool_lock);
+    }
+
+    apply_defaults(curl);
+    return curl;
+}
+
+void http_pool_release(CURL *curl) {
+    if (!curl) return;
+
+    pthread_mutex_lock(&pool_lock);
+    if (idle_count < idle_capacity) {
+        idle_handles[idle_count++] = curl;
+        curl = NULL;
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    if (curl) curl_easy_cleanup(curl); // Pool is full
+}
+
+void http_pool_get_stats(struct HttpPoolStats *stats) {
+    pthread_mutex_lock(&pool_lock);
+    stats->handles_created = handles_created;
+    stats->handles_reused = handles_reused;
+    stats->handles_idle = (unsigned long)idle_count;
+    stats->setup_ms = (double)setup_ns / 1e6;
+    pthread_mutex_unlock(&pool_lock);
+}
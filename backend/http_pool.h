@@ -0,0 +1,23 @@
+#ifndef HTTP_POOL_H
+#define HTTP_POOL_H
+
+#include <curl/curl.h>
+
+#define HTTP_POOL_MAX_IDLE 32 // Default number of idle handles kept around
+
+// Counters for the upstream handle pool
+struct HttpPoolStats {
+    unsigned long handles_created; // Handles created with curl_easy_init
+    unsigned long handles_reused; // Handles taken from the idle pool
+    unsigned long handles_idle; // Handles currently parked in the pool
+    double setup_ms; // Time curl and TLS setup took, 0 until the first call or http_pool_warm
+};
+
+void http_pool_init(int max_idle); // Function to size the pool; curl and TLS are set up on first use
+void http_pool_warm(); // Function to set up curl, TLS and the shared cache now instead of on first use
+void http_pool_cleanup(); // Function to free pooled handles and the shared cache, and clean up curl
+CURL* http_pool_acquire(); // Function to take a handle (reset, with shared defaults applied)
+void http_pool_release(CURL *curl); // Function to return a handle to the pool
+void http_pool_get_stats(struct HttpPoolStats *stats); // Function to read the pool counters
+
+#endif
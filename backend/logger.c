@@ -0,0 +1,474 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/random.h>
+#include "logger.h"
+
+#define RING_MASK ((uint64_t)LOG_RING_BYTES - 1)
+
+enum RecordKind {
+    RECORD_SKIP = 0, // Filler up to the end of the buffer
+    RECORD_LINE,
+    RECORD_PAYLOAD,
+    RECORD_SPAN
+};
+
+// Fixed head of a record; lines and payloads are followed by their text
+struct LogRecord {
+    uint32_t size; // Bytes of the record, rounded up to 8
+    uint8_t kind; // enum RecordKind
+    uint8_t level;
+    uint16_t reserved;
+    uint32_t text_len;
+    uint32_t total; // RECORD_PAYLOAD: bytes before truncation
+    const char *event; // A string literal
+    uint64_t time_ns; // Wall clock for lines, monotonic start for spans
+    uint64_t dur_ns; // RECORD_SPAN
+    uint64_t request_id;
+};
+
+// Single-producer, single-consumer buffer: the owning thread advances head,
+// the writer advances tail. Positions only grow; records never straddle the end.
+struct LogRing {
+    uint64_t head;
+    char pad_head[56];
+    uint64_t tail;
+    char pad_tail[56];
+    uint64_t dropped; // Written by the owner only
+    uint64_t dropped_seen; // Written by the writer only
+    struct LogRing *next; // Every buffer ever created (registry lock)
+    struct LogRing *next_free; // Buffers of exited threads, reused by new ones
+    char data[LOG_RING_BYTES];
+} __attribute__((aligned(64)));
+
+#define SAMPLED_TRACE 1
+#define SAMPLED_PAYLOAD 2
+
+static struct LogSettings settings = { LOG_OFF, NULL, NULL, 0, 0 };
+static int min_level = LOG_OFF; // Read on every call; LOG_OFF until log_init
+static int tracing = 0;
+static FILE *out = NULL;
+static FILE *trace = NULL;
+static uint64_t trace_epoch = 0; // Spans are timed from here
+static uint64_t id_prefix = 0; // Random high half of minted ids
+static uint32_t id_seq = 0; // Atomic
+static unsigned long lines_written = 0, spans_written = 0, dropped_total = 0; // Atomic
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct LogRing *rings = NULL;
+static struct LogRing *retired = NULL;
+static pthread_key_t thread_key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static __thread struct LogRing *local = NULL;
+static __thread uint64_t current = 0; // Request this thread works on
+static __thread int current_sampled = 0; // SAMPLED_* bits of current
+
+static pthread_t writer;
+static int writer_running = 0;
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_wake = PTHREAD_COND_INITIALIZER;
+static int stopping = 0; // writer_lock
+static int reopen = 0; // writer_lock; LOG_FILE was rotated
+
+static uint64_t wall_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// A finished thread's buffer goes back to the pool; the writer still drains it
+static void retire_ring(void *ptr) {
+    struct LogRing *ring = (struct LogRing *)ptr;
+    pthread_mutex_lock(&registry_lock);
+    ring->next_free = retired;
+    retired = ring;
+    pthread_mutex_unlock(&registry_lock);
+}
+
+static void make_key() {
+    pthread_key_create(&thread_key, retire_ring);
+}
+
+static struct LogRing* local_ring() {
+    if (local) return local;
+    pthread_once(&key_once, make_key);
+
+    pthread_mutex_lock(&registry_lock);
+    struct LogRing *ring = retired;
+    if (ring) {
+        retired = ring->next_free;
+    } else {
+        ring = aligned_alloc(64, sizeof(struct LogRing));
+        if (ring) {
+            memset(ring, 0, offsetof(struct LogRing, data));
+            ring->next = rings;
+            rings = ring;
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+
+    if (ring) pthread_setspecific(thread_key, ring);
+    local = ring;
+    return ring;
+}
+
+// Room for a record of size bytes at the head, or NULL (counted) when the
+// writer is too far behind. Filler is published at once if the record has to
+// start over at the beginning.
+static struct LogRecord* reserve(struct LogRing *ring, size_t size) {
+    uint64_t head = ring->head;
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    size_t to_end = LOG_RING_BYTES - (size_t)(head & RING_MASK);
+    size_t skip = to_end < size ? to_end : 0;
+    if (LOG_RING_BYTES - (head - tail) < skip + size) {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        metrics_add(M_LOG_DROPPED, 1);
+        return NULL;
+    }
+    if (skip) {
+        struct LogRecord *filler = (struct LogRecord *)(ring->data + (head & RING_MASK));
+        filler->size = (uint32_t)skip;
+        filler->kind = RECORD_SKIP;
+        head += skip;
+        __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+    }
+    return (struct LogRecord *)(ring->data + (head & RING_MASK));
+}
+
+// Publish a record; the writer is woken early when this buffer passes half full
+static void commit(struct LogRing *ring, struct LogRecord *record, size_t size) {
+    record->size = (uint32_t)((size + 7) & ~(size_t)7);
+    uint64_t head = ring->head + record->size;
+    __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+    uint64_t used = head - __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    if (used >= LOG_RING_BYTES / 2 && used - record->size < LOG_RING_BYTES / 2) pthread_cond_signal(&writer_wake);
+}
+
+int log_level_parse(const char *name) {
+    static const char *names[] = { "debug", "info", "warn", "error", "off" };
+    if (!name || !name[0]) return LOG_INFO;
+    for (int i = 0; i <= LOG_OFF; i++) {
+        if (strcmp(name, names[i]) == 0) return i;
+    }
+    return -1;
+}
+
+const char* log_level_name(int level) {
+    static const char *names[] = { "debug", "info", "warn", "error", "off" };
+    return level >= LOG_DEBUG && level <= LOG_OFF ? names[level] : "off";
+}
+
+int log_enabled(int level) {
+    return level >= __atomic_load_n(&min_level, __ATOMIC_RELAXED);
+}
+
+void log_msg(int level, const char *event, const char *fmt, ...) {
+    if (!log_enabled(level)) return;
+    struct LogRing *ring = local_ring();
+    if (!ring) return;
+    struct LogRecord *record = reserve(ring, sizeof(struct LogRecord) + LOG_MESSAGE_MAX);
+    if (!record) return;
+
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf((char *)(record + 1), LOG_MESSAGE_MAX, fmt, args);
+    va_end(args);
+    if (len < 0) len = 0;
+    if (len >= LOG_MESSAGE_MAX) len = LOG_MESSAGE_MAX - 1;
+    record->kind = RECORD_LINE;
+    record->level = (uint8_t)level;
+    record->text_len = (uint32_t)len;
+    record->total = (uint32_t)len;
+    record->event = event;
+    record->time_ns = wall_ns();
+    record->dur_ns = 0;
+    record->request_id = current;
+    commit(ring, record, sizeof(struct LogRecord) + (size_t)len);
+}
+
+// Mix of a request id, uniform enough to compare against a sampling rate
+static uint64_t mix(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+static int sampled(uint64_t bits, double rate) {
+    if (rate >= 1.0) return 1;
+    return rate > 0.0 && (double)(bits >> 11) * (1.0 / 9007199254740992.0) < rate;
+}
+
+uint64_t log_request_id(const char *header) {
+    if (header) {
+        uint64_t id = 0;
+        size_t len = 0;
+        for (; header[len] && len < LOG_REQUEST_ID_LEN; len++) {
+            char c = header[len];
+            int digit = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 :
+                        c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+            if (digit < 0) break;
+            id = id << 4 | (uint64_t)digit;
+        }
+        if (len > 0 && !header[len] && id) return id; // Anything else is ignored
+    }
+    // The low half numbers requests in order, so each gets its own trace track
+    uint32_t seq = __atomic_add_fetch(&id_seq, 1, __ATOMIC_RELAXED);
+    return id_prefix << 32 | (seq ? seq : __atomic_add_fetch(&id_seq, 1, __ATOMIC_RELAXED));
+}
+
+void log_format_request_id(uint64_t id, char out_id[LOG_REQUEST_ID_LEN + 1]) {
+    snprintf(out_id, LOG_REQUEST_ID_LEN + 1, "%016llx", (unsigned long long)id);
+}
+
+void log_set_request(uint64_t id) {
+    current = id;
+    current_sampled = 0;
+    if (!id) return;
+    uint64_t bits = mix(id);
+    if (__atomic_load_n(&tracing, __ATOMIC_RELAXED) && sampled(bits, settings.trace_sample)) current_sampled |= SAMPLED_TRACE;
+    if (sampled(mix(bits), settings.payload_sample)) current_sampled |= SAMPLED_PAYLOAD;
+}
+
+uint64_t log_request() { return current; }
+
+void log_span(enum MetricHistogram stage, uint64_t start_ns, uint64_t ns) {
+    if (!(current_sampled & SAMPLED_TRACE) || !__atomic_load_n(&tracing, __ATOMIC_RELAXED)) return;
+    struct LogRing *ring = local_ring();
+    struct LogRecord *record = ring ? reserve(ring, sizeof(struct LogRecord)) : NULL;
+    if (!record) return;
+    record->kind = RECORD_SPAN;
+    record->level = LOG_DEBUG;
+    record->text_len = 0;
+    record->total = 0;
+    record->event = metrics_stage_name(stage);
+    record->time_ns = start_ns;
+    record->dur_ns = ns;
+    record->request_id = current;
+    commit(ring, record, sizeof(struct LogRecord));
+}
+
+int log_payload_sampled() {
+    return (current_sampled & SAMPLED_PAYLOAD) && log_enabled(LOG_DEBUG);
+}
+
+void log_payload(const char *event, const char *data, size_t len, size_t total) {
+    if (!log_payload_sampled()) return;
+    if (len > LOG_PAYLOAD_MAX) len = LOG_PAYLOAD_MAX;
+    struct LogRing *ring = local_ring();
+    struct LogRecord *record = ring ? reserve(ring, sizeof(struct LogRecord) + len) : NULL;
+    if (!record) return;
+    memcpy(record + 1, data, len);
+    record->kind = RECORD_PAYLOAD;
+    record->level = LOG_DEBUG;
+    record->text_len = (uint32_t)len;
+    record->total = total > UINT32_MAX ? UINT32_MAX : (uint32_t)total;
+    record->event = event;
+    record->time_ns = wall_ns();
+    record->dur_ns = 0;
+    record->request_id = current;
+    commit(ring, record, sizeof(struct LogRecord) + len);
+}
+
+// Writer side: everything below runs on the writer thread only
+
+static void write_json_string(FILE *f, const char *text, size_t len) {
+    size_t run = 0; // Bytes written as they are
+    putc('"', f);
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)text[i];
+        if (c >= 0x20 && c != '"' && c != '\\') continue;
+        fwrite(text + run, 1, i - run, f);
+        run = i + 1;
+        if (c == '"' || c == '\\') {
+            putc('\\', f);
+            putc(c, f);
+        } else if (c == '\n') {
+            fputs("\\n", f);
+        } else {
+            fprintf(f, "\\u%04x", c);
+        }
+    }
+    fwrite(text + run, 1, len - run, f);
+    putc('"', f);
+}
+
+static void write_line(const struct LogRecord *record, const char *text) {
+    char stamp[32];
+    time_t seconds = (time_t)(record->time_ns / 1000000000ULL);
+    struct tm tm;
+    gmtime_r(&seconds, &tm);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+    fprintf(out, "{\"ts\":\"%s.%03uZ\",\"level\":\"%s\",\"event\":\"%s\"", stamp,
+            (unsigned)(record->time_ns / 1000000ULL % 1000), log_level_name(record->level), record->event);
+    if (record->request_id) fprintf(out, ",\"request_id\":\"%016llx\"", (unsigned long long)record->request_id);
+    if (record->kind == RECORD_PAYLOAD) {
+        fprintf(out, ",\"bytes\":%u,\"truncated\":%s,\"payload\":", record->total,
+                record->text_len < record->total ? "true" : "false");
+    } else {
+        fputs(",\"msg\":", out);
+    }
+    write_json_string(out, text, record->text_len);
+    fputs("}\n", out);
+    __atomic_add_fetch(&lines_written, 1, __ATOMIC_RELAXED);
+}
+
+// A complete event in the Chrome trace format; each request is a track of its
+// own, so its stages nest under chat_total
+static void write_span(const struct LogRecord *record) {
+    uint64_t start = record->time_ns > trace_epoch ? record->time_ns - trace_epoch : 0;
+    fprintf(trace, "%s{\"name\":\"%s\",\"cat\":\"chat\",\"ph\":\"X\",\"ts\":%llu.%03u,\"dur\":%llu.%03u,"
+                   "\"pid\":1,\"tid\":%u,\"args\":{\"request_id\":\"%016llx\"}}",
+            spans_written ? ",\n" : "", record->event,
+            (unsigned long long)(start / 1000), (unsigned)(start % 1000),
+            (unsigned long long)(record->dur_ns / 1000), (unsigned)(record->dur_ns % 1000),
+            (unsigned)(record->request_id & 0xffffffffu), (unsigned long long)record->request_id);
+    __atomic_add_fetch(&spans_written, 1, __ATOMIC_RELAXED);
+}
+
+// Write out every buffered record; lines of one thread keep their order
+static int drain() {
+    pthread_mutex_lock(&registry_lock);
+    struct LogRing *first = rings; // Buffers are only ever prepended
+    pthread_mutex_unlock(&registry_lock);
+
+    int wrote = 0;
+    for (struct LogRing *ring = first; ring; ring = ring->next) {
+        uint64_t tail = ring->tail;
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        while (tail != head) {
+            const struct LogRecord *record = (const struct LogRecord *)(ring->data + (tail & RING_MASK));
+            if (record->kind == RECORD_SPAN) {
+                if (trace) write_span(record);
+            } else if (record->kind != RECORD_SKIP) {
+                write_line(record, (const char *)(record + 1));
+            }
+            tail += record->size;
+            wrote = 1;
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+        uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        if (dropped != ring->dropped_seen) {
+            __atomic_add_fetch(&dropped_total, dropped - ring->dropped_seen, __ATOMIC_RELAXED);
+            if (log_enabled(LOG_WARN)) {
+                char text[64];
+                struct LogRecord note = { 0, RECORD_LINE, LOG_WARN, 0, 0, 0, "log_dropped", wall_ns(), 0, 0 };
+                note.text_len = (uint32_t)snprintf(text, sizeof(text), "%llu records lost to a full buffer",
+                                                   (unsigned long long)(dropped - ring->dropped_seen));
+                write_line(&note, text);
+            }
+            ring->dropped_seen = dropped;
+            wrote = 1;
+        }
+    }
+    if (wrote) {
+        fflush(out);
+        if (trace) fflush(trace);
+    }
+    return wrote;
+}
+
+// Follow a rotated LOG_FILE; lines buffered so far went to the old file
+static void reopen_output() {
+    if (out == stdout) return;
+    FILE *f = fopen(settings.file, "a");
+    if (!f) return; // Keep writing where we were
+    fclose(out);
+    out = f;
+}
+
+static void* writer_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&writer_lock);
+    while (!stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += LOG_FLUSH_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&writer_wake, &writer_lock, &deadline);
+        int rotated = reopen;
+        reopen = 0;
+        pthread_mutex_unlock(&writer_lock);
+        drain();
+        if (rotated) reopen_output();
+        pthread_mutex_lock(&writer_lock);
+    }
+    pthread_mutex_unlock(&writer_lock);
+    drain();
+    return NULL;
+}
+
+int log_init(const struct LogSettings *s) {
+    if (s->level < LOG_DEBUG || s->level > LOG_OFF || s->trace_sample < 0 || s->trace_sample > 1 ||
+        s->payload_sample < 0 || s->payload_sample > 1) {
+        return 0;
+    }
+    out = stdout;
+    if (s->file && s->file[0] && strcmp(s->file, "-") != 0 && !(out = fopen(s->file, "a"))) {
+        out = stdout;
+        return 0;
+    }
+    if (s->trace_file && s->trace_file[0]) {
+        // An array left open is still loadable; a clean shutdown closes it
+        trace = fopen(s->trace_file, "w");
+        if (!trace) return 0;
+        fputs("[\n", trace);
+    }
+
+    uint32_t prefix;
+    if (getrandom(&prefix, sizeof(prefix), 0) != (ssize_t)sizeof(prefix)) prefix = (uint32_t)wall_ns();
+    id_prefix = prefix;
+    trace_epoch = metrics_now_ns();
+    settings = *s;
+    tracing = trace != NULL;
+    stopping = 0;
+    if (pthread_create(&writer, NULL, writer_main, NULL) != 0) return 0;
+    writer_running = 1;
+    __atomic_store_n(&min_level, s->level, __ATOMIC_RELAXED);
+    return 1;
+}
+
+void log_cleanup() {
+    if (!writer_running) return;
+    // Refuse new records first so the writer's final drain sees every one accepted
+    __atomic_store_n(&min_level, LOG_OFF, __ATOMIC_RELAXED);
+    __atomic_store_n(&tracing, 0, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&writer_lock);
+    stopping = 1;
+    pthread_cond_signal(&writer_wake);
+    pthread_mutex_unlock(&writer_lock);
+    pthread_join(writer, NULL); // Drains once more on the way out
+    writer_running = 0;
+
+    if (trace) {
+        fputs("\n]\n", trace);
+        fclose(trace);
+        trace = NULL;
+    }
+    if (out && out != stdout) fclose(out);
+    out = stdout;
+}
+
+void log_reopen() {
+    pthread_mutex_lock(&writer_lock);
+    reopen = 1;
+    pthread_cond_signal(&writer_wake);
+    pthread_mutex_unlock(&writer_lock);
+}
+
+void log_get_stats(struct LogStats *stats) {
+    stats->level = __atomic_load_n(&min_level, __ATOMIC_RELAXED);
+    stats->tracing = tracing;
+    stats->trace_sample = settings.trace_sample;
+    stats->payload_sample = settings.payload_sample;
+    stats->lines = __atomic_load_n(&lines_written, __ATOMIC_RELAXED);
+    stats->spans = __atomic_load_n(&spans_written, __ATOMIC_RELAXED);
+    stats->dropped = __atomic_load_n(&dropped_total, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,71 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "metrics.h"
+
+#define LOG_RING_BYTES (256 * 1024) // Per-thread buffer of records waiting for the writer (a power of two)
+#define LOG_MESSAGE_MAX 1024 // Bytes of a formatted message
+#define LOG_PAYLOAD_MAX (16 * 1024) // Bytes of a sampled payload dump
+#define LOG_FLUSH_MS 20 // How often the writer drains the buffers
+#define LOG_REQUEST_ID_LEN 16 // Hex digits of a request id
+
+enum LogLevel {
+    LOG_DEBUG = 0, // Sampled payload dumps
+    LOG_INFO, // One line per chat and lifecycle events
+    LOG_WARN, // Failed chats and dropped records
+    LOG_ERROR,
+    LOG_OFF
+};
+
+struct LogSettings {
+    int level; // enum LogLevel; lines below it are not formatted at all
+    const char *file; // Where JSON lines go, NULL or "-" for stdout
+    const char *trace_file; // Chrome trace event file for stage spans, NULL for none
+    double trace_sample; // Share of requests whose spans are recorded
+    double payload_sample; // Share of requests whose upstream payloads are dumped at LOG_DEBUG
+};
+
+struct LogStats {
+    int level; // enum LogLevel
+    int tracing;
+    double trace_sample;
+    double payload_sample;
+    unsigned long lines; // Lines written
+    unsigned long spans; // Trace events written
+    unsigned long dropped; // Records lost to full buffers
+};
+
+// Records are copied into a buffer owned by the calling thread, with no lock
+// or shared write, and a background thread formats and writes them. A full
+// buffer drops the record and counts it; callers never wait on I/O.
+int log_init(const struct LogSettings *settings); // Function to open the outputs and start the writer; 0 on failure
+void log_cleanup(); // Function to write what is buffered and stop the writer
+void log_reopen(); // Function to have the writer reopen LOG_FILE after it was rotated
+int log_level_parse(const char *name); // Function to map "debug", "info", "warn", "error" or "off" to an enum LogLevel, -1 if unknown
+const char* log_level_name(int level); // Function to name an enum LogLevel
+int log_enabled(int level); // Function to check whether lines of a level are kept
+
+// Function to write a line {ts, level, event, request_id, msg}; event must be
+// a string literal, the message is formatted on the calling thread
+void log_msg(int level, const char *event, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+
+// Requests: an id is minted at the HTTP entry, or taken from a client's
+// X-Request-Id of up to 16 hex digits, and set on each thread that works on
+// the request so lines and spans below carry it. Sampling is decided by the
+// id, so every thread agrees on it.
+uint64_t log_request_id(const char *header); // Function to parse or mint a request id (never 0)
+void log_format_request_id(uint64_t id, char out[LOG_REQUEST_ID_LEN + 1]); // Function to print an id as hex
+void log_set_request(uint64_t id); // Function to attach this thread's work to a request (0 for none)
+uint64_t log_request(); // Function to get the request this thread works on
+
+void log_span(enum MetricHistogram stage, uint64_t start_ns, uint64_t ns); // Function to record a stage of the current request
+int log_payload_sampled(); // Function to check whether the current request's payloads are dumped
+// Function to dump a payload of the current request; total is its size before
+// the caller cut it to len (at most LOG_PAYLOAD_MAX bytes are kept)
+void log_payload(const char *event, const char *data, size_t len, size_t total);
+
+void log_get_stats(struct LogStats *stats); // Function to read the writer's counters
+
+#endif
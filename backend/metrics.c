@@ -0,0 +1,248 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "metrics.h"
+
+// Counters and histograms owned by one thread. Only the owner writes, so an
+// update is a relaxed load and store with no lock prefix or shared cache line;
+// scrapes sum every block with relaxed loads.
+struct MetricsThread {
+    uint64_t counters[M_COUNTER_COUNT];
+    uint64_t buckets[H_COUNT][METRICS_BUCKETS];
+    uint64_t sums[H_COUNT]; // Total nanoseconds per histogram
+    struct MetricsThread *next; // Every block ever created (registry lock)
+    struct MetricsThread *next_free; // Blocks of exited threads, reused by new ones
+} __attribute__((aligned(64)));
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct MetricsThread *threads = NULL;
+static struct MetricsThread *retired = NULL;
+static pthread_key_t thread_key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static __thread struct MetricsThread *local = NULL;
+
+// Exposition names; members of one family are adjacent in the enum
+static const struct {
+    const char *family;
+    const char *labels;
+    const char *help;
+} counter_info[M_COUNTER_COUNT] = {
+    [M_CHAT_REQUESTS] = { "gemini_chat_requests_total", "mode=\"json\"", "Chat requests by reply mode" },
+    [M_CHAT_STREAMS] = { "gemini_chat_requests_total", "mode=\"stream\"", "Chat requests by reply mode" },
+    [M_BYTES_IN] = { "gemini_chat_bytes_received_total", NULL, "Request body bytes received" },
+    [M_BYTES_OUT] = { "gemini_chat_bytes_sent_total", NULL, "Response body bytes queued" },
+    [M_BODIES_TOO_LARGE] = { "gemini_chat_rejected_bodies_total", "reason=\"too_large\"", "Request bodies refused by reason" },
+    [M_BODIES_INVALID] = { "gemini_chat_rejected_bodies_total", "reason=\"invalid\"", "Request bodies refused by reason" },
+    [M_RATE_CLIENT_REQUESTS] = { "gemini_chat_rate_limited_total", "reason=\"client_requests\"", "Admissions refused by rate limits" },
+    [M_RATE_CLIENT_TOKENS] = { "gemini_chat_rate_limited_total", "reason=\"client_tokens\"", "Admissions refused by rate limits" },
+    [M_RATE_GLOBAL_REQUESTS] = { "gemini_chat_rate_limited_total", "reason=\"global_requests\"", "Admissions refused by rate limits" },
+    [M_RATE_GLOBAL_TOKENS] = { "gemini_chat_rate_limited_total", "reason=\"global_tokens\"", "Admissions refused by rate limits" },
+    [M_RATE_BULK_DEFERRED] = { "gemini_chat_rate_bulk_deferred_total", NULL, "Batch item admissions held back by rate limits" },
+    [M_COMPRESSED_RESPONSES] = { "gemini_chat_compressed_responses_total", NULL, "Dynamic responses sent gzip or deflate encoded" },
+    [M_COMPRESS_BYTES_RAW] = { "gemini_chat_compression_bytes_total", "side=\"raw\"", "Bytes into and out of response compression" },
+    [M_COMPRESS_BYTES_ENCODED] = { "gemini_chat_compression_bytes_total", "side=\"encoded\"", "Bytes into and out of response compression" },
+    [M_UPSTREAM_REQUESTS] = { "gemini_chat_upstream_requests_total", NULL, "Calls made to the Gemini API" },
+    [M_UPSTREAM_BYTES_OUT] = { "gemini_chat_upstream_bytes_sent_total", NULL, "Payload bytes sent upstream" },
+    [M_UPSTREAM_BYTES_IN] = { "gemini_chat_upstream_bytes_received_total", NULL, "Bytes received from upstream" },
+    [M_COALESCE_LEADERS] = { "gemini_chat_coalesced_requests_total", "role=\"leader\"", "Requests by role in single-flight coalescing" },
+    [M_COALESCE_FOLLOWERS] = { "gemini_chat_coalesced_requests_total", "role=\"follower\"", "Requests by role in single-flight coalescing" },
+    [M_TOKENS_PROMPT] = { "gemini_chat_tokens_total", "kind=\"prompt\"", "Token usage reported by upstream" },
+    [M_TOKENS_CANDIDATE] = { "gemini_chat_tokens_total", "kind=\"candidate\"", "Token usage reported by upstream" },
+    [M_TOKENS_TOTAL] = { "gemini_chat_tokens_total", "kind=\"total\"", "Token usage reported by upstream" },
+    [M_TOKENS_CACHED] = { "gemini_chat_tokens_total", "kind=\"cached\"", "Token usage reported by upstream" },
+    [M_CONTEXT_CACHE_HITS] = { "gemini_chat_context_cache_total", "result=\"hit\"", "Upstream context cache use by result" },
+    [M_CONTEXT_CACHE_CREATES] = { "gemini_chat_context_cache_total", "result=\"created\"", "Upstream context cache use by result" },
+    [M_CONTEXT_CACHE_FAILURES] = { "gemini_chat_context_cache_total", "result=\"failed\"", "Upstream context cache use by result" },
+    [M_SUMMARIES] = { "gemini_chat_summaries_total", "result=\"ok\"", "Background history summaries by result" },
+    [M_SUMMARY_FAILURES] = { "gemini_chat_summaries_total", "result=\"failed\"", "Background history summaries by result" },
+    [M_RAG_QUERIES] = { "gemini_chat_retrieval_queries_total", NULL, "Prompts searched for retrieved context" },
+    [M_RAG_SNIPPETS] = { "gemini_chat_retrieval_snippets_total", NULL, "Retrieved snippets added to prompts" },
+    [M_RAG_TOKENS] = { "gemini_chat_retrieval_tokens_total", NULL, "Estimated tokens of retrieved context added to prompts" },
+    [M_RAG_EMBED_FAILURES] = { "gemini_chat_retrieval_embed_failures_total", NULL, "Texts that could not be embedded" },
+    [M_UPSTREAM_RETRIES] = { "gemini_chat_upstream_retries_total", NULL, "Upstream attempts after a transient failure" },
+    [M_UPSTREAM_HEDGES] = { "gemini_chat_upstream_hedges_total", "result=\"sent\"", "Hedged upstream calls by result" },
+    [M_UPSTREAM_HEDGE_WINS] = { "gemini_chat_upstream_hedges_total", "result=\"won\"", "Hedged upstream calls by result" },
+    [M_ERRORS_TRANSPORT] = { "gemini_chat_errors_total", "class=\"transport\"", "Failed chats by error class" },
+    [M_ERRORS_API] = { "gemini_chat_errors_total", "class=\"api\"", "Failed chats by error class" },
+    [M_ERRORS_PARSE] = { "gemini_chat_errors_total", "class=\"parse\"", "Failed chats by error class" },
+    [M_ERRORS_BLOCKED] = { "gemini_chat_errors_total", "class=\"blocked\"", "Failed chats by error class" },
+    [M_ERRORS_OVERLOAD] = { "gemini_chat_errors_total", "class=\"overload\"", "Failed chats by error class" },
+    [M_ERRORS_TIMEOUT] = { "gemini_chat_errors_total", "class=\"timeout\"", "Failed chats by error class" },
+    [M_ERRORS_RATE_LIMITED] = { "gemini_chat_errors_total", "class=\"rate_limited\"", "Failed chats by error class" },
+    [M_ERRORS_CIRCUIT_OPEN] = { "gemini_chat_errors_total", "class=\"circuit_open\"", "Failed chats by error class" },
+    [M_ERRORS_THROTTLED] = { "gemini_chat_errors_total", "class=\"throttled\"", "Failed chats by error class" },
+    [M_LOG_DROPPED] = { "gemini_chat_log_dropped_total", NULL, "Log records lost to a full buffer" },
+};
+
+static const char *histogram_stage[H_COUNT] = {
+    [H_REQUEST_PARSE] = "request_parse",
+    [H_PAYLOAD_BUILD] = "payload_build",
+    [H_RAG_EMBED] = "retrieval_embed",
+    [H_RAG_SEARCH] = "retrieval_search",
+    [H_UPSTREAM_CONNECT] = "upstream_connect",
+    [H_UPSTREAM_TLS] = "upstream_tls",
+    [H_UPSTREAM_TTFB] = "upstream_ttfb",
+    [H_UPSTREAM_TOTAL] = "upstream_total",
+    [H_RESPONSE_PARSE] = "response_parse",
+    [H_CHAT_TOTAL] = "chat_total",
+};
+
+const char* metrics_stage_name(enum MetricHistogram histogram) { return histogram_stage[histogram]; }
+
+uint64_t metrics_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// A finished thread's block goes back to the pool; its counts stay in the totals
+static void retire_block(void *ptr) {
+    struct MetricsThread *block = (struct MetricsThread *)ptr;
+    pthread_mutex_lock(&registry_lock);
+    block->next_free = retired;
+    retired = block;
+    pthread_mutex_unlock(&registry_lock);
+}
+
+static void make_key() {
+    pthread_key_create(&thread_key, retire_block);
+}
+
+static struct MetricsThread* local_block() {
+    if (local) return local;
+    pthread_once(&key_once, make_key);
+
+    pthread_mutex_lock(&registry_lock);
+    struct MetricsThread *block = retired;
+    if (block) {
+        retired = block->next_free;
+    } else {
+        block = aligned_alloc(64, sizeof(struct MetricsThread));
+        if (block) {
+            memset(block, 0, sizeof(*block));
+            block->next = threads;
+            threads = block;
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+
+    if (block) pthread_setspecific(thread_key, block);
+    local = block;
+    return block;
+}
+
+static void bump(uint64_t *slot, uint64_t n) {
+    __atomic_store_n(slot, __atomic_load_n(slot, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+void metrics_add(enum MetricCounter counter, uint64_t n) {
+    struct MetricsThread *block = local_block();
+    if (block) bump(&block->counters[counter], n);
+}
+
+// Log-linear bucket: exact below 8, then 8 sub-buckets per power of two
+static int bucket_index(uint64_t ns) {
+    if (ns < (1u << METRICS_SUB_BITS)) return (int)ns;
+    int exponent = 63 - __builtin_clzll(ns);
+    if (exponent > METRICS_MAX_EXPONENT) return METRICS_BUCKETS - 1;
+    int sub = (int)(ns >> (exponent - METRICS_SUB_BITS)) & ((1 << METRICS_SUB_BITS) - 1);
+    return ((exponent - METRICS_SUB_BITS + 1) << METRICS_SUB_BITS) + sub;
+}
+
+// Smallest value that lands in a bucket
+static uint64_t bucket_lower(int index) {
+    if (index < (1 << METRICS_SUB_BITS)) return (uint64_t)index;
+    int exponent = (index >> METRICS_SUB_BITS) + METRICS_SUB_BITS - 1;
+    uint64_t sub = (uint64_t)(index & ((1 << METRICS_SUB_BITS) - 1));
+    return ((1ULL << METRICS_SUB_BITS) + sub) << (exponent - METRICS_SUB_BITS);
+}
+
+void metrics_observe(enum MetricHistogram histogram, uint64_t ns) {
+    struct MetricsThread *block = local_block();
+    if (!block) return;
+    bump(&block->buckets[histogram][bucket_index(ns)], 1);
+    bump(&block->sums[histogram], ns);
+}
+
+// Value at quantile q, taken as the midpoint of the bucket holding that rank
+static double quantile_seconds(const uint64_t *merged, uint64_t count, double q) {
+    uint64_t rank = (uint64_t)(q * (double)count);
+    if (rank >= count) rank = count - 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < METRICS_BUCKETS; i++) {
+        seen += merged[i];
+        if (seen > rank) {
+            uint64_t lower = bucket_lower(i);
+            uint64_t upper = i + 1 < METRICS_BUCKETS ? bucket_lower(i + 1) : lower;
+            return (double)(lower + upper) / 2.0 / 1e9;
+        }
+    }
+    return 0.0;
+}
+
+void metrics_render(struct ArenaBuf *buf) {
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    uint64_t counters[M_COUNTER_COUNT] = { 0 };
+    uint64_t sums[H_COUNT] = { 0 };
+    uint64_t merged[H_COUNT][METRICS_BUCKETS];
+    memset(merged, 0, sizeof(merged));
+
+    pthread_mutex_lock(&registry_lock);
+    for (struct MetricsThread *block = threads; block; block = block->next) {
+        for (int c = 0; c < M_COUNTER_COUNT; c++) counters[c] += __atomic_load_n(&block->counters[c], __ATOMIC_RELAXED);
+        for (int h = 0; h < H_COUNT; h++) {
+            sums[h] += __atomic_load_n(&block->sums[h], __ATOMIC_RELAXED);
+            for (int i = 0; i < METRICS_BUCKETS; i++) {
+                merged[h][i] += __atomic_load_n(&block->buckets[h][i], __ATOMIC_RELAXED);
+            }
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+
+    for (int c = 0; c < M_COUNTER_COUNT; c++) {
+        if (c == 0 || strcmp(counter_info[c].family, counter_info[c - 1].family) != 0) {
+            arena_buf_printf(buf, "# HELP %s %s\n# TYPE %s counter\n",
+                             counter_info[c].family, counter_info[c].help, counter_info[c].family);
+        }
+        if (counter_info[c].labels) {
+            arena_buf_printf(buf, "%s{%s} %llu\n", counter_info[c].family, counter_info[c].labels,
+                             (unsigned long long)counters[c]);
+        } else {
+            arena_buf_printf(buf, "%s %llu\n", counter_info[c].family, (unsigned long long)counters[c]);
+        }
+    }
+
+    // Prometheus buckets at powers of two from ~1us; the fine buckets feed the quantiles below
+    arena_buf_puts(buf, "# HELP gemini_chat_stage_duration_seconds Latency of each stage of a chat\n"
+                        "# TYPE gemini_chat_stage_duration_seconds histogram\n");
+    uint64_t counts[H_COUNT];
+    for (int h = 0; h < H_COUNT; h++) {
+        uint64_t cumulative = 0;
+        int next = 0;
+        for (int exponent = 10; exponent <= METRICS_MAX_EXPONENT; exponent++) {
+            int limit = bucket_index(1ULL << exponent);
+            while (next < limit) cumulative += merged[h][next++];
+            arena_buf_printf(buf, "gemini_chat_stage_duration_seconds_bucket{stage=\"%s\",le=\"%.9g\"} %llu\n",
+                             histogram_stage[h], (double)(1ULL << exponent) / 1e9, (unsigned long long)cumulative);
+        }
+        while (next < METRICS_BUCKETS) cumulative += merged[h][next++];
+        counts[h] = cumulative;
+        arena_buf_printf(buf, "gemini_chat_stage_duration_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n"
+                              "gemini_chat_stage_duration_seconds_sum{stage=\"%s\"} %.9f\n"
+                              "gemini_chat_stage_duration_seconds_count{stage=\"%s\"} %llu\n",
+                         histogram_stage[h], (unsigned long long)cumulative,
+                         histogram_stage[h], (double)sums[h] / 1e9,
+                         histogram_stage[h], (unsigned long long)cumulative);
+    }
+
+    arena_buf_puts(buf, "# HELP gemini_chat_stage_duration_quantile_seconds Stage latency quantiles since start\n"
+                        "# TYPE gemini_chat_stage_duration_quantile_seconds gauge\n");
+    for (int h = 0; h < H_COUNT; h++) {
+        if (counts[h] == 0) continue;
+        for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+            arena_buf_printf(buf, "gemini_chat_stage_duration_quantile_seconds{stage=\"%s\",quantile=\"%g\"} %.9f\n",
+                             histogram_stage[h], quantiles[q], quantile_seconds(merged[h], counts[h], quantiles[q]));
+        }
+    }
+}
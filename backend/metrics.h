@@ -0,0 +1,82 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include "arena.h"
+
+// Monotonic counters, summed across threads when scraped
+enum MetricCounter {
+    M_CHAT_REQUESTS, // /chat requests answered with JSON
+    M_CHAT_STREAMS, // /chat requests answered with a stream
+    M_BYTES_IN, // Request body bytes received
+    M_BYTES_OUT, // Response body bytes queued
+    M_BODIES_TOO_LARGE, // Requests refused for a body over the limit
+    M_BODIES_INVALID, // Requests refused for a body that is not a JSON object
+    M_RATE_CLIENT_REQUESTS, // Requests refused by a client's request rate (same order as enum RateVerdict)
+    M_RATE_CLIENT_TOKENS, // ... by a client's token quota
+    M_RATE_GLOBAL_REQUESTS, // ... by the global request budget
+    M_RATE_GLOBAL_TOKENS, // ... by the global token budget
+    M_RATE_BULK_DEFERRED, // Batch items held back by a limit, shed before interactive requests
+    M_COMPRESSED_RESPONSES, // Dynamic responses sent gzip or deflate encoded
+    M_COMPRESS_BYTES_RAW, // Body bytes fed to the compressor
+    M_COMPRESS_BYTES_ENCODED, // Bytes it produced
+    M_UPSTREAM_REQUESTS, // Calls made to the Gemini API
+    M_UPSTREAM_BYTES_OUT, // Request payload bytes sent upstream
+    M_UPSTREAM_BYTES_IN, // Response bytes received from upstream
+    M_COALESCE_LEADERS, // Upstream calls other identical requests could join
+    M_COALESCE_FOLLOWERS, // Requests answered by joining an in-flight call
+    M_TOKENS_PROMPT, // usageMetadata.promptTokenCount
+    M_TOKENS_CANDIDATE, // usageMetadata.candidatesTokenCount
+    M_TOKENS_TOTAL, // usageMetadata.totalTokenCount
+    M_TOKENS_CACHED, // usageMetadata.cachedContentTokenCount
+    M_CONTEXT_CACHE_HITS, // Requests that referenced an existing cachedContent
+    M_CONTEXT_CACHE_CREATES, // cachedContents created upstream
+    M_CONTEXT_CACHE_FAILURES, // Creations or references upstream rejected
+    M_SUMMARIES, // Rolling summaries produced for long conversations
+    M_SUMMARY_FAILURES, // Summary calls that failed (older turns are retried later)
+    M_RAG_QUERIES, // Prompts the retrieval stage searched for
+    M_RAG_SNIPPETS, // Retrieved snippets added to prompts
+    M_RAG_TOKENS, // Estimated tokens of those snippets
+    M_RAG_EMBED_FAILURES, // Texts the embedder could not embed (the chat goes on without retrieval)
+    M_UPSTREAM_RETRIES, // Upstream attempts after a transient failure
+    M_UPSTREAM_HEDGES, // Second copies of slow calls sent
+    M_UPSTREAM_HEDGE_WINS, // Second copies that answered first
+    M_ERRORS_TRANSPORT, // curl failures (DNS, connect, TLS, timeout)
+    M_ERRORS_API, // Upstream replied with an error object
+    M_ERRORS_PARSE, // Upstream body could not be parsed
+    M_ERRORS_BLOCKED, // Prompt blocked by upstream safety filters
+    M_ERRORS_OVERLOAD, // Requests rejected because the worker queue was full
+    M_ERRORS_TIMEOUT, // Upstream connect, idle or total timeouts
+    M_ERRORS_RATE_LIMITED, // Upstream answered 429
+    M_ERRORS_CIRCUIT_OPEN, // Calls failed fast while the circuit breaker was open
+    M_ERRORS_THROTTLED, // Calls that found no slot under the adaptive concurrency limit
+    M_LOG_DROPPED, // Log records and spans lost to a full per-thread buffer
+    M_COUNTER_COUNT
+};
+
+// Latency histograms, recorded in nanoseconds
+enum MetricHistogram {
+    H_REQUEST_PARSE, // Parsing the /chat request body
+    H_PAYLOAD_BUILD, // create_json_payload
+    H_RAG_EMBED, // Embedding a prompt for retrieval
+    H_RAG_SEARCH, // Vector index searches for one prompt
+    H_UPSTREAM_CONNECT, // TCP connect (new connections only)
+    H_UPSTREAM_TLS, // TLS handshake (new connections only)
+    H_UPSTREAM_TTFB, // Time to the first upstream response byte
+    H_UPSTREAM_TOTAL, // Whole upstream transfer
+    H_RESPONSE_PARSE, // Scanning the upstream body
+    H_CHAT_TOTAL, // /chat from request arrival to the last byte queued
+    H_COUNT
+};
+
+#define METRICS_SUB_BITS 3 // 8 linear sub-buckets per power of two (~12% precision)
+#define METRICS_MAX_EXPONENT 37 // Largest bucketed value is about 2^38 ns (~270 s)
+#define METRICS_BUCKETS (((METRICS_MAX_EXPONENT - METRICS_SUB_BITS + 2) << METRICS_SUB_BITS))
+
+uint64_t metrics_now_ns(); // Function to read the monotonic clock
+void metrics_add(enum MetricCounter counter, uint64_t n); // Function to bump a counter on this thread
+void metrics_observe(enum MetricHistogram histogram, uint64_t ns); // Function to record a latency on this thread
+void metrics_render(struct ArenaBuf *buf); // Function to append every metric in Prometheus text format
+const char* metrics_stage_name(enum MetricHistogram histogram); // Function to name a stage, as in the stage label
+
+#endif
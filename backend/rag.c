@@ -0,0 +1,424 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "rag.h"
+#include "embedder.h"
+#include "metrics.h"
+#include "logger.h"
+#include "vector_index.h"
+
+#define RAG_HEADING "Context retrieved from earlier in this conversation and from reference documents. " \
+                    "Use it only where it helps with the message after it.\n"
+#define RAG_DOC_FILE_MAX (64UL * 1024 * 1024) // Larger documents are skipped
+#define RAG_INDEX_NAME ".rag-index" // Default index file inside the documents directory
+#define RAG_CHUNK_BYTES 800 // Paragraphs are packed into chunks of about this size
+
+// A hit from either index, best first once sorted
+struct Snippet {
+    float score;
+    const char *text;
+    size_t len;
+};
+
+static int enabled = 0;
+static struct RagSettings settings;
+
+// Ring of answered exchanges across all sessions, tagged with their session;
+// the oldest is overwritten once it is full
+static pthread_rwlock_t message_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct VectorIndex *messages = NULL;
+static char **message_texts = NULL; // Snippet per row, NULL when forgotten
+static uint64_t *message_seqs = NULL; // History position of each row's user message
+static size_t message_next = 0; // Row the next exchange goes into
+static size_t message_live = 0; // Rows holding an exchange
+
+static struct VectorIndex *documents = NULL; // Mapped from the index file, read-only
+
+// Nonzero tag for a session id; rows of forgotten exchanges are tagged 0
+static uint64_t scope_tag(const char *scope) {
+    uint64_t h = 14695981039346656037ULL;
+    for (const char *p = scope; *p; p++) {
+        h ^= (unsigned char)*p;
+        h *= 1099511628211ULL;
+    }
+    return h | 1;
+}
+
+// Longest prefix of at most max bytes that does not split a UTF-8 sequence
+static size_t utf8_cut(const char *text, size_t len, size_t max) {
+    if (len <= max) return len;
+    while (max > 0 && ((unsigned char)text[max] & 0xC0) == 0x80) max--;
+    return max;
+}
+
+// Growing list of document chunks and their embeddings while an index is built
+struct ChunkList {
+    char **texts;
+    float *vectors;
+    size_t count;
+    size_t capacity;
+};
+
+// Embed "[name] text" and add it to the list; a chunk that cannot be embedded is skipped
+static void add_chunk(struct ChunkList *chunks, const char *name, const char *text, size_t len) {
+    if (chunks->count == chunks->capacity) {
+        size_t capacity = chunks->capacity ? chunks->capacity * 2 : 256;
+        char **texts = realloc(chunks->texts, capacity * sizeof(char *));
+        if (texts) chunks->texts = texts;
+        float *vectors = realloc(chunks->vectors, capacity * (size_t)settings.dim * sizeof(float));
+        if (vectors) chunks->vectors = vectors;
+        if (!texts || !vectors) return;
+        chunks->capacity = capacity;
+    }
+    size_t size = strlen(name) + len + 4;
+    char *chunk = malloc(size);
+    if (!chunk) return;
+    snprintf(chunk, size, "[%s] %.*s", name, (int)len, text);
+    if (!embedder_embed(chunk, strlen(chunk), EMBED_DOCUMENT, chunks->vectors + chunks->count * settings.dim)) {
+        metrics_add(M_RAG_EMBED_FAILURES, 1);
+        free(chunk);
+        return;
+    }
+    chunks->texts[chunks->count++] = chunk;
+}
+
+// Pack the blank-line separated paragraphs of a document into chunks of at
+// most RAG_CHUNK_BYTES; a longer paragraph is cut at spaces
+static void chunk_document(struct ChunkList *chunks, const char *name, const char *text, size_t len) {
+    size_t limit = RAG_CHUNK_BYTES;
+    size_t start = 0, end = 0; // Pending chunk [start, end)
+    size_t pos = 0;
+    while (pos < len) {
+        // Next paragraph [pos, stop), trimmed of surrounding blank lines
+        while (pos < len && (text[pos] == '\n' || text[pos] == '\r' || text[pos] == ' ' || text[pos] == '\t')) pos++;
+        if (pos >= len) break;
+        const char *blank = NULL;
+        for (const char *p = text + pos; (p = memchr(p, '\n', len - (size_t)(p - text))) != NULL; p++) {
+            const char *q = p + 1;
+            while (q < text + len && (*q == ' ' || *q == '\t' || *q == '\r')) q++;
+            if (q < text + len && *q == '\n') {
+                blank = p;
+                break;
+            }
+        }
+        size_t stop = blank ? (size_t)(blank - text) : len;
+
+        if (end > start && stop - start > limit) {
+            add_chunk(chunks, name, text + start, end - start);
+            end = start = pos;
+        }
+        if (end == start) start = pos;
+        end = stop;
+        while (end - start > limit) {
+            size_t cut = utf8_cut(text + start, end - start, limit);
+            size_t space = cut;
+            while (space > limit / 2 && text[start + space] != ' ' && text[start + space] != '\n') space--;
+            if (space > limit / 2) cut = space;
+            if (cut == 0) cut = limit; // Not UTF-8; cut anywhere
+            add_chunk(chunks, name, text + start, cut);
+            start += cut;
+            while (start < end && (text[start] == ' ' || text[start] == '\n')) start++;
+        }
+        pos = stop;
+    }
+    if (end > start) add_chunk(chunks, name, text + start, end - start);
+}
+
+static int document_file(const char *name) {
+    size_t len = strlen(name);
+    if (name[0] == '.') return 0;
+    return (len > 4 && strcmp(name + len - 4, ".txt") == 0) || (len > 3 && strcmp(name + len - 3, ".md") == 0);
+}
+
+static char* read_file(const char *path, size_t *len) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return NULL;
+    struct stat st;
+    char *data = NULL;
+    if (fstat(fileno(f), &st) == 0 && (size_t)st.st_size <= RAG_DOC_FILE_MAX) {
+        data = malloc((size_t)st.st_size + 1);
+        if (data && fread(data, 1, (size_t)st.st_size, f) == (size_t)st.st_size) {
+            data[st.st_size] = '\0';
+            *len = (size_t)st.st_size;
+        } else {
+            free(data);
+            data = NULL;
+        }
+    }
+    fclose(f);
+    return data;
+}
+
+// Map the document index, rebuilding it first when a document is newer than
+// the file or it was built by another embedder
+static struct VectorIndex* load_documents(const char *dir, const char *index_path) {
+    DIR *d = opendir(dir);
+    if (!d) {
+        log_msg(LOG_ERROR, "rag_documents", "Could not open RAG_DOCS_DIR %s", dir);
+        return NULL;
+    }
+    char path[4096];
+    struct stat dir_st;
+    time_t newest = stat(dir, &dir_st) == 0 ? dir_st.st_mtime : 0; // Changes when a document is removed
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        if (document_file(entry->d_name) && stat(path, &st) == 0 && S_ISREG(st.st_mode) && st.st_mtime > newest) {
+            newest = st.st_mtime;
+        }
+    }
+
+    struct stat index_st;
+    if (stat(index_path, &index_st) == 0 && index_st.st_mtime >= newest) {
+        struct VectorIndex *index = vector_index_open(index_path, embedder_id());
+        if (index) {
+            closedir(d);
+            return index;
+        }
+    }
+
+    struct ChunkList chunks = { NULL, NULL, 0, 0 };
+    uint64_t start = metrics_now_ns();
+    rewinddir(d);
+    while ((entry = readdir(d)) != NULL) {
+        if (!document_file(entry->d_name)) continue;
+        size_t len = 0;
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        char *text = read_file(path, &len);
+        if (!text) continue;
+        chunk_document(&chunks, entry->d_name, text, len);
+        free(text);
+    }
+    closedir(d);
+
+    struct VectorIndex *index = NULL;
+    if (chunks.count > 0) {
+        // Large corpora are clustered so a query reads about nprobe/sqrt(n) of them
+        int nlist = chunks.count >= RAG_IVF_MIN_ROWS ? (int)sqrt((double)chunks.count) : 0;
+        if (vector_index_write(index_path, settings.dim, chunks.count, chunks.vectors, NULL,
+                               (const char *const *)chunks.texts, nlist, embedder_id())) {
+            index = vector_index_open(index_path, embedder_id());
+        }
+        if (index) {
+            log_msg(LOG_INFO, "rag_indexed", "Indexed %zu chunks from %s in %.1fs", chunks.count, dir,
+                    (metrics_now_ns() - start) / 1e9);
+        } else {
+            log_msg(LOG_ERROR, "rag_index", "Could not write the document index %s", index_path);
+        }
+    }
+    for (size_t i = 0; i < chunks.count; i++) free(chunks.texts[i]);
+    free(chunks.texts);
+    free(chunks.vectors);
+    return index;
+}
+
+int rag_init(const struct RagSettings *options) {
+    rag_cleanup();
+    if (!embedder_init(options->embedder, options->model, options->dim)) return 0;
+    settings = *options;
+    settings.dim = embedder_dim();
+    if (settings.k < 1) settings.k = RAG_K_DEFAULT;
+    if (settings.k > VECTOR_INDEX_K_MAX) settings.k = VECTOR_INDEX_K_MAX;
+    if (settings.token_budget < 1) settings.token_budget = RAG_TOKEN_BUDGET_DEFAULT;
+    if (settings.nprobe < 1) settings.nprobe = VECTOR_INDEX_NPROBE_DEFAULT;
+    if (settings.min_score < 0) settings.min_score = embedder_min_score();
+    settings.docs_dir = settings.index_file = NULL; // Only used below
+
+    if (options->messages > 0) {
+        messages = vector_index_create(settings.dim, options->messages);
+        message_texts = calloc(options->messages, sizeof(char *));
+        message_seqs = calloc(options->messages, sizeof(uint64_t));
+        if (!messages || !message_texts || !message_seqs) {
+            rag_cleanup();
+            return 0;
+        }
+    }
+    if (options->docs_dir && options->docs_dir[0]) {
+        char index_path[4096];
+        if (options->index_file && options->index_file[0]) {
+            snprintf(index_path, sizeof(index_path), "%s", options->index_file);
+        } else {
+            snprintf(index_path, sizeof(index_path), "%s/" RAG_INDEX_NAME, options->docs_dir);
+        }
+        documents = load_documents(options->docs_dir, index_path);
+    }
+    enabled = 1;
+    return 1;
+}
+
+void rag_cleanup() {
+    enabled = 0;
+    pthread_rwlock_wrlock(&message_lock);
+    for (size_t i = 0; messages && message_texts && i < messages->capacity; i++) free(message_texts[i]);
+    free(message_texts);
+    free(message_seqs);
+    vector_index_free(messages);
+    message_texts = NULL;
+    message_seqs = NULL;
+    messages = NULL;
+    message_next = message_live = 0;
+    pthread_rwlock_unlock(&message_lock);
+    vector_index_free(documents);
+    documents = NULL;
+}
+
+int rag_enabled() {
+    return enabled;
+}
+
+size_t rag_token_budget() {
+    return enabled ? (size_t)settings.token_budget : 0;
+}
+
+static int compare_snippets(const void *a, const void *b) {
+    float x = ((const struct Snippet *)a)->score, y = ((const struct Snippet *)b)->score;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+char* rag_augment(struct Arena *arena, const char *scope, const char *input, const struct HistoryWindow *history) {
+    if (!enabled || !input || !input[0] || (!documents && !(scope && messages))) return NULL;
+    metrics_add(M_RAG_QUERIES, 1);
+
+    float *query = malloc((size_t)settings.dim * sizeof(float));
+    uint64_t start = metrics_now_ns();
+    int embedded = query && embedder_embed(input, strlen(input), EMBED_QUERY, query);
+    uint64_t embed_ns = metrics_now_ns() - start;
+    metrics_observe(H_RAG_EMBED, embed_ns);
+    log_span(H_RAG_EMBED, start, embed_ns);
+    if (!embedded) {
+        metrics_add(M_RAG_EMBED_FAILURES, 1);
+        free(query);
+        return NULL;
+    }
+
+    struct Arena scratch;
+    struct Snippet found[2 * VECTOR_INDEX_K_MAX];
+    struct VectorHit hits[VECTOR_INDEX_K_MAX];
+    size_t n = 0;
+    arena_init(&scratch);
+    start = metrics_now_ns();
+    if (scope && messages) {
+        // Exchanges still inside the window are already part of the prompt
+        uint64_t first_seq = history && history->count ? history->last_seq + 1 - history->count : UINT64_MAX;
+        pthread_rwlock_rdlock(&message_lock);
+        size_t count = vector_index_search(messages, query, scope_tag(scope), (size_t)settings.k * 2, 0, hits);
+        for (size_t i = 0; i < count && hits[i].score >= settings.min_score; i++) {
+            const char *text = message_texts[hits[i].row];
+            if (!text || message_seqs[hits[i].row] >= first_seq) continue;
+            found[n].score = hits[i].score;
+            found[n].len = strlen(text);
+            found[n].text = arena_strndup(&scratch, text, found[n].len); // Copied: the ring may overwrite it
+            if (found[n].text) n++;
+        }
+        pthread_rwlock_unlock(&message_lock);
+    }
+    if (documents) {
+        size_t count = vector_index_search(documents, query, 0, (size_t)settings.k, settings.nprobe, hits);
+        for (size_t i = 0; i < count && hits[i].score >= settings.min_score; i++) {
+            found[n].score = hits[i].score;
+            found[n].text = vector_index_text(documents, hits[i].row, &found[n].len);
+            if (found[n].text) n++;
+        }
+    }
+    uint64_t search_ns = metrics_now_ns() - start;
+    metrics_observe(H_RAG_SEARCH, search_ns);
+    log_span(H_RAG_SEARCH, start, search_ns);
+    free(query);
+    qsort(found, n, sizeof(struct Snippet), compare_snippets);
+
+    // Best snippets first while they fit the budget; a long one may leave room for a shorter one
+    struct ArenaBuf buf;
+    size_t added = 0, used = 0, input_len = strlen(input);
+    arena_buf_init(&buf, &scratch, input_len + (size_t)settings.token_budget * 8);
+    arena_buf_puts(&buf, RAG_HEADING);
+    for (size_t i = 0; i < n && added < (size_t)settings.k; i++) {
+        size_t tokens = history_calibrated(history_estimate_tokens(found[i].text, found[i].len));
+        if (used + tokens > (size_t)settings.token_budget) continue;
+        arena_buf_puts(&buf, "---\n");
+        arena_buf_append(&buf, found[i].text, found[i].len);
+        arena_buf_puts(&buf, "\n");
+        used += tokens;
+        added++;
+    }
+    arena_buf_puts(&buf, "---\n\n");
+    arena_buf_append(&buf, input, input_len);
+
+    char *prompt = NULL;
+    if (added && buf.data) {
+        prompt = arena ? arena_strndup(arena, buf.data, buf.len) : strndup(buf.data, buf.len);
+        metrics_add(M_RAG_SNIPPETS, added);
+        metrics_add(M_RAG_TOKENS, used);
+    }
+    arena_free(&scratch);
+    return prompt;
+}
+
+void rag_index_exchange(const char *scope, uint64_t seq, const char *user, const char *reply) {
+    if (!enabled || !messages || !scope) return;
+    size_t size = strlen(user) + strlen(reply) + 32;
+    char *snippet = malloc(size);
+    float *vec = malloc((size_t)settings.dim * sizeof(float));
+    if (!snippet || !vec) {
+        free(snippet);
+        free(vec);
+        return;
+    }
+    // The labels would only make every exchange look alike, so they are left out of the embedding
+    snprintf(snippet, size, "%s\n%s", user, reply);
+    if (!embedder_embed(snippet, utf8_cut(snippet, strlen(snippet), RAG_SNIPPET_MAX), EMBED_DOCUMENT, vec)) {
+        metrics_add(M_RAG_EMBED_FAILURES, 1);
+        free(snippet);
+        free(vec);
+        return;
+    }
+    snprintf(snippet, size, "User: %s\nAssistant: %s", user, reply);
+    snippet[utf8_cut(snippet, strlen(snippet), RAG_SNIPPET_MAX)] = '\0';
+
+    pthread_rwlock_wrlock(&message_lock);
+    size_t row = message_next;
+    if (message_texts[row]) {
+        free(message_texts[row]);
+        message_live--;
+    }
+    vector_index_set(messages, row, vec, scope_tag(scope));
+    message_texts[row] = snippet;
+    message_seqs[row] = seq;
+    message_live++;
+    message_next = (row + 1) % messages->capacity;
+    pthread_rwlock_unlock(&message_lock);
+    free(vec);
+}
+
+void rag_forget(const char *scope) {
+    if (!enabled || !messages || !scope) return;
+    uint64_t tag = scope_tag(scope);
+    pthread_rwlock_wrlock(&message_lock);
+    for (size_t row = 0; row < messages->count; row++) {
+        if (messages->tags[row] != tag) continue;
+        messages->tags[row] = 0; // Matches no session
+        free(message_texts[row]);
+        message_texts[row] = NULL;
+        message_live--;
+    }
+    pthread_rwlock_unlock(&message_lock);
+}
+
+void rag_get_stats(struct RagStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    stats->enabled = enabled;
+    stats->embedder = embedder_name();
+    stats->kernel = vector_index_kernel();
+    stats->dim = embedder_dim();
+    pthread_rwlock_rdlock(&message_lock);
+    stats->messages = message_live;
+    stats->message_capacity = messages ? messages->capacity : 0;
+    pthread_rwlock_unlock(&message_lock);
+    stats->documents = documents ? documents->count : 0;
+    stats->document_lists = documents ? documents->nlist : 0;
+}
@@ -0,0 +1,61 @@
+#ifndef RAG_H
+#define RAG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "arena.h"
+#include "history.h"
+
+#define RAG_K_DEFAULT 4 // Snippets added to one prompt at most
+#define RAG_TOKEN_BUDGET_DEFAULT 512 // Estimated tokens of retrieved context per prompt
+#define RAG_MESSAGES_DEFAULT 16384 // Exchanges the message index holds across sessions
+#define RAG_SNIPPET_MAX 2048 // Bytes of an exchange or document chunk kept as one snippet
+#define RAG_IVF_MIN_ROWS 16384 // Smaller document indexes are scanned flat
+
+// Retrieval of earlier exchanges of the same conversation (from an in-memory
+// index fed after each reply) and of chunks of a document corpus (built into
+// an index file and memory-mapped) for the prompt about to be sent
+struct RagSettings {
+    const char *embedder; // "hash" or "gemini" (see embedder.h)
+    const char *model; // embedContent model for "gemini", NULL for the default
+    int dim; // Embedding width, a multiple of 16
+    int k; // Snippets per prompt
+    int token_budget; // Estimated tokens of snippets per prompt
+    double min_score; // Least cosine similarity worth adding, negative for the embedder's default
+    int nprobe; // IVF lists searched in the document index
+    size_t messages; // Exchanges kept in the message index, 0 to not index conversations
+    const char *docs_dir; // .txt and .md files to index, NULL for none
+    const char *index_file; // Where the document index lives, NULL for <docs_dir>/.rag-index
+};
+
+struct RagStats {
+    int enabled;
+    const char *embedder; // Name of the embedder
+    const char *kernel; // Dot-product kernel of the vector index
+    int dim;
+    unsigned long messages; // Exchanges in the message index
+    unsigned long message_capacity;
+    unsigned long documents; // Chunks in the document index
+    int document_lists; // IVF lists of the document index, 0 when flat
+};
+
+// Function to select the embedder and load (or build) the document index; 0 on
+// bad settings. Retrieval stays off until this succeeds.
+int rag_init(const struct RagSettings *settings);
+void rag_cleanup(); // Function to free both indexes
+int rag_enabled(); // Function to check whether prompts are augmented
+size_t rag_token_budget(); // Function to get the tokens to keep free for retrieved context, 0 when off
+
+// Prefix input with the snippets most similar to it: earlier exchanges of the
+// conversation named scope (NULL for none) that history no longer holds, and
+// document chunks. Returns the new prompt in arena (malloc'd when arena is
+// NULL), or NULL when nothing relevant was found.
+char* rag_augment(struct Arena *arena, const char *scope, const char *input, const struct HistoryWindow *history);
+
+// Function to index one answered exchange of scope; seq is the user message's position in its history
+void rag_index_exchange(const char *scope, uint64_t seq, const char *user, const char *reply);
+void rag_forget(const char *scope); // Function to drop every indexed exchange of scope
+
+void rag_get_stats(struct RagStats *stats); // Function to read index sizes
+
+#endif
@@ -0,0 +1,261 @@
+#include <stdlib.h>
+#include <string.h>
+#include "rate_limit.h"
+#include "metrics.h"
+
+#define RATE_MINUTE_NS 60000000000ULL
+
+// A token bucket kept as one timestamp, the time it will be full again
+// (GCRA). Taking n units moves it n * interval later; a take is allowed while
+// that stays within tolerance (the bucket's depth, in time) of now. Refill is
+// implicit in the clock, so nothing runs between requests, and a take is a
+// single compare-and-swap.
+struct Rate {
+    uint64_t interval_ns; // Refill time of one unit, 0 when unlimited
+    uint64_t tolerance_ns; // Depth of the bucket
+};
+
+// One client's buckets. A slot whose buckets are both full holds no state,
+// so another client may take it over.
+struct RateEntry {
+    uint64_t key; // rate_client() value, 0 while the slot was never used
+    uint64_t requests; // Full time of the request bucket
+    uint64_t tokens; // Full time of the token bucket
+} __attribute__((aligned(64))); // One client per cache line
+
+struct RateShard {
+    struct RateEntry *entries;
+    size_t mask; // Slots - 1
+};
+
+static struct RateShard shards[RATE_SHARDS];
+static struct Rate client_requests, client_tokens, global_requests, global_tokens;
+static uint64_t global_requests_at, global_tokens_at; // Full times of the global buckets
+static double bulk_share = 1.0 - RATE_BULK_RESERVE_DEFAULT; // Share of the global depth batch items may use
+static int key_mode = RATE_KEY_IP;
+static int enabled = 0;
+static unsigned long untracked = 0; // Atomic
+
+static struct Rate make_rate(double per_second, double depth) {
+    struct Rate rate = { 0, 0 };
+    if (per_second <= 0) return rate;
+    double interval = 1e9 / per_second;
+    rate.interval_ns = interval < 1 ? 1 : (uint64_t)interval;
+    rate.tolerance_ns = (uint64_t)(depth * interval);
+    return rate;
+}
+
+int rate_key_parse(const char *name) {
+    if (!name || !name[0] || strcmp(name, "ip") == 0) return RATE_KEY_IP;
+    if (strcmp(name, "session") == 0) return RATE_KEY_SESSION;
+    if (strcmp(name, "key") == 0) return RATE_KEY_API;
+    return -1;
+}
+
+int rate_init(const struct RateSettings *s) {
+    if (s->key < RATE_KEY_IP || s->key > RATE_KEY_API || s->rps < 0 || s->burst < 0 || s->tpm < 0 ||
+        s->global_rps < 0 || s->global_tpm < 0 || s->bulk_reserve < 0 || s->bulk_reserve >= 1 || s->clients < 1) {
+        return 0;
+    }
+    int burst = s->burst > 0 ? s->burst : (s->rps * 2 > 1 ? (int)(s->rps * 2) : 1);
+    client_requests = make_rate(s->rps, burst);
+    client_tokens = make_rate((double)s->tpm / 60, (double)s->tpm); // A minute's worth
+    global_requests = make_rate(s->global_rps, s->global_rps > 1 ? s->global_rps : 1); // A second's worth
+    global_tokens = make_rate((double)s->global_tpm / 60, (double)s->global_tpm);
+    bulk_share = 1.0 - s->bulk_reserve;
+    key_mode = s->key;
+
+    rate_cleanup();
+    if (client_requests.interval_ns || client_tokens.interval_ns) {
+        size_t slots = RATE_PROBES;
+        while (slots * RATE_SHARDS < (size_t)s->clients) slots *= 2;
+        for (int i = 0; i < RATE_SHARDS; i++) {
+            shards[i].entries = aligned_alloc(64, slots * sizeof(struct RateEntry));
+            if (!shards[i].entries) {
+                rate_cleanup();
+                return 0;
+            }
+            memset(shards[i].entries, 0, slots * sizeof(struct RateEntry));
+            shards[i].mask = slots - 1;
+        }
+    }
+    enabled = client_requests.interval_ns || client_tokens.interval_ns || global_requests.interval_ns ||
+              global_tokens.interval_ns;
+    return 1;
+}
+
+void rate_cleanup() {
+    for (int i = 0; i < RATE_SHARDS; i++) {
+        free(shards[i].entries);
+        shards[i].entries = NULL;
+        shards[i].mask = 0;
+    }
+}
+
+int rate_enabled() { return enabled; }
+int rate_key() { return key_mode; }
+
+uint64_t rate_client(const char *id) {
+    uint64_t h = 14695981039346656037ULL;
+    for (const unsigned char *p = (const unsigned char *)id; *p; p++) {
+        h ^= *p;
+        h *= 1099511628211ULL;
+    }
+    // FNV's low bits pick the slot; mix the high ones in
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h ? h : 1;
+}
+
+static int entry_idle(const struct RateEntry *entry, uint64_t now) {
+    return __atomic_load_n(&entry->requests, __ATOMIC_RELAXED) <= now &&
+           __atomic_load_n(&entry->tokens, __ATOMIC_RELAXED) <= now;
+}
+
+// The client's slot: where it already is, else the first never-used slot or
+// an idle one in its probe window. Slots never go back to unused, so the
+// search can stop at the first one. NULL when every slot is busy.
+static struct RateEntry* find_entry(uint64_t key, uint64_t now) {
+    struct RateShard *shard = &shards[(key >> 32) % RATE_SHARDS];
+    if (!shard->entries) return NULL;
+    struct RateEntry *idle = NULL;
+    for (size_t probe = 0, i = key & shard->mask; probe < RATE_PROBES; probe++, i = (i + 1) & shard->mask) {
+        struct RateEntry *entry = &shard->entries[i];
+        uint64_t found = __atomic_load_n(&entry->key, __ATOMIC_ACQUIRE);
+        if (found == key) return entry;
+        if (found == 0) {
+            uint64_t expected = 0;
+            if (__atomic_compare_exchange_n(&entry->key, &expected, key, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ||
+                expected == key) {
+                return entry;
+            }
+            continue;
+        }
+        if (!idle && entry_idle(entry, now)) idle = entry;
+    }
+    // Full buckets look the same whoever owned them, so nothing needs resetting
+    if (idle) {
+        uint64_t owner = __atomic_load_n(&idle->key, __ATOMIC_ACQUIRE);
+        if (owner == key || (entry_idle(idle, now) && __atomic_compare_exchange_n(&idle->key, &owner, key, 0,
+                                                                                  __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))) {
+            return idle;
+        }
+    }
+    return NULL;
+}
+
+// Take cost from the bucket whose full time is *at; 0 with *wait_ns set when it lacks it
+static int take(uint64_t *at, uint64_t cost, uint64_t tolerance, uint64_t now, uint64_t *wait_ns) {
+    uint64_t old = __atomic_load_n(at, __ATOMIC_RELAXED);
+    for (;;) {
+        uint64_t next = (old > now ? old : now) + cost;
+        if (next > now + tolerance) {
+            *wait_ns = next - now - tolerance;
+            return 0;
+        }
+        if (__atomic_compare_exchange_n(at, &old, next, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) return 1;
+    }
+}
+
+// A token bucket is charged after the fact, so it can be overdrawn: refuse until it is not
+static int overdrawn(const uint64_t *at, uint64_t tolerance, uint64_t now, uint64_t *wait_ns) {
+    uint64_t full = __atomic_load_n(at, __ATOMIC_RELAXED);
+    if (full <= now + tolerance) return 0;
+    *wait_ns = full - now - tolerance;
+    return 1;
+}
+
+static void charge(uint64_t *at, uint64_t cost, uint64_t now) {
+    uint64_t old = __atomic_load_n(at, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(at, &old, (old > now ? old : now) + cost, 1, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED)) {
+    }
+}
+
+int rate_admit(uint64_t client, int priority, long *retry_after_ms) {
+    if (!enabled) return RATE_OK;
+    uint64_t now = metrics_now_ns();
+    uint64_t wait = 0;
+    int bulk = priority == RATE_BULK;
+    // Batch items only reach into the global buckets as deep as their share
+    uint64_t global_requests_depth = bulk ? (uint64_t)(global_requests.tolerance_ns * bulk_share)
+                                          : global_requests.tolerance_ns;
+    uint64_t global_tokens_depth = bulk ? (uint64_t)(global_tokens.tolerance_ns * bulk_share) : global_tokens.tolerance_ns;
+
+    struct RateEntry *entry = NULL;
+    if (client && (client_requests.interval_ns || client_tokens.interval_ns)) {
+        entry = find_entry(client, now);
+        if (!entry) __atomic_add_fetch(&untracked, 1, __ATOMIC_RELAXED); // Let it through rather than refuse strangers
+    }
+
+    // Checks that take nothing come first, so a refusal leaves no charge behind
+    int verdict = RATE_OK;
+    if (entry && client_tokens.interval_ns && overdrawn(&entry->tokens, client_tokens.tolerance_ns, now, &wait)) {
+        verdict = RATE_CLIENT_TOKENS;
+    } else if (global_tokens.interval_ns && overdrawn(&global_tokens_at, global_tokens_depth, now, &wait)) {
+        verdict = RATE_GLOBAL_TOKENS;
+    } else if (entry && !bulk && client_requests.interval_ns &&
+               !take(&entry->requests, client_requests.interval_ns, client_requests.tolerance_ns, now, &wait)) {
+        verdict = RATE_CLIENT_REQUESTS;
+    } else if (global_requests.interval_ns &&
+               !take(&global_requests_at, global_requests.interval_ns, global_requests_depth, now, &wait)) {
+        verdict = RATE_GLOBAL_REQUESTS;
+        if (entry && !bulk && client_requests.interval_ns) {
+            __atomic_sub_fetch(&entry->requests, client_requests.interval_ns, __ATOMIC_RELAXED); // Hand it back
+        }
+    }
+    if (verdict == RATE_OK) return RATE_OK;
+
+    metrics_add(M_RATE_CLIENT_REQUESTS + (verdict - RATE_CLIENT_REQUESTS), 1);
+    if (bulk) metrics_add(M_RATE_BULK_DEFERRED, 1);
+    *retry_after_ms = (long)((wait + 999999) / 1000000);
+    return verdict;
+}
+
+void rate_charge(uint64_t client, long tokens) {
+    if (!enabled || tokens <= 0) return;
+    uint64_t now = metrics_now_ns();
+    if (client && client_tokens.interval_ns) {
+        struct RateEntry *entry = find_entry(client, now);
+        if (entry) charge(&entry->tokens, (uint64_t)tokens * client_tokens.interval_ns, now);
+    }
+    if (global_tokens.interval_ns) charge(&global_tokens_at, (uint64_t)tokens * global_tokens.interval_ns, now);
+}
+
+const char* rate_verdict_name(int verdict) {
+    static const char *names[RATE_VERDICT_COUNT] = {
+        [RATE_OK] = "Admitted",
+        [RATE_CLIENT_REQUESTS] = "Too many requests from this client",
+        [RATE_CLIENT_TOKENS] = "This client's token quota is used up",
+        [RATE_GLOBAL_REQUESTS] = "The server is at its request limit",
+        [RATE_GLOBAL_TOKENS] = "The server's token quota is used up",
+    };
+    return verdict >= 0 && verdict < RATE_VERDICT_COUNT ? names[verdict] : "Rate limited";
+}
+
+// Units a bucket could still give out, -1 when it is unlimited
+static long available(const struct Rate *rate, const uint64_t *at, uint64_t now) {
+    if (!rate->interval_ns) return -1;
+    uint64_t full = __atomic_load_n(at, __ATOMIC_RELAXED);
+    uint64_t used = full > now ? full - now : 0;
+    return used >= rate->tolerance_ns ? 0 : (long)((rate->tolerance_ns - used) / rate->interval_ns);
+}
+
+void rate_get_stats(struct RateStats *stats) {
+    uint64_t now = metrics_now_ns();
+    memset(stats, 0, sizeof(*stats));
+    stats->enabled = enabled;
+    stats->key = key_mode;
+    for (int i = 0; i < RATE_SHARDS; i++) {
+        if (!shards[i].entries) continue;
+        stats->capacity += shards[i].mask + 1;
+        for (size_t j = 0; j <= shards[i].mask; j++) {
+            const struct RateEntry *entry = &shards[i].entries[j];
+            stats->clients += __atomic_load_n(&entry->key, __ATOMIC_RELAXED) && !entry_idle(entry, now);
+        }
+    }
+    stats->global_requests = available(&global_requests, &global_requests_at, now);
+    stats->global_tokens = available(&global_tokens, &global_tokens_at, now);
+    stats->untracked = __atomic_load_n(&untracked, __ATOMIC_RELAXED);
+}
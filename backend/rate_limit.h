@@ -0,0 +1,72 @@
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H
+
+#include <stdint.h>
+
+#define RATE_CLIENTS_DEFAULT 65536 // Clients tracked at once
+#define RATE_SHARDS 16 // Independent slices of the client table
+#define RATE_PROBES 32 // Slots searched for a client before it goes unmetered
+#define RATE_BULK_RESERVE_DEFAULT 0.25 // Share of the global budget only interactive requests may use
+
+// What identifies a client; requests without the chosen one fall back to their address
+enum RateKey {
+    RATE_KEY_IP = 0,
+    RATE_KEY_SESSION, // X-Session-Id or the sid cookie
+    RATE_KEY_API // X-API-Key, or a bearer token in Authorization
+};
+
+enum RatePriority {
+    RATE_INTERACTIVE = 0, // A /chat or /batch request
+    RATE_BULK // One /batch item: charged no request of its own, shed first
+};
+
+// Why a request was refused
+enum RateVerdict {
+    RATE_OK = 0,
+    RATE_CLIENT_REQUESTS, // The client's requests per second
+    RATE_CLIENT_TOKENS, // The client's upstream tokens per minute
+    RATE_GLOBAL_REQUESTS, // The server-wide request budget
+    RATE_GLOBAL_TOKENS, // The server-wide token budget
+    RATE_VERDICT_COUNT
+};
+
+// Limits of 0 are off. Buckets start full: a client may send burst requests at
+// once and spend a minute's tokens before it has to wait.
+struct RateSettings {
+    int key; // enum RateKey
+    double rps; // Requests per second per client
+    int burst; // Requests a client may send at once, 0 for max(1, 2 * rps)
+    long tpm; // Upstream tokens per minute per client, charged from usageMetadata
+    double global_rps; // Upstream calls per second across all clients, batch items included
+    long global_tpm; // Upstream tokens per minute across all clients
+    double bulk_reserve; // Share of the global budgets batch items leave to interactive requests
+    int clients; // Table capacity, rounded up to a power of two per shard
+};
+
+struct RateStats {
+    int enabled;
+    int key; // enum RateKey
+    unsigned long clients; // Clients with a bucket still refilling
+    unsigned long capacity;
+    long global_requests; // Requests the global budget has left, -1 when unlimited
+    long global_tokens; // Tokens it has left, -1 when unlimited
+    unsigned long untracked; // Admissions that found no free slot and went unmetered
+};
+
+int rate_init(const struct RateSettings *settings); // Function to size the table and set limits; 0 on bad settings
+void rate_cleanup(); // Function to free the table
+int rate_enabled(); // Function to check whether any limit is set
+int rate_key(); // Function to get the enum RateKey in use
+int rate_key_parse(const char *name); // Function to map "ip", "session" or "key" to an enum RateKey, -1 if unknown
+uint64_t rate_client(const char *id); // Function to turn a client identity into its table key (never 0)
+
+// Admit one request of client (0 to check only the global budget) before any
+// upstream work: takes a request from its buckets, and refuses it while a
+// token bucket is overdrawn. On refusal *retry_after_ms says when it would pass.
+int rate_admit(uint64_t client, int priority, long *retry_after_ms);
+void rate_charge(uint64_t client, long tokens); // Function to bill a reply's tokens to client and the global budget
+const char* rate_verdict_name(int verdict); // Function to describe a refusal for clients
+
+void rate_get_stats(struct RateStats *stats); // Function to read table occupancy and global budgets
+
+#endif
@@ -0,0 +1,167 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include "request_body.h"
+
+static int blank(const char *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (data[i] != ' ' && data[i] != '\t' && data[i] != '\r' && data[i] != '\n') return 0;
+    }
+    return 1;
+}
+
+// Make room for need bytes, doubling so a body sent in n chunks costs O(log n) copies
+static int reserve(struct RequestBody *body, size_t need) {
+    if (need <= body->cap) return 1;
+    size_t cap = body->cap ? body->cap : REQUEST_BODY_INITIAL;
+    while (cap < need) cap *= 2;
+    if (cap > body->limit + 1) cap = body->limit + 1; // need never exceeds this
+    char *data = realloc(body->data, cap);
+    if (!data) return 0;
+    body->data = data;
+    body->cap = cap;
+    return 1;
+}
+
+int request_body_begin(struct RequestBody *body, int mode, size_t limit, const char *content_length) {
+    memset(body, 0, sizeof(*body));
+    body->mode = mode;
+    body->limit = limit;
+    if (!content_length || !content_length[0]) return BODY_OK;
+
+    char *end;
+    errno = 0;
+    unsigned long long declared = strtoull(content_length, &end, 10);
+    if (errno == ERANGE || declared > limit) return body->state = BODY_TOO_LARGE;
+    if (*end || declared == 0 || mode != BODY_RAW) return BODY_OK;
+    if (!reserve(body, (size_t)declared + 1)) return body->state = BODY_FAILED; // The one allocation it needs
+    return BODY_OK;
+}
+
+// Bytes that can continue a number
+static int number_byte(char c) {
+    return (c >= '0' && c <= '9') || c == '.' || c == '-' || c == '+' || c == 'e' || c == 'E';
+}
+
+// Hand bytes to the tokenizer; once the object closes only whitespace may follow
+static int tokenize(struct RequestBody *body, const char *data, size_t len) {
+    while (len > 0 && !body->json) {
+        int piece = len > INT_MAX ? INT_MAX : (int)len;
+        struct json_object *json = json_tokener_parse_ex(body->tokener, data, piece);
+        if (!json) {
+            if (json_tokener_get_error(body->tokener) != json_tokener_continue) return body->state = BODY_INVALID;
+            data += piece;
+            len -= (size_t)piece;
+            continue;
+        }
+        size_t used = json_tokener_get_parse_end(body->tokener);
+        json_tokener_free(body->tokener);
+        body->tokener = NULL;
+        body->json = json;
+        data += used;
+        len -= used;
+    }
+    return body->json && !blank(data, len) ? (body->state = BODY_INVALID) : BODY_OK;
+}
+
+// json-c rebuilds a number's state from its text when a call ends inside it
+// and then takes a '-' after the digits, so "0-5" split after the 0 would
+// read as 0. A trailing run of number bytes is held back until the byte that
+// ends it arrives; only runs longer than the carry are still split.
+static int feed_json(struct RequestBody *body, const char *data, size_t len) {
+    if (!body->started) {
+        while (len > 0 && blank(data, 1)) {
+            data++;
+            len--;
+        }
+        if (len == 0) return BODY_OK;
+        body->started = 1;
+    }
+    if (body->json) return blank(data, len) ? BODY_OK : (body->state = BODY_INVALID);
+    if (!body->tokener && !(body->tokener = json_tokener_new_ex(JSON_TOKENER_DEFAULT_DEPTH))) {
+        return body->state = BODY_FAILED;
+    }
+
+    if (body->carry_len > 0) {
+        size_t n = 0; // Bytes of data joining the held run, with the one ending it
+        while (n < len && number_byte(data[n])) n++;
+        if (n < len) n++;
+        if (body->carry_len + n <= sizeof(body->carry)) {
+            memcpy(body->carry + body->carry_len, data, n);
+            body->carry_len += n;
+            data += n;
+            len -= n;
+            if (len == 0 && number_byte(body->carry[body->carry_len - 1])) return BODY_OK; // Still going
+        }
+        size_t held = body->carry_len;
+        body->carry_len = 0;
+        if (tokenize(body, body->carry, held) != BODY_OK) return body->state;
+        if (body->json) return blank(data, len) ? BODY_OK : (body->state = BODY_INVALID);
+    }
+
+    size_t keep = 0;
+    while (keep < len && keep < sizeof(body->carry) && number_byte(data[len - 1 - keep])) keep++;
+    if (tokenize(body, data, len - keep) != BODY_OK) return body->state;
+    if (body->json) return blank(data + len - keep, keep) ? BODY_OK : (body->state = BODY_INVALID);
+    memcpy(body->carry, data + len - keep, keep);
+    body->carry_len = keep;
+    return BODY_OK;
+}
+
+int request_body_feed(struct RequestBody *body, const char *data, size_t len) {
+    if (body->state != BODY_OK) return body->state;
+    if (len > body->limit - body->received) return body->state = BODY_TOO_LARGE; // Chunked bodies stop here
+    body->received += len;
+    if (body->mode == BODY_JSON) return feed_json(body, data, len);
+
+    if (!reserve(body, body->received + 1)) return body->state = BODY_FAILED;
+    memcpy(body->data + body->received - len, data, len);
+    body->data[body->received] = '\0';
+    return BODY_OK;
+}
+
+struct json_object* request_body_json(struct RequestBody *body) {
+    if (body->state != BODY_OK) return NULL;
+    if (!body->started) return json_object_new_object();
+    if (!body->json && body->carry_len > 0) {
+        size_t held = body->carry_len;
+        body->carry_len = 0;
+        if (tokenize(body, body->carry, held) != BODY_OK) return NULL;
+    }
+    if (!body->json) {
+        // A NUL ends whatever the tokenizer still holds, such as a bare number
+        body->json = body->tokener ? json_tokener_parse_ex(body->tokener, "", 1) : NULL;
+        if (!body->json) {
+            body->state = BODY_INVALID;
+            return NULL;
+        }
+    }
+    if (!json_object_is_type(body->json, json_type_object)) {
+        body->state = BODY_INVALID;
+        return NULL;
+    }
+    struct json_object *json = body->json;
+    body->json = NULL;
+    return json;
+}
+
+char* request_body_take(struct RequestBody *body, size_t *len) {
+    if (body->state != BODY_OK || (!body->data && !reserve(body, 1))) return NULL;
+    char *data = body->data;
+    data[body->received] = '\0';
+    *len = body->received;
+    body->data = NULL;
+    body->cap = 0;
+    return data;
+}
+
+void request_body_free(struct RequestBody *body) {
+    if (body->tokener) json_tokener_free(body->tokener);
+    if (body->json) json_object_put(body->json);
+    free(body->data);
+    body->tokener = NULL;
+    body->json = NULL;
+    body->data = NULL;
+    body->cap = 0;
+}
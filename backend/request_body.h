@@ -0,0 +1,55 @@
+#ifndef REQUEST_BODY_H
+#define REQUEST_BODY_H
+
+#include <stddef.h>
+#include <json-c/json.h>
+
+#define REQUEST_BODY_MAX_DEFAULT (128 * 1024) // Bytes of a JSON body; a CHAT_INPUT_MAX message fits even when escaped
+#define REQUEST_BODY_BATCH_MAX_DEFAULT (64 * 1024 * 1024) // Bytes of a /batch JSONL body
+#define REQUEST_BODY_INITIAL 4096 // First buffer of a raw body sent without Content-Length
+#define REQUEST_BODY_CARRY 64 // Bytes of a number held back from the JSON tokenizer between chunks
+
+enum BodyMode {
+    BODY_JSON = 0, // One JSON object, parsed as it arrives
+    BODY_RAW // Bytes kept as they are
+};
+
+enum BodyState {
+    BODY_OK = 0,
+    BODY_TOO_LARGE, // Declared or received length over the limit
+    BODY_INVALID, // Not a JSON object (BODY_JSON)
+    BODY_FAILED // Out of memory
+};
+
+// A request body taken in chunk by chunk as the server reads it. JSON bodies
+// go straight through an incremental tokenizer, so the document is ready when
+// the last byte arrives and the raw text is never held; raw bodies grow a
+// buffer geometrically, sized once up front when Content-Length is known.
+struct RequestBody {
+    int mode; // enum BodyMode
+    int state; // enum BodyState; once not BODY_OK further chunks are dropped
+    size_t limit; // Most bytes accepted
+    size_t received; // Bytes seen so far
+    int started; // BODY_JSON: a non-blank byte arrived
+    struct json_tokener *tokener; // BODY_JSON until the document is complete
+    struct json_object *json; // BODY_JSON document once complete
+    char carry[REQUEST_BODY_CARRY]; // BODY_JSON bytes held back from the tokenizer
+    size_t carry_len;
+    char *data; // BODY_RAW bytes (malloc'd, NUL-terminated)
+    size_t cap; // Capacity of data
+};
+
+// Function to start a body of at most limit bytes. content_length is the
+// header's value (NULL when the body is chunked); a declared length over the
+// limit returns BODY_TOO_LARGE before a byte is read.
+int request_body_begin(struct RequestBody *body, int mode, size_t limit, const char *content_length);
+int request_body_feed(struct RequestBody *body, const char *data, size_t len); // Function to take the next chunk; returns the state
+
+// Function to end a BODY_JSON body: the object (an empty one for no body) for
+// the caller to put, or NULL with the reason in body->state
+struct json_object* request_body_json(struct RequestBody *body);
+// Function to take a BODY_RAW body's bytes (malloc'd, NUL-terminated; the caller frees them)
+char* request_body_take(struct RequestBody *body, size_t *len);
+void request_body_free(struct RequestBody *body); // Function to drop whatever the body still holds
+
+#endif
@@ -0,0 +1,411 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "response_cache.h"
+
+#define CACHE_BUCKETS_INITIAL 256 // Initial hash buckets
+#define CACHE_FILE_MAGIC "GRC1" // On-disk format tag
+#define CACHE_FILE_MAX_ENTRY (16UL * 1024 * 1024) // Larger replies stay in memory only; the loader treats them as corruption
+
+// Reply bytes; shared with compaction so it can write them after cache_lock is released
+struct CacheText {
+    unsigned refs; // Entry plus in-flight compactions
+    char data[]; // Reply text (NUL terminated)
+};
+
+// A cached reply; lives in one hash chain and the LRU list
+struct CacheEntry {
+    struct CacheKey key;
+    struct CacheText *text; // Reply text
+    size_t len; // Reply length
+    struct CacheEntry *hash_next; // Next entry in the bucket chain
+    struct CacheEntry *lru_prev; // Towards most recently used
+    struct CacheEntry *lru_next; // Towards least recently used
+};
+
+// On-disk record header; the reply text follows it
+struct CacheRecord {
+    uint64_t h1;
+    uint64_t h2;
+    uint32_t len;
+} __attribute__((packed));
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER; // In-memory table only
+static pthread_mutex_t file_lock = PTHREAD_MUTEX_INITIALIZER; // Cache file; taken before cache_lock, never inside it
+static int cache_enabled = 0;
+static int cache_force = 0;
+static size_t cache_max_bytes = RESPONSE_CACHE_DEFAULT_BYTES;
+
+static struct CacheEntry **buckets = NULL;
+static size_t bucket_count = 0;
+static size_t entry_count = 0;
+static size_t cache_bytes = 0;
+static struct CacheEntry *lru_head = NULL;
+static struct CacheEntry *lru_tail = NULL;
+
+static unsigned long cache_hits = 0;
+static unsigned long cache_misses = 0;
+static unsigned long cache_bypasses = 0;
+static unsigned long cache_evictions = 0;
+
+// Append-only persistence; rewritten from memory when it grows past twice the bound. file_lock
+static char *cache_path = NULL;
+static int cache_fd = -1;
+static size_t file_bytes = 0;
+
+static size_t entry_cost(size_t len) {
+    return sizeof(struct CacheEntry) + sizeof(struct CacheText) + len + 1;
+}
+
+static void text_release(struct CacheText *text) {
+    if (__atomic_sub_fetch(&text->refs, 1, __ATOMIC_ACQ_REL) == 0) free(text);
+}
+
+void cache_key_init(struct CacheKey *key) {
+    key->h1 = 1469598103934665603ULL; // FNV-1a offset basis
+    key->h2 = 0x9e3779b97f4a7c15ULL;
+}
+
+static void key_byte(struct CacheKey *key, unsigned char c) {
+    key->h1 ^= c;
+    key->h1 *= 1099511628211ULL;
+    key->h2 = (key->h2 ^ c) * 0xff51afd7ed558ccdULL;
+    key->h2 = (key->h2 << 29) | (key->h2 >> 35);
+}
+
+void cache_key_add(struct CacheKey *key, const char *bytes, size_t len) {
+    for (size_t i = 0; i < len; i++) key_byte(key, (unsigned char)bytes[i]);
+    key_byte(key, 0xff); // Field separator so "ab"+"c" differs from "a"+"bc"
+}
+
+static int is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v';
+}
+
+void cache_key_add_text(struct CacheKey *key, const char *text) {
+    int pending_space = 0, emitted = 0;
+    for (const char *p = text ? text : ""; *p; p++) {
+        if (is_space(*p)) {
+            pending_space = emitted;
+            continue;
+        }
+        if (pending_space) key_byte(key, ' ');
+        key_byte(key, (unsigned char)*p);
+        pending_space = 0;
+        emitted = 1;
+    }
+    key_byte(key, 0xff);
+}
+
+static void lru_unlink(struct CacheEntry *entry) {
+    if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+    else lru_head = entry->lru_next;
+    if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+    else lru_tail = entry->lru_prev;
+    entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void lru_push_front(struct CacheEntry *entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = lru_head;
+    if (lru_head) lru_head->lru_prev = entry;
+    lru_head = entry;
+    if (!lru_tail) lru_tail = entry;
+}
+
+static struct CacheEntry** find_slot(const struct CacheKey *key) {
+    struct CacheEntry **slot = &buckets[key->h1 & (bucket_count - 1)];
+    while (*slot && ((*slot)->key.h1 != key->h1 || (*slot)->key.h2 != key->h2)) slot = &(*slot)->hash_next;
+    return slot;
+}
+
+static void remove_entry(struct CacheEntry *entry) {
+    struct CacheEntry **slot = find_slot(&entry->key);
+    if (*slot) *slot = entry->hash_next;
+    lru_unlink(entry);
+    entry_count--;
+    cache_bytes -= entry_cost(entry->len);
+    text_release(entry->text);
+    free(entry);
+}
+
+static void grow_buckets() {
+    size_t new_count = bucket_count * 2;
+    struct CacheEntry **grown = calloc(new_count, sizeof(struct CacheEntry *));
+    if (!grown) return; // Keep the longer chains
+    for (size_t i = 0; i < bucket_count; i++) {
+        struct CacheEntry *entry = buckets[i];
+        while (entry) {
+            struct CacheEntry *next = entry->hash_next;
+            size_t idx = entry->key.h1 & (new_count - 1);
+            entry->hash_next = grown[idx];
+            grown[idx] = entry;
+            entry = next;
+        }
+    }
+    free(buckets);
+    buckets = grown;
+    bucket_count = new_count;
+}
+
+// Insert or replace an entry and evict from the LRU tail down to the bound.
+// Called with cache_lock held.
+static int insert_entry(const struct CacheKey *key, const char *text, size_t len) {
+    if (!buckets || entry_cost(len) > cache_max_bytes) return 0;
+
+    struct CacheEntry **slot = find_slot(key);
+    if (*slot) remove_entry(*slot);
+
+    struct CacheEntry *entry = calloc(1, sizeof(struct CacheEntry));
+    struct CacheText *copy = malloc(sizeof(struct CacheText) + len + 1);
+    if (!entry || !copy) {
+        free(entry);
+        free(copy);
+        return 0;
+    }
+    copy->refs = 1;
+    memcpy(copy->data, text, len);
+    copy->data[len] = '\0';
+    entry->key = *key;
+    entry->text = copy;
+    entry->len = len;
+
+    size_t idx = key->h1 & (bucket_count - 1);
+    entry->hash_next = buckets[idx];
+    buckets[idx] = entry;
+    lru_push_front(entry);
+    cache_bytes += entry_cost(len);
+    if (++entry_count > bucket_count * 2) grow_buckets();
+
+    while (cache_bytes > cache_max_bytes && lru_tail && lru_tail != entry) {
+        remove_entry(lru_tail);
+        cache_evictions++;
+    }
+    return 1;
+}
+
+static int write_all(int fd, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n <= 0) return 0;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 1;
+}
+
+static int write_record(int fd, const struct CacheKey *key, const char *text, size_t len) {
+    struct CacheRecord record = { key->h1, key->h2, (uint32_t)len };
+    return write_all(fd, &record, sizeof(record)) && write_all(fd, text, len);
+}
+
+// Replay the file into memory; a torn tail from a crash is cut off.
+// Records are in insertion order, so replay also rebuilds recency.
+static void load_file() {
+    struct stat st;
+    if (fstat(cache_fd, &st) != 0) return;
+    size_t size = (size_t)st.st_size;
+    size_t good = 0;
+
+    if (size >= sizeof(CACHE_FILE_MAGIC) - 1) {
+        char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, cache_fd, 0);
+        if (map != MAP_FAILED) {
+            if (memcmp(map, CACHE_FILE_MAGIC, sizeof(CACHE_FILE_MAGIC) - 1) == 0) {
+                size_t pos = good = sizeof(CACHE_FILE_MAGIC) - 1;
+                while (pos + sizeof(struct CacheRecord) <= size) {
+                    struct CacheRecord record;
+                    memcpy(&record, map + pos, sizeof(record));
+                    if (record.len > CACHE_FILE_MAX_ENTRY || pos + sizeof(record) + record.len > size) break;
+                    struct CacheKey key = { record.h1, record.h2 };
+                    insert_entry(&key, map + pos + sizeof(record), record.len);
+                    pos += sizeof(record) + record.len;
+                    good = pos;
+                }
+            }
+            munmap(map, size);
+        }
+    }
+
+    if (good == 0) {
+        // Empty or foreign file: start over
+        if (ftruncate(cache_fd, 0) != 0 || !write_all(cache_fd, CACHE_FILE_MAGIC, sizeof(CACHE_FILE_MAGIC) - 1)) {
+            close(cache_fd);
+            cache_fd = -1;
+            return;
+        }
+        good = sizeof(CACHE_FILE_MAGIC) - 1;
+    } else if (good < size && ftruncate(cache_fd, (off_t)good) != 0) {
+        close(cache_fd);
+        cache_fd = -1;
+        return;
+    }
+    file_bytes = good;
+}
+
+// Rewrite the file from the live entries, oldest first. Called with file_lock held; cache_lock
+// is held only to take references to the entries, so lookups never wait for the disk. A put
+// that lands between the snapshot and the rename appends its record to the new file after it.
+static void compact_file() {
+    size_t path_len = strlen(cache_path);
+    char *tmp_path = malloc(path_len + 5);
+    if (!tmp_path) return;
+    memcpy(tmp_path, cache_path, path_len);
+    memcpy(tmp_path + path_len, ".tmp", 5);
+
+    pthread_mutex_lock(&cache_lock);
+    size_t count = 0;
+    struct CacheKey *keys = malloc(entry_count * sizeof(struct CacheKey));
+    struct CacheText **texts = malloc(entry_count * sizeof(struct CacheText *));
+    size_t *lens = malloc(entry_count * sizeof(size_t));
+    if (keys && texts && lens) {
+        for (struct CacheEntry *entry = lru_tail; entry; entry = entry->lru_prev) {
+            __atomic_add_fetch(&entry->text->refs, 1, __ATOMIC_RELAXED);
+            keys[count] = entry->key;
+            texts[count] = entry->text;
+            lens[count++] = entry->len;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    int fd = -1, ok = keys && texts && lens;
+    if (ok) {
+        fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+        ok = fd >= 0 && write_all(fd, CACHE_FILE_MAGIC, sizeof(CACHE_FILE_MAGIC) - 1);
+    }
+    size_t written = sizeof(CACHE_FILE_MAGIC) - 1;
+    for (size_t i = 0; i < count; i++) {
+        if (ok && lens[i] <= CACHE_FILE_MAX_ENTRY) {
+            ok = write_record(fd, &keys[i], texts[i]->data, lens[i]);
+            written += sizeof(struct CacheRecord) + lens[i];
+        }
+        text_release(texts[i]);
+    }
+    free(keys);
+    free(texts);
+    free(lens);
+
+    if (ok && rename(tmp_path, cache_path) == 0) {
+        close(cache_fd);
+        cache_fd = fd;
+        file_bytes = written;
+    } else {
+        if (fd >= 0) close(fd);
+        unlink(tmp_path);
+    }
+    free(tmp_path);
+}
+
+void response_cache_init(size_t max_bytes, const char *path, int force) {
+    pthread_mutex_lock(&file_lock);
+    pthread_mutex_lock(&cache_lock);
+    cache_max_bytes = max_bytes > 0 ? max_bytes : RESPONSE_CACHE_DEFAULT_BYTES;
+    cache_force = force;
+    buckets = calloc(CACHE_BUCKETS_INITIAL, sizeof(struct CacheEntry *));
+    bucket_count = buckets ? CACHE_BUCKETS_INITIAL : 0;
+    cache_enabled = buckets != NULL;
+
+    if (cache_enabled && path && path[0]) {
+        cache_fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+        if (cache_fd >= 0) {
+            cache_path = strdup(path);
+            load_file();
+        } else {
+            perror("response cache file");
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    pthread_mutex_unlock(&file_lock);
+}
+
+void response_cache_cleanup() {
+    pthread_mutex_lock(&file_lock);
+    pthread_mutex_lock(&cache_lock);
+    if (cache_fd >= 0) {
+        fsync(cache_fd);
+        close(cache_fd);
+        cache_fd = -1;
+    }
+    free(cache_path);
+    cache_path = NULL;
+
+    struct CacheEntry *entry = lru_head;
+    while (entry) {
+        struct CacheEntry *next = entry->lru_next;
+        text_release(entry->text);
+        free(entry);
+        entry = next;
+    }
+    free(buckets);
+    buckets = NULL;
+    bucket_count = entry_count = cache_bytes = 0;
+    lru_head = lru_tail = NULL;
+    cache_enabled = 0;
+    pthread_mutex_unlock(&cache_lock);
+    pthread_mutex_unlock(&file_lock);
+}
+
+int response_cache_applies(double temperature) {
+    if (!cache_enabled) return 0;
+    if (temperature > 0.0 && !cache_force) {
+        // Sampled replies differ per call, so caching would change behaviour
+        pthread_mutex_lock(&cache_lock);
+        cache_bypasses++;
+        pthread_mutex_unlock(&cache_lock);
+        return 0;
+    }
+    return 1;
+}
+
+char* response_cache_get(const struct CacheKey *key, struct Arena *arena) {
+    char *copy = NULL;
+
+    pthread_mutex_lock(&cache_lock);
+    struct CacheEntry *entry = buckets ? *find_slot(key) : NULL;
+    if (entry) {
+        lru_unlink(entry);
+        lru_push_front(entry);
+        copy = arena ? arena_alloc(arena, entry->len + 1) : malloc(entry->len + 1);
+        if (copy) memcpy(copy, entry->text->data, entry->len + 1);
+        cache_hits++;
+    } else {
+        cache_misses++;
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    return copy;
+}
+
+void response_cache_put(const struct CacheKey *key, const char *text, size_t len) {
+    if (!cache_enabled || !text) return;
+
+    pthread_mutex_lock(&cache_lock);
+    int stored = insert_entry(key, text, len);
+    pthread_mutex_unlock(&cache_lock);
+    if (!stored || len > CACHE_FILE_MAX_ENTRY) return;
+
+    // The record is written from the caller's copy, outside cache_lock
+    pthread_mutex_lock(&file_lock);
+    if (cache_fd >= 0 && write_record(cache_fd, key, text, len)) {
+        file_bytes += sizeof(struct CacheRecord) + len;
+        if (file_bytes > 2 * cache_max_bytes) compact_file();
+    }
+    pthread_mutex_unlock(&file_lock);
+}
+
+void response_cache_get_stats(struct ResponseCacheStats *stats) {
+    pthread_mutex_lock(&cache_lock);
+    stats->enabled = cache_enabled;
+    stats->hits = cache_hits;
+    stats->misses = cache_misses;
+    stats->bypasses = cache_bypasses;
+    stats->evictions = cache_evictions;
+    stats->entries = (unsigned long)entry_count;
+    stats->bytes = cache_bytes;
+    pthread_mutex_unlock(&cache_lock);
+}
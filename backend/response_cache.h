@@ -0,0 +1,39 @@
+#ifndef RESPONSE_CACHE_H
+#define RESPONSE_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "arena.h"
+
+#define RESPONSE_CACHE_DEFAULT_BYTES (64UL * 1024 * 1024) // Memory bound when enabled
+
+// 128-bit fingerprint of everything that determines a reply
+struct CacheKey {
+    uint64_t h1; // FNV-1a lane
+    uint64_t h2; // Multiply-rotate lane
+};
+
+struct ResponseCacheStats {
+    int enabled; // Cache was switched on
+    unsigned long hits; // Lookups answered from the cache
+    unsigned long misses; // Lookups that went upstream
+    unsigned long bypasses; // Requests skipped because temperature > 0
+    unsigned long evictions; // Entries dropped by the LRU
+    unsigned long entries; // Entries held
+    size_t bytes; // Reply bytes held
+};
+
+void response_cache_init(size_t max_bytes, const char *path, int force); // Function to enable the cache (path may be NULL)
+void response_cache_cleanup(); // Function to flush and free the cache
+int response_cache_applies(double temperature); // Function to check whether a request may use the cache
+
+void cache_key_init(struct CacheKey *key); // Function to start a key
+void cache_key_add(struct CacheKey *key, const char *bytes, size_t len); // Function to mix raw bytes into a key
+void cache_key_add_text(struct CacheKey *key, const char *text); // Function to mix trimmed, whitespace-collapsed text
+
+char* response_cache_get(const struct CacheKey *key, struct Arena *arena); // Function to copy a cached reply (arena or malloc), NULL on miss
+void response_cache_put(const struct CacheKey *key, const char *text, size_t len); // Function to store a reply
+
+void response_cache_get_stats(struct ResponseCacheStats *stats); // Function to read the counters
+
+#endif
@@ -0,0 +1,462 @@
+#include <stdlib.h>
+#include <string.h>
+#include "response_parser.h"
+
+// Scanner states
+enum {
+    PS_VALUE, // Expecting a value
+    PS_VALUE_OR_END, // Just after '[': a value or ']'
+    PS_KEY_OR_END, // Just after '{': a key or '}'
+    PS_KEY, // After ',' in an object: a key
+    PS_COLON, // After a key
+    PS_AFTER, // After a value inside a container: ',' or the closer
+    PS_STRING, // Inside a string
+    PS_ESCAPE, // After a backslash in a string
+    PS_UNICODE, // Inside \uXXXX
+    PS_SCALAR // Inside a number or true/false/null
+};
+
+// Containers of a GenerateContentResponse that hold wanted fields
+enum {
+    N_OTHER,
+    N_STREAM, // Top-level array of responses (non-SSE streaming)
+    N_ROOT, // A GenerateContentResponse
+    N_CANDIDATES, // root.candidates
+    N_CANDIDATE, // candidates[0]
+    N_CONTENT, // candidates[0].content
+    N_PARTS, // content.parts
+    N_PART, // parts[i]
+    N_USAGE, // root.usageMetadata
+    N_FEEDBACK, // root.promptFeedback
+    N_ERROR // root.error
+};
+
+// Where the current string or scalar goes
+enum {
+    F_NONE,
+    F_KEY,
+    F_TEXT,
+    F_FINISH,
+    F_BLOCK,
+    F_ERROR_STATUS,
+    F_ERROR_MESSAGE,
+    F_NAME,
+    F_PROMPT_TOKENS,
+    F_CANDIDATE_TOKENS,
+    F_TOTAL_TOKENS,
+    F_CACHED_TOKENS,
+    F_ERROR_CODE
+};
+
+void response_parser_init(struct ResponseParser *parser, struct Arena *arena) {
+    memset(parser, 0, sizeof(*parser));
+    parser->arena = arena;
+    parser->state = PS_VALUE;
+}
+
+void response_parser_reset(struct ResponseParser *parser) {
+    parser->depth = 0;
+    parser->state = PS_VALUE;
+    parser->field = F_NONE;
+    parser->high_surrogate = 0;
+    parser->documents = 0;
+    parser->failed = 0;
+}
+
+void response_parser_free(struct ResponseParser *parser) {
+    if (!parser->arena) free(parser->result.text);
+    parser->result.text = NULL;
+    parser->result.text_len = 0;
+    parser->text_cap = 0;
+}
+
+static int key_is(const struct ResponseParser *parser, const char *name) {
+    size_t len = strlen(name);
+    return parser->key_len == (int)len && memcmp(parser->key, name, len) == 0;
+}
+
+// Node of the container opening with c, given its parent and key
+static int child_node(const struct ResponseParser *parser, char c) {
+    if (parser->depth == 0) return c == '[' ? N_STREAM : N_ROOT;
+    const struct ParserFrame *parent = &parser->stack[parser->depth - 1];
+    int object = c == '{';
+
+    switch (parent->node) {
+    case N_STREAM:
+        return object ? N_ROOT : N_OTHER;
+    case N_ROOT:
+        if (!object && key_is(parser, "candidates")) return N_CANDIDATES;
+        if (object && key_is(parser, "usageMetadata")) return N_USAGE;
+        if (object && key_is(parser, "promptFeedback")) return N_FEEDBACK;
+        if (object && key_is(parser, "error")) return N_ERROR;
+        return N_OTHER;
+    case N_CANDIDATES:
+        return object && parent->index == 0 ? N_CANDIDATE : N_OTHER;
+    case N_CANDIDATE:
+        return object && key_is(parser, "content") ? N_CONTENT : N_OTHER;
+    case N_CONTENT:
+        return !object && key_is(parser, "parts") ? N_PARTS : N_OTHER;
+    case N_PARTS:
+        return object ? N_PART : N_OTHER;
+    default:
+        return N_OTHER;
+    }
+}
+
+// Field a string (or scalar) value at the current position is captured into
+static int child_field(const struct ResponseParser *parser, int is_string) {
+    if (parser->depth == 0) return F_NONE;
+    int node = parser->stack[parser->depth - 1].node;
+
+    if (is_string) {
+        if (node == N_PART && key_is(parser, "text")) return F_TEXT;
+        if (node == N_CANDIDATE && key_is(parser, "finishReason")) return F_FINISH;
+        if (node == N_FEEDBACK && key_is(parser, "blockReason")) return F_BLOCK;
+        if (node == N_ERROR && key_is(parser, "status")) return F_ERROR_STATUS;
+        if (node == N_ERROR && key_is(parser, "message")) return F_ERROR_MESSAGE;
+        if (node == N_ROOT && key_is(parser, "name")) return F_NAME;
+    } else {
+        if (node == N_USAGE && key_is(parser, "promptTokenCount")) return F_PROMPT_TOKENS;
+        if (node == N_USAGE && key_is(parser, "candidatesTokenCount")) return F_CANDIDATE_TOKENS;
+        if (node == N_USAGE && key_is(parser, "totalTokenCount")) return F_TOTAL_TOKENS;
+        if (node == N_USAGE && key_is(parser, "cachedContentTokenCount")) return F_CACHED_TOKENS;
+        if (node == N_ERROR && key_is(parser, "code")) return F_ERROR_CODE;
+    }
+    return F_NONE;
+}
+
+// Fixed-size destination of a short string field
+static char* field_buffer(struct ResponseParser *parser, size_t *size) {
+    struct AiResponse *r = &parser->result;
+    switch (parser->field) {
+    case F_FINISH: *size = sizeof(r->finish_reason); return r->finish_reason;
+    case F_BLOCK: *size = sizeof(r->block_reason); return r->block_reason;
+    case F_ERROR_STATUS: *size = sizeof(r->error_status); return r->error_status;
+    case F_ERROR_MESSAGE: *size = sizeof(r->error_message); return r->error_message;
+    case F_NAME: *size = sizeof(r->name); return r->name;
+    default: return NULL;
+    }
+}
+
+static int text_append(struct ResponseParser *parser, const char *bytes, size_t len) {
+    struct AiResponse *r = &parser->result;
+    if (r->text_len + len + 1 > parser->text_cap) {
+        size_t new_cap = parser->text_cap ? parser->text_cap * 2 : 256;
+        while (new_cap < r->text_len + len + 1) new_cap *= 2;
+        // In an arena the text is normally the newest allocation, so this bumps in place
+        char *p = parser->arena ? arena_realloc(parser->arena, r->text, parser->text_cap, new_cap)
+                                : realloc(r->text, new_cap);
+        if (!p) {
+            parser->failed = 1;
+            return 0;
+        }
+        r->text = p;
+        parser->text_cap = new_cap;
+    }
+    memcpy(r->text + r->text_len, bytes, len);
+    r->text_len += len;
+    r->text[r->text_len] = '\0';
+    return 1;
+}
+
+// Append decoded string bytes to wherever the current string goes
+static int capture(struct ResponseParser *parser, const char *bytes, size_t len) {
+    switch (parser->field) {
+    case F_NONE:
+        return 1;
+    case F_KEY:
+        if (parser->key_len < 0) return 1;
+        if ((size_t)parser->key_len + len >= sizeof(parser->key)) {
+            parser->key_len = -1; // Longer than any key we look for
+            return 1;
+        }
+        memcpy(parser->key + parser->key_len, bytes, len);
+        parser->key_len += (int)len;
+        return 1;
+    case F_TEXT:
+        return text_append(parser, bytes, len);
+    default: {
+        size_t size = 0;
+        char *buf = field_buffer(parser, &size);
+        size_t room = size - 1 - (size_t)parser->field_len;
+        size_t n = len < room ? len : room;
+        memcpy(buf + parser->field_len, bytes, n);
+        parser->field_len += (int)n;
+        buf[parser->field_len] = '\0';
+        return 1;
+    }
+    }
+}
+
+static int emit_utf8(struct ResponseParser *parser, unsigned int cp) {
+    char out[4];
+    size_t n;
+    if (cp < 0x80) {
+        out[0] = (char)cp;
+        n = 1;
+    } else if (cp < 0x800) {
+        out[0] = (char)(0xc0 | (cp >> 6));
+        out[1] = (char)(0x80 | (cp & 0x3f));
+        n = 2;
+    } else if (cp < 0x10000) {
+        out[0] = (char)(0xe0 | (cp >> 12));
+        out[1] = (char)(0x80 | ((cp >> 6) & 0x3f));
+        out[2] = (char)(0x80 | (cp & 0x3f));
+        n = 3;
+    } else {
+        out[0] = (char)(0xf0 | (cp >> 18));
+        out[1] = (char)(0x80 | ((cp >> 12) & 0x3f));
+        out[2] = (char)(0x80 | ((cp >> 6) & 0x3f));
+        out[3] = (char)(0x80 | (cp & 0x3f));
+        n = 4;
+    }
+    return capture(parser, out, n);
+}
+
+// A high surrogate not followed by its low half becomes U+FFFD
+static int flush_surrogate(struct ResponseParser *parser) {
+    if (!parser->high_surrogate) return 1;
+    parser->high_surrogate = 0;
+    return emit_utf8(parser, 0xfffd);
+}
+
+static int emit_codepoint(struct ResponseParser *parser, unsigned int cp) {
+    if (cp >= 0xdc00 && cp <= 0xdfff) {
+        if (!parser->high_surrogate) return emit_utf8(parser, 0xfffd);
+        cp = 0x10000 + ((parser->high_surrogate - 0xd800) << 10) + (cp - 0xdc00);
+        parser->high_surrogate = 0;
+        return emit_utf8(parser, cp);
+    }
+    if (!flush_surrogate(parser)) return 0;
+    if (cp >= 0xd800 && cp <= 0xdbff) {
+        parser->high_surrogate = cp;
+        return 1;
+    }
+    return emit_utf8(parser, cp);
+}
+
+static void value_done(struct ResponseParser *parser) {
+    if (parser->depth == 0) {
+        parser->documents++;
+        parser->state = PS_VALUE; // Another top-level value may follow
+    } else {
+        parser->state = PS_AFTER;
+    }
+}
+
+static void string_done(struct ResponseParser *parser) {
+    if (parser->field == F_KEY) {
+        parser->state = PS_COLON;
+        return;
+    }
+    if (parser->field == F_TEXT) parser->result.parts++;
+    parser->field = F_NONE;
+    value_done(parser);
+}
+
+static void scalar_done(struct ResponseParser *parser) {
+    parser->scalar[parser->scalar_len] = '\0';
+    long value = strtol(parser->scalar, NULL, 10);
+    struct AiResponse *r = &parser->result;
+    switch (parser->field) {
+    case F_PROMPT_TOKENS: r->prompt_tokens = value; break;
+    case F_CANDIDATE_TOKENS: r->candidate_tokens = value; break;
+    case F_TOTAL_TOKENS: r->total_tokens = value; break;
+    case F_CACHED_TOKENS: r->cached_tokens = value; break;
+    case F_ERROR_CODE: r->error_code = (int)value; break;
+    default: break;
+    }
+    parser->field = F_NONE;
+    value_done(parser);
+}
+
+static int push(struct ResponseParser *parser, char c) {
+    if (parser->depth == RESPONSE_PARSER_MAX_DEPTH) return 0;
+    int node = child_node(parser, c);
+    if (node == N_CANDIDATE) parser->result.candidates = 1;
+    struct ParserFrame *frame = &parser->stack[parser->depth++];
+    frame->is_object = c == '{';
+    frame->node = (unsigned char)node;
+    frame->index = 0;
+    parser->state = frame->is_object ? PS_KEY_OR_END : PS_VALUE_OR_END;
+    return 1;
+}
+
+static int pop(struct ResponseParser *parser, char c) {
+    if (parser->depth == 0 || parser->stack[parser->depth - 1].is_object != (c == '}')) return 0;
+    parser->depth--;
+    value_done(parser);
+    return 1;
+}
+
+static void start_string(struct ResponseParser *parser, int field) {
+    parser->field = field;
+    parser->field_len = 0;
+    parser->high_surrogate = 0;
+    if (field == F_KEY) {
+        parser->key_len = 0;
+    } else {
+        size_t size = 0;
+        char *buf = field_buffer(parser, &size);
+        if (buf) buf[0] = '\0';
+    }
+    parser->state = PS_STRING;
+}
+
+static int is_space(char c) {
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+static int is_scalar_char(char c) {
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+           c == '-' || c == '+' || c == '.';
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static int scan(struct ResponseParser *parser, const char *bytes, size_t len) {
+    size_t i = 0;
+    while (i < len) {
+        char c = bytes[i];
+        switch (parser->state) {
+        case PS_STRING: {
+            // Copy the run up to the next quote or backslash in one piece
+            size_t start = i;
+            while (i < len && bytes[i] != '"' && bytes[i] != '\\') i++;
+            if (i > start && (!flush_surrogate(parser) || !capture(parser, bytes + start, i - start))) return 0;
+            if (i == len) return 1;
+            if (bytes[i++] == '"') {
+                if (!flush_surrogate(parser)) return 0;
+                string_done(parser);
+            } else {
+                parser->state = PS_ESCAPE;
+            }
+            break;
+        }
+        case PS_ESCAPE: {
+            char out;
+            switch (c) {
+            case '"': case '\\': case '/': out = c; break;
+            case 'b': out = '\b'; break;
+            case 'f': out = '\f'; break;
+            case 'n': out = '\n'; break;
+            case 'r': out = '\r'; break;
+            case 't': out = '\t'; break;
+            case 'u':
+                parser->code = 0;
+                parser->code_digits = 0;
+                parser->state = PS_UNICODE;
+                i++;
+                continue;
+            default:
+                return 0;
+            }
+            if (!flush_surrogate(parser) || !capture(parser, &out, 1)) return 0;
+            parser->state = PS_STRING;
+            i++;
+            break;
+        }
+        case PS_UNICODE: {
+            int v = hex_value(c);
+            if (v < 0) return 0;
+            parser->code = parser->code * 16 + (unsigned int)v;
+            if (++parser->code_digits == 4) {
+                if (!emit_codepoint(parser, parser->code)) return 0;
+                parser->state = PS_STRING;
+            }
+            i++;
+            break;
+        }
+        case PS_SCALAR:
+            if (is_scalar_char(c)) {
+                if (parser->scalar_len < (int)sizeof(parser->scalar) - 1) parser->scalar[parser->scalar_len++] = c;
+                i++;
+            } else {
+                scalar_done(parser); // c is handled by the next state
+            }
+            break;
+        case PS_VALUE:
+        case PS_VALUE_OR_END:
+            if (is_space(c)) {
+                i++;
+            } else if (c == '{' || c == '[') {
+                if (!push(parser, c)) return 0;
+                i++;
+            } else if (c == '"') {
+                start_string(parser, child_field(parser, 1));
+                i++;
+            } else if (c == ']' && parser->state == PS_VALUE_OR_END) {
+                if (!pop(parser, c)) return 0;
+                i++;
+            } else if (is_scalar_char(c)) {
+                parser->field = child_field(parser, 0);
+                parser->scalar_len = 0;
+                parser->state = PS_SCALAR;
+            } else {
+                return 0;
+            }
+            break;
+        case PS_KEY_OR_END:
+        case PS_KEY:
+            if (is_space(c)) {
+                i++;
+            } else if (c == '"') {
+                start_string(parser, F_KEY);
+                i++;
+            } else if (c == '}' && parser->state == PS_KEY_OR_END) {
+                if (!pop(parser, c)) return 0;
+                i++;
+            } else {
+                return 0;
+            }
+            break;
+        case PS_COLON:
+            if (c == ':') parser->state = PS_VALUE;
+            else if (!is_space(c)) return 0;
+            i++;
+            break;
+        case PS_AFTER:
+            if (is_space(c)) {
+                i++;
+            } else if (c == ',') {
+                struct ParserFrame *frame = &parser->stack[parser->depth - 1];
+                if (frame->is_object) {
+                    parser->state = PS_KEY;
+                } else {
+                    frame->index++;
+                    parser->state = PS_VALUE;
+                }
+                i++;
+            } else if (c == '}' || c == ']') {
+                if (!pop(parser, c)) return 0;
+                i++;
+            } else {
+                return 0;
+            }
+            break;
+        default:
+            return 0;
+        }
+        if (parser->failed) return 0;
+    }
+    return 1;
+}
+
+int response_parser_feed(struct ResponseParser *parser, const char *bytes, size_t len) {
+    if (parser->failed) return 0;
+    if (!scan(parser, bytes, len)) {
+        parser->failed = 1;
+        return 0;
+    }
+    return 1;
+}
+
+int response_parser_finish(struct ResponseParser *parser) {
+    if (!parser->failed && parser->state == PS_SCALAR && parser->depth == 0) scalar_done(parser);
+    return !parser->failed && parser->depth == 0 && parser->state == PS_VALUE && parser->documents > 0;
+}
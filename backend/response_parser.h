@@ -0,0 +1,67 @@
+#ifndef RESPONSE_PARSER_H
+#define RESPONSE_PARSER_H
+
+#include <stddef.h>
+#include "arena.h"
+
+#define RESPONSE_PARSER_MAX_DEPTH 64 // Deepest JSON nesting accepted
+
+// Fields pulled out of a GenerateContentResponse (or a CachedContent)
+struct AiResponse {
+    char *text; // All text parts of the first candidate, concatenated (NULL if none)
+    size_t text_len; // Bytes of text
+    int parts; // Text parts seen
+    int candidates; // Whether a first candidate was seen
+    char finish_reason[32]; // candidates[0].finishReason
+    char block_reason[32]; // promptFeedback.blockReason
+    long prompt_tokens; // usageMetadata.promptTokenCount
+    long candidate_tokens; // usageMetadata.candidatesTokenCount
+    long total_tokens; // usageMetadata.totalTokenCount
+    long cached_tokens; // usageMetadata.cachedContentTokenCount
+    int error_code; // error.code
+    char error_status[64]; // error.status
+    char error_message[512]; // error.message (truncated)
+    char name[128]; // Resource name, e.g. of a created cachedContent
+    int http_status; // Status of the upstream reply, 0 if none arrived (set by ai.c)
+    long retry_after; // Seconds upstream or the circuit breaker asked callers to wait, 0 if none
+    int upstream_error; // enum UpstreamError, 0 when upstream answered (see upstream.h)
+    char model[128]; // Model the reply came from, or the last one tried (set by ai.c)
+};
+
+// Frame of an open object or array
+struct ParserFrame {
+    unsigned char is_object; // Object (keys) or array (indices)
+    unsigned char node; // Which part of the response this container is
+    int index; // Current array index
+};
+
+// Incremental scanner over a response body. It keeps only the open
+// containers and the fields above, never the document, so bytes can be
+// fed straight from the curl write callback in any split.
+struct ResponseParser {
+    struct AiResponse result; // Extracted fields
+    struct Arena *arena; // Arena the text grows in, NULL for malloc
+    size_t text_cap; // Capacity of result.text
+    struct ParserFrame stack[RESPONSE_PARSER_MAX_DEPTH];
+    int depth; // Open containers
+    int state; // Scanner state
+    int field; // Field the current string or scalar is captured into
+    int field_len; // Bytes captured into a fixed-size field
+    char key[32]; // Current object key (truncated keys never match)
+    int key_len; // Bytes in key, -1 once truncated
+    char scalar[24]; // Current number or literal
+    int scalar_len; // Bytes in scalar
+    unsigned int code; // \uXXXX being decoded
+    int code_digits; // Hex digits read into code
+    unsigned int high_surrogate; // Pending high surrogate, 0 if none
+    int documents; // Complete top-level values seen
+    int failed; // Malformed input or allocation failure
+};
+
+void response_parser_init(struct ResponseParser *parser, struct Arena *arena); // Function to set up a parser
+void response_parser_reset(struct ResponseParser *parser); // Function to start a new document, keeping the result
+int response_parser_feed(struct ResponseParser *parser, const char *bytes, size_t len); // Function to scan bytes, 0 on malformed input
+int response_parser_finish(struct ResponseParser *parser); // Function to end input, 1 if a complete document was seen
+void response_parser_free(struct ResponseParser *parser); // Function to release malloc'd text
+
+#endif
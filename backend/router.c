@@ -0,0 +1,327 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "router.h"
+#include "metrics.h"
+#include "upstream.h"
+
+struct PoolModel {
+    char name[CONFIG_MODEL_MAX];
+    double cost;
+    double weight;
+    long rpm; // Requests per minute, 0 for unlimited
+    long max_input_tokens;
+    double budget; // Token bucket holding up to rpm requests
+    uint64_t refilled_ns; // Last budget refill
+    int failures; // Consecutive failures
+    uint64_t cooldown_until_ns; // Tried last until then
+    double latency_ms;
+    double ttft_ms;
+    unsigned long requests;
+    unsigned long errors;
+    unsigned long failovers;
+    unsigned long tokens;
+};
+
+// The pool is fixed by router_init; its mutable state is guarded by lock
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct PoolModel models[ROUTER_MAX_MODELS];
+static int model_count = 0;
+static int default_policy = ROUTER_EXPLICIT;
+static unsigned long explore_counter = 0;
+
+static __thread unsigned int explore_seed = 0;
+
+int router_valid_model(const char *name) {
+    size_t len = name ? strlen(name) : 0;
+    if (len == 0 || len >= CONFIG_MODEL_MAX) return 0;
+    for (size_t i = 0; i < len; i++) {
+        char c = name[i];
+        if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' ||
+              c == '.' || c == '_')) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int router_policy_parse(const char *name) {
+    if (!name || !name[0] || strcmp(name, "explicit") == 0) return ROUTER_EXPLICIT;
+    if (strcmp(name, "cost") == 0) return ROUTER_COST;
+    if (strcmp(name, "latency") == 0) return ROUTER_LATENCY;
+    return -1;
+}
+
+// One "name:key=value:..." entry; 0 if it is malformed
+static int parse_model(char *entry, struct PoolModel *m) {
+    char *save = NULL;
+    char *name = strtok_r(entry, ":", &save);
+    if (!router_valid_model(name)) return 0;
+    memset(m, 0, sizeof(*m));
+    snprintf(m->name, sizeof(m->name), "%s", name);
+    m->cost = 1.0;
+    m->weight = 1.0;
+    for (char *opt = strtok_r(NULL, ":", &save); opt; opt = strtok_r(NULL, ":", &save)) {
+        char *value = strchr(opt, '=');
+        if (!value) return 0;
+        *value++ = '\0';
+        char *end;
+        double number = strtod(value, &end);
+        if (end == value || *end != '\0' || number < 0) return 0;
+        if (strcmp(opt, "cost") == 0) m->cost = number;
+        else if (strcmp(opt, "weight") == 0 && number > 0) m->weight = number;
+        else if (strcmp(opt, "rpm") == 0) m->rpm = (long)number;
+        else if (strcmp(opt, "max_input") == 0) m->max_input_tokens = (long)number;
+        else return 0;
+    }
+    m->budget = (double)m->rpm;
+    m->refilled_ns = metrics_now_ns();
+    return 1;
+}
+
+int router_init(const char *spec, int policy) {
+    struct PoolModel parsed[ROUTER_MAX_MODELS];
+    int count = 0;
+    if (spec && spec[0]) {
+        char *copy = strdup(spec);
+        if (!copy) return -1;
+        char *save = NULL;
+        for (char *entry = strtok_r(copy, ",", &save); entry; entry = strtok_r(NULL, ",", &save)) {
+            while (*entry == ' ') entry++;
+            if (count == ROUTER_MAX_MODELS || !parse_model(entry, &parsed[count])) {
+                free(copy);
+                return -1;
+            }
+            count++;
+        }
+        free(copy);
+    }
+
+    pthread_mutex_lock(&lock);
+    memcpy(models, parsed, sizeof(struct PoolModel) * (size_t)count);
+    model_count = count;
+    default_policy = policy >= ROUTER_EXPLICIT && policy <= ROUTER_LATENCY ? policy : ROUTER_EXPLICIT;
+    pthread_mutex_unlock(&lock);
+    return count;
+}
+
+int router_default_policy() {
+    return default_policy;
+}
+
+static int find_model(const char *name) {
+    for (int i = 0; i < model_count; i++) {
+        if (strcmp(models[i].name, name) == 0) return i;
+    }
+    return -1;
+}
+
+// Call with lock held
+static void refill(struct PoolModel *m, uint64_t now) {
+    if (m->rpm <= 0) return;
+    m->budget += (double)(now - m->refilled_ns) / 60e9 * (double)m->rpm;
+    if (m->budget > (double)m->rpm) m->budget = (double)m->rpm;
+    m->refilled_ns = now;
+}
+
+// Latency the policy compares, 0 before any sample (so new models get tried)
+static double observed_latency(const struct PoolModel *m, int streaming) {
+    double ms = streaming ? m->ttft_ms : m->latency_ms;
+    if (ms == 0) ms = streaming ? m->latency_ms : m->ttft_ms;
+    return ms / m->weight;
+}
+
+void router_plan(struct Route *route, const struct AiConfig *config, size_t prompt_tokens, int streaming, int policy) {
+    snprintf(route->requested, sizeof(route->requested), "%s", config->model);
+    route->count = 0;
+    route->at = 0;
+    route->streaming = streaming;
+
+    pthread_mutex_lock(&lock);
+    double key[ROUTER_MAX_MODELS];
+    int ready[ROUTER_MAX_MODELS];
+    int fitting = 0;
+    uint64_t now = metrics_now_ns();
+    for (int i = 0; i < model_count; i++) {
+        fitting += models[i].max_input_tokens == 0 || prompt_tokens <= (size_t)models[i].max_input_tokens;
+    }
+    for (int i = 0; i < model_count; i++) {
+        struct PoolModel *m = &models[i];
+        // A prompt no model fits still goes somewhere; upstream has the final word
+        if (fitting > 0 && m->max_input_tokens > 0 && prompt_tokens > (size_t)m->max_input_tokens) continue;
+        refill(m, now);
+        ready[i] = now >= m->cooldown_until_ns && (m->rpm <= 0 || m->budget >= 1.0);
+        key[i] = policy == ROUTER_LATENCY ? observed_latency(m, streaming) : m->cost - m->weight * 1e-9;
+
+        // Insertion by (ready first, then key)
+        int at = route->count++;
+        while (at > 0) {
+            int prev = route->order[at - 1];
+            if (ready[prev] > ready[i] || (ready[prev] == ready[i] && key[prev] <= key[i])) break;
+            route->order[at] = prev;
+            at--;
+        }
+        route->order[at] = i;
+    }
+
+    // Keep latency estimates of the others fresh now and then
+    if (policy == ROUTER_LATENCY && route->count > 1 && ++explore_counter % ROUTER_EXPLORE == 0) {
+        if (!explore_seed) explore_seed = (unsigned int)(now ^ (uintptr_t)&explore_seed);
+        int pick = 1 + (int)(rand_r(&explore_seed) % (unsigned int)(route->count - 1));
+        if (ready[route->order[pick]]) {
+            int first = route->order[0];
+            route->order[0] = route->order[pick];
+            route->order[pick] = first;
+        }
+    }
+
+    // The configured (or session/request chosen) model is tried first, the rest stay as fallbacks
+    if (policy == ROUTER_EXPLICIT || config->model_explicit || model_count == 0) {
+        int index = find_model(config->model);
+        int at = 0;
+        while (at < route->count && route->order[at] != index) at++;
+        if (at == route->count) route->count++; // Not a fitting pool model: add it in front
+        for (; at > 0; at--) {
+            route->order[at] = route->order[at - 1];
+        }
+        route->order[0] = index;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+const char* router_model(const struct Route *route) {
+    int index = route->order[route->at];
+    return index < 0 ? route->requested : models[index].name;
+}
+
+// A model-specific failure: another model may well succeed
+static int model_failure(int error, const struct AiResponse *r) {
+    switch (error) {
+    case UPSTREAM_TRANSPORT:
+    case UPSTREAM_TIMEOUT:
+    case UPSTREAM_RATE_LIMITED:
+    case UPSTREAM_UNAVAILABLE:
+    case UPSTREAM_BAD_RESPONSE:
+        return 1;
+    case UPSTREAM_REJECTED:
+        return r->http_status == 404; // Unknown or retired model
+    default:
+        return 0;
+    }
+}
+
+void router_report(struct Route *route, int error, uint64_t latency_ns, const struct AiResponse *r) {
+    int index = route->order[route->at];
+    // Calls that never left (open circuit, no slot) or lost a hedge say nothing about the model
+    if (index < 0 || error == UPSTREAM_CIRCUIT_OPEN || error == UPSTREAM_OVERLOADED || error == UPSTREAM_CANCELLED) {
+        return;
+    }
+
+    pthread_mutex_lock(&lock);
+    struct PoolModel *m = &models[index];
+    uint64_t now = metrics_now_ns();
+    refill(m, now);
+    if (m->rpm > 0) m->budget -= 1.0;
+    m->requests++;
+    if (error == UPSTREAM_OK) {
+        double ms = (double)latency_ns / 1e6;
+        double *ewma = route->streaming ? &m->ttft_ms : &m->latency_ms;
+        *ewma = *ewma == 0 ? ms : *ewma + ROUTER_EWMA_ALPHA * (ms - *ewma);
+        m->failures = 0;
+        if (r->total_tokens > 0) m->tokens += (unsigned long)r->total_tokens;
+    } else if (model_failure(error, r)) {
+        m->errors++;
+        m->failures++;
+        // A 429 means this model's quota is spent; wait as long as upstream asks
+        if (error == UPSTREAM_RATE_LIMITED) {
+            uint64_t wait_ms = r->retry_after > 0 ? (uint64_t)r->retry_after * 1000 : ROUTER_COOLDOWN_MS;
+            m->cooldown_until_ns = now + wait_ms * 1000000ULL;
+        } else if (m->failures >= ROUTER_FAILURES) {
+            m->cooldown_until_ns = now + (uint64_t)ROUTER_COOLDOWN_MS * 1000000ULL;
+            m->failures = 0;
+        }
+    } else {
+        m->errors++;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+int router_can_fail_over(const struct Route *route, const struct AiResponse *r) {
+    return route->at + 1 < route->count && model_failure(r->upstream_error, r);
+}
+
+void router_fail_over(struct Route *route) {
+    int index = route->order[route->at];
+    if (index >= 0) {
+        pthread_mutex_lock(&lock);
+        models[index].failovers++;
+        pthread_mutex_unlock(&lock);
+    }
+    route->at++;
+}
+
+int router_get_stats(struct RouterModelStats *stats, int max) {
+    pthread_mutex_lock(&lock);
+    uint64_t now = metrics_now_ns();
+    int n = model_count < max ? model_count : max;
+    for (int i = 0; i < n; i++) {
+        struct PoolModel *m = &models[i];
+        refill(m, now);
+        stats[i].name = m->name;
+        stats[i].cost = m->cost;
+        stats[i].weight = m->weight;
+        stats[i].max_input_tokens = m->max_input_tokens;
+        stats[i].healthy = now >= m->cooldown_until_ns;
+        stats[i].latency_ms = m->latency_ms;
+        stats[i].ttft_ms = m->ttft_ms;
+        stats[i].budget = m->rpm > 0 ? (m->budget > 0 ? (long)m->budget : 0) : -1;
+        stats[i].requests = m->requests;
+        stats[i].errors = m->errors;
+        stats[i].failovers = m->failovers;
+        stats[i].tokens = m->tokens;
+    }
+    pthread_mutex_unlock(&lock);
+    return n;
+}
+
+void router_render_metrics(struct ArenaBuf *buf) {
+    struct RouterModelStats stats[ROUTER_MAX_MODELS];
+    int n = router_get_stats(stats, ROUTER_MAX_MODELS);
+    if (n == 0) return;
+
+    arena_buf_puts(buf, "# HELP gemini_chat_model_requests_total Upstream attempts per pool model by result\n"
+                        "# TYPE gemini_chat_model_requests_total counter\n");
+    for (int i = 0; i < n; i++) {
+        arena_buf_printf(buf, "gemini_chat_model_requests_total{model=\"%s\",result=\"ok\"} %lu\n"
+                              "gemini_chat_model_requests_total{model=\"%s\",result=\"error\"} %lu\n",
+                         stats[i].name, stats[i].requests - stats[i].errors, stats[i].name, stats[i].errors);
+    }
+    arena_buf_puts(buf, "# HELP gemini_chat_model_failovers_total Requests moved to another model after this one failed\n"
+                        "# TYPE gemini_chat_model_failovers_total counter\n");
+    for (int i = 0; i < n; i++) {
+        arena_buf_printf(buf, "gemini_chat_model_failovers_total{model=\"%s\"} %lu\n", stats[i].name, stats[i].failovers);
+    }
+    arena_buf_puts(buf, "# HELP gemini_chat_model_tokens_total Prompt plus candidate tokens per pool model\n"
+                        "# TYPE gemini_chat_model_tokens_total counter\n");
+    for (int i = 0; i < n; i++) {
+        arena_buf_printf(buf, "gemini_chat_model_tokens_total{model=\"%s\"} %lu\n", stats[i].name, stats[i].tokens);
+    }
+    arena_buf_puts(buf, "# HELP gemini_chat_model_latency_seconds Latency EWMA per pool model (stream: first token)\n"
+                        "# TYPE gemini_chat_model_latency_seconds gauge\n");
+    for (int i = 0; i < n; i++) {
+        arena_buf_printf(buf, "gemini_chat_model_latency_seconds{model=\"%s\",kind=\"json\"} %.6f\n"
+                              "gemini_chat_model_latency_seconds{model=\"%s\",kind=\"stream\"} %.6f\n",
+                         stats[i].name, stats[i].latency_ms / 1e3, stats[i].name, stats[i].ttft_ms / 1e3);
+    }
+    arena_buf_puts(buf, "# HELP gemini_chat_model_healthy Whether a pool model is out of cooldown\n"
+                        "# TYPE gemini_chat_model_healthy gauge\n");
+    for (int i = 0; i < n; i++) {
+        arena_buf_printf(buf, "gemini_chat_model_healthy{model=\"%s\"} %d\n", stats[i].name, stats[i].healthy);
+    }
+    arena_buf_puts(buf, "# HELP gemini_chat_model_budget Requests left in the per-minute budget (-1 unlimited)\n"
+                        "# TYPE gemini_chat_model_budget gauge\n");
+    for (int i = 0; i < n; i++) {
+        arena_buf_printf(buf, "gemini_chat_model_budget{model=\"%s\"} %ld\n", stats[i].name, stats[i].budget);
+    }
+}
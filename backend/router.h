@@ -0,0 +1,69 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "arena.h"
+#include "config.h"
+#include "response_parser.h"
+
+#define ROUTER_MAX_MODELS 8 // Models in the pool
+#define ROUTER_FAILURES 3 // Consecutive failures that put a model in cooldown
+#define ROUTER_COOLDOWN_MS 15000 // Time a failing model is tried last
+#define ROUTER_EWMA_ALPHA 0.2 // Weight of the newest latency sample
+#define ROUTER_EXPLORE 50 // One latency-routed request in this many tries another model first
+
+// How the first model of a request is chosen
+enum RouterPolicy {
+    ROUTER_EXPLICIT = 0, // The configured model, the pool only as fallback
+    ROUTER_COST, // Cheapest healthy model whose context fits the prompt
+    ROUTER_LATENCY // Lowest latency EWMA, divided by weight
+};
+
+// One request's candidate models, best first
+struct Route {
+    int order[ROUTER_MAX_MODELS + 1]; // Pool indexes, -1 for the requested model when outside the pool
+    int count; // Candidates in order
+    int at; // Candidate in use
+    int streaming; // Latency is time to first token rather than the whole reply
+    char requested[CONFIG_MODEL_MAX]; // Model name behind index -1
+};
+
+struct RouterModelStats {
+    const char *name;
+    double cost; // Relative price per token
+    double weight;
+    long max_input_tokens; // 0 when unbounded
+    int healthy; // Not cooling down after failures
+    double latency_ms; // EWMA of whole JSON replies, 0 before the first sample
+    double ttft_ms; // EWMA of a stream's first token, 0 before the first sample
+    long budget; // Requests left in the current minute, -1 when unlimited
+    unsigned long requests; // Attempts sent
+    unsigned long errors; // Attempts that failed
+    unsigned long failovers; // Requests moved on to another model after this one failed
+    unsigned long tokens; // Prompt plus candidate tokens reported
+};
+
+// Parse "name[:key=value...],..." with keys cost, weight, rpm and max_input;
+// NULL or empty keeps routing off. Returns the number of models, -1 on a bad spec.
+int router_init(const char *spec, int policy);
+int router_policy_parse(const char *name); // Function to map "explicit", "cost" or "latency" to a policy, -1 if unknown
+int router_valid_model(const char *name); // Function to check a model name is safe to put in a URL
+
+// Order the candidates for one request. config->model goes first under the
+// explicit policy or when config->model_explicit is set.
+void router_plan(struct Route *route, const struct AiConfig *config, size_t prompt_tokens, int streaming, int policy);
+int router_default_policy(); // Function to read the policy from router_init
+const char* router_model(const struct Route *route); // Function to name the model in use
+
+// Record one attempt's outcome for the model in use; latency_ns is the whole
+// reply, or the first token of a stream
+void router_report(struct Route *route, int error, uint64_t latency_ns, const struct AiResponse *r);
+// Whether r's failure is one another model may not have and one is left
+int router_can_fail_over(const struct Route *route, const struct AiResponse *r);
+void router_fail_over(struct Route *route); // Function to move on to the next candidate
+
+int router_get_stats(struct RouterModelStats *stats, int max); // Function to read per-model state, returns the count
+void router_render_metrics(struct ArenaBuf *buf); // Function to append per-model series in Prometheus text format
+
+#endif
@@ -1,49 +1,180 @@
 #include <microhttpd.h>
 #include <string.h>
+#include <strings.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
 #include <json-c/json.h>
 #include "ai.h"
-#include "linked_list.h"
+#include "alloc_stats.h"
+#include "arena.h"
+#include "config.h"
+#include "context_cache.h"
+#include "encoding.h"
+#include "history_log.h"
+#include "http_pool.h"
+#include "logger.h"
+#include "metrics.h"
+#include "response_cache.h"
+#include "session_store.h"
+#include "singleflight.h"
+#include "static_files.h"
+#include "upstream.h"
+#include "router.h"
+#include "batch.h"
+#include "rag.h"
+#include "rate_limit.h"
+#include "request_body.h"
+#include "embedder.h"
+#include "vector_index.h"
+#include "worker_pool.h"
 
-#define PORT 8080 // Server port
+#define HTTP_PORT_DEFAULT 8080 // Listening port
+#define HTTP_MAX_CONNECTIONS_DEFAULT 1000 // Open connections across all server threads
+#define HTTP_TIMEOUT_DEFAULT 30 // Seconds an idle keep-alive connection is kept open
+#define HTTP_KEEPALIVE_REQUESTS_DEFAULT 1000 // Replies on one connection before it is closed
+#define DRAIN_TIMEOUT_DEFAULT 30000 // Milliseconds a shutdown waits for running chats and batches
+#define DRAIN_ABORT_GRACE_MS 2000 // After the deadline, time for aborted requests to send their errors
+#define LISTEN_FD_INHERITED 3 // First socket passed on by LISTEN_FDS, as in systemd socket activation
+#ifndef MHD_HTTP_CONTENT_TOO_LARGE
+#define MHD_HTTP_CONTENT_TOO_LARGE MHD_HTTP_PAYLOAD_TOO_LARGE // Its name before libmicrohttpd 0.9.74
+#endif
+
+// HTTP front end settings, from the command line or the environment
+struct ServerOptions {
+    int port;
+    int threads; // MHD polling threads, each with its own epoll set
+    const char *poll; // epoll, poll, select or auto
+    int max_connections;
+    int per_ip_connections; // 0 for no per-client cap
+    int timeout; // Idle seconds, 0 to never time out
+    int keepalive_requests; // 0 for no limit
+    int compress_level; // zlib level for dynamic replies, 0 to send them as is
+    int max_body; // Bytes of a JSON request body
+    int max_batch_body; // Bytes of a /batch body
+    int reuseport; // Bind with SO_REUSEPORT so another instance can share the port
+    int drain_timeout; // Milliseconds a shutdown waits for running requests
+};
+
+// Per-connection state MHD keeps across the requests of a keep-alive connection
+struct HttpConnection {
+    unsigned long replies; // Replies queued so far
+};
+
+// Upstream call for a non-streaming /chat, run on the worker pool while
+// the MHD connection is suspended
+struct ChatJob {
+    struct MHD_Connection *connection; // Suspended connection to resume
+    struct Arena *arena; // Request arena holding the job and its strings
+    struct Session *session; // Conversation the reply belongs to
+    char *message; // User message
+    uint64_t message_seq; // Position of message in the session's history
+    char *model; // Model the request asked for, NULL to let the router pick
+    struct HistoryWindow *history; // History snapshot for this turn
+    uint64_t client; // Rate limit key the reply's tokens are billed to
+    uint64_t request_id; // Log id of the /chat request
+    char *response; // AI response, set by the worker
+    struct AiResponse info; // finishReason and token usage, set by the worker
+    int done; // Set by the worker before resuming
+};
 
 struct PostContext {
-    char *buffer; // Buffer to store POST data
-    size_t size; // Size of the buffer
+    struct Arena arena; // Per-request allocations, released in request_completed
+    struct RequestBody body; // POST body, parsed or collected as it arrives
+    uint64_t parse_ns; // Time spent tokenizing the body so far
+    struct ChatJob *job; // Pending /chat upstream call, if any
+    struct ChatStream *stream; // Streamed /chat waiting for its first event, if any
+    char session_id[SESSION_ID_MAX + 1]; // Caller's session, resolved on first use
+    int new_session; // Session id was minted for this request
+    uint64_t started_ns; // Arrival time, for the end-to-end /chat histogram
+    uint64_t client; // Rate limit key of the caller, 0 when limits are off
+    uint64_t request_id; // Log id of a /chat or /batch request, 0 for others
 };
 
-struct LinkedList *chat_history; // Chat history linked list
-
-static enum MHD_Result handle_post_data(void *coninfo_cls, 
-                                      enum MHD_ValueKind kind,
-                                      const char *key,
-                                      const char *filename,
-                                      const char *content_type,
-                                      const char *transfer_encoding,
-                                      const char *data,
-                                      uint64_t off,
-                                      size_t size) {
-    struct PostContext *context = (struct PostContext *)coninfo_cls;
-    
-    // Acknowledge unused parameters
-    (void)kind;
-    (void)key;
-    (void)filename;
-    (void)content_type;
-    (void)transfer_encoding;
-    (void)off;
-    
-    char *new_buffer = realloc(context->buffer, context->size + size + 1);
-    if (!new_buffer)
-        return MHD_NO;
+static struct ServerOptions server_options;
+static struct MHD_Daemon *http_daemon;
+static struct WorkerPool *chat_workers; // Bounds concurrent upstream requests
+static struct WorkerPool *batch_workers; // Runs /batch items, apart from interactive chats
+static int draining = 0; // Shutting down: no new connections, replies close theirs (atomic)
+static int active_requests = 0; // /chat and /batch requests not yet completed (atomic)
+static void stream_release(void *cls);
+static void stream_close(void *cls);
+static size_t context_budget = HISTORY_TOKEN_BUDGET; // Tokens of summary, history and input per request
 
-    context->buffer = new_buffer;
-    memcpy(context->buffer + context->size, data, size);
-    context->size += size;
-    context->buffer[context->size] = '\0';
-    
-    return MHD_YES;
+// Names of the settings a session can override, as reported by GET /config
+static const struct {
+    unsigned field; // enum ConfigField
+    const char *name;
+} config_fields[] = {
+    { CONFIG_MODEL, "model" },
+    { CONFIG_TEMPERATURE, "temperature" },
+    { CONFIG_TOP_P, "top_p" },
+    { CONFIG_TOP_K, "top_k" },
+    { CONFIG_MAX_OUTPUT, "max_output_tokens" },
+    { CONFIG_SYSTEM_PROMPT, "system_prompt" },
+};
+
+// Background job folding a session's oldest turns into its summary
+struct CompactionJob {
+    struct Session *session; // Referenced until the job ends
+    struct HistoryWindow *old; // Turns to fold in, with the summary so far
+};
+
+// Answered exchange waiting to be embedded into the retrieval index
+struct RagIndexJob {
+    char session_id[SESSION_ID_MAX + 1];
+    uint64_t seq; // Position of the user message
+    char *user;
+    char *reply;
+};
+
+// Hand-off between the worker producing upstream deltas and the MHD reader.
+// The reader suspends the connection when nothing is queued and the worker
+// resumes it on the next event.
+struct ChatStream {
+    pthread_mutex_t lock;
+    struct MHD_Connection *connection; // Connection owning the response
+    struct Session *session; // Conversation the reply belongs to
+    int suspended; // Reader suspended the connection waiting for data
+    char *buffer; // Pending SSE bytes not yet sent to the client
+    size_t size; // Bytes pending
+    size_t cap; // Capacity of buffer
+    int sent_delta; // Whether any delta was queued
+    int done; // Producer finished
+    int closed; // Nobody reads any more (client gone); new output is dropped
+    int refs; // Producer job + MHD response
+    const char *content_type; // text/event-stream for /chat, application/x-ndjson for /batch
+    struct Encoder *encoder; // Compresses the reply, NULL when it goes out as is
+    char *message; // User message
+    uint64_t message_seq; // Position of message in the session's history
+    char *model; // Model the request asked for, NULL to let the router pick
+    struct HistoryWindow *history; // History snapshot for this turn
+    uint64_t started_ns; // Arrival time of the /chat request
+    uint64_t client; // Rate limit key the reply's tokens are billed to
+    uint64_t request_id; // Log id of the /chat request
+    int error; // enum UpstreamError of a failure before any text, answered with a status code
+    long retry_after; // Seconds the client should wait after that failure
+    char *error_message; // Description of that failure
+};
+
+// Take one upload chunk into the body; a chunked body that outgrows its limit
+// has no status line left to answer with, so its connection is dropped
+static enum MHD_Result handle_post_data(struct PostContext *context, const char *data, size_t size) {
+    metrics_add(M_BYTES_IN, size);
+    uint64_t start = metrics_now_ns();
+    int state = request_body_feed(&context->body, data, size);
+    context->parse_ns += metrics_now_ns() - start;
+    if (state == BODY_TOO_LARGE) {
+        metrics_add(M_BODIES_TOO_LARGE, 1);
+        return MHD_NO;
+    }
+    return state == BODY_FAILED ? MHD_NO : MHD_YES; // Invalid JSON is answered once the body is in
 }
 
 static void request_completed(void *cls,
@@ -57,17 +188,739 @@ static void request_completed(void *cls,
     
     struct PostContext *context = *con_cls;
     if (context) {
-        if (context->buffer)
-            free(context->buffer);
+        if (context->request_id) __atomic_sub_fetch(&active_requests, 1, __ATOMIC_RELAXED);
+        if (context->job)
+            session_release(context->job->session); // Still set if the job was rejected
+        if (context->stream)
+            stream_close(context->stream); // Connection closed before the stream started
+        request_body_free(&context->body);
+        arena_free(&context->arena); // Job, history, payload and reply
         free(context);
         *con_cls = NULL;
     }
 }
 
-static struct MHD_Response* json_response_from_obj(struct json_object *obj) {
-    const char *response_str = json_object_to_json_string(obj);
-    char *response_copy = strdup(response_str);
-    return MHD_create_response_from_buffer(strlen(response_copy), (void*)response_copy, MHD_RESPMEM_MUST_FREE);
+// Start and end of a connection: count its replies for the keep-alive limit
+static void notify_connection(void *cls, struct MHD_Connection *connection, void **socket_context,
+                              enum MHD_ConnectionNotificationCode toe) {
+    (void)cls;
+    (void)connection;
+    if (toe == MHD_CONNECTION_NOTIFY_STARTED) {
+        *socket_context = calloc(1, sizeof(struct HttpConnection)); // NULL only skips the limit
+    } else {
+        free(*socket_context);
+        *socket_context = NULL;
+    }
+}
+
+// Queue response and drop our reference to it. The reply that uses up the
+// connection's keep-alive budget, or any reply while draining, asks the client
+// to reconnect.
+static enum MHD_Result queue_response(struct MHD_Connection *connection, unsigned int status,
+                                      struct MHD_Response *response) {
+    const union MHD_ConnectionInfo *info = MHD_get_connection_info(connection, MHD_CONNECTION_INFO_SOCKET_CONTEXT);
+    struct HttpConnection *http = info ? (struct HttpConnection *)info->socket_context : NULL;
+    if ((http && server_options.keepalive_requests > 0 &&
+         ++http->replies >= (unsigned long)server_options.keepalive_requests) ||
+        __atomic_load_n(&draining, __ATOMIC_RELAXED)) {
+        MHD_add_response_header(response, "Connection", "close");
+    }
+    enum MHD_Result ret = MHD_queue_response(connection, status, response);
+    MHD_destroy_response(response);
+    return ret;
+}
+
+// Response over a finished body of len bytes, gzip or deflate encoded when the
+// client accepts it and the body is big enough to gain. The body stays valid
+// until release(cls); pass NULL for bodies that outlive the request (its arena).
+static struct MHD_Response* body_response(struct MHD_Connection *connection, const char *data, size_t len,
+                                          MHD_ContentReaderFreeCallback release, void *cls) {
+    int encoding = len >= ENCODING_MIN_BYTES
+                       ? encoding_negotiate(MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "Accept-Encoding"))
+                       : ENCODING_IDENTITY;
+    size_t encoded_len = 0;
+    char *encoded = encoding_compress(encoding, data, len, &encoded_len);
+    struct MHD_Response *response;
+    metrics_add(M_BYTES_OUT, len);
+    if (encoded) {
+        if (release) release(cls);
+        response = MHD_create_response_from_buffer(encoded_len, encoded, MHD_RESPMEM_MUST_FREE);
+        if (!response) {
+            free(encoded);
+            return NULL;
+        }
+        MHD_add_response_header(response, "Content-Encoding", encoding_name(encoding));
+        metrics_add(M_COMPRESSED_RESPONSES, 1);
+        metrics_add(M_COMPRESS_BYTES_RAW, len);
+        metrics_add(M_COMPRESS_BYTES_ENCODED, encoded_len);
+    } else {
+        response = MHD_create_response_from_buffer_with_free_callback_cls(len, data, release, cls);
+        if (!response) {
+            if (release) release(cls);
+            return NULL;
+        }
+    }
+    if (len >= ENCODING_MIN_BYTES && encoding_enabled()) MHD_add_response_header(response, "Vary", "Accept-Encoding");
+    return response;
+}
+
+// Open connections across the MHD threads, 0 before the daemon is up
+static unsigned int http_connections() {
+    struct MHD_Daemon *daemon = __atomic_load_n(&http_daemon, __ATOMIC_ACQUIRE);
+    const union MHD_DaemonInfo *info = daemon ? MHD_get_daemon_info(daemon, MHD_DAEMON_INFO_CURRENT_CONNECTIONS) : NULL;
+    return info ? info->num_connections : 0;
+}
+
+static void json_release(void *cls) {
+    json_object_put((struct json_object *)cls);
+}
+
+// Reply straight from json-c's own serialization buffer; the response takes over obj
+static struct MHD_Response* json_response_from_obj(struct MHD_Connection *connection, struct json_object *obj) {
+    size_t len = 0;
+    const char *body = json_object_to_json_string_length(obj, JSON_C_TO_STRING_SPACED, &len);
+    if (!body) {
+        json_object_put(obj);
+        return NULL;
+    }
+    return body_response(connection, body, len, json_release, obj);
+}
+
+// Pick the session from X-Session-Id or the sid cookie, minting a new id if neither is usable
+static const char* resolve_session_id(struct MHD_Connection *connection, struct PostContext *context) {
+    if (context->session_id[0]) return context->session_id;
+
+    const char *id = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "X-Session-Id");
+    if (!session_id_valid(id)) id = MHD_lookup_connection_value(connection, MHD_COOKIE_KIND, "sid");
+    if (session_id_valid(id)) {
+        strcpy(context->session_id, id);
+    } else {
+        session_new_id(context->session_id, sizeof(context->session_id));
+        context->new_session = 1;
+    }
+    return context->session_id;
+}
+
+// Whom a request is charged to: its API key or session when RATE_LIMIT_KEY
+// names one and the request carries it, else the client address. Nothing is
+// minted here, so a client cannot shed its limits by dropping its session.
+static uint64_t rate_identity(struct MHD_Connection *connection) {
+    char id[256];
+    const char *value = NULL;
+    if (rate_key() == RATE_KEY_API) {
+        value = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "X-API-Key");
+        const char *auth = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "Authorization");
+        if ((!value || !value[0]) && auth && strncasecmp(auth, "Bearer ", 7) == 0) value = auth + 7;
+    } else if (rate_key() == RATE_KEY_SESSION) {
+        value = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "X-Session-Id");
+        if (!session_id_valid(value)) value = MHD_lookup_connection_value(connection, MHD_COOKIE_KIND, "sid");
+        if (!session_id_valid(value)) value = NULL;
+    }
+    if (value && value[0]) {
+        snprintf(id, sizeof(id), "%c:%s", rate_key() == RATE_KEY_API ? 'k' : 's', value);
+        return rate_client(id);
+    }
+
+    const union MHD_ConnectionInfo *info = MHD_get_connection_info(connection, MHD_CONNECTION_INFO_CLIENT_ADDRESS);
+    const struct sockaddr *addr = info ? info->client_addr : NULL;
+    char host[INET6_ADDRSTRLEN] = "";
+    if (addr && addr->sa_family == AF_INET) {
+        inet_ntop(AF_INET, &((const struct sockaddr_in *)addr)->sin_addr, host, sizeof(host));
+    } else if (addr && addr->sa_family == AF_INET6) {
+        inet_ntop(AF_INET6, &((const struct sockaddr_in6 *)addr)->sin6_addr, host, sizeof(host));
+    }
+    snprintf(id, sizeof(id), "a:%s", host);
+    return rate_client(id);
+}
+
+// Echo the session id so clients without cookies can keep using it, and the
+// request id so a reply can be matched with its log lines and trace
+static void add_session_headers(struct MHD_Response *response, const struct PostContext *context) {
+    if (!context) return;
+    if (context->request_id) {
+        char id[LOG_REQUEST_ID_LEN + 1];
+        log_format_request_id(context->request_id, id);
+        MHD_add_response_header(response, "X-Request-Id", id);
+    }
+    if (!context->session_id[0]) {
+        if (context->request_id) MHD_add_response_header(response, "Access-Control-Expose-Headers", "X-Request-Id");
+        return;
+    }
+    MHD_add_response_header(response, "X-Session-Id", context->session_id);
+    MHD_add_response_header(response, "Access-Control-Expose-Headers",
+                            context->request_id ? "X-Session-Id, X-Request-Id" : "X-Session-Id");
+    if (context->new_session) {
+        char cookie[SESSION_ID_MAX + 64];
+        snprintf(cookie, sizeof(cookie), "sid=%s; Path=/; HttpOnly; SameSite=Lax", context->session_id);
+        MHD_add_response_header(response, "Set-Cookie", cookie);
+    }
+}
+
+// Queue a JSON reply with the given status; obj goes with it
+static enum MHD_Result queue_json_response(struct MHD_Connection *connection, const struct PostContext *context,
+                                           unsigned int status, struct json_object *obj) {
+    struct MHD_Response *response = json_response_from_obj(connection, obj);
+    if (!response) return MHD_NO;
+    MHD_add_response_header(response, "Content-Type", "application/json");
+    MHD_add_response_header(response, "Access-Control-Allow-Origin", "*");
+    add_session_headers(response, context);
+    return queue_response(connection, status, response);
+}
+
+static enum MHD_Result queue_busy_response(struct MHD_Connection *connection, const struct PostContext *context) {
+    metrics_add(M_ERRORS_OVERLOAD, 1);
+    struct json_object *err = json_object_new_object();
+    json_object_object_add(err, "error", json_object_new_string("Too many requests in flight, try again"));
+    return queue_json_response(connection, context, MHD_HTTP_SERVICE_UNAVAILABLE, err);
+}
+
+// A failed upstream call: its status, with Retry-After when upstream or the breaker asked for a pause
+static enum MHD_Result queue_upstream_error(struct MHD_Connection *connection, const struct PostContext *context,
+                                            int error, long retry_after, const char *message) {
+    struct json_object *err = json_object_new_object();
+    json_object_object_add(err, "error", json_object_new_string(message ? message : "Upstream request failed"));
+    json_object_object_add(err, "type", json_object_new_string(upstream_error_name(error)));
+    struct MHD_Response *response = json_response_from_obj(connection, err);
+    if (!response) return MHD_NO;
+    MHD_add_response_header(response, "Content-Type", "application/json");
+    MHD_add_response_header(response, "Access-Control-Allow-Origin", "*");
+    if (retry_after > 0) {
+        char seconds[32];
+        snprintf(seconds, sizeof(seconds), "%ld", retry_after);
+        MHD_add_response_header(response, "Retry-After", seconds);
+    }
+    add_session_headers(response, context);
+    return queue_response(connection, upstream_http_status(error), response);
+}
+
+// A request refused by the rate limits, before any upstream work
+static enum MHD_Result queue_rate_limited(struct MHD_Connection *connection, const struct PostContext *context,
+                                          int verdict, long retry_after_ms) {
+    struct json_object *err = json_object_new_object();
+    json_object_object_add(err, "error", json_object_new_string(rate_verdict_name(verdict)));
+    json_object_object_add(err, "type", json_object_new_string("rate_limited"));
+    struct MHD_Response *response = json_response_from_obj(connection, err);
+    if (!response) return MHD_NO;
+    char seconds[32];
+    snprintf(seconds, sizeof(seconds), "%ld", retry_after_ms > 0 ? (retry_after_ms + 999) / 1000 : 1);
+    MHD_add_response_header(response, "Content-Type", "application/json");
+    MHD_add_response_header(response, "Access-Control-Allow-Origin", "*");
+    MHD_add_response_header(response, "Retry-After", seconds);
+    add_session_headers(response, context);
+    return queue_response(connection, MHD_HTTP_TOO_MANY_REQUESTS, response);
+}
+
+// A request refused for its body: 413 when it is over the limit (closing the
+// connection, whose unread body would otherwise follow), 400 when it is not
+// a JSON object
+static enum MHD_Result queue_body_error(struct MHD_Connection *connection, const struct PostContext *context,
+                                        int state, const char *message) {
+    if (state != BODY_TOO_LARGE && state != BODY_INVALID) return MHD_NO;
+    metrics_add(state == BODY_TOO_LARGE ? M_BODIES_TOO_LARGE : M_BODIES_INVALID, 1);
+    struct json_object *err = json_object_new_object();
+    json_object_object_add(err, "error", json_object_new_string(message));
+    json_object_object_add(err, "type", json_object_new_string(state == BODY_TOO_LARGE ? "too_large" : "invalid"));
+    struct MHD_Response *response = json_response_from_obj(connection, err);
+    if (!response) return MHD_NO;
+    MHD_add_response_header(response, "Content-Type", "application/json");
+    MHD_add_response_header(response, "Access-Control-Allow-Origin", "*");
+    if (state == BODY_TOO_LARGE) MHD_add_response_header(response, "Connection", "close");
+    add_session_headers(response, context);
+    return queue_response(connection, state == BODY_TOO_LARGE ? MHD_HTTP_CONTENT_TOO_LARGE : MHD_HTTP_BAD_REQUEST,
+                          response);
+}
+
+// Attach the answering model, finishReason and token usage when known
+static void add_usage(struct json_object *obj, const struct AiResponse *info) {
+    if (info->model[0]) json_object_object_add(obj, "model", json_object_new_string(info->model));
+    if (info->finish_reason[0]) {
+        json_object_object_add(obj, "finish_reason", json_object_new_string(info->finish_reason));
+    }
+    if (info->total_tokens > 0) {
+        struct json_object *usage = json_object_new_object();
+        json_object_object_add(usage, "prompt_tokens", json_object_new_int64(info->prompt_tokens));
+        json_object_object_add(usage, "candidate_tokens", json_object_new_int64(info->candidate_tokens));
+        json_object_object_add(usage, "total_tokens", json_object_new_int64(info->total_tokens));
+        json_object_object_add(obj, "usage", usage);
+    }
+}
+
+static void stream_release(void *cls) {
+    struct ChatStream *stream = (struct ChatStream *)cls;
+    pthread_mutex_lock(&stream->lock);
+    int refs = --stream->refs;
+    pthread_mutex_unlock(&stream->lock);
+    if (refs > 0) return;
+
+    pthread_mutex_destroy(&stream->lock);
+    session_release(stream->session);
+    free(stream->buffer);
+    free(stream->message);
+    free(stream->model);
+    free(stream->history);
+    free(stream->error_message);
+    if (stream->encoder) {
+        encoder_free(stream->encoder);
+        free(stream->encoder);
+    }
+    free(stream);
+}
+
+// MHD let go of the response (or never got it): stop buffering output for it
+static void stream_close(void *cls) {
+    struct ChatStream *stream = (struct ChatStream *)cls;
+    pthread_mutex_lock(&stream->lock);
+    stream->closed = 1;
+    pthread_mutex_unlock(&stream->lock);
+    stream_release(stream);
+}
+
+// Make room for needed more bytes; call with the lock held. 0 once closed.
+static int stream_reserve(struct ChatStream *stream, size_t needed) {
+    if (stream->closed) return 0;
+    if (stream->size + needed <= stream->cap) return 1;
+    size_t new_cap = stream->cap ? stream->cap * 2 : 1024;
+    while (new_cap < stream->size + needed) new_cap *= 2;
+    char *p = realloc(stream->buffer, new_cap);
+    if (!p) return 0;
+    stream->buffer = p;
+    stream->cap = new_cap;
+    return 1;
+}
+
+// Resume a reader parked for data; call with the lock held
+static void stream_wake(struct ChatStream *stream) {
+    if (stream->suspended) {
+        stream->suspended = 0;
+        MHD_resume_connection(stream->connection);
+    }
+}
+
+// Queue one SSE event ("event: <name>" is omitted for plain data events)
+static void stream_push_event(struct ChatStream *stream, const char *event, struct json_object *data) {
+    size_t data_len = 0;
+    const char *data_str = json_object_to_json_string_length(data, JSON_C_TO_STRING_PLAIN, &data_len);
+    size_t needed = data_len + (event ? strlen(event) + 8 : 0) + 9;
+
+    pthread_mutex_lock(&stream->lock);
+    if (!stream_reserve(stream, needed)) {
+        pthread_mutex_unlock(&stream->lock);
+        return;
+    }
+    int n = event ? snprintf(stream->buffer + stream->size, stream->cap - stream->size,
+                             "event: %s\ndata: %s\n\n", event, data_str)
+                  : snprintf(stream->buffer + stream->size, stream->cap - stream->size,
+                             "data: %s\n\n", data_str);
+    if (n > 0) {
+        stream->size += (size_t)n;
+        metrics_add(M_BYTES_OUT, (uint64_t)n);
+    }
+    stream_wake(stream);
+    pthread_mutex_unlock(&stream->lock);
+}
+
+// /batch result line; 0 tells the batch the client is gone
+static int batch_emit(const char *line, size_t len, void *userdata) {
+    struct ChatStream *stream = (struct ChatStream *)userdata;
+    pthread_mutex_lock(&stream->lock);
+    int ok = stream_reserve(stream, len + 1);
+    if (ok) {
+        memcpy(stream->buffer + stream->size, line, len);
+        stream->buffer[stream->size + len] = '\n';
+        stream->size += len + 1;
+        metrics_add(M_BYTES_OUT, len + 1);
+        stream_wake(stream);
+    }
+    ok = ok || !stream->closed; // A failed allocation only loses this line
+    pthread_mutex_unlock(&stream->lock);
+    return ok;
+}
+
+static void batch_done(void *userdata) {
+    struct ChatStream *stream = (struct ChatStream *)userdata;
+    pthread_mutex_lock(&stream->lock);
+    stream->done = 1;
+    stream_wake(stream);
+    pthread_mutex_unlock(&stream->lock);
+    stream_release(stream);
+}
+
+static void stream_delta(const char *text, size_t len, void *userdata) {
+    struct ChatStream *stream = (struct ChatStream *)userdata;
+    struct json_object *data = json_object_new_object();
+    json_object_object_add(data, "text", json_object_new_string_len(text, (int)len));
+    stream_push_event(stream, NULL, data);
+    json_object_put(data);
+    stream->sent_delta = 1;
+}
+
+static void compaction_run(void *arg) {
+    struct CompactionJob *job = (struct CompactionJob *)arg;
+    struct AiConfig config;
+    struct Arena arena;
+    arena_init(&arena);
+    int copied = config_resolve_copy(&config, &job->session->config, &arena);
+    char *summary = ai_summarize(&config, job->old);
+    if (!copied) config_read_end();
+    arena_free(&arena);
+    session_finish_compaction(job->session, summary, job->old->last_seq);
+    free(summary);
+    session_release(job->session);
+    free(job->old);
+    free(job);
+}
+
+// Summarize older turns once the conversation outgrows the budget; the
+// request path never waits for it and a full queue just retries next turn
+static void schedule_compaction(struct Session *session) {
+    struct HistoryWindow *old = session_begin_compaction(session, context_budget);
+    if (!old) return;
+    struct CompactionJob *job = malloc(sizeof(struct CompactionJob));
+    if (job) {
+        job->session = session;
+        job->old = old;
+        session_retain(session);
+        if (worker_pool_submit_background(chat_workers, compaction_run, job)) return;
+        session_release(session);
+        free(job);
+    }
+    session_finish_compaction(session, NULL, 0);
+    free(old);
+}
+
+static void rag_index_run(void *arg) {
+    struct RagIndexJob *job = (struct RagIndexJob *)arg;
+    rag_index_exchange(job->session_id, job->seq, job->user, job->reply);
+    free(job->user);
+    free(job->reply);
+    free(job);
+}
+
+// Make an answered exchange retrievable once it leaves the history window;
+// embedding happens off the request path and a full queue just skips it
+static void schedule_rag_index(struct Session *session, uint64_t seq, const char *message, const char *reply) {
+    if (!rag_enabled()) return;
+    struct RagIndexJob *job = malloc(sizeof(struct RagIndexJob));
+    if (!job) return;
+    snprintf(job->session_id, sizeof(job->session_id), "%s", session->id);
+    job->seq = seq;
+    job->user = strdup(message);
+    job->reply = strdup(reply);
+    if (job->user && job->reply && worker_pool_submit_background(chat_workers, rag_index_run, job)) return;
+    free(job->user);
+    free(job->reply);
+    free(job);
+}
+
+// One line per answered chat: the model and tokens, or why it failed
+static void report_chat(const struct AiResponse *info, const char *reply, uint64_t started_ns) {
+    double ms = (double)(metrics_now_ns() - started_ns) / 1e6;
+    if (info->upstream_error) {
+        log_msg(LOG_WARN, "chat_failed", "%s after %.1f ms: %s", upstream_error_name(info->upstream_error), ms,
+                reply ? reply : "");
+    } else {
+        log_msg(LOG_INFO, "chat", "%s answered in %.1f ms, %ld tokens", info->model[0] ? info->model : "upstream",
+                ms, info->total_tokens);
+    }
+}
+
+// Runs the upstream streaming call on the worker pool
+static void stream_worker(void *arg) {
+    struct ChatStream *stream = (struct ChatStream *)arg;
+    log_set_request(stream->request_id);
+
+    // The whole reply uses one copy of the settings, however /config changes meanwhile
+    struct AiConfig config;
+    struct AiResponse info;
+    struct Arena arena;
+    arena_init(&arena);
+    // Retrieved snippets go in front of the message sent upstream; history keeps it as typed
+    char *prompt = rag_augment(NULL, stream->session->id, stream->message, stream->history);
+    int copied = config_resolve_copy(&config, &stream->session->config, &arena);
+    if (stream->model) {
+        config.model = stream->model;
+        config.model_explicit = 1;
+    }
+    char *ai_response = get_ai_response_stream(&config, prompt ? prompt : stream->message, stream->history,
+                                               stream_delta, stream, &info);
+    if (!copied) config_read_end();
+    arena_free(&arena);
+    rate_charge(stream->client, info.total_tokens);
+    report_chat(&info, ai_response, stream->started_ns);
+    free(prompt);
+
+    // A failed reply stays out of history. Before any text the client still
+    // gets a status code; after it, an error event ends the stream.
+    if (info.upstream_error && !stream->sent_delta) {
+        pthread_mutex_lock(&stream->lock);
+        stream->error = info.upstream_error;
+        stream->retry_after = info.retry_after;
+        stream->error_message = ai_response;
+        ai_response = NULL;
+        pthread_mutex_unlock(&stream->lock);
+    } else if (info.upstream_error) {
+        struct json_object *err = json_object_new_object();
+        json_object_object_add(err, "error", json_object_new_string(ai_response));
+        json_object_object_add(err, "type", json_object_new_string(upstream_error_name(info.upstream_error)));
+        stream_push_event(stream, "error", err);
+        json_object_put(err);
+    } else {
+        if (!stream->sent_delta) {
+            // Nothing streamed (e.g. an empty reply); send the text as one delta
+            stream_delta(ai_response, strlen(ai_response), stream);
+        }
+        session_add_message(stream->session, ROLE_MODEL, ai_response);
+        schedule_compaction(stream->session);
+        schedule_rag_index(stream->session, stream->message_seq, stream->message, ai_response);
+
+        struct json_object *done = json_object_new_object();
+        add_usage(done, &info);
+        stream_push_event(stream, "done", done);
+        json_object_put(done);
+    }
+    free(ai_response);
+
+    uint64_t total_ns = metrics_now_ns() - stream->started_ns;
+    metrics_observe(H_CHAT_TOTAL, total_ns);
+    log_span(H_CHAT_TOTAL, stream->started_ns, total_ns);
+    log_set_request(0);
+
+    pthread_mutex_lock(&stream->lock);
+    stream->done = 1;
+    stream_wake(stream);
+    pthread_mutex_unlock(&stream->lock);
+
+    stream_release(stream);
+}
+
+static ssize_t stream_reader(void *cls, uint64_t pos, char *buf, size_t max) {
+    struct ChatStream *stream = (struct ChatStream *)cls;
+    (void)pos;
+
+    pthread_mutex_lock(&stream->lock);
+    if (stream->size == 0 && !stream->done && !(stream->encoder && stream->encoder->pending)) {
+        // Nothing to send yet; park the connection until the worker resumes it
+        stream->suspended = 1;
+        MHD_suspend_connection(stream->connection);
+        pthread_mutex_unlock(&stream->lock);
+        return 0;
+    }
+    if (stream->encoder) {
+        // Flushed per call, so every event is decodable on arrival; done ends the gzip/zlib stream
+        struct Encoder *encoder = stream->encoder;
+        size_t consumed = stream->size;
+        size_t n = encoder_run(encoder, stream->buffer, &consumed, buf, max, stream->done);
+        memmove(stream->buffer, stream->buffer + consumed, stream->size - consumed);
+        stream->size -= consumed;
+        pthread_mutex_unlock(&stream->lock);
+        metrics_add(M_COMPRESS_BYTES_RAW, consumed);
+        metrics_add(M_COMPRESS_BYTES_ENCODED, n);
+        if (n == 0 && encoder->finished) {
+            return encoder->failed ? MHD_CONTENT_READER_END_WITH_ERROR : MHD_CONTENT_READER_END_OF_STREAM;
+        }
+        return (ssize_t)n;
+    }
+    if (stream->size == 0) {
+        pthread_mutex_unlock(&stream->lock);
+        return MHD_CONTENT_READER_END_OF_STREAM;
+    }
+    size_t n = stream->size < max ? stream->size : max;
+    memcpy(buf, stream->buffer, n);
+    memmove(stream->buffer, stream->buffer + n, stream->size - n);
+    stream->size -= n;
+    pthread_mutex_unlock(&stream->lock);
+    return (ssize_t)n;
+}
+
+// Worker side of a non-streaming /chat
+static void chat_job_run(void *arg) {
+    struct ChatJob *job = (struct ChatJob *)arg;
+    log_set_request(job->request_id);
+
+    // Get AI response with history context, using one copy of the settings
+    struct AiConfig config;
+    // Retrieved snippets go in front of the message sent upstream; history keeps it as typed
+    const char *prompt = rag_augment(job->arena, job->session->id, job->message, job->history);
+    int copied = config_resolve_copy(&config, &job->session->config, job->arena);
+    if (job->model) {
+        config.model = job->model;
+        config.model_explicit = 1;
+    }
+    job->response = get_ai_response(job->arena, &config, prompt ? prompt : job->message, job->history, &job->info);
+    if (!copied) config_read_end();
+    rate_charge(job->client, job->info.total_tokens);
+
+    // Add AI response to chat history; a failure is only reported to the client
+    if (!job->info.upstream_error) {
+        session_add_message(job->session, ROLE_MODEL, job->response);
+        schedule_compaction(job->session);
+        schedule_rag_index(job->session, job->message_seq, job->message, job->response);
+    }
+    session_release(job->session);
+    job->session = NULL;
+    log_set_request(0);
+
+    job->done = 1;
+    MHD_resume_connection(job->connection); // Last touch; MHD may free the job after this
+}
+
+// Start the upstream call with the connection parked until its first event
+static enum MHD_Result queue_chat_stream(struct MHD_Connection *connection, struct PostContext *context,
+                                         struct Session *session, const char *message, uint64_t message_seq,
+                                         const char *model, struct HistoryWindow *history) {
+    struct ChatStream *stream = calloc(1, sizeof(struct ChatStream));
+    if (!stream) {
+        session_release(session);
+        free(history);
+        return MHD_NO;
+    }
+    pthread_mutex_init(&stream->lock, NULL);
+    stream->connection = connection;
+    stream->session = session;
+    stream->refs = 2;
+    stream->content_type = "text/event-stream";
+    stream->message = strdup(message);
+    stream->message_seq = message_seq;
+    stream->model = model ? strdup(model) : NULL;
+    stream->history = history;
+    stream->started_ns = context->started_ns;
+    stream->client = context->client;
+    stream->request_id = context->request_id;
+
+    // The worker's first event waits on the lock until the connection is suspended
+    pthread_mutex_lock(&stream->lock);
+    if (!stream->message || (model && !stream->model) || !worker_pool_submit(chat_workers, stream_worker, stream)) {
+        pthread_mutex_unlock(&stream->lock);
+        stream->refs = 1;
+        stream_release(stream);
+        return queue_busy_response(connection, context);
+    }
+    stream->suspended = 1;
+    context->stream = stream;
+    MHD_suspend_connection(connection);
+    pthread_mutex_unlock(&stream->lock);
+    return MHD_YES;
+}
+
+// Start a /batch over the collected body; results stream back as JSONL once the first is ready.
+// ?parallel=N bounds its items in flight, ?checkpoint=name makes it resumable.
+static enum MHD_Result queue_batch(struct MHD_Connection *connection, struct PostContext *context) {
+    const char *parallel = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "parallel");
+    const char *checkpoint = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "checkpoint");
+    struct ChatStream *stream = calloc(1, sizeof(struct ChatStream));
+    size_t len = 0;
+    char *body = request_body_take(&context->body, &len); // Handed to the batch as it is, no copy
+    if (!stream || !body) {
+        free(stream);
+        free(body);
+        return MHD_NO;
+    }
+    pthread_mutex_init(&stream->lock, NULL);
+    stream->connection = connection;
+    stream->refs = 2;
+    stream->content_type = "application/x-ndjson";
+    stream->started_ns = context->started_ns;
+
+    // As with chat streams, the first result waits on the lock until the connection is suspended
+    pthread_mutex_lock(&stream->lock);
+    int started = batch_start(body, len, parallel ? atoi(parallel) : 0, checkpoint && checkpoint[0] ? checkpoint : NULL,
+                              context->client, batch_emit, batch_done, stream);
+    if (started != BATCH_STARTED) {
+        pthread_mutex_unlock(&stream->lock);
+        free(body);
+        stream->refs = 1;
+        stream_release(stream);
+        if (started == BATCH_FAILED) return queue_busy_response(connection, context);
+        static const char *reasons[] = {
+            [BATCH_NO_CHECKPOINTS] = "Checkpoints are disabled (set BATCH_CHECKPOINT_DIR)",
+            [BATCH_BAD_NAME] = "Checkpoint names use letters, digits, '-' and '_' only",
+            [BATCH_BUSY] = "Another batch is using this checkpoint",
+        };
+        struct json_object *err = json_object_new_object();
+        json_object_object_add(err, "error", json_object_new_string(reasons[started]));
+        return queue_json_response(connection, context, started == BATCH_BUSY ? MHD_HTTP_CONFLICT : MHD_HTTP_BAD_REQUEST,
+                                   err);
+    }
+    stream->suspended = 1;
+    context->stream = stream;
+    MHD_suspend_connection(connection);
+    pthread_mutex_unlock(&stream->lock);
+    return MHD_YES;
+}
+
+// Called back once the stream has its first event: answer a failure that
+// came before any text with its status, or start the streamed reply
+static enum MHD_Result queue_stream_reply(struct MHD_Connection *connection, struct PostContext *context) {
+    struct ChatStream *stream = context->stream;
+    context->stream = NULL;
+
+    pthread_mutex_lock(&stream->lock);
+    int error = stream->error;
+    long retry_after = stream->retry_after;
+    pthread_mutex_unlock(&stream->lock);
+    if (error) {
+        enum MHD_Result ret = queue_upstream_error(connection, context, error, retry_after, stream->error_message);
+        stream_release(stream);
+        return ret;
+    }
+
+    // Streams are compressed whatever their size; the reader is the only user of the encoder
+    int encoding = encoding_negotiate(MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "Accept-Encoding"));
+    if (encoding != ENCODING_IDENTITY) {
+        stream->encoder = malloc(sizeof(struct Encoder));
+        if (stream->encoder && !encoder_init(stream->encoder, encoding)) {
+            free(stream->encoder);
+            stream->encoder = NULL;
+        }
+    }
+    struct MHD_Response *response = MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, 4096,
+                                                                      stream_reader, stream, stream_close);
+    if (!response) {
+        stream_release(stream);
+        return MHD_NO;
+    }
+    MHD_add_response_header(response, "Content-Type", stream->content_type);
+    MHD_add_response_header(response, "Cache-Control", "no-cache");
+    MHD_add_response_header(response, "Access-Control-Allow-Origin", "*");
+    if (encoding_enabled()) MHD_add_response_header(response, "Vary", "Accept-Encoding");
+    if (stream->encoder) {
+        MHD_add_response_header(response, "Content-Encoding", encoding_name(encoding));
+        metrics_add(M_COMPRESSED_RESPONSES, 1);
+    }
+    add_session_headers(response, context);
+    return queue_response(connection, MHD_HTTP_OK, response);
+}
+
+// Settings named in a /config body or CONFIG_FILE; values points into obj. Returns enum ConfigField bits.
+static unsigned config_values_from_json(struct json_object *obj, struct AiConfig *values) {
+    struct json_object *value = NULL;
+    unsigned fields = 0;
+    memset(values, 0, sizeof(*values));
+    if (json_object_object_get_ex(obj, "model", &value) && router_valid_model(json_object_get_string(value))) {
+        values->model = json_object_get_string(value); // It ends up in upstream URLs
+        fields |= CONFIG_MODEL;
+    }
+    if (json_object_object_get_ex(obj, "temperature", &value)) {
+        values->temperature = json_object_get_double(value);
+        fields |= CONFIG_TEMPERATURE;
+    }
+    if (json_object_object_get_ex(obj, "top_p", &value)) {
+        values->top_p = json_object_get_double(value);
+        fields |= CONFIG_TOP_P;
+    }
+    if (json_object_object_get_ex(obj, "top_k", &value)) {
+        values->top_k = json_object_get_int(value);
+        fields |= CONFIG_TOP_K;
+    }
+    if (json_object_object_get_ex(obj, "max_output_tokens", &value)) {
+        values->max_output_tokens = json_object_get_int(value);
+        fields |= CONFIG_MAX_OUTPUT;
+    }
+    if (json_object_object_get_ex(obj, "system_prompt", &value)) {
+        values->system_prompt = json_object_get_string(value); // Empty clears it
+        fields |= CONFIG_SYSTEM_PROMPT;
+    }
+    return fields;
 }
 
 static enum MHD_Result handle_request(void *cls,
@@ -85,234 +938,998 @@ static enum MHD_Result handle_request(void *cls,
     if (*con_cls == NULL) {
         struct PostContext *context = calloc(1, sizeof(struct PostContext));
         if (!context) return MHD_NO;
+        arena_init(&context->arena);
+        context->started_ns = metrics_now_ns();
         *con_cls = context;
-        return MHD_YES;
+        int batch = strcmp(method, "POST") == 0 && strcmp(url, "/batch") == 0;
+        int chat = strcmp(method, "POST") == 0 && strcmp(url, "/chat") == 0;
+        if (batch || chat) {
+            context->request_id = log_request_id(MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "X-Request-Id"));
+            __atomic_add_fetch(&active_requests, 1, __ATOMIC_RELAXED); // A shutdown waits for it
+        }
+        log_set_request(context->request_id); // Lines and spans on this thread belong to the request
+        if (strcmp(method, "POST") != 0) return MHD_YES; // Other methods take no body: its limit stays 0
+
+        // Admission control comes before the body is read or anything goes upstream
+        if ((batch || chat) && rate_enabled()) {
+            long retry_after_ms = 0;
+            context->client = rate_identity(connection);
+            int verdict = rate_admit(context->client, RATE_INTERACTIVE, &retry_after_ms);
+            if (verdict != RATE_OK) return queue_rate_limited(connection, context, verdict, retry_after_ms);
+        }
+
+        // Refuse a declared length over the route's limit before reading any of it
+        size_t limit = (size_t)(batch ? server_options.max_batch_body : server_options.max_body);
+        int state = request_body_begin(&context->body, batch ? BODY_RAW : BODY_JSON, limit,
+                                       MHD_lookup_connection_value(connection, MHD_HEADER_KIND,
+                                                                   MHD_HTTP_HEADER_CONTENT_LENGTH));
+        if (state == BODY_OK) return MHD_YES;
+        char message[64];
+        snprintf(message, sizeof(message), "Request body is over %zu bytes", limit);
+        return queue_body_error(connection, context, state, message);
     }
 
-    if (strcmp(method, "POST") == 0 && strcmp(url, "/chat") == 0) {
+    log_set_request(((struct PostContext *)*con_cls)->request_id);
+
+    // Streamed /chat or /batch whose first output arrived
+    if (((struct PostContext *)*con_cls)->stream) {
+        return queue_stream_reply(connection, *con_cls);
+    }
+
+    // Bodies are parsed or collected chunk by chunk; routes see them once complete
+    if (*upload_data_size != 0) {
+        size_t size = *upload_data_size;
+        *upload_data_size = 0;
+        return handle_post_data(*con_cls, upload_data, size);
+    }
+
+    // Completed (or rejected) /chat job after the connection was resumed
+    if (((struct PostContext *)*con_cls)->job) {
         struct PostContext *context = *con_cls;
-        
-        if (*upload_data_size != 0) {
-            handle_post_data(*con_cls, 0, NULL, NULL, NULL, NULL,
-                           upload_data, 0, *upload_data_size);
-            *upload_data_size = 0;
-            return MHD_YES;
+        struct ChatJob *job = context->job;
+        if (job->done < 0) return queue_busy_response(connection, context);
+        report_chat(&job->info, job->response, context->started_ns);
+        if (job->info.upstream_error) {
+            return queue_upstream_error(connection, context, job->info.upstream_error, job->info.retry_after,
+                                        job->response);
         }
 
-        // Parse JSON request
-        struct json_object *parsed_json = json_tokener_parse(context->buffer ? context->buffer : "{}");
+        // Serialize the reply into the request arena; it outlives the response
+        struct ArenaBuf body;
+        arena_buf_init(&body, &context->arena, strlen(job->response) + 32);
+        arena_buf_puts(&body, "{\"response\":");
+        arena_buf_json_string(&body, job->response, strlen(job->response));
+        if (job->info.model[0]) {
+            arena_buf_puts(&body, ",\"model\":");
+            arena_buf_json_string(&body, job->info.model, strlen(job->info.model));
+        }
+        if (job->info.finish_reason[0]) {
+            arena_buf_puts(&body, ",\"finish_reason\":");
+            arena_buf_json_string(&body, job->info.finish_reason, strlen(job->info.finish_reason));
+        }
+        if (job->info.total_tokens > 0) {
+            arena_buf_printf(&body, ",\"usage\":{\"prompt_tokens\":%ld,\"candidate_tokens\":%ld,\"total_tokens\":%ld}",
+                             job->info.prompt_tokens, job->info.candidate_tokens, job->info.total_tokens);
+        }
+        if (!arena_buf_puts(&body, "}")) return MHD_NO;
+
+        struct MHD_Response *response = body_response(connection, body.data, body.len, NULL, NULL);
+        if (!response) return MHD_NO;
+        MHD_add_response_header(response, "Content-Type", "application/json");
+        MHD_add_response_header(response, "Access-Control-Allow-Origin", "*");
+        add_session_headers(response, context);
+        enum MHD_Result ret = queue_response(connection, MHD_HTTP_OK, response);
+        uint64_t total_ns = metrics_now_ns() - context->started_ns;
+        metrics_observe(H_CHAT_TOTAL, total_ns);
+        log_span(H_CHAT_TOTAL, context->started_ns, total_ns);
+        return ret;
+    }
+
+    if (strcmp(method, "POST") == 0 && strcmp(url, "/chat") == 0) {
+        struct PostContext *context = *con_cls;
+
+        // The body was tokenized as it arrived; only its fields are left to read
+        uint64_t parse_start = metrics_now_ns();
+        struct json_object *parsed_json = request_body_json(&context->body);
+        if (!parsed_json) {
+            return queue_body_error(connection, context, context->body.state, "Request body must be a JSON object");
+        }
         struct json_object *message_obj = NULL;
         json_object_object_get_ex(parsed_json, "message", &message_obj);
         const char *message = message_obj ? json_object_get_string(message_obj) : "";
+        if (strlen(message) > CHAT_INPUT_MAX) {
+            json_object_put(parsed_json);
+            char reason[64];
+            snprintf(reason, sizeof(reason), "Message is over %d bytes", CHAT_INPUT_MAX);
+            return queue_body_error(connection, context, BODY_TOO_LARGE, reason);
+        }
 
-        // Get chat history before adding new message
-        char *history = get_chat_history(chat_history, 10); // Last 10 messages
-        
-        // Add user message to chat history
-        add_message(chat_history, message);
+        // Stream when asked for in the body or via the Accept header
+        struct json_object *stream_obj = NULL;
+        const char *accept = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "Accept");
+        int stream = (json_object_object_get_ex(parsed_json, "stream", &stream_obj) &&
+                      json_object_get_boolean(stream_obj)) ||
+                     (accept && strstr(accept, "text/event-stream"));
+        // An explicit model goes first for this request only; the router's pool stays the fallback
+        struct json_object *model_obj = NULL;
+        const char *model = json_object_object_get_ex(parsed_json, "model", &model_obj) &&
+                            router_valid_model(json_object_get_string(model_obj))
+                                ? json_object_get_string(model_obj) : NULL;
+        uint64_t parse_ns = context->parse_ns + metrics_now_ns() - parse_start;
+        metrics_observe(H_REQUEST_PARSE, parse_ns);
+        log_span(H_REQUEST_PARSE, metrics_now_ns() - parse_ns, parse_ns); // Chunks were tokenized as they arrived
+        metrics_add(stream ? M_CHAT_STREAMS : M_CHAT_REQUESTS, 1);
 
-        // Get AI response with history context
-        char *ai_response = get_ai_response(message, history);
-        free(history);
-        
-        // Add AI response to chat history
-        add_message(chat_history, ai_response);
+        struct Session *session = session_acquire(resolve_session_id(connection, context));
+        if (!session) {
+            json_object_put(parsed_json);
+            return MHD_NO;
+        }
 
-        // Create JSON response after getting AI response
-        struct json_object *response_obj = json_object_new_object();
-        json_object_object_add(response_obj, "response", json_object_new_string(ai_response));
+        // Get chat history before adding new message; a stream outlives the request arena.
+        // The newest whole turns that fit the budget left after the message go upstream.
+        // Retrieved context, when enabled, gets its own share of the budget.
+        size_t input_tokens = history_calibrated(history_estimate_tokens(message, strlen(message))) + rag_token_budget();
+        size_t history_budget = context_budget > input_tokens ? context_budget - input_tokens : 0;
+        struct HistoryWindow *history = session_get_history(session, history_budget, stream ? NULL : &context->arena);
         
-        struct MHD_Response *response = json_response_from_obj(response_obj);
+        // Add user message to chat history
+        uint64_t message_seq = session_add_message(session, ROLE_USER, message);
 
-        MHD_add_response_header(response, "Content-Type", "application/json");
-        MHD_add_response_header(response, "Access-Control-Allow-Origin", "*");
-        
-        int ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
-        MHD_destroy_response(response);
-        json_object_put(response_obj);
+        if (stream) {
+            enum MHD_Result ret = queue_chat_stream(connection, context, session, message, message_seq, model, history);
+            json_object_put(parsed_json);
+            return ret;
+        }
+
+        // Hand the upstream call to the worker pool and park the connection
+        struct ChatJob *job = arena_alloc(&context->arena, sizeof(struct ChatJob));
+        if (!job) {
+            session_release(session);
+            json_object_put(parsed_json);
+            return MHD_NO;
+        }
+        memset(job, 0, sizeof(*job));
+        job->connection = connection;
+        job->arena = &context->arena;
+        job->session = session;
+        job->message = arena_strdup(&context->arena, message);
+        job->message_seq = message_seq;
+        job->model = model ? arena_strdup(&context->arena, model) : NULL;
+        job->history = history;
+        job->client = context->client;
+        job->request_id = context->request_id;
+        context->job = job;
         json_object_put(parsed_json);
-        free(ai_response);
-        
-        return ret;
+
+        MHD_suspend_connection(connection);
+        if (!job->message || (model && !job->model) || !worker_pool_submit(chat_workers, chat_job_run, job)) {
+            job->done = -1; // Rejected; answered when MHD calls back in
+            MHD_resume_connection(connection);
+        }
+        return MHD_YES;
+    }
+
+    // Bulk prompts: JSONL in, one JSONL result per line out in completion order
+    if (strcmp(method, "POST") == 0 && strcmp(url, "/batch") == 0) {
+        return queue_batch(connection, *con_cls);
     }
 
-    // Config GET
+    // Config GET: global settings, or the caller's effective ones with ?scope=session
     if (strcmp(method, "GET") == 0 && strcmp(url, "/config") == 0) {
+        struct PostContext *context = *con_cls;
+        const char *scope = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "scope");
+        struct Session *session = NULL;
+        if (scope && strcmp(scope, "session") == 0) {
+            session = session_acquire(resolve_session_id(connection, context));
+            if (!session) return MHD_NO;
+        }
+
+        struct AiConfig config;
         struct json_object *cfg = json_object_new_object();
-        json_object_object_add(cfg, "model", json_object_new_string(ai_get_model()));
-        json_object_object_add(cfg, "temperature", json_object_new_double(ai_get_temperature()));
-        json_object_object_add(cfg, "top_p", json_object_new_double(ai_get_top_p()));
-        json_object_object_add(cfg, "top_k", json_object_new_int(ai_get_top_k()));
-        json_object_object_add(cfg, "max_output_tokens", json_object_new_int(ai_get_max_output_tokens()));
-        json_object_object_add(cfg, "system_prompt", json_object_new_string(ai_get_system_prompt()));
-
-        struct MHD_Response *response = json_response_from_obj(cfg);
-        MHD_add_response_header(response, "Content-Type", "application/json");
-        MHD_add_response_header(response, "Access-Control-Allow-Origin", "*");
-        enum MHD_Result ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
-        MHD_destroy_response(response);
-        json_object_put(cfg);
-        return ret;
+        config_read_begin();
+        config_resolve(&config, session ? &session->config : NULL);
+        json_object_object_add(cfg, "version", json_object_new_int64((int64_t)config.version));
+        json_object_object_add(cfg, "model", json_object_new_string(config.model));
+        json_object_object_add(cfg, "temperature", json_object_new_double(config.temperature));
+        json_object_object_add(cfg, "top_p", json_object_new_double(config.top_p));
+        json_object_object_add(cfg, "top_k", json_object_new_int(config.top_k));
+        json_object_object_add(cfg, "max_output_tokens", json_object_new_int(config.max_output_tokens));
+        json_object_object_add(cfg, "system_prompt",
+                               json_object_new_string(config.system_prompt ? config.system_prompt : ""));
+        if (session) {
+            unsigned fields = config_override_fields(&session->config);
+            struct json_object *overrides = json_object_new_array();
+            for (size_t i = 0; i < sizeof(config_fields) / sizeof(config_fields[0]); i++) {
+                if (fields & config_fields[i].field) {
+                    json_object_array_add(overrides, json_object_new_string(config_fields[i].name));
+                }
+            }
+            json_object_object_add(cfg, "overrides", overrides);
+        }
+        config_read_end();
+        session_release(session);
+        return queue_json_response(connection, context, MHD_HTTP_OK, cfg);
     }
 
-    // Config POST
+    // Config POST: publishes a new global snapshot, or with "scope": "session" sets the
+    // caller's overrides ("reset": true drops them first). Chats already running keep
+    // the snapshot they started with.
     if (strcmp(method, "POST") == 0 && strcmp(url, "/config") == 0) {
         struct PostContext *context = *con_cls;
-        if (*upload_data_size != 0) {
-            handle_post_data(*con_cls, 0, NULL, NULL, NULL, NULL,
-                           upload_data, 0, *upload_data_size);
-            *upload_data_size = 0;
-            return MHD_YES;
-        }
-        struct json_object *parsed_json = json_tokener_parse(context->buffer ? context->buffer : "{}");
-        struct json_object *model = NULL, *temperature = NULL, *top_p = NULL, *top_k = NULL, *max_out = NULL, *sys_prompt = NULL;
-        if (json_object_object_get_ex(parsed_json, "model", &model)) {
-            ai_set_model(json_object_get_string(model));
+        struct json_object *parsed_json = request_body_json(&context->body);
+        if (!parsed_json) {
+            return queue_body_error(connection, context, context->body.state, "Request body must be a JSON object");
         }
-        if (json_object_object_get_ex(parsed_json, "temperature", &temperature) ||
-            json_object_object_get_ex(parsed_json, "top_p", &top_p) ||
-            json_object_object_get_ex(parsed_json, "top_k", &top_k) ||
-            json_object_object_get_ex(parsed_json, "max_output_tokens", &max_out)) {
-            double t = temperature ? json_object_get_double(temperature) : ai_get_temperature();
-            double p = top_p ? json_object_get_double(top_p) : ai_get_top_p();
-            int k = top_k ? json_object_get_int(top_k) : ai_get_top_k();
-            int m = max_out ? json_object_get_int(max_out) : ai_get_max_output_tokens();
-            ai_set_generation_params(t, p, k, m);
-        }
-        if (json_object_object_get_ex(parsed_json, "system_prompt", &sys_prompt)) {
-            const char *sp = json_object_get_string(sys_prompt);
-            if (sp && strlen(sp) > 0) { ai_set_system_prompt(sp); } else { ai_clear_system_prompt(); }
+        struct json_object *value = NULL;
+        struct AiConfig values;
+        unsigned fields = config_values_from_json(parsed_json, &values);
+
+        int ok = 1;
+        struct Session *session = NULL;
+        if (json_object_object_get_ex(parsed_json, "scope", &value) &&
+            strcmp(json_object_get_string(value), "session") == 0) {
+            session = session_acquire(resolve_session_id(connection, context));
+            if (!session) {
+                json_object_put(parsed_json);
+                return MHD_NO;
+            }
+            if (json_object_object_get_ex(parsed_json, "reset", &value) && json_object_get_boolean(value)) {
+                ok = config_override_update(&session->config, 0, NULL);
+            }
+            if (ok && fields) ok = config_override_update(&session->config, fields, &values);
+        } else if (fields) {
+            ok = config_update(fields, &values);
         }
+        json_object_put(parsed_json); // values points into it until here
 
-        struct json_object *ok = json_object_new_object();
-        json_object_object_add(ok, "status", json_object_new_string("ok"));
-        struct MHD_Response *response = json_response_from_obj(ok);
-        MHD_add_response_header(response, "Content-Type", "application/json");
-        MHD_add_response_header(response, "Access-Control-Allow-Origin", "*");
-        enum MHD_Result ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
-        MHD_destroy_response(response);
-        json_object_put(ok);
-        json_object_put(parsed_json);
-        return ret;
+        struct AiConfig config;
+        config_read_begin();
+        config_resolve(&config, NULL);
+        uint64_t version = config.version;
+        config_read_end();
+        session_release(session);
+
+        struct json_object *reply = json_object_new_object();
+        if (!ok) {
+            json_object_object_add(reply, "error", json_object_new_string("Could not store the configuration"));
+            return queue_json_response(connection, context, MHD_HTTP_INTERNAL_SERVER_ERROR, reply);
+        }
+        json_object_object_add(reply, "status", json_object_new_string("ok"));
+        json_object_object_add(reply, "version", json_object_new_int64((int64_t)version));
+        return queue_json_response(connection, context, MHD_HTTP_OK, reply);
     }
 
     // Clear chat history
     if (strcmp(method, "POST") == 0 && strcmp(url, "/clear") == 0) {
-        // Free old list and create a new one
-        free_list(chat_history);
-        chat_history = create_list();
+        // Empty only the caller's conversation
+        struct PostContext *context = *con_cls;
+        struct Session *session = session_acquire(resolve_session_id(connection, context));
+        if (session) {
+            session_clear(session);
+            rag_forget(session->id); // Nor is it retrieved any more
+            session_release(session);
+        }
         struct json_object *ok = json_object_new_object();
         json_object_object_add(ok, "status", json_object_new_string("cleared"));
-        struct MHD_Response *response = json_response_from_obj(ok);
-        MHD_add_response_header(response, "Content-Type", "application/json");
-        MHD_add_response_header(response, "Access-Control-Allow-Origin", "*");
-        enum MHD_Result ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
-        MHD_destroy_response(response);
-        json_object_put(ok);
-        return ret;
+        return queue_json_response(connection, context, MHD_HTTP_OK, ok);
     }
 
     // Health check
     if (strcmp(method, "GET") == 0 && strcmp(url, "/health") == 0) {
         struct json_object *h = json_object_new_object();
-        json_object_object_add(h, "status", json_object_new_string("ok"));
-        struct MHD_Response *response = json_response_from_obj(h);
-        MHD_add_response_header(response, "Content-Type", "application/json");
-        MHD_add_response_header(response, "Access-Control-Allow-Origin", "*");
-        enum MHD_Result ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
-        MHD_destroy_response(response);
-        json_object_put(h);
-        return ret;
+        // Load balancers take a draining instance out of rotation
+        int stopping = __atomic_load_n(&draining, __ATOMIC_RELAXED);
+        json_object_object_add(h, "status", json_object_new_string(stopping ? "draining" : "ok"));
+
+        struct HttpPoolStats pool;
+        http_pool_get_stats(&pool);
+        struct json_object *upstream = json_object_new_object();
+        json_object_object_add(upstream, "handles_created", json_object_new_int64((int64_t)pool.handles_created));
+        json_object_object_add(upstream, "handles_reused", json_object_new_int64((int64_t)pool.handles_reused));
+        json_object_object_add(upstream, "handles_idle", json_object_new_int64((int64_t)pool.handles_idle));
+        json_object_object_add(upstream, "setup_ms", json_object_new_double(pool.setup_ms));
+        json_object_object_add(upstream, "pending_requests", json_object_new_int(worker_pool_pending(chat_workers)));
+        struct UpstreamStats control;
+        upstream_get_stats(&control);
+        static const char *circuit_names[] = { "closed", "open", "half_open" };
+        json_object_object_add(upstream, "concurrency_limit", json_object_new_double(control.limit));
+        json_object_object_add(upstream, "inflight", json_object_new_int(control.inflight));
+        json_object_object_add(upstream, "circuit", json_object_new_string(circuit_names[control.circuit]));
+        json_object_object_add(upstream, "p95_ms", json_object_new_double(control.p95_ms));
+        json_object_object_add(h, "upstream", upstream);
+
+        struct json_object *http = json_object_new_object();
+        json_object_object_add(http, "port", json_object_new_int(server_options.port));
+        json_object_object_add(http, "threads", json_object_new_int(server_options.threads));
+        json_object_object_add(http, "poll", json_object_new_string(server_options.poll));
+        json_object_object_add(http, "connections", json_object_new_int64((int64_t)http_connections()));
+        json_object_object_add(http, "max_connections", json_object_new_int(server_options.max_connections));
+        json_object_object_add(http, "per_ip_connections", json_object_new_int(server_options.per_ip_connections));
+        json_object_object_add(http, "timeout_s", json_object_new_int(server_options.timeout));
+        json_object_object_add(http, "keepalive_requests", json_object_new_int(server_options.keepalive_requests));
+        json_object_object_add(http, "compress_level", json_object_new_int(server_options.compress_level));
+        json_object_object_add(http, "max_body", json_object_new_int(server_options.max_body));
+        json_object_object_add(http, "max_batch_body", json_object_new_int(server_options.max_batch_body));
+        json_object_object_add(http, "reuseport", json_object_new_boolean(server_options.reuseport));
+        json_object_object_add(http, "drain_timeout_ms", json_object_new_int(server_options.drain_timeout));
+        json_object_object_add(http, "active_requests",
+                               json_object_new_int(__atomic_load_n(&active_requests, __ATOMIC_RELAXED)));
+        json_object_object_add(h, "http", http);
+
+        static const char *policy_names[] = { "explicit", "cost", "latency" };
+        struct RouterModelStats pool_models[ROUTER_MAX_MODELS];
+        int model_count = router_get_stats(pool_models, ROUTER_MAX_MODELS);
+        struct json_object *routing = json_object_new_object();
+        struct json_object *models = json_object_new_array();
+        json_object_object_add(routing, "policy", json_object_new_string(policy_names[router_default_policy()]));
+        for (int i = 0; i < model_count; i++) {
+            struct json_object *m = json_object_new_object();
+            json_object_object_add(m, "name", json_object_new_string(pool_models[i].name));
+            json_object_object_add(m, "cost", json_object_new_double(pool_models[i].cost));
+            json_object_object_add(m, "weight", json_object_new_double(pool_models[i].weight));
+            json_object_object_add(m, "healthy", json_object_new_boolean(pool_models[i].healthy));
+            json_object_object_add(m, "latency_ms", json_object_new_double(pool_models[i].latency_ms));
+            json_object_object_add(m, "ttft_ms", json_object_new_double(pool_models[i].ttft_ms));
+            json_object_object_add(m, "budget", json_object_new_int64(pool_models[i].budget));
+            json_object_object_add(m, "requests", json_object_new_int64((int64_t)pool_models[i].requests));
+            json_object_object_add(m, "errors", json_object_new_int64((int64_t)pool_models[i].errors));
+            json_object_object_add(m, "failovers", json_object_new_int64((int64_t)pool_models[i].failovers));
+            json_object_object_add(m, "tokens", json_object_new_int64((int64_t)pool_models[i].tokens));
+            json_object_array_add(models, m);
+        }
+        json_object_object_add(routing, "models", models);
+        json_object_object_add(h, "routing", routing);
+
+        struct SessionStoreStats store;
+        session_store_get_stats(&store);
+        struct json_object *sessions = json_object_new_object();
+        json_object_object_add(sessions, "active", json_object_new_int64((int64_t)store.sessions));
+        json_object_object_add(sessions, "evictions", json_object_new_int64((int64_t)store.evictions));
+        json_object_object_add(sessions, "expirations", json_object_new_int64((int64_t)store.expirations));
+        json_object_object_add(sessions, "bytes", json_object_new_int64((int64_t)store.bytes));
+        json_object_object_add(h, "sessions", sessions);
+
+        // Heap call counts need a build with ALLOC_STATS=1
+        struct AllocStats mem;
+        struct ArenaStats arenas;
+        alloc_stats_get(&mem);
+        arena_get_stats(&arenas);
+        struct json_object *memory = json_object_new_object();
+        json_object_object_add(memory, "rss_bytes", json_object_new_int64((int64_t)mem.rss_bytes));
+        json_object_object_add(memory, "heap_in_use", json_object_new_int64((int64_t)mem.heap_in_use));
+        json_object_object_add(memory, "counting", json_object_new_boolean(mem.counting));
+        json_object_object_add(memory, "mallocs", json_object_new_int64((int64_t)mem.mallocs));
+        json_object_object_add(memory, "reallocs", json_object_new_int64((int64_t)mem.reallocs));
+        json_object_object_add(memory, "frees", json_object_new_int64((int64_t)mem.frees));
+        json_object_object_add(memory, "live_bytes", json_object_new_int64((int64_t)mem.live_bytes));
+        json_object_object_add(memory, "peak_bytes", json_object_new_int64((int64_t)mem.peak_bytes));
+        json_object_object_add(memory, "arena_allocations", json_object_new_int64((int64_t)arenas.allocations));
+        json_object_object_add(memory, "arena_bytes", json_object_new_int64((int64_t)arenas.bytes));
+        json_object_object_add(memory, "arena_blocks_malloced", json_object_new_int64((int64_t)arenas.blocks_malloced));
+        json_object_object_add(memory, "arena_blocks_reused", json_object_new_int64((int64_t)arenas.blocks_reused));
+        json_object_object_add(h, "memory", memory);
+
+        struct StaticFilesStats files;
+        static_files_get_stats(&files);
+        struct json_object *assets = json_object_new_object();
+        json_object_object_add(assets, "assets", json_object_new_int64((int64_t)files.assets));
+        json_object_object_add(assets, "reloads", json_object_new_int64((int64_t)files.reloads));
+        json_object_object_add(assets, "not_modified", json_object_new_int64((int64_t)files.not_modified));
+        json_object_object_add(assets, "compressed", json_object_new_int64((int64_t)files.compressed));
+        json_object_object_add(h, "static", assets);
+
+        struct AiConfig current;
+        config_read_begin();
+        config_resolve(&current, NULL);
+        struct json_object *config = json_object_new_object();
+        json_object_object_add(config, "version", json_object_new_int64((int64_t)current.version));
+        config_read_end();
+        json_object_object_add(config, "retired_pending", json_object_new_int64((int64_t)config_retired_pending()));
+        json_object_object_add(h, "config", config);
+
+        struct BatchStats batches;
+        batch_get_stats(&batches);
+        struct json_object *batch = json_object_new_object();
+        json_object_object_add(batch, "active", json_object_new_int64((int64_t)batches.active));
+        json_object_object_add(batch, "items_ok", json_object_new_int64((int64_t)batches.items_ok));
+        json_object_object_add(batch, "items_failed", json_object_new_int64((int64_t)batches.items_failed));
+        json_object_object_add(batch, "items_resumed", json_object_new_int64((int64_t)batches.items_resumed));
+        json_object_object_add(h, "batch", batch);
+
+        struct RagStats rag;
+        rag_get_stats(&rag);
+        struct json_object *retrieval = json_object_new_object();
+        json_object_object_add(retrieval, "enabled", json_object_new_boolean(rag.enabled));
+        json_object_object_add(retrieval, "embedder", json_object_new_string(rag.embedder));
+        json_object_object_add(retrieval, "dim", json_object_new_int(rag.dim));
+        json_object_object_add(retrieval, "kernel", json_object_new_string(rag.kernel));
+        json_object_object_add(retrieval, "messages", json_object_new_int64((int64_t)rag.messages));
+        json_object_object_add(retrieval, "message_capacity", json_object_new_int64((int64_t)rag.message_capacity));
+        json_object_object_add(retrieval, "documents", json_object_new_int64((int64_t)rag.documents));
+        json_object_object_add(retrieval, "document_lists", json_object_new_int(rag.document_lists));
+        json_object_object_add(h, "retrieval", retrieval);
+
+        struct RateStats limits;
+        rate_get_stats(&limits);
+        static const char *rate_keys[] = { [RATE_KEY_IP] = "ip", [RATE_KEY_SESSION] = "session", [RATE_KEY_API] = "key" };
+        struct json_object *rate = json_object_new_object();
+        json_object_object_add(rate, "enabled", json_object_new_boolean(limits.enabled));
+        json_object_object_add(rate, "key", json_object_new_string(rate_keys[limits.key]));
+        json_object_object_add(rate, "clients", json_object_new_int64((int64_t)limits.clients));
+        json_object_object_add(rate, "capacity", json_object_new_int64((int64_t)limits.capacity));
+        json_object_object_add(rate, "untracked", json_object_new_int64((int64_t)limits.untracked));
+        json_object_object_add(rate, "global_requests", json_object_new_int64(limits.global_requests));
+        json_object_object_add(rate, "global_tokens", json_object_new_int64(limits.global_tokens));
+        json_object_object_add(h, "rate_limit", rate);
+
+        struct LogStats logged;
+        log_get_stats(&logged);
+        struct json_object *logging = json_object_new_object();
+        json_object_object_add(logging, "level", json_object_new_string(log_level_name(logged.level)));
+        json_object_object_add(logging, "tracing", json_object_new_boolean(logged.tracing));
+        json_object_object_add(logging, "trace_sample", json_object_new_double(logged.trace_sample));
+        json_object_object_add(logging, "payload_sample", json_object_new_double(logged.payload_sample));
+        json_object_object_add(logging, "lines", json_object_new_int64((int64_t)logged.lines));
+        json_object_object_add(logging, "spans", json_object_new_int64((int64_t)logged.spans));
+        json_object_object_add(logging, "dropped", json_object_new_int64((int64_t)logged.dropped));
+        json_object_object_add(h, "logging", logging);
+
+        struct HistoryLogStats log;
+        history_log_get_stats(&log);
+        struct json_object *persistence = json_object_new_object();
+        json_object_object_add(persistence, "enabled", json_object_new_boolean(log.enabled));
+        json_object_object_add(persistence, "records", json_object_new_int64((int64_t)log.records));
+        json_object_object_add(persistence, "bytes_written", json_object_new_int64((int64_t)log.bytes_written));
+        json_object_object_add(persistence, "fsyncs", json_object_new_int64((int64_t)log.fsyncs));
+        json_object_object_add(persistence, "compactions", json_object_new_int64((int64_t)log.compactions));
+        json_object_object_add(persistence, "dropped", json_object_new_int64((int64_t)log.dropped));
+        json_object_object_add(persistence, "write_errors", json_object_new_int64((int64_t)log.write_errors));
+        json_object_object_add(persistence, "replayed", json_object_new_int64((int64_t)log.replayed));
+        json_object_object_add(persistence, "truncated_bytes", json_object_new_int64((int64_t)log.truncated_bytes));
+        json_object_object_add(persistence, "replay_seconds", json_object_new_double(log.replay_seconds));
+        json_object_object_add(h, "persistence", persistence);
+        return queue_json_response(connection, NULL, stopping ? MHD_HTTP_SERVICE_UNAVAILABLE : MHD_HTTP_OK, h);
+    }
+
+    // Prometheus scrape: process counters and histograms, then gauges from the other modules
+    if (strcmp(method, "GET") == 0 && strcmp(url, "/metrics") == 0) {
+        struct PostContext *context = *con_cls;
+        struct SessionStoreStats store;
+        struct HttpPoolStats pool;
+        struct ResponseCacheStats cache;
+        struct AllocStats mem;
+        struct UpstreamStats control;
+        struct BatchStats batches;
+        struct RagStats rag;
+        struct RateStats limits;
+        session_store_get_stats(&store);
+        batch_get_stats(&batches);
+        rag_get_stats(&rag);
+        rate_get_stats(&limits);
+        upstream_get_stats(&control);
+        http_pool_get_stats(&pool);
+        response_cache_get_stats(&cache);
+        alloc_stats_get(&mem);
+
+        struct ArenaBuf body;
+        arena_buf_init(&body, &context->arena, 16384);
+        metrics_render(&body);
+        router_render_metrics(&body);
+        arena_buf_printf(&body,
+                         "# TYPE gemini_chat_sessions gauge\ngemini_chat_sessions %lu\n"
+                         "# TYPE gemini_chat_session_bytes gauge\ngemini_chat_session_bytes %zu\n"
+                         "# TYPE gemini_chat_upstream_pending gauge\ngemini_chat_upstream_pending %d\n"
+                         "# TYPE gemini_chat_upstream_handles_created_total counter\ngemini_chat_upstream_handles_created_total %lu\n"
+                         "# TYPE gemini_chat_upstream_handles_reused_total counter\ngemini_chat_upstream_handles_reused_total %lu\n"
+                         "# TYPE gemini_chat_cache_hits_total counter\ngemini_chat_cache_hits_total %lu\n"
+                         "# TYPE gemini_chat_cache_misses_total counter\ngemini_chat_cache_misses_total %lu\n"
+                         "# TYPE gemini_chat_resident_bytes gauge\ngemini_chat_resident_bytes %zu\n"
+                         "# TYPE gemini_chat_upstream_concurrency_limit gauge\ngemini_chat_upstream_concurrency_limit %.2f\n"
+                         "# TYPE gemini_chat_upstream_inflight gauge\ngemini_chat_upstream_inflight %d\n"
+                         "# TYPE gemini_chat_upstream_circuit_open gauge\ngemini_chat_upstream_circuit_open %d\n"
+                         "# TYPE gemini_chat_http_connections gauge\ngemini_chat_http_connections %u\n"
+                         "# TYPE gemini_chat_batches_active gauge\ngemini_chat_batches_active %lu\n"
+                         "# TYPE gemini_chat_batch_items_total counter\n"
+                         "gemini_chat_batch_items_total{result=\"ok\"} %lu\n"
+                         "gemini_chat_batch_items_total{result=\"failed\"} %lu\n"
+                         "gemini_chat_batch_items_total{result=\"resumed\"} %lu\n"
+                         "# TYPE gemini_chat_retrieval_index_entries gauge\n"
+                         "gemini_chat_retrieval_index_entries{index=\"messages\"} %lu\n"
+                         "gemini_chat_retrieval_index_entries{index=\"documents\"} %lu\n"
+                         "# TYPE gemini_chat_rate_clients gauge\ngemini_chat_rate_clients %lu\n"
+                         "# TYPE gemini_chat_rate_untracked_total counter\ngemini_chat_rate_untracked_total %lu\n",
+                         store.sessions, store.bytes, worker_pool_pending(chat_workers),
+                         pool.handles_created, pool.handles_reused, cache.hits, cache.misses, mem.rss_bytes,
+                         control.limit, control.inflight, control.circuit != 0, http_connections(), batches.active, batches.items_ok,
+                         batches.items_failed, batches.items_resumed, rag.messages, rag.documents, limits.clients,
+                         limits.untracked);
+        if (!body.data) return MHD_NO;
+
+        struct MHD_Response *response = body_response(connection, body.data, body.len, NULL, NULL);
+        if (!response) return MHD_NO;
+        MHD_add_response_header(response, "Content-Type", "text/plain; version=0.0.4");
+        return queue_response(connection, MHD_HTTP_OK, response);
+    }
+
+    // Response cache counters
+    if (strcmp(method, "GET") == 0 && strcmp(url, "/cache/stats") == 0) {
+        struct ResponseCacheStats cache;
+        response_cache_get_stats(&cache);
+        struct json_object *c = json_object_new_object();
+        json_object_object_add(c, "enabled", json_object_new_boolean(cache.enabled));
+        json_object_object_add(c, "hits", json_object_new_int64((int64_t)cache.hits));
+        json_object_object_add(c, "misses", json_object_new_int64((int64_t)cache.misses));
+        json_object_object_add(c, "bypasses", json_object_new_int64((int64_t)cache.bypasses));
+        json_object_object_add(c, "evictions", json_object_new_int64((int64_t)cache.evictions));
+        json_object_object_add(c, "entries", json_object_new_int64((int64_t)cache.entries));
+        json_object_object_add(c, "bytes", json_object_new_int64((int64_t)cache.bytes));
+        return queue_json_response(connection, NULL, MHD_HTTP_OK, c);
     }
 
     struct MHD_Response *response;
-    enum MHD_Result ret;
     
     // Handle CORS preflight
     if (strcmp(method, "OPTIONS") == 0) {
         response = MHD_create_response_from_buffer(0, NULL, MHD_RESPMEM_PERSISTENT);
         MHD_add_response_header(response, "Access-Control-Allow-Origin", "*");
         MHD_add_response_header(response, "Access-Control-Allow-Methods", "POST, GET, OPTIONS");
-        MHD_add_response_header(response, "Access-Control-Allow-Headers", "Content-Type");
-        ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
-        MHD_destroy_response(response);
-        return ret;
+        MHD_add_response_header(response, "Access-Control-Allow-Headers", "Content-Type, X-Session-Id");
+        return queue_response(connection, MHD_HTTP_OK, response);
     }
 
-    // Serve static files for GET requests
+    // Serve static files for GET requests from the in-memory asset table
     if (strcmp(method, "GET") == 0) {
-        const char *filename = url;
-        if (strcmp(url, "/") == 0) {
-            filename = "/index.html";
-        }
-        
-        char filepath[256];
-        snprintf(filepath, sizeof(filepath), "../frontend%s", filename);
-        
-        FILE *file = fopen(filepath, "rb");
-        if (!file) {
-            const char *not_found = "404 Not Found";
-            response = MHD_create_response_from_buffer(strlen(not_found),
-                                                     (void*)not_found,
-                                                     MHD_RESPMEM_PERSISTENT);
-            ret = MHD_queue_response(connection, MHD_HTTP_NOT_FOUND, response);
-            MHD_destroy_response(response);
-            return ret;
-        }
-        
-        fseek(file, 0, SEEK_END);
-        long size = ftell(file);
-        fseek(file, 0, SEEK_SET);
-        
-        char *buffer = malloc(size);
-        fread(buffer, 1, size, file);
-        fclose(file);
-        
-        response = MHD_create_response_from_buffer(size, buffer, MHD_RESPMEM_MUST_FREE);
-        
-        // Set content type based on file extension
-        if (strstr(filename, ".html")) {
-            MHD_add_response_header(response, "Content-Type", "text/html");
-        } else if (strstr(filename, ".css")) {
-            MHD_add_response_header(response, "Content-Type", "text/css");
-        } else if (strstr(filename, ".js")) {
-            MHD_add_response_header(response, "Content-Type", "application/javascript");
-        }
-    } else {
-        // Handle POST request for chat
-        const char *json_response = "{\"response\": \"Hello from C server!\"}";
-        response = MHD_create_response_from_buffer(strlen(json_response),
-                                                 (void*)json_response,
-                                                 MHD_RESPMEM_PERSISTENT);
-        MHD_add_response_header(response, "Content-Type", "application/json");
+        return static_files_serve(connection, url);
     }
-    
+
+    // Handle POST request for chat
+    const char *json_response = "{\"response\": \"Hello from C server!\"}";
+    response = MHD_create_response_from_buffer(strlen(json_response),
+                                             (void*)json_response,
+                                             MHD_RESPMEM_PERSISTENT);
+    MHD_add_response_header(response, "Content-Type", "application/json");
     MHD_add_response_header(response, "Access-Control-Allow-Origin", "*");
-    ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
-    MHD_destroy_response(response);
-    
-    return ret;
+    return queue_response(connection, MHD_HTTP_OK, response);
+}
+
+static int env_int(const char *name, int fallback) {
+    const char *value = getenv(name);
+    return value && value[0] ? atoi(value) : fallback;
+}
+
+static double env_double(const char *name, double fallback) {
+    const char *value = getenv(name);
+    return value && value[0] ? atof(value) : fallback;
+}
+
+// MHD flag for a --poll / HTTP_POLL name, -1 if unknown
+static int poll_flag(const char *name) {
+    if (strcmp(name, "epoll") == 0) return MHD_USE_EPOLL;
+    if (strcmp(name, "poll") == 0) return MHD_USE_POLL;
+    if (strcmp(name, "select") == 0) return MHD_NO_FLAG;
+    if (strcmp(name, "auto") == 0) return MHD_USE_AUTO;
+    return -1;
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s [--port N] [--threads N] [--poll epoll|poll|select|auto] [--max-connections N]\n"
+                    "          [--per-ip-connections N] [--timeout S] [--keepalive-requests N] [--compress-level 0-9]\n"
+                    "          [--max-body BYTES] [--max-batch-body BYTES] [--reuseport 0|1] [--drain-timeout MS]\n",
+            argv0);
+}
+
+// Environment first, then flags on top; 0 on a bad flag or value
+static int parse_options(int argc, char **argv, struct ServerOptions *options) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *poll = getenv("HTTP_POLL");
+    options->port = env_int("PORT", HTTP_PORT_DEFAULT);
+    options->threads = env_int("HTTP_THREADS", cores > 0 ? (int)cores : 1);
+#ifdef __linux__
+    options->poll = poll && poll[0] ? poll : "epoll";
+#else
+    options->poll = poll && poll[0] ? poll : "auto";
+#endif
+    options->max_connections = env_int("HTTP_MAX_CONNECTIONS", HTTP_MAX_CONNECTIONS_DEFAULT);
+    options->per_ip_connections = env_int("HTTP_PER_IP_CONNECTIONS", 0);
+    options->timeout = env_int("HTTP_TIMEOUT", HTTP_TIMEOUT_DEFAULT);
+    options->keepalive_requests = env_int("HTTP_KEEPALIVE_REQUESTS", HTTP_KEEPALIVE_REQUESTS_DEFAULT);
+    options->compress_level = env_int("HTTP_COMPRESS_LEVEL", ENCODING_LEVEL_DEFAULT);
+    options->max_body = env_int("HTTP_MAX_BODY", REQUEST_BODY_MAX_DEFAULT);
+    options->max_batch_body = env_int("HTTP_MAX_BATCH_BODY", REQUEST_BODY_BATCH_MAX_DEFAULT);
+    options->reuseport = env_int("HTTP_REUSEPORT", 0);
+    options->drain_timeout = env_int("DRAIN_TIMEOUT_MS", DRAIN_TIMEOUT_DEFAULT);
+
+    for (int i = 1; i < argc; i++) {
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (!value) return 0;
+        if (strcmp(argv[i], "--port") == 0) options->port = atoi(value);
+        else if (strcmp(argv[i], "--threads") == 0) options->threads = atoi(value);
+        else if (strcmp(argv[i], "--poll") == 0) options->poll = value;
+        else if (strcmp(argv[i], "--max-connections") == 0) options->max_connections = atoi(value);
+        else if (strcmp(argv[i], "--per-ip-connections") == 0) options->per_ip_connections = atoi(value);
+        else if (strcmp(argv[i], "--timeout") == 0) options->timeout = atoi(value);
+        else if (strcmp(argv[i], "--keepalive-requests") == 0) options->keepalive_requests = atoi(value);
+        else if (strcmp(argv[i], "--compress-level") == 0) options->compress_level = atoi(value);
+        else if (strcmp(argv[i], "--max-body") == 0) options->max_body = atoi(value);
+        else if (strcmp(argv[i], "--max-batch-body") == 0) options->max_batch_body = atoi(value);
+        else if (strcmp(argv[i], "--reuseport") == 0) options->reuseport = atoi(value);
+        else if (strcmp(argv[i], "--drain-timeout") == 0) options->drain_timeout = atoi(value);
+        else return 0;
+        i++;
+    }
+    return options->port > 0 && options->port < 65536 && options->threads >= 1 && poll_flag(options->poll) >= 0 &&
+           options->max_connections >= 1 && options->per_ip_connections >= 0 && options->timeout >= 0 &&
+           options->keepalive_requests >= 0 && options->compress_level >= 0 && options->compress_level <= 9 &&
+           options->max_body >= 1 && options->max_batch_body >= 1 && options->drain_timeout >= 0;
+}
+
+// CONFIG_FILE holds /config fields as one JSON object, applied at startup and on SIGHUP
+static void load_config_file(const char *path) {
+    struct json_object *obj = json_object_from_file(path);
+    if (!obj || !json_object_is_type(obj, json_type_object)) {
+        log_msg(LOG_ERROR, "config_invalid", "Could not read a JSON object from %s", path);
+        json_object_put(obj);
+        return;
+    }
+    struct AiConfig values;
+    unsigned fields = config_values_from_json(obj, &values);
+    if (fields && !config_update(fields, &values)) {
+        log_msg(LOG_ERROR, "config_invalid", "Could not store the configuration from %s", path);
+    }
+    json_object_put(obj); // values points into it until here
+}
+
+// SIGHUP: settings from CONFIG_FILE, assets from STATIC_DIR and a new LOG_FILE after rotation.
+// Chats already running keep the snapshot they started with.
+static void reload(const char *config_file) {
+    if (config_file && config_file[0]) load_config_file(config_file);
+    int assets = static_files_reload();
+    log_reopen();
+
+    struct AiConfig current;
+    config_read_begin();
+    config_resolve(&current, NULL);
+    uint64_t version = current.version;
+    config_read_end();
+    log_msg(assets ? LOG_INFO : LOG_WARN, "reload", "Configuration at version %llu, static files %s",
+            (unsigned long long)version, assets ? "reloaded" : "kept (reload failed)");
+}
+
+// Background job setting up curl and TLS once the server listens, so the first chat does not pay for it
+static void warm_upstream(void *arg) {
+    (void)arg;
+    http_pool_warm();
+}
+
+// Listening socket passed on by a predecessor (or a supervisor) through LISTEN_FDS, -1 for none
+static int inherited_listen_fd() {
+    const char *fds = getenv("LISTEN_FDS");
+    const char *pid = getenv("LISTEN_PID");
+    if (!fds || !pid || atoi(fds) != 1 || atol(pid) != (long)getpid()) return -1;
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_PID");
+    fcntl(LISTEN_FD_INHERITED, F_SETFD, FD_CLOEXEC);
+    return LISTEN_FD_INHERITED;
+}
+
+// SIGUSR2: run the binary now at path with the same arguments on our listening socket. Both
+// processes accept from it until the new one is up and sends us SIGTERM, so an upgrade
+// refuses no connection. Returns the new process, -1 on failure.
+static pid_t start_successor(struct MHD_Daemon *daemon, const char *path, char **argv) {
+    extern char **environ;
+    const union MHD_DaemonInfo *info = MHD_get_daemon_info(daemon, MHD_DAEMON_INFO_LISTEN_FD);
+    if (!info || info->listen_fd == MHD_INVALID_SOCKET) return -1;
+    int listen_fd = info->listen_fd;
+
+    // The environment is built before fork: only async-signal-safe calls may follow it
+    size_t count = 0;
+    while (environ[count]) count++;
+    char **env = calloc(count + 4, sizeof(char *));
+    if (!env) return -1;
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (strncmp(environ[i], "LISTEN_FDS=", 11) != 0 && strncmp(environ[i], "LISTEN_PID=", 11) != 0 &&
+            strncmp(environ[i], "UPGRADE_PARENT_PID=", 19) != 0) {
+            env[n++] = environ[i];
+        }
+    }
+    char parent[40];
+    char listen_pid[32] = "LISTEN_PID=";
+    snprintf(parent, sizeof(parent), "UPGRADE_PARENT_PID=%ld", (long)getpid());
+    env[n++] = (char *)"LISTEN_FDS=1";
+    env[n++] = parent;
+    env[n++] = listen_pid; // Completed in the child, which knows its pid
+    env[n] = NULL;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        char digits[20];
+        int len = 0;
+        size_t at = 11;
+        for (long v = (long)getpid(); v > 0; v /= 10) digits[len++] = (char)('0' + v % 10);
+        while (len > 0) listen_pid[at++] = digits[--len];
+        listen_pid[at] = '\0';
+        // MHD opens its socket close-on-exec; the copy at LISTEN_FD_INHERITED survives exec
+        if (listen_fd == LISTEN_FD_INHERITED) fcntl(listen_fd, F_SETFD, 0);
+        else if (dup2(listen_fd, LISTEN_FD_INHERITED) < 0) _exit(127);
+        execve(path, argv, env);
+        _exit(127);
+    }
+    free(env);
+    return pid;
+}
+
+// Wait for running /chat and /batch requests to complete; 0 if some remain at deadline_ns
+static int wait_idle(uint64_t deadline_ns) {
+    while (__atomic_load_n(&active_requests, __ATOMIC_RELAXED) > 0) {
+        if (metrics_now_ns() >= deadline_ns) return 0;
+        usleep(10000);
+    }
+    return 1;
+}
+
+// SIGTERM or SIGINT: stop accepting, let running chats and batches finish until the
+// drain timeout, then abort their upstream calls so they fail fast with an error
+static void drain(struct MHD_Daemon *daemon) {
+    uint64_t start = metrics_now_ns();
+    __atomic_store_n(&draining, 1, __ATOMIC_RELAXED);
+    MHD_socket listen_fd = MHD_quiesce_daemon(daemon);
+    if (listen_fd != MHD_INVALID_SOCKET) close(listen_fd); // A successor keeps its own copy open
+    batch_shutdown(); // Running items finish; the rest stay for a resume from the checkpoint
+    log_msg(LOG_INFO, "drain_start", "Draining %d requests for up to %d ms",
+            __atomic_load_n(&active_requests, __ATOMIC_RELAXED), server_options.drain_timeout);
+
+    if (!wait_idle(start + (uint64_t)server_options.drain_timeout * 1000000ULL)) {
+        log_msg(LOG_WARN, "drain_timeout", "Aborting the upstream calls of %d requests",
+                __atomic_load_n(&active_requests, __ATOMIC_RELAXED));
+        upstream_abort();
+        wait_idle(metrics_now_ns() + (uint64_t)DRAIN_ABORT_GRACE_MS * 1000000ULL);
+    }
+    log_msg(LOG_INFO, "drain_done", "Drained in %.0f ms", (double)(metrics_now_ns() - start) / 1e6);
 }
 
-int main() {
+int main(int argc, char **argv) {
+    uint64_t boot_ns = metrics_now_ns();
+
+    // Lifecycle signals are taken by sigwait below; they are blocked before any thread starts so
+    // every thread inherits the mask and none of them gets one
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGUSR2);
+    sigaddset(&signals, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    signal(SIGPIPE, SIG_IGN); // A client gone mid-reply is an error return, not a crash
+
+    // Upgrades run whatever binary is at this path by then
+    static char self_path[4096];
+    ssize_t self_len = readlink("/proc/self/exe", self_path, sizeof(self_path) - 1);
+    if (self_len > 0) self_path[self_len] = '\0';
+    else snprintf(self_path, sizeof(self_path), "%s", argv[0]);
+
+    if (!parse_options(argc, argv, &server_options)) {
+        usage(argv[0]);
+        return 1;
+    }
+    encoding_init(server_options.compress_level);
+
+    // JSON lines at LOG_LEVEL (debug, info, warn, error or off) to LOG_FILE, stdout by default, written
+    // by a background thread. TRACE_FILE collects stage spans of TRACE_SAMPLE of the requests as Chrome
+    // trace events; LOG_PAYLOAD_SAMPLE of the requests dump their upstream payloads at debug level.
+    struct LogSettings logging;
+    logging.level = log_level_parse(getenv("LOG_LEVEL"));
+    logging.file = getenv("LOG_FILE");
+    logging.trace_file = getenv("TRACE_FILE");
+    logging.trace_sample = env_double("TRACE_SAMPLE", 1.0);
+    logging.payload_sample = env_double("LOG_PAYLOAD_SAMPLE", 0.0);
+    if (!log_init(&logging)) {
+        fprintf(stderr, "Invalid LOG_LEVEL, LOG_FILE, TRACE_FILE or sample rate\n");
+        return 1;
+    }
+
+    config_init(); // Default generation settings
     init_ai(); // Initialize AI
-    chat_history = create_list(); // Create chat history list
+    // Optional model pool, e.g. MODEL_POOL="gemini-1.5-flash:cost=1:rpm=2000,gemini-1.5-pro:cost=10:rpm=360",
+    // routed by MODEL_POLICY (explicit, cost or latency) with failover between its models
+    int policy = router_policy_parse(getenv("MODEL_POLICY"));
+    if (policy < 0 || router_init(getenv("MODEL_POOL"), policy) < 0) {
+        fprintf(stderr, "Invalid MODEL_POOL or MODEL_POLICY\n");
+        cleanup_ai();
+        return 1;
+    }
+    // CONFIG_FILE: a JSON object of /config fields over the defaults, read again on SIGHUP
+    const char *config_file = getenv("CONFIG_FILE");
+    if (config_file && config_file[0]) load_config_file(config_file);
+    // Per-session histories; SESSION_TTL in seconds, SESSION_MEMORY_MB across all sessions
+    session_store_init(env_int("SESSION_TTL", SESSION_TTL_DEFAULT),
+                       (size_t)env_int("SESSION_MEMORY_MB", (int)(SESSION_MEMORY_DEFAULT >> 20)) << 20);
+
+    // Opt-in durable histories: HISTORY_LOG_DIR holds the logs, synced every HISTORY_LOG_FSYNC_MS
+    // and folded into snapshots past HISTORY_LOG_COMPACT_MB per shard; replayed here on startup
+    const char *log_dir = getenv("HISTORY_LOG_DIR");
+    if (log_dir && log_dir[0]) {
+        if (!history_log_open(log_dir, env_int("HISTORY_LOG_FSYNC_MS", HISTORY_LOG_FSYNC_MS_DEFAULT),
+                              (size_t)env_int("HISTORY_LOG_COMPACT_MB", (int)(HISTORY_LOG_COMPACT_DEFAULT >> 20)) << 20,
+                              session_store_restore, session_store_dump)) {
+            fprintf(stderr, "Could not open history log in %s\n", log_dir);
+        }
+    }
+
+    // Opt-in reply cache: RESPONSE_CACHE=1, sized by RESPONSE_CACHE_MB, persisted to RESPONSE_CACHE_FILE;
+    // RESPONSE_CACHE_FORCE=1 keeps it on even when temperature > 0
+    if (env_int("RESPONSE_CACHE", 0)) {
+        response_cache_init((size_t)env_int("RESPONSE_CACHE_MB", (int)(RESPONSE_CACHE_DEFAULT_BYTES >> 20)) << 20,
+                            getenv("RESPONSE_CACHE_FILE"), env_int("RESPONSE_CACHE_FORCE", 0));
+    }
+
+    // CONTEXT_TOKEN_BUDGET bounds the summary, recent turns and message sent with each chat;
+    // older turns are summarized in the background
+    int budget = env_int("CONTEXT_TOKEN_BUDGET", HISTORY_TOKEN_BUDGET);
+    context_budget = budget > 0 ? (size_t)budget : HISTORY_TOKEN_BUDGET;
+
+    // Identical in-flight prompts share one upstream call unless UPSTREAM_COALESCE=0
+    singleflight_init(env_int("UPSTREAM_COALESCE", 1));
+
+    // Opt-in upstream cachedContents for the system instruction and early turns: CONTEXT_CACHE=1,
+    // for prefixes of at least CONTEXT_CACHE_MIN_TOKENS, kept CONTEXT_CACHE_TTL seconds
+    context_cache_init(env_int("CONTEXT_CACHE", 0), env_int("CONTEXT_CACHE_MIN_TOKENS", CONTEXT_CACHE_MIN_TOKENS_DEFAULT),
+                       env_int("CONTEXT_CACHE_TTL", CONTEXT_CACHE_TTL_DEFAULT));
+
+    // UPSTREAM_CONCURRENCY caps simultaneous Gemini calls; UPSTREAM_QUEUE caps waiting ones
+    int concurrency = env_int("UPSTREAM_CONCURRENCY", WORKER_POOL_THREADS);
+    chat_workers = worker_pool_create(concurrency, env_int("UPSTREAM_QUEUE", WORKER_POOL_QUEUE));
+
+    // Timeouts, retries, the adaptive limit under UPSTREAM_CONCURRENCY, the circuit breaker and hedging
+    struct UpstreamSettings upstream;
+    upstream.connect_timeout_ms = env_int("UPSTREAM_CONNECT_TIMEOUT_MS", UPSTREAM_CONNECT_TIMEOUT_MS);
+    upstream.timeout_ms = env_int("UPSTREAM_TIMEOUT_MS", UPSTREAM_TIMEOUT_MS);
+    upstream.stream_timeout_ms = env_int("UPSTREAM_STREAM_TIMEOUT_MS", UPSTREAM_STREAM_TIMEOUT_MS);
+    upstream.idle_timeout_ms = env_int("UPSTREAM_IDLE_TIMEOUT_MS", UPSTREAM_IDLE_TIMEOUT_MS);
+    upstream.retries = env_int("UPSTREAM_RETRIES", UPSTREAM_RETRIES);
+    upstream.limit_max = concurrency > 0 ? concurrency : WORKER_POOL_THREADS;
+    upstream.queue_timeout_ms = env_int("UPSTREAM_QUEUE_TIMEOUT_MS", UPSTREAM_QUEUE_TIMEOUT_MS);
+    upstream.breaker_failures = env_int("UPSTREAM_BREAKER_FAILURES", UPSTREAM_BREAKER_FAILURES);
+    upstream.breaker_open_ms = env_int("UPSTREAM_BREAKER_OPEN_MS", UPSTREAM_BREAKER_OPEN_MS);
+    upstream.hedge = env_int("UPSTREAM_HEDGE", 0);
+    upstream_init(&upstream);
+    if (chat_workers == NULL) {
+        return 1;
+    }
+
+    // /batch items run on their own BATCH_CONCURRENCY threads, sharing the upstream limit with chats;
+    // BATCH_CHECKPOINT_DIR enables resumable batches
+    batch_workers = worker_pool_create(env_int("BATCH_CONCURRENCY", BATCH_PARALLEL_DEFAULT), WORKER_POOL_QUEUE);
+    if (batch_workers == NULL) {
+        worker_pool_destroy(chat_workers);
+        return 1;
+    }
+    batch_init(getenv("BATCH_CHECKPOINT_DIR"), batch_workers);
+
+    // Opt-in retrieval: RAG=1 adds up to RAG_K snippets (RAG_TOKEN_BUDGET tokens, similarity at least
+    // RAG_MIN_SCORE) from earlier exchanges and from the .txt/.md files in RAG_DOCS_DIR to each prompt.
+    // RAG_EMBEDDER is "hash" (local) or "gemini" (RAG_EMBED_MODEL), RAG_DIM wide.
+    if (env_int("RAG", 0)) {
+        struct RagSettings rag;
+        const char *min_score = getenv("RAG_MIN_SCORE");
+        rag.embedder = getenv("RAG_EMBEDDER");
+        rag.model = getenv("RAG_EMBED_MODEL");
+        rag.dim = env_int("RAG_DIM", EMBEDDER_DIM_DEFAULT);
+        rag.k = env_int("RAG_K", RAG_K_DEFAULT);
+        rag.token_budget = env_int("RAG_TOKEN_BUDGET", RAG_TOKEN_BUDGET_DEFAULT);
+        rag.min_score = min_score && min_score[0] ? atof(min_score) : -1;
+        rag.nprobe = env_int("RAG_NPROBE", VECTOR_INDEX_NPROBE_DEFAULT);
+        rag.messages = (size_t)env_int("RAG_MESSAGES", RAG_MESSAGES_DEFAULT);
+        rag.docs_dir = getenv("RAG_DOCS_DIR");
+        rag.index_file = getenv("RAG_INDEX_FILE");
+        if (!rag_init(&rag)) fprintf(stderr, "Invalid RAG_EMBEDDER or RAG_DIM; retrieval is off\n");
+    }
+
+    // Admission control, off unless a limit is set: per client (RATE_LIMIT_KEY ip, session or key)
+    // RATE_LIMIT_RPS with RATE_LIMIT_BURST and RATE_LIMIT_TPM upstream tokens per minute; across all
+    // clients RATE_GLOBAL_RPS and RATE_GLOBAL_TPM, of which batch items leave RATE_BULK_RESERVE unused
+    struct RateSettings rate;
+    rate.key = rate_key_parse(getenv("RATE_LIMIT_KEY"));
+    rate.rps = env_double("RATE_LIMIT_RPS", 0);
+    rate.burst = env_int("RATE_LIMIT_BURST", 0);
+    rate.tpm = env_int("RATE_LIMIT_TPM", 0);
+    rate.global_rps = env_double("RATE_GLOBAL_RPS", 0);
+    rate.global_tpm = env_int("RATE_GLOBAL_TPM", 0);
+    rate.bulk_reserve = env_double("RATE_BULK_RESERVE", RATE_BULK_RESERVE_DEFAULT);
+    rate.clients = env_int("RATE_CLIENTS", RATE_CLIENTS_DEFAULT);
+    if (!rate_init(&rate)) fprintf(stderr, "Invalid RATE_* settings; rate limits are off\n");
+
+    // Frontend assets are loaded once, precompressed and reloaded on change
+    const char *static_dir = getenv("STATIC_DIR");
+    if (!static_files_init(static_dir ? static_dir : STATIC_DIR_DEFAULT)) {
+        fprintf(stderr, "Could not load static files from %s\n", static_dir ? static_dir : STATIC_DIR_DEFAULT);
+    }
     
+    // A pool of polling threads, each with its own epoll set by default, shares the
+    // connections; MHD answers pipelined requests on a connection in order. The socket
+    // is the one a predecessor passed on when there is one; MHD_USE_ITC lets a drain
+    // stop the threads accepting.
+    int listen_fd = inherited_listen_fd();
     struct MHD_Daemon *daemon;
-    daemon = MHD_start_daemon(MHD_USE_INTERNAL_POLLING_THREAD, PORT, NULL, NULL,
-                            &handle_request, NULL,
-                            MHD_OPTION_NOTIFY_COMPLETED, request_completed, NULL,
-                            MHD_OPTION_END);
+    daemon = MHD_start_daemon(MHD_USE_INTERNAL_POLLING_THREAD | MHD_ALLOW_SUSPEND_RESUME | MHD_USE_ITC |
+                                  (unsigned int)poll_flag(server_options.poll),
+                              (uint16_t)server_options.port, NULL, NULL,
+                              &handle_request, NULL,
+                              MHD_OPTION_NOTIFY_COMPLETED, request_completed, NULL,
+                              MHD_OPTION_NOTIFY_CONNECTION, notify_connection, NULL,
+                              MHD_OPTION_THREAD_POOL_SIZE, (unsigned int)server_options.threads,
+                              MHD_OPTION_CONNECTION_LIMIT, (unsigned int)server_options.max_connections,
+                              MHD_OPTION_PER_IP_CONNECTION_LIMIT, (unsigned int)server_options.per_ip_connections,
+                              MHD_OPTION_CONNECTION_TIMEOUT, (unsigned int)server_options.timeout,
+                              MHD_OPTION_LISTENING_ADDRESS_REUSE, (unsigned int)(server_options.reuseport != 0),
+                              // Without an inherited socket the list ends here and MHD binds the port
+                              listen_fd >= 0 ? MHD_OPTION_LISTEN_SOCKET : MHD_OPTION_END, (MHD_socket)listen_fd,
+                              MHD_OPTION_END);
     
     if (daemon == NULL) {
+        fprintf(stderr, "Could not listen on port %d with %s polling\n", server_options.port, server_options.poll);
+        worker_pool_destroy(batch_workers);
+        worker_pool_destroy(chat_workers);
+        history_log_close();
+        static_files_cleanup();
         return 1;
     }
     
-    printf("Server running on port %d\n", PORT);
-    getchar();
-    
+    __atomic_store_n(&http_daemon, daemon, __ATOMIC_RELEASE);
+    worker_pool_submit_background(chat_workers, warm_upstream, NULL);
+    log_msg(LOG_INFO, "server_start", "Server running on port %d (%d threads, %s%s), ready in %.1f ms",
+            server_options.port, server_options.threads, server_options.poll,
+            listen_fd >= 0 ? ", inherited socket" : "", (double)(metrics_now_ns() - boot_ns) / 1e6);
+
+    // A predecessor that started us can go now: we accept on its socket
+    const char *parent = getenv("UPGRADE_PARENT_PID");
+    if (parent && atol(parent) == (long)getppid()) kill(getppid(), SIGTERM);
+    unsetenv("UPGRADE_PARENT_PID");
+
+    // SIGHUP reloads, SIGUSR2 hands the socket to a new binary, SIGTERM or SIGINT drains and stops
+    pid_t successor = -1;
+    for (;;) {
+        int sig = 0;
+        if (sigwait(&signals, &sig) != 0) continue;
+        if (sig == SIGHUP) {
+            reload(config_file);
+        } else if (sig == SIGUSR2) {
+            if (successor > 0) continue; // One upgrade at a time
+            successor = start_successor(daemon, self_path, argv);
+            if (successor < 0) log_msg(LOG_ERROR, "upgrade_failed", "Could not start %s", self_path);
+            else log_msg(LOG_INFO, "upgrade_start", "Started process %ld on the listening socket", (long)successor);
+        } else if (sig == SIGCHLD) {
+            // A successor that exits before taking over leaves us serving
+            int status;
+            pid_t pid;
+            while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+                if (pid != successor) continue;
+                log_msg(LOG_ERROR, "upgrade_failed", "Process %ld exited with status %d before taking over",
+                        (long)pid, WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+                successor = -1;
+            }
+        } else {
+            break;
+        }
+    }
+
+    drain(daemon);
+    worker_pool_destroy(batch_workers);
+    worker_pool_destroy(chat_workers); // Finish queued chats so no connection stays suspended
+    __atomic_store_n(&http_daemon, NULL, __ATOMIC_RELEASE);
     MHD_stop_daemon(daemon);
     cleanup_ai(); // Cleanup AI
-    free_list(chat_history); // Free chat history list
+    rag_cleanup(); // Unmap the document index
+    rate_cleanup(); // No request is admitted any more
+    history_log_close(); // Sync the last changes before the sessions go
+    session_store_cleanup(); // Free every session
+    config_cleanup(); // Sessions retired their overrides above
+    response_cache_cleanup(); // Sync the cache file and free entries
+    singleflight_cleanup(); // No flights remain once the workers are gone
+    context_cache_cleanup(); // Upstream caches expire on their own
+    static_files_cleanup(); // Stop the watcher and free assets
+    log_cleanup(); // Write out the last lines and close the trace
     return 0;
 }
@@ -0,0 +1,424 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/random.h>
+#include "session_store.h"
+
+#define SESSION_BUCKETS_INITIAL 64 // Initial buckets per shard
+
+// One lock domain: a chained hash table plus an LRU list of its sessions
+struct SessionShard {
+    pthread_mutex_t lock;
+    struct Session **buckets; // Chained hash buckets
+    size_t bucket_count; // Number of buckets (power of two)
+    size_t count; // Sessions in this shard
+    struct Session *lru_head; // Most recently used
+    struct Session *lru_tail; // Least recently used
+    size_t bytes; // History bytes held by this shard
+    unsigned long evictions; // Dropped for memory
+    unsigned long expirations; // Dropped for TTL
+} __attribute__((aligned(64)));
+
+static struct SessionShard shards[SESSION_SHARDS];
+static int session_ttl = SESSION_TTL_DEFAULT;
+static size_t shard_memory_cap = SESSION_MEMORY_DEFAULT / SESSION_SHARDS;
+
+static uint64_t hash_id(const char *id) {
+    uint64_t hash = 1469598103934665603ULL; // FNV-1a
+    for (const unsigned char *p = (const unsigned char *)id; *p; p++) {
+        hash ^= *p;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static struct SessionShard* shard_for(uint64_t hash) {
+    return &shards[hash % SESSION_SHARDS];
+}
+
+void session_store_init(int ttl_seconds, size_t memory_cap) {
+    session_ttl = ttl_seconds > 0 ? ttl_seconds : SESSION_TTL_DEFAULT;
+    if (memory_cap == 0) memory_cap = SESSION_MEMORY_DEFAULT;
+    shard_memory_cap = memory_cap / SESSION_SHARDS;
+
+    for (int i = 0; i < SESSION_SHARDS; i++) {
+        struct SessionShard *shard = &shards[i];
+        memset(shard, 0, sizeof(*shard));
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->buckets = calloc(SESSION_BUCKETS_INITIAL, sizeof(struct Session *));
+        shard->bucket_count = shard->buckets ? SESSION_BUCKETS_INITIAL : 0;
+    }
+}
+
+static void free_session(struct Session *session) {
+    pthread_mutex_destroy(&session->lock);
+    config_override_free(&session->config);
+    history_free(session->history);
+    free(session);
+}
+
+void session_store_cleanup() {
+    for (int i = 0; i < SESSION_SHARDS; i++) {
+        struct SessionShard *shard = &shards[i];
+        pthread_mutex_lock(&shard->lock);
+        struct Session *session = shard->lru_head;
+        while (session) {
+            struct Session *next = session->lru_next;
+            free_session(session);
+            session = next;
+        }
+        free(shard->buckets);
+        shard->buckets = NULL;
+        shard->bucket_count = shard->count = shard->bytes = 0;
+        shard->lru_head = shard->lru_tail = NULL;
+        pthread_mutex_unlock(&shard->lock);
+        pthread_mutex_destroy(&shard->lock);
+    }
+}
+
+int session_id_valid(const char *id) {
+    if (!id || id[0] == '\0') return 0;
+    size_t len = 0;
+    for (const char *p = id; *p; p++, len++) {
+        char c = *p;
+        int ok = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+                 (c >= '0' && c <= '9') || c == '-' || c == '_';
+        if (!ok || len >= SESSION_ID_MAX) return 0;
+    }
+    return 1;
+}
+
+void session_new_id(char *out, size_t out_size) {
+    unsigned char bytes[16];
+    if (getrandom(bytes, sizeof(bytes), 0) != (ssize_t)sizeof(bytes)) {
+        // Fall back to a clock-derived id; uniqueness matters more than secrecy here
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        uint64_t seed = hash_id("") ^ (uint64_t)ts.tv_nsec ^ ((uint64_t)ts.tv_sec << 32) ^ (uint64_t)(uintptr_t)out;
+        for (size_t i = 0; i < sizeof(bytes); i++) {
+            seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+            bytes[i] = (unsigned char)seed;
+        }
+    }
+    size_t pos = 0;
+    for (size_t i = 0; i < sizeof(bytes) && pos + 2 < out_size; i++) {
+        pos += (size_t)snprintf(out + pos, out_size - pos, "%02x", bytes[i]);
+    }
+}
+
+static void lru_unlink(struct SessionShard *shard, struct Session *session) {
+    if (session->lru_prev) session->lru_prev->lru_next = session->lru_next;
+    else shard->lru_head = session->lru_next;
+    if (session->lru_next) session->lru_next->lru_prev = session->lru_prev;
+    else shard->lru_tail = session->lru_prev;
+    session->lru_prev = session->lru_next = NULL;
+}
+
+static void lru_push_front(struct SessionShard *shard, struct Session *session) {
+    session->lru_prev = NULL;
+    session->lru_next = shard->lru_head;
+    if (shard->lru_head) shard->lru_head->lru_prev = session;
+    shard->lru_head = session;
+    if (!shard->lru_tail) shard->lru_tail = session;
+}
+
+// Remove a session from the map; returns it when the last reference is gone
+static struct Session* shard_remove(struct SessionShard *shard, struct Session *session) {
+    struct Session **slot = &shard->buckets[hash_id(session->id) & (shard->bucket_count - 1)];
+    while (*slot && *slot != session) slot = &(*slot)->hash_next;
+    if (*slot) *slot = session->hash_next;
+
+    lru_unlink(shard, session);
+    shard->count--;
+    shard->bytes -= session->bytes;
+    session->linked = 0;
+    return --session->refs == 0 ? session : NULL;
+}
+
+static void shard_grow(struct SessionShard *shard) {
+    size_t new_count = shard->bucket_count * 2;
+    struct Session **buckets = calloc(new_count, sizeof(struct Session *));
+    if (!buckets) return; // Keep the longer chains
+    for (size_t i = 0; i < shard->bucket_count; i++) {
+        struct Session *session = shard->buckets[i];
+        while (session) {
+            struct Session *next = session->hash_next;
+            size_t idx = hash_id(session->id) & (new_count - 1);
+            session->hash_next = buckets[idx];
+            buckets[idx] = session;
+            session = next;
+        }
+    }
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->bucket_count = new_count;
+}
+
+// Collect idle sessions from the LRU tail that are expired or over the memory cap.
+// Sessions in use by a request (refs > 1) are skipped.
+static struct Session* shard_evict(struct SessionShard *shard, time_t now) {
+    struct Session *freed = NULL;
+    struct Session *session = shard->lru_tail;
+    while (session) {
+        struct Session *prev = session->lru_prev;
+        int expired = now - session->last_used > session_ttl;
+        int over_cap = shard->bytes > shard_memory_cap;
+        if (!expired && !over_cap) break;
+        if (session->refs == 1) {
+            if (expired) shard->expirations++;
+            else shard->evictions++;
+            struct Session *dead = shard_remove(shard, session);
+            if (dead) {
+                dead->hash_next = freed; // Reuse the chain pointer for the free list
+                freed = dead;
+            }
+        }
+        session = prev;
+    }
+    return freed;
+}
+
+static void free_evicted(struct Session *freed) {
+    while (freed) {
+        struct Session *next = freed->hash_next;
+        free_session(freed);
+        freed = next;
+    }
+}
+
+struct Session* session_acquire(const char *id) {
+    if (!session_id_valid(id)) return NULL;
+    uint64_t hash = hash_id(id);
+    struct SessionShard *shard = shard_for(hash);
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&shard->lock);
+    struct Session *freed = shard_evict(shard, now);
+
+    struct Session *session = shard->buckets[hash & (shard->bucket_count - 1)];
+    while (session && strcmp(session->id, id) != 0) session = session->hash_next;
+
+    if (session) {
+        lru_unlink(shard, session);
+    } else {
+        session = calloc(1, sizeof(struct Session));
+        if (session) session->history = history_create(HISTORY_CAPACITY);
+        if (!session || !session->history) {
+            free(session);
+            pthread_mutex_unlock(&shard->lock);
+            free_evicted(freed);
+            return NULL;
+        }
+        strcpy(session->id, id);
+        pthread_mutex_init(&session->lock, NULL);
+        session->log_fresh = 1;
+        session->refs = 1; // Map reference
+        session->linked = 1;
+        size_t idx = hash & (shard->bucket_count - 1);
+        session->hash_next = shard->buckets[idx];
+        shard->buckets[idx] = session;
+        if (++shard->count > shard->bucket_count * 2) shard_grow(shard);
+    }
+    lru_push_front(shard, session);
+    session->last_used = now;
+    session->refs++;
+    pthread_mutex_unlock(&shard->lock);
+
+    free_evicted(freed);
+    return session;
+}
+
+void session_retain(struct Session *session) {
+    struct SessionShard *shard = shard_for(hash_id(session->id));
+    pthread_mutex_lock(&shard->lock);
+    session->refs++;
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void session_release(struct Session *session) {
+    if (!session) return;
+    struct SessionShard *shard = shard_for(hash_id(session->id));
+
+    pthread_mutex_lock(&shard->lock);
+    int refs = --session->refs;
+    pthread_mutex_unlock(&shard->lock);
+
+    if (refs == 0) free_session(session); // Already evicted from the map
+}
+
+// Adjust memory accounting, evicting idle sessions if the shard went over its cap.
+// Called with session->lock held so bytes changes stay ordered with history changes.
+static void account_bytes(struct Session *session, size_t added, size_t removed) {
+    struct SessionShard *shard = shard_for(hash_id(session->id));
+
+    pthread_mutex_lock(&shard->lock);
+    session->bytes = session->bytes + added - removed;
+    if (session->linked) shard->bytes = shard->bytes + added - removed;
+    struct Session *freed = added > removed ? shard_evict(shard, time(NULL)) : NULL;
+    pthread_mutex_unlock(&shard->lock);
+
+    free_evicted(freed);
+}
+
+// Bytes held by a history's messages and summary, including their terminators
+static size_t history_bytes(const struct ChatHistory *history) {
+    return history->total_bytes + history->count + history->summary_len;
+}
+
+// Queue a change for the history log. Called with session->lock held, so the
+// log orders a session's changes the same way memory does.
+static void log_change(struct Session *session, int type, int role, const char *text, uint64_t arg) {
+    if (!history_log_enabled()) return;
+    unsigned shard = (unsigned)(hash_id(session->id) % SESSION_SHARDS);
+    struct HistoryLogRecord record = { 0 };
+    record.id = session->id;
+    if (session->log_fresh) {
+        // An evicted session with the same id may still have records in the log
+        session->log_fresh = 0;
+        record.type = LOG_CLEAR;
+        record.text = "";
+        history_log_append(shard, &record);
+    }
+    record.type = type;
+    record.role = role;
+    record.text = text ? text : "";
+    record.len = strlen(record.text);
+    record.arg = arg;
+    history_log_append(shard, &record);
+    session->log_seq = record.seq;
+}
+
+uint64_t session_add_message(struct Session *session, int role, const char *message) {
+    pthread_mutex_lock(&session->lock);
+    size_t before = history_bytes(session->history);
+    history_append(session->history, role, message); // Drops the oldest message once the summary covers it
+    uint64_t seq = session->history->next_seq - 1;
+    log_change(session, LOG_APPEND, role, message, 0);
+    account_bytes(session, history_bytes(session->history), before);
+    pthread_mutex_unlock(&session->lock);
+    return seq;
+}
+
+struct HistoryWindow* session_get_history(struct Session *session, size_t max_tokens, struct Arena *arena) {
+    pthread_mutex_lock(&session->lock);
+    struct HistoryWindow *history = history_window(session->history, max_tokens, arena);
+    pthread_mutex_unlock(&session->lock);
+    return history;
+}
+
+struct HistoryWindow* session_begin_compaction(struct Session *session, size_t max_tokens) {
+    pthread_mutex_lock(&session->lock);
+    struct HistoryWindow *old = history_begin_compaction(session->history, max_tokens);
+    pthread_mutex_unlock(&session->lock);
+    return old;
+}
+
+void session_finish_compaction(struct Session *session, const char *summary, uint64_t through_seq) {
+    pthread_mutex_lock(&session->lock);
+    size_t before = history_bytes(session->history);
+    history_finish_compaction(session->history, summary, through_seq);
+    if (summary) log_change(session, LOG_SUMMARY, 0, summary, through_seq); // Replay makes the same decision
+    size_t after = history_bytes(session->history);
+    account_bytes(session, after, before);
+    pthread_mutex_unlock(&session->lock);
+}
+
+void session_clear(struct Session *session) {
+    pthread_mutex_lock(&session->lock);
+    history_clear(session->history);
+    log_change(session, LOG_CLEAR, 0, NULL, 0);
+    account_bytes(session, 0, session->bytes);
+    pthread_mutex_unlock(&session->lock);
+}
+
+void session_store_get_stats(struct SessionStoreStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    for (int i = 0; i < SESSION_SHARDS; i++) {
+        struct SessionShard *shard = &shards[i];
+        pthread_mutex_lock(&shard->lock);
+        stats->sessions += shard->count;
+        stats->evictions += shard->evictions;
+        stats->expirations += shard->expirations;
+        stats->bytes += shard->bytes;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+void session_store_restore(const struct HistoryLogRecord *record) {
+    struct Session *session = session_acquire(record->id);
+    if (!session) return;
+
+    pthread_mutex_lock(&session->lock);
+    struct ChatHistory *history = session->history;
+    size_t before = history_bytes(history);
+    session->log_fresh = 0;
+    if (record->type == LOG_SESSION) {
+        history_restore(history, record->arg, record->arg2, record->text);
+        session->log_seq = record->seq;
+    } else if (record->from_snapshot || record->seq > session->log_seq) {
+        // Log records already folded into the snapshot are skipped
+        if (record->type == LOG_APPEND) history_append(history, record->role, record->text);
+        else if (record->type == LOG_CLEAR) history_clear(history);
+        else if (record->type == LOG_SUMMARY) history_finish_compaction(history, record->text, record->arg);
+        if (!record->from_snapshot) session->log_seq = record->seq;
+    }
+    account_bytes(session, history_bytes(history), before);
+    pthread_mutex_unlock(&session->lock);
+    session_release(session);
+}
+
+// A LOG_SESSION record followed by the retained messages, oldest first (session->lock held)
+static int encode_session(struct Session *session, struct HistoryLogBuf *out) {
+    struct ChatHistory *history = session->history;
+    if (session->log_seq == 0 && history->count == 0 && !history->summary) return 1; // Never changed
+
+    struct HistoryLogRecord record = { 0 };
+    record.type = LOG_SESSION;
+    record.seq = session->log_seq;
+    record.arg = history->next_seq - history->count;
+    record.arg2 = history->summarized_seq;
+    record.id = session->id;
+    record.text = history->summary ? history->summary : "";
+    record.len = history->summary_len;
+    if (!history_log_encode(out, &record)) return 0;
+
+    record.type = LOG_APPEND;
+    record.arg = record.arg2 = 0;
+    for (size_t i = history->count; i-- > 0;) {
+        const struct HistoryEntry *entry = history_recent(history, i);
+        record.role = entry->role;
+        record.text = entry->text;
+        record.len = entry->len;
+        if (!history_log_encode(out, &record)) return 0;
+    }
+    return 1;
+}
+
+int session_store_dump(unsigned log_shard, unsigned log_shards, struct HistoryLogBuf *out) {
+    for (unsigned i = log_shard; i < SESSION_SHARDS; i += log_shards) {
+        struct SessionShard *shard = &shards[i];
+
+        // Pin the shard's sessions, then encode each under its own lock so chats keep going
+        pthread_mutex_lock(&shard->lock);
+        size_t count = 0;
+        struct Session **pinned = malloc((shard->count + 1) * sizeof(struct Session *));
+        for (struct Session *session = shard->lru_head; session && pinned; session = session->lru_next) {
+            session->refs++;
+            pinned[count++] = session;
+        }
+        pthread_mutex_unlock(&shard->lock);
+        if (!pinned) return 0;
+
+        int ok = 1;
+        for (size_t j = 0; j < count; j++) {
+            pthread_mutex_lock(&pinned[j]->lock);
+            if (ok) ok = encode_session(pinned[j], out);
+            pthread_mutex_unlock(&pinned[j]->lock);
+            session_release(pinned[j]);
+        }
+        free(pinned);
+        if (!ok) return 0;
+    }
+    return 1;
+}
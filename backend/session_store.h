@@ -0,0 +1,60 @@
+#ifndef SESSION_STORE_H
+#define SESSION_STORE_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include <time.h>
+#include "config.h"
+#include "history.h"
+#include "history_log.h"
+
+#define SESSION_SHARDS 64 // Independent lock domains
+#define SESSION_ID_MAX 64 // Longest accepted session id
+#define SESSION_TTL_DEFAULT 3600 // Idle seconds before a session expires
+#define SESSION_MEMORY_DEFAULT (256UL * 1024 * 1024) // Bytes of history kept across all sessions
+
+struct Session {
+    char id[SESSION_ID_MAX + 1]; // Session id from cookie or header
+    pthread_mutex_t lock; // Guards history
+    struct ChatHistory *history; // Ring of this session's most recent messages
+    struct ConfigSnapshot *config; // Settings overriding the global ones, NULL for none (see config.h)
+    uint64_t log_seq; // Last history log change applied (lock)
+    int log_fresh; // Created by a request; its first logged change starts with LOG_CLEAR (lock)
+    size_t bytes; // Approximate bytes held by history (shard lock)
+    time_t last_used; // Last acquire time (shard lock)
+    int refs; // Map reference + callers (shard lock)
+    int linked; // Still reachable from the map (shard lock)
+    struct Session *hash_next; // Next session in the bucket chain
+    struct Session *lru_prev; // Towards most recently used
+    struct Session *lru_next; // Towards least recently used
+};
+
+struct SessionStoreStats {
+    unsigned long sessions; // Live sessions
+    unsigned long evictions; // Sessions dropped by LRU or memory cap
+    unsigned long expirations; // Sessions dropped by TTL
+    size_t bytes; // History bytes accounted across shards
+};
+
+void session_store_init(int ttl_seconds, size_t memory_cap); // Function to set up the store
+void session_store_cleanup(); // Function to free every session
+int session_id_valid(const char *id); // Function to check an id from a client
+void session_new_id(char *out, size_t out_size); // Function to generate a random id
+
+struct Session* session_acquire(const char *id); // Function to find or create a session (referenced)
+void session_retain(struct Session *session); // Function to take another reference on an acquired session
+void session_release(struct Session *session); // Function to drop a reference
+
+uint64_t session_add_message(struct Session *session, int role, const char *message); // Function to append to history, returning the message's seq
+struct HistoryWindow* session_get_history(struct Session *session, size_t max_tokens, struct Arena *arena); // Function to copy the summary and latest messages within a token budget
+struct HistoryWindow* session_begin_compaction(struct Session *session, size_t max_tokens); // Function to take the messages due for summarizing (malloc'd), NULL if none
+void session_finish_compaction(struct Session *session, const char *summary, uint64_t through_seq); // Function to install a new summary (NULL on failure)
+void session_clear(struct Session *session); // Function to empty history
+
+void session_store_get_stats(struct SessionStoreStats *stats); // Function to read store counters
+
+// History log hooks (see history_log.h): replay one record, and encode the sessions of a log shard
+void session_store_restore(const struct HistoryLogRecord *record);
+int session_store_dump(unsigned log_shard, unsigned log_shards, struct HistoryLogBuf *out);
+
+#endif
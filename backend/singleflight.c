@@ -0,0 +1,174 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "singleflight.h"
+#include "metrics.h"
+
+struct Flight {
+    struct CacheKey key;
+    pthread_mutex_t lock; // Guards everything below
+    pthread_cond_t cond; // Signalled on each delta and on completion
+    char *text; // Text streamed by the leader so far
+    size_t len; // Bytes of text
+    size_t cap; // Capacity of text
+    int done; // Leader completed
+    char *result; // Final result, set on completion
+    struct AiResponse info; // finishReason and usage of the result
+    int refs; // Leader + followers (table lock)
+    int linked; // Still in the table (table lock)
+    struct Flight *next; // Bucket chain
+};
+
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct Flight **table = NULL;
+
+void singleflight_init(int enabled) {
+    pthread_mutex_lock(&table_lock);
+    if (enabled && !table) table = calloc(SINGLEFLIGHT_BUCKETS, sizeof(struct Flight *));
+    pthread_mutex_unlock(&table_lock);
+}
+
+void singleflight_cleanup() {
+    pthread_mutex_lock(&table_lock);
+    free(table);
+    table = NULL;
+    pthread_mutex_unlock(&table_lock);
+}
+
+int singleflight_enabled() {
+    pthread_mutex_lock(&table_lock);
+    int enabled = table != NULL;
+    pthread_mutex_unlock(&table_lock);
+    return enabled;
+}
+
+struct Flight* singleflight_join(const struct CacheKey *key, int *leader) {
+    *leader = 1;
+    pthread_mutex_lock(&table_lock);
+    if (!table) {
+        pthread_mutex_unlock(&table_lock);
+        return NULL;
+    }
+
+    struct Flight **bucket = &table[key->h1 % SINGLEFLIGHT_BUCKETS];
+    struct Flight *flight = *bucket;
+    while (flight && (flight->key.h1 != key->h1 || flight->key.h2 != key->h2)) flight = flight->next;
+
+    if (flight) {
+        flight->refs++;
+        *leader = 0;
+        metrics_add(M_COALESCE_FOLLOWERS, 1);
+    } else {
+        flight = calloc(1, sizeof(struct Flight));
+        if (flight) {
+            flight->key = *key;
+            pthread_mutex_init(&flight->lock, NULL);
+            pthread_cond_init(&flight->cond, NULL);
+            flight->refs = 1;
+            flight->linked = 1;
+            flight->next = *bucket;
+            *bucket = flight;
+            metrics_add(M_COALESCE_LEADERS, 1);
+        }
+    }
+    pthread_mutex_unlock(&table_lock);
+    return flight;
+}
+
+void singleflight_publish(struct Flight *flight, const char *text, size_t len) {
+    pthread_mutex_lock(&flight->lock);
+    if (flight->len + len + 1 > flight->cap) {
+        size_t new_cap = flight->cap ? flight->cap * 2 : 1024;
+        while (new_cap < flight->len + len + 1) new_cap *= 2;
+        char *p = realloc(flight->text, new_cap);
+        if (!p) {
+            pthread_mutex_unlock(&flight->lock);
+            return; // Followers still get the full result on completion
+        }
+        flight->text = p;
+        flight->cap = new_cap;
+    }
+    memcpy(flight->text + flight->len, text, len);
+    flight->len += len;
+    pthread_cond_broadcast(&flight->cond);
+    pthread_mutex_unlock(&flight->lock);
+}
+
+static void unlink_flight(struct Flight *flight) {
+    if (!flight->linked) return;
+    struct Flight **slot = &table[flight->key.h1 % SINGLEFLIGHT_BUCKETS];
+    while (*slot && *slot != flight) slot = &(*slot)->next;
+    if (*slot) *slot = flight->next;
+    flight->linked = 0;
+}
+
+void singleflight_complete(struct Flight *flight, const char *result, const struct AiResponse *info) {
+    // Requests arriving from now on start a fresh call
+    pthread_mutex_lock(&table_lock);
+    unlink_flight(flight);
+    pthread_mutex_unlock(&table_lock);
+
+    pthread_mutex_lock(&flight->lock);
+    flight->result = strdup(result ? result : "");
+    if (info) flight->info = *info;
+    flight->info.text = NULL; // The leader's text is not shared; followers copy result
+    flight->done = 1;
+    pthread_cond_broadcast(&flight->cond);
+    pthread_mutex_unlock(&flight->lock);
+}
+
+char* singleflight_wait(struct Flight *flight, flight_delta_cb on_delta, void *userdata, struct AiResponse *info) {
+    size_t sent = 0;
+    char *chunk = NULL;
+    size_t chunk_cap = 0;
+
+    pthread_mutex_lock(&flight->lock);
+    for (;;) {
+        if (on_delta && flight->len > sent) {
+            // Copy out so the callback runs without holding the flight lock
+            size_t n = flight->len - sent;
+            if (n > chunk_cap) {
+                char *p = realloc(chunk, n);
+                if (p) {
+                    chunk = p;
+                    chunk_cap = n;
+                }
+            }
+            if (n <= chunk_cap) {
+                memcpy(chunk, flight->text + sent, n);
+                sent += n;
+                pthread_mutex_unlock(&flight->lock);
+                on_delta(chunk, n, userdata);
+                pthread_mutex_lock(&flight->lock);
+                continue;
+            }
+        }
+        if (flight->done) break;
+        pthread_cond_wait(&flight->cond, &flight->lock);
+    }
+    char *result = strdup(flight->result ? flight->result : "");
+    if (info) {
+        *info = flight->info;
+        info->text = result;
+        info->text_len = result ? strlen(result) : 0;
+    }
+    pthread_mutex_unlock(&flight->lock);
+
+    free(chunk);
+    return result;
+}
+
+void singleflight_release(struct Flight *flight) {
+    if (!flight) return;
+    pthread_mutex_lock(&table_lock);
+    int refs = --flight->refs;
+    if (refs == 0) unlink_flight(flight);
+    pthread_mutex_unlock(&table_lock);
+    if (refs > 0) return;
+
+    pthread_mutex_destroy(&flight->lock);
+    pthread_cond_destroy(&flight->cond);
+    free(flight->text);
+    free(flight->result);
+    free(flight);
+}
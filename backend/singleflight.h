@@ -0,0 +1,33 @@
+#ifndef SINGLEFLIGHT_H
+#define SINGLEFLIGHT_H
+
+#include <stddef.h>
+#include "response_cache.h"
+#include "response_parser.h"
+
+#define SINGLEFLIGHT_BUCKETS 256 // Hash buckets for in-flight calls
+
+// Called on the subscriber's own thread with text the leader has streamed
+typedef void (*flight_delta_cb)(const char *text, size_t len, void *userdata);
+
+struct Flight; // One in-flight upstream call shared by identical requests
+
+void singleflight_init(int enabled); // Function to switch coalescing on or off
+void singleflight_cleanup(); // Function to drop the table (no flights may be running)
+int singleflight_enabled(); // Function to check whether coalescing is on
+
+// Join the flight for key or start one. *leader is set when the caller must
+// make the upstream call, publish its deltas and complete the flight.
+struct Flight* singleflight_join(const struct CacheKey *key, int *leader);
+
+void singleflight_publish(struct Flight *flight, const char *text, size_t len); // Function for the leader to share a text delta
+void singleflight_complete(struct Flight *flight, const char *result, const struct AiResponse *info); // Function for the leader to share the final result
+
+// Followers block until the leader completes, replaying streamed text to
+// on_delta (may be NULL) as it arrives. Returns a malloc'd copy of the result;
+// info->text points at it.
+char* singleflight_wait(struct Flight *flight, flight_delta_cb on_delta, void *userdata, struct AiResponse *info);
+
+void singleflight_release(struct Flight *flight); // Function to drop the caller's reference
+
+#endif
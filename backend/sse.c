@@ -0,0 +1,95 @@
+#include <stdlib.h>
+#include <string.h>
+#include "sse.h"
+
+void sse_parser_init(struct SseParser *parser, sse_event_cb on_event, void *userdata) {
+    memset(parser, 0, sizeof(*parser));
+    parser->on_event = on_event;
+    parser->userdata = userdata;
+}
+
+static int append(char **buf, size_t *len, size_t *cap, const char *bytes, size_t n) {
+    if (*len + n + 1 > *cap) {
+        size_t new_cap = *cap ? *cap : 256;
+        while (new_cap < *len + n + 1) new_cap *= 2;
+        char *p = realloc(*buf, new_cap);
+        if (!p) return 0;
+        *buf = p;
+        *cap = new_cap;
+    }
+    memcpy(*buf + *len, bytes, n);
+    *len += n;
+    (*buf)[*len] = '\0';
+    return 1;
+}
+
+static void dispatch(struct SseParser *parser) {
+    if (parser->data_len == 0) return;
+    // The spec drops the final newline added after the last data line
+    if (parser->data[parser->data_len - 1] == '\n') parser->data[--parser->data_len] = '\0';
+    parser->on_event(parser->data, parser->data_len, parser->userdata);
+    parser->data_len = 0;
+}
+
+// Handle one line with the line terminator already removed
+static int process_line(struct SseParser *parser, const char *line, size_t len) {
+    if (len == 0) {
+        dispatch(parser);
+        return 1;
+    }
+    if (line[0] == ':') return 1; // Comment
+
+    if (len >= 4 && memcmp(line, "data", 4) == 0 && (len == 4 || line[4] == ':')) {
+        const char *value = len > 4 ? line + 5 : line + 4;
+        size_t value_len = len > 4 ? len - 5 : 0;
+        if (value_len > 0 && value[0] == ' ') {
+            value++;
+            value_len--;
+        }
+        if (!append(&parser->data, &parser->data_len, &parser->data_cap, value, value_len)) return 0;
+        return append(&parser->data, &parser->data_len, &parser->data_cap, "\n", 1);
+    }
+    return 1; // event/id/retry fields are not needed by our callers
+}
+
+int sse_parser_feed(struct SseParser *parser, const char *bytes, size_t len) {
+    size_t start = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (bytes[i] != '\n') continue;
+
+        size_t n = i - start;
+        const char *line = bytes + start;
+        if (parser->line_len > 0) {
+            // Finish a line that began in an earlier chunk
+            if (!append(&parser->line, &parser->line_len, &parser->line_cap, line, n)) return 0;
+            line = parser->line;
+            n = parser->line_len;
+        }
+        if (n > 0 && line[n - 1] == '\r') n--;
+        int ok = process_line(parser, line, n);
+        parser->line_len = 0;
+        if (!ok) return 0;
+        start = i + 1;
+    }
+    if (start < len) {
+        return append(&parser->line, &parser->line_len, &parser->line_cap, bytes + start, len - start);
+    }
+    return 1;
+}
+
+void sse_parser_finish(struct SseParser *parser) {
+    if (parser->line_len > 0) {
+        size_t n = parser->line_len;
+        if (parser->line[n - 1] == '\r') n--;
+        process_line(parser, parser->line, n);
+        parser->line_len = 0;
+    }
+    dispatch(parser);
+}
+
+void sse_parser_free(struct SseParser *parser) {
+    free(parser->line);
+    free(parser->data);
+    parser->line = parser->data = NULL;
+    parser->line_len = parser->line_cap = parser->data_len = parser->data_cap = 0;
+}
@@ -0,0 +1,26 @@
+#ifndef SSE_H
+#define SSE_H
+
+#include <stddef.h>
+
+// Called once per complete event with the joined "data:" lines
+typedef void (*sse_event_cb)(const char *data, size_t len, void *userdata);
+
+// Incremental Server-Sent Events parser; bytes can arrive in any split
+struct SseParser {
+    char *line; // Current partial line
+    size_t line_len; // Bytes in the partial line
+    size_t line_cap; // Capacity of the line buffer
+    char *data; // Data of the event being assembled
+    size_t data_len; // Bytes of event data
+    size_t data_cap; // Capacity of the data buffer
+    sse_event_cb on_event; // Event callback
+    void *userdata; // Passed to the callback
+};
+
+void sse_parser_init(struct SseParser *parser, sse_event_cb on_event, void *userdata); // Function to set up a parser
+int sse_parser_feed(struct SseParser *parser, const char *bytes, size_t len); // Function to feed bytes, 0 on allocation failure
+void sse_parser_finish(struct SseParser *parser); // Function to flush a trailing event without blank line
+void sse_parser_free(struct SseParser *parser); // Function to release parser buffers
+
+#endif
@@ -0,0 +1,443 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <zlib.h>
+#include <brotli/encode.h>
+#include "static_files.h"
+#include "encoding.h"
+#include "metrics.h"
+#include "logger.h"
+
+#define ASSET_PATH_MAX 160 // Longest URL path kept for an asset
+#define IMMUTABLE_CACHE "public, max-age=31536000, immutable"
+
+// One file of the frontend with its precomputed encodings
+struct StaticAsset {
+    char path[ASSET_PATH_MAX]; // URL path, e.g. "/script.js"
+    char hashed_path[ASSET_PATH_MAX]; // Content-addressed path, e.g. "/script.1a2b3c4d.js"
+    const char *content_type; // MIME type from the extension
+    char hash[17]; // Content hash in hex, shared by the ETags of every encoding
+    char etag[24]; // Strong ETag of the identity body, quoted
+    char etag_gzip[28]; // Of the gzip body: "<hash>-gz"
+    char etag_br[28]; // Of the Brotli body: "<hash>-br"
+    char *data; // Identity body
+    size_t size; // Bytes in data
+    char *gzip; // gzip body, NULL when not smaller
+    size_t gzip_size; // Bytes in gzip
+    char *br; // Brotli body, NULL when not smaller
+    size_t br_size; // Bytes in br
+    int refs; // Asset table + responses still sending it
+};
+
+// All assets loaded together; swapped as a whole on reload
+struct AssetTable {
+    struct StaticAsset **assets; // Assets, unordered
+    size_t count; // Number of assets
+};
+
+static char static_dir[256] = STATIC_DIR_DEFAULT;
+static struct AssetTable *current_table = NULL;
+static pthread_rwlock_t table_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static pthread_t watch_thread;
+static int watch_fd = -1;
+static volatile int watch_running = 0;
+
+static unsigned long stat_reloads = 0;
+static unsigned long stat_not_modified = 0;
+static unsigned long stat_compressed = 0;
+
+static uint64_t hash_bytes(const char *data, size_t len) {
+    uint64_t hash = 1469598103934665603ULL; // FNV-1a
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static const char* content_type_for(const char *name) {
+    const char *ext = strrchr(name, '.');
+    if (!ext) return "application/octet-stream";
+    if (strcmp(ext, ".html") == 0) return "text/html; charset=utf-8";
+    if (strcmp(ext, ".css") == 0) return "text/css; charset=utf-8";
+    if (strcmp(ext, ".js") == 0) return "application/javascript; charset=utf-8";
+    if (strcmp(ext, ".json") == 0) return "application/json";
+    if (strcmp(ext, ".svg") == 0) return "image/svg+xml";
+    if (strcmp(ext, ".png") == 0) return "image/png";
+    if (strcmp(ext, ".ico") == 0) return "image/x-icon";
+    if (strcmp(ext, ".txt") == 0) return "text/plain; charset=utf-8";
+    return "application/octet-stream";
+}
+
+static int is_compressible(const char *content_type) {
+    return strncmp(content_type, "text/", 5) == 0 ||
+           strncmp(content_type, "application/javascript", 22) == 0 ||
+           strncmp(content_type, "application/json", 16) == 0 ||
+           strncmp(content_type, "image/svg", 9) == 0;
+}
+
+static void asset_free(struct StaticAsset *asset) {
+    free(asset->data);
+    free(asset->gzip);
+    free(asset->br);
+    free(asset);
+}
+
+static void asset_release(void *cls) {
+    struct StaticAsset *asset = (struct StaticAsset *)cls;
+    if (__atomic_sub_fetch(&asset->refs, 1, __ATOMIC_ACQ_REL) == 0) asset_free(asset);
+}
+
+static void table_release(struct AssetTable *table) {
+    if (!table) return;
+    for (size_t i = 0; i < table->count; i++) asset_release(table->assets[i]);
+    free(table->assets);
+    free(table);
+}
+
+static void compress_gzip(struct StaticAsset *asset) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) return;
+
+    uLong bound = deflateBound(&zs, (uLong)asset->size);
+    char *out = malloc(bound);
+    if (out) {
+        zs.next_in = (Bytef *)asset->data;
+        zs.avail_in = (uInt)asset->size;
+        zs.next_out = (Bytef *)out;
+        zs.avail_out = (uInt)bound;
+        if (deflate(&zs, Z_FINISH) == Z_STREAM_END && zs.total_out < asset->size) {
+            asset->gzip = out;
+            asset->gzip_size = zs.total_out;
+            out = NULL;
+        }
+        free(out);
+    }
+    deflateEnd(&zs);
+}
+
+static void compress_brotli(struct StaticAsset *asset) {
+    size_t out_size = BrotliEncoderMaxCompressedSize(asset->size);
+    if (out_size == 0) return;
+    char *out = malloc(out_size);
+    if (!out) return;
+    if (BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT,
+                              asset->size, (const uint8_t *)asset->data, &out_size, (uint8_t *)out) &&
+        out_size < asset->size) {
+        asset->br = out;
+        asset->br_size = out_size;
+    } else {
+        free(out);
+    }
+}
+
+// Hash, compress and name an asset once its final bytes are known
+static void asset_finalize(struct StaticAsset *asset) {
+    uint64_t hash = hash_bytes(asset->data, asset->size);
+    // Each encoding is its own representation and needs its own strong validator
+    snprintf(asset->hash, sizeof(asset->hash), "%016llx", (unsigned long long)hash);
+    snprintf(asset->etag, sizeof(asset->etag), "\"%s\"", asset->hash);
+    snprintf(asset->etag_gzip, sizeof(asset->etag_gzip), "\"%s-gz\"", asset->hash);
+    snprintf(asset->etag_br, sizeof(asset->etag_br), "\"%s-br\"", asset->hash);
+
+    // "/script.js" -> "/script.1a2b3c4d.js"
+    const char *ext = strrchr(asset->path, '.');
+    size_t stem = ext ? (size_t)(ext - asset->path) : strlen(asset->path);
+    snprintf(asset->hashed_path, sizeof(asset->hashed_path), "%.*s.%08x%s",
+             (int)stem, asset->path, (unsigned)(hash & 0xffffffffu), ext ? ext : "");
+
+    if (is_compressible(asset->content_type)) {
+        compress_gzip(asset);
+        compress_brotli(asset);
+    }
+}
+
+static struct StaticAsset* asset_load(const char *dir, const char *name) {
+    char filepath[512];
+    snprintf(filepath, sizeof(filepath), "%s/%s", dir, name);
+
+    FILE *file = fopen(filepath, "rb");
+    if (!file) return NULL;
+    struct stat st;
+    if (fstat(fileno(file), &st) != 0 || !S_ISREG(st.st_mode) || st.st_size > STATIC_FILE_MAX) {
+        fclose(file);
+        return NULL;
+    }
+
+    struct StaticAsset *asset = calloc(1, sizeof(struct StaticAsset));
+    char *data = malloc((size_t)st.st_size + 1);
+    if (!asset || !data) {
+        free(asset);
+        free(data);
+        fclose(file);
+        return NULL;
+    }
+    size_t read = fread(data, 1, (size_t)st.st_size, file);
+    fclose(file);
+    if (read != (size_t)st.st_size) {
+        free(data);
+        free(asset);
+        return NULL;
+    }
+    data[read] = '\0';
+
+    snprintf(asset->path, sizeof(asset->path), "/%s", name);
+    asset->content_type = content_type_for(name);
+    asset->data = data;
+    asset->size = read;
+    asset->refs = 1; // Held by the table
+    return asset;
+}
+
+// Point the HTML at content-hashed asset URLs so they can be cached forever
+static void rewrite_html(struct StaticAsset *html, struct AssetTable *table) {
+    for (size_t i = 0; i < table->count; i++) {
+        struct StaticAsset *asset = table->assets[i];
+        if (asset == html || strstr(asset->content_type, "text/html")) continue;
+
+        char from[ASSET_PATH_MAX + 2], to[ASSET_PATH_MAX + 2];
+        snprintf(from, sizeof(from), "\"%s\"", asset->path + 1); // Relative reference, e.g. "script.js"
+        snprintf(to, sizeof(to), "\"%s\"", asset->hashed_path + 1);
+        size_t from_len = strlen(from), to_len = strlen(to);
+
+        size_t hits = 0;
+        for (const char *p = html->data; (p = strstr(p, from)) != NULL; p += from_len) hits++;
+        if (hits == 0) continue;
+
+        char *out = malloc(html->size + hits * (to_len - from_len) + 1);
+        if (!out) continue;
+        char *w = out;
+        const char *r = html->data;
+        for (const char *p; (p = strstr(r, from)) != NULL; r = p + from_len) {
+            memcpy(w, r, (size_t)(p - r));
+            w += p - r;
+            memcpy(w, to, to_len);
+            w += to_len;
+        }
+        size_t tail = strlen(r);
+        memcpy(w, r, tail + 1);
+        free(html->data);
+        html->data = out;
+        html->size = (size_t)(w - out) + tail;
+    }
+}
+
+static struct AssetTable* table_load(const char *dir) {
+    DIR *d = opendir(dir);
+    if (!d) return NULL;
+
+    struct AssetTable *table = calloc(1, sizeof(struct AssetTable));
+    size_t cap = 0;
+    struct dirent *entry;
+    while (table && (entry = readdir(d)) != NULL) {
+        if (entry->d_name[0] == '.') continue; // Hidden files, "." and ".."
+        if (strlen(entry->d_name) + 16 >= ASSET_PATH_MAX) continue;
+        struct StaticAsset *asset = asset_load(dir, entry->d_name);
+        if (!asset) continue;
+        if (table->count == cap) {
+            cap = cap ? cap * 2 : 16;
+            struct StaticAsset **grown = realloc(table->assets, cap * sizeof(*grown));
+            if (!grown) {
+                asset_free(asset);
+                break;
+            }
+            table->assets = grown;
+        }
+        table->assets[table->count++] = asset;
+    }
+    closedir(d);
+    if (!table) return NULL;
+
+    // Other assets first so their hashed names exist before HTML is rewritten
+    for (size_t i = 0; i < table->count; i++) {
+        if (!strstr(table->assets[i]->content_type, "text/html")) asset_finalize(table->assets[i]);
+    }
+    for (size_t i = 0; i < table->count; i++) {
+        if (strstr(table->assets[i]->content_type, "text/html")) {
+            rewrite_html(table->assets[i], table);
+            asset_finalize(table->assets[i]);
+        }
+    }
+    return table;
+}
+
+int static_files_reload() {
+    struct AssetTable *table = table_load(static_dir);
+    if (!table) return 0;
+
+    pthread_rwlock_wrlock(&table_lock);
+    struct AssetTable *old = current_table;
+    current_table = table;
+    pthread_rwlock_unlock(&table_lock);
+
+    table_release(old); // Assets still being sent live on until their responses finish
+    __atomic_fetch_add(&stat_reloads, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+// Reload when files in the directory change; bursts of events are coalesced
+static void* watch_main(void *arg) {
+    (void)arg;
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd pfd = { .fd = watch_fd, .events = POLLIN, .revents = 0 };
+
+    while (watch_running) {
+        if (poll(&pfd, 1, 500) <= 0) continue;
+        if (read(watch_fd, events, sizeof(events)) <= 0) continue;
+        // Editors write files in several steps; wait for the burst to settle
+        while (poll(&pfd, 1, 100) > 0) {
+            if (read(watch_fd, events, sizeof(events)) <= 0) break;
+        }
+        if (static_files_reload()) {
+            log_msg(LOG_INFO, "static_reload", "Reloaded static files from %s", static_dir);
+        }
+    }
+    return NULL;
+}
+
+int static_files_init(const char *dir) {
+    if (dir && dir[0]) {
+        strncpy(static_dir, dir, sizeof(static_dir) - 1);
+        static_dir[sizeof(static_dir) - 1] = '\0';
+    }
+    if (!static_files_reload()) return 0;
+
+    watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch_fd >= 0 &&
+        inotify_add_watch(watch_fd, static_dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM |
+                                                IN_CREATE | IN_DELETE) >= 0) {
+        watch_running = 1;
+        if (pthread_create(&watch_thread, NULL, watch_main, NULL) != 0) watch_running = 0;
+    }
+    if (!watch_running && watch_fd >= 0) {
+        close(watch_fd); // Serve without hot reload
+        watch_fd = -1;
+    }
+    return 1;
+}
+
+void static_files_cleanup() {
+    if (watch_running) {
+        watch_running = 0;
+        pthread_join(watch_thread, NULL);
+    }
+    if (watch_fd >= 0) {
+        close(watch_fd);
+        watch_fd = -1;
+    }
+    pthread_rwlock_wrlock(&table_lock);
+    struct AssetTable *old = current_table;
+    current_table = NULL;
+    pthread_rwlock_unlock(&table_lock);
+    table_release(old);
+}
+
+// Find an asset by plain or hashed path and take a reference to it
+static struct StaticAsset* asset_acquire(const char *path, int *hashed) {
+    struct StaticAsset *found = NULL;
+    pthread_rwlock_rdlock(&table_lock);
+    for (size_t i = 0; current_table && i < current_table->count; i++) {
+        struct StaticAsset *asset = current_table->assets[i];
+        if (strcmp(asset->path, path) == 0 || strcmp(asset->hashed_path, path) == 0) {
+            *hashed = strcmp(asset->hashed_path, path) == 0;
+            __atomic_add_fetch(&asset->refs, 1, __ATOMIC_RELAXED);
+            found = asset;
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&table_lock);
+    return found;
+}
+
+// If-None-Match uses weak comparison: a tag of any encoding of the same content matches
+static int etag_matches(const char *if_none_match, const struct StaticAsset *asset) {
+    if (!if_none_match) return 0;
+    if (strcmp(if_none_match, "*") == 0) return 1;
+    return strstr(if_none_match, asset->hash) != NULL;
+}
+
+enum MHD_Result static_files_serve(struct MHD_Connection *connection, const char *url) {
+    const char *path = strcmp(url, "/") == 0 ? "/index.html" : url;
+    int hashed = 0;
+    struct StaticAsset *asset = strstr(path, "..") ? NULL : asset_acquire(path, &hashed);
+
+    struct MHD_Response *response;
+    enum MHD_Result ret;
+    if (!asset) {
+        const char *not_found = "404 Not Found";
+        response = MHD_create_response_from_buffer(strlen(not_found),
+                                                 (void*)not_found,
+                                                 MHD_RESPMEM_PERSISTENT);
+        ret = MHD_queue_response(connection, MHD_HTTP_NOT_FOUND, response);
+        MHD_destroy_response(response);
+        return ret;
+    }
+
+    // Pick the smallest encoding the client accepts
+    const char *accept_encoding = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "Accept-Encoding");
+    const char *body = asset->data, *encoding = NULL, *etag = asset->etag;
+    size_t body_size = asset->size;
+    if (asset->br && encoding_accepts(accept_encoding, "br")) {
+        body = asset->br;
+        body_size = asset->br_size;
+        encoding = "br";
+        etag = asset->etag_br;
+    } else if (asset->gzip && encoding_accepts(accept_encoding, "gzip")) {
+        body = asset->gzip;
+        body_size = asset->gzip_size;
+        encoding = "gzip";
+        etag = asset->etag_gzip;
+    }
+
+    const char *cache_control = hashed ? IMMUTABLE_CACHE : "no-cache";
+    const char *if_none_match = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "If-None-Match");
+    if (etag_matches(if_none_match, asset)) {
+        response = MHD_create_response_from_buffer(0, NULL, MHD_RESPMEM_PERSISTENT);
+        MHD_add_response_header(response, "ETag", etag); // The tag a 200 would have carried
+        MHD_add_response_header(response, "Cache-Control", cache_control);
+        MHD_add_response_header(response, "Vary", "Accept-Encoding");
+        ret = MHD_queue_response(connection, MHD_HTTP_NOT_MODIFIED, response);
+        MHD_destroy_response(response);
+        asset_release(asset);
+        __atomic_fetch_add(&stat_not_modified, 1, __ATOMIC_RELAXED);
+        return ret;
+    }
+
+    // The buffer stays valid until MHD drops the response, even across a reload
+    response = MHD_create_response_from_buffer_with_free_callback_cls(body_size, body, asset_release, asset);
+    if (!response) {
+        asset_release(asset);
+        return MHD_NO;
+    }
+    metrics_add(M_BYTES_OUT, body_size);
+    MHD_add_response_header(response, "Content-Type", asset->content_type);
+    MHD_add_response_header(response, "ETag", etag);
+    MHD_add_response_header(response, "Cache-Control", cache_control);
+    MHD_add_response_header(response, "Vary", "Accept-Encoding");
+    if (encoding) {
+        MHD_add_response_header(response, "Content-Encoding", encoding);
+        __atomic_fetch_add(&stat_compressed, 1, __ATOMIC_RELAXED);
+    }
+    MHD_add_response_header(response, "Access-Control-Allow-Origin", "*");
+    ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+    MHD_destroy_response(response);
+    return ret;
+}
+
+void static_files_get_stats(struct StaticFilesStats *stats) {
+    pthread_rwlock_rdlock(&table_lock);
+    stats->assets = current_table ? current_table->count : 0;
+    pthread_rwlock_unlock(&table_lock);
+    stats->reloads = __atomic_load_n(&stat_reloads, __ATOMIC_RELAXED);
+    stats->not_modified = __atomic_load_n(&stat_not_modified, __ATOMIC_RELAXED);
+    stats->compressed = __atomic_load_n(&stat_compressed, __ATOMIC_RELAXED);
+}
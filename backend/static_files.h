@@ -0,0 +1,25 @@
+#ifndef STATIC_FILES_H
+#define STATIC_FILES_H
+
+#include <microhttpd.h>
+
+#define STATIC_DIR_DEFAULT "../frontend" // Frontend directory relative to backend/
+#define STATIC_FILE_MAX (8 * 1024 * 1024) // Larger files are not served
+
+struct StaticFilesStats {
+    unsigned long assets; // Assets in the current generation
+    unsigned long reloads; // Successful (re)loads
+    unsigned long not_modified; // 304 answers
+    unsigned long compressed; // Responses sent gzip or brotli encoded
+};
+
+int static_files_init(const char *dir); // Function to load the directory and start watching it
+void static_files_cleanup(); // Function to stop watching and free the assets
+int static_files_reload(); // Function to reload every asset now, 0 on failure
+
+// Function to answer a GET for url from the in-memory assets (404 if unknown)
+enum MHD_Result static_files_serve(struct MHD_Connection *connection, const char *url);
+
+void static_files_get_stats(struct StaticFilesStats *stats); // Function to read the counters
+
+#endif
@@ -0,0 +1,373 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "upstream.h"
+#include "metrics.h"
+
+#define LATENCY_SAMPLES 256 // Recent JSON latencies the p95 is taken over
+#define LATENCY_MIN_SAMPLES 32 // Fewer than this and no hedge is sent
+#define LATENCY_REFRESH 16 // Samples between p95 recomputations
+#define DECREASE_MIN_NS 100000000ULL // At most one limit cut per 100 ms (or per failed call's latency)
+
+enum CircuitState { CIRCUIT_CLOSED, CIRCUIT_OPEN, CIRCUIT_HALF_OPEN };
+
+// Name, client status and /metrics error class of each outcome
+static const struct {
+    const char *name;
+    unsigned int status;
+    int counter; // enum MetricCounter, -1 for none
+} error_info[UPSTREAM_ERROR_COUNT] = {
+    [UPSTREAM_OK] = { "ok", 200, -1 },
+    [UPSTREAM_TRANSPORT] = { "transport", 502, M_ERRORS_TRANSPORT },
+    [UPSTREAM_TIMEOUT] = { "timeout", 504, M_ERRORS_TIMEOUT },
+    [UPSTREAM_RATE_LIMITED] = { "rate_limited", 429, M_ERRORS_RATE_LIMITED },
+    [UPSTREAM_UNAVAILABLE] = { "unavailable", 502, M_ERRORS_API },
+    [UPSTREAM_REJECTED] = { "rejected", 502, M_ERRORS_API },
+    [UPSTREAM_BLOCKED] = { "blocked", 422, M_ERRORS_BLOCKED },
+    [UPSTREAM_BAD_RESPONSE] = { "bad_response", 502, M_ERRORS_PARSE },
+    [UPSTREAM_CIRCUIT_OPEN] = { "circuit_open", 503, M_ERRORS_CIRCUIT_OPEN },
+    [UPSTREAM_OVERLOADED] = { "overloaded", 503, M_ERRORS_THROTTLED },
+    [UPSTREAM_CANCELLED] = { "cancelled", 499, -1 },
+};
+
+static struct UpstreamSettings settings = {
+    UPSTREAM_CONNECT_TIMEOUT_MS, UPSTREAM_TIMEOUT_MS, UPSTREAM_STREAM_TIMEOUT_MS, UPSTREAM_IDLE_TIMEOUT_MS,
+    UPSTREAM_RETRIES, 8, UPSTREAM_QUEUE_TIMEOUT_MS, UPSTREAM_BREAKER_FAILURES, UPSTREAM_BREAKER_OPEN_MS, 0,
+};
+
+// Concurrency limit and circuit, guarded by lock
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t slot_freed = PTHREAD_COND_INITIALIZER;
+static double limit = 8; // Additive increase per success, halved on overload signals
+static int inflight = 0;
+static uint64_t last_decrease_ns = 0;
+static int circuit = CIRCUIT_CLOSED;
+static int failures = 0; // Consecutive transport/timeout/5xx outcomes
+static uint64_t open_until_ns = 0;
+static int probing = 0; // Half-open probe in flight
+
+// Recent latencies for the hedge delay, guarded by latency_lock
+static pthread_mutex_t latency_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t latencies[LATENCY_SAMPLES];
+static size_t latency_count = 0; // Samples ever recorded
+static uint64_t hedge_delay_ns = 0; // p95 of latencies (atomic)
+
+static __thread unsigned int jitter_seed = 0;
+static int aborting = 0; // Set once at shutdown: transfers stop and nothing new starts (atomic)
+
+static void default_settings(struct UpstreamSettings *s) {
+    s->connect_timeout_ms = UPSTREAM_CONNECT_TIMEOUT_MS;
+    s->timeout_ms = UPSTREAM_TIMEOUT_MS;
+    s->stream_timeout_ms = UPSTREAM_STREAM_TIMEOUT_MS;
+    s->idle_timeout_ms = UPSTREAM_IDLE_TIMEOUT_MS;
+    s->retries = UPSTREAM_RETRIES;
+    s->limit_max = 8;
+    s->queue_timeout_ms = UPSTREAM_QUEUE_TIMEOUT_MS;
+    s->breaker_failures = UPSTREAM_BREAKER_FAILURES;
+    s->breaker_open_ms = UPSTREAM_BREAKER_OPEN_MS;
+    s->hedge = 0;
+}
+
+void upstream_init(const struct UpstreamSettings *s) {
+    struct UpstreamSettings defaults;
+    default_settings(&defaults);
+    if (!s) s = &defaults;
+
+    pthread_mutex_lock(&lock);
+    settings = *s;
+    if (settings.connect_timeout_ms < 1) settings.connect_timeout_ms = defaults.connect_timeout_ms;
+    if (settings.timeout_ms < 1) settings.timeout_ms = defaults.timeout_ms;
+    if (settings.stream_timeout_ms < 1) settings.stream_timeout_ms = defaults.stream_timeout_ms;
+    if (settings.idle_timeout_ms < 1000) settings.idle_timeout_ms = 1000; // curl counts it in seconds
+    if (settings.retries < 0) settings.retries = 0;
+    if (settings.limit_max < 1) settings.limit_max = 1;
+    if (settings.queue_timeout_ms < 0) settings.queue_timeout_ms = 0;
+    if (settings.breaker_failures < 1) settings.breaker_failures = defaults.breaker_failures;
+    if (settings.breaker_open_ms < 1) settings.breaker_open_ms = defaults.breaker_open_ms;
+    limit = settings.limit_max; // Start wide open; overload signals bring it down
+    circuit = CIRCUIT_CLOSED;
+    failures = probing = 0;
+    pthread_mutex_unlock(&lock);
+}
+
+int upstream_acquire() {
+    pthread_mutex_lock(&lock);
+    if (__atomic_load_n(&aborting, __ATOMIC_RELAXED)) {
+        pthread_mutex_unlock(&lock);
+        return UPSTREAM_OVERLOADED;
+    }
+    uint64_t now = metrics_now_ns();
+    if (circuit == CIRCUIT_OPEN && now >= open_until_ns) {
+        circuit = CIRCUIT_HALF_OPEN;
+        probing = 0;
+    }
+    // While half-open a single probe decides whether the circuit closes
+    if (circuit == CIRCUIT_OPEN || (circuit == CIRCUIT_HALF_OPEN && probing)) {
+        pthread_mutex_unlock(&lock);
+        metrics_add(M_ERRORS_CIRCUIT_OPEN, 1);
+        return UPSTREAM_CIRCUIT_OPEN;
+    }
+    if (circuit == CIRCUIT_HALF_OPEN) probing = 1;
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += settings.queue_timeout_ms / 1000;
+    deadline.tv_nsec += (long)(settings.queue_timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    while (inflight >= (int)limit) {
+        if ((pthread_cond_timedwait(&slot_freed, &lock, &deadline) == ETIMEDOUT && inflight >= (int)limit) ||
+            __atomic_load_n(&aborting, __ATOMIC_RELAXED)) {
+            if (circuit == CIRCUIT_HALF_OPEN) probing = 0;
+            pthread_mutex_unlock(&lock);
+            metrics_add(M_ERRORS_THROTTLED, 1);
+            return UPSTREAM_OVERLOADED;
+        }
+    }
+    inflight++;
+    pthread_mutex_unlock(&lock);
+    return UPSTREAM_OK;
+}
+
+// Slot for a hedge: only when one is free right now and the circuit is closed
+static int try_acquire_hedge() {
+    pthread_mutex_lock(&lock);
+    int ok = circuit == CIRCUIT_CLOSED && inflight < (int)limit;
+    if (ok) inflight++;
+    pthread_mutex_unlock(&lock);
+    return ok;
+}
+
+void upstream_release(int error, uint64_t latency_ns) {
+    pthread_mutex_lock(&lock);
+    if (inflight > 0) inflight--;
+    uint64_t now = metrics_now_ns();
+
+    if (error == UPSTREAM_OK) {
+        limit += 1.0 / limit; // About +1 per limit's worth of successes
+        if (limit > settings.limit_max) limit = settings.limit_max;
+    } else if (error == UPSTREAM_RATE_LIMITED || error == UPSTREAM_UNAVAILABLE || error == UPSTREAM_TIMEOUT) {
+        // One cut per round trip, so a burst of failures from one window halves the limit once
+        uint64_t window = latency_ns > DECREASE_MIN_NS ? latency_ns : DECREASE_MIN_NS;
+        if (now - last_decrease_ns >= window) {
+            limit /= 2;
+            if (limit < 1) limit = 1;
+            last_decrease_ns = now;
+        }
+    }
+
+    if (error == UPSTREAM_TRANSPORT || error == UPSTREAM_TIMEOUT || error == UPSTREAM_UNAVAILABLE ||
+        (error == UPSTREAM_RATE_LIMITED && circuit == CIRCUIT_HALF_OPEN)) {
+        failures++;
+        if (circuit == CIRCUIT_HALF_OPEN || failures >= settings.breaker_failures) {
+            circuit = CIRCUIT_OPEN;
+            open_until_ns = now + (uint64_t)settings.breaker_open_ms * 1000000ULL;
+            failures = 0;
+        }
+    } else if (error != UPSTREAM_CANCELLED) {
+        // Any answer, even a rejection, shows upstream is reachable
+        failures = 0;
+        if (circuit == CIRCUIT_HALF_OPEN) circuit = CIRCUIT_CLOSED;
+    }
+    if (error != UPSTREAM_CANCELLED) probing = 0;
+
+    pthread_cond_broadcast(&slot_freed);
+    pthread_mutex_unlock(&lock);
+}
+
+// Progress callback: curl calls it at least once a second, so an abort reaches idle streams too
+static int check_abort(void *clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow) {
+    (void)clientp;
+    (void)dltotal;
+    (void)dlnow;
+    (void)ultotal;
+    (void)ulnow;
+    return __atomic_load_n(&aborting, __ATOMIC_RELAXED);
+}
+
+void upstream_apply_timeouts(CURL *curl, int streaming) {
+    curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, check_abort);
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, (long)settings.connect_timeout_ms);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, (long)(streaming ? settings.stream_timeout_ms : settings.timeout_ms));
+    if (streaming) {
+        // Abort a stream that goes quiet, however long the whole reply may take
+        curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+        curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, (long)(settings.idle_timeout_ms / 1000));
+    }
+}
+
+static int classify_status(long status) {
+    if (status == 429) return UPSTREAM_RATE_LIMITED;
+    if (status >= 500) return UPSTREAM_UNAVAILABLE;
+    if (status >= 400) return UPSTREAM_REJECTED;
+    return UPSTREAM_OK;
+}
+
+int upstream_classify(CURLcode res, long http_status, const struct AiResponse *r, int parsed) {
+    int error;
+    if (res == CURLE_OPERATION_TIMEDOUT) {
+        error = UPSTREAM_TIMEOUT;
+    } else if (res != CURLE_OK) {
+        error = UPSTREAM_TRANSPORT;
+    } else if (classify_status(http_status) != UPSTREAM_OK) {
+        error = classify_status(http_status);
+    } else if (r->error_code) {
+        error = classify_status(r->error_code) != UPSTREAM_OK ? classify_status(r->error_code) : UPSTREAM_REJECTED;
+    } else if (!parsed) {
+        error = UPSTREAM_BAD_RESPONSE;
+    } else if (r->candidates) {
+        error = UPSTREAM_OK;
+    } else {
+        error = r->block_reason[0] ? UPSTREAM_BLOCKED : UPSTREAM_BAD_RESPONSE;
+    }
+    if (error_info[error].counter >= 0) metrics_add((enum MetricCounter)error_info[error].counter, 1);
+    return error;
+}
+
+long upstream_retry_delay_ms(int attempt, int error, long retry_after_s, uint64_t elapsed_ms) {
+    if (attempt >= settings.retries || __atomic_load_n(&aborting, __ATOMIC_RELAXED)) return -1;
+    if (error != UPSTREAM_TRANSPORT && error != UPSTREAM_TIMEOUT && error != UPSTREAM_RATE_LIMITED &&
+        error != UPSTREAM_UNAVAILABLE) {
+        return -1;
+    }
+    if (!jitter_seed) jitter_seed = (unsigned int)(metrics_now_ns() ^ (uintptr_t)&jitter_seed);
+
+    // Full jitter: anywhere up to an exponential ceiling, so clients that failed together spread out
+    long ceiling = (long)UPSTREAM_BACKOFF_BASE_MS << (attempt < 8 ? attempt : 8);
+    if (ceiling > UPSTREAM_BACKOFF_MAX_MS) ceiling = UPSTREAM_BACKOFF_MAX_MS;
+    long delay = (long)(rand_r(&jitter_seed) % (unsigned int)(ceiling + 1));
+    if (retry_after_s > 0) {
+        if (retry_after_s * 1000 > UPSTREAM_BACKOFF_MAX_MS) return -1; // Not worth holding the client
+        delay = retry_after_s * 1000 + delay / 4;
+    }
+    if (elapsed_ms + (uint64_t)delay >= (uint64_t)settings.timeout_ms) return -1;
+    metrics_add(M_UPSTREAM_RETRIES, 1);
+    return delay;
+}
+
+void upstream_abort() {
+    pthread_mutex_lock(&lock);
+    __atomic_store_n(&aborting, 1, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&slot_freed); // Callers waiting for a slot give up
+    pthread_mutex_unlock(&lock);
+}
+
+long upstream_retry_after() {
+    pthread_mutex_lock(&lock);
+    uint64_t now = metrics_now_ns();
+    long seconds = circuit == CIRCUIT_OPEN && open_until_ns > now
+                       ? (long)((open_until_ns - now + 999999999ULL) / 1000000000ULL) : 0;
+    pthread_mutex_unlock(&lock);
+    return seconds;
+}
+
+int upstream_hedging() {
+    return settings.hedge && __atomic_load_n(&hedge_delay_ns, __ATOMIC_RELAXED) > 0;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+void upstream_observe_latency(uint64_t ns) {
+    uint64_t sorted[LATENCY_SAMPLES];
+    size_t n = 0;
+    pthread_mutex_lock(&latency_lock);
+    latencies[latency_count++ % LATENCY_SAMPLES] = ns;
+    if (latency_count >= LATENCY_MIN_SAMPLES && latency_count % LATENCY_REFRESH == 0) {
+        n = latency_count < LATENCY_SAMPLES ? latency_count : LATENCY_SAMPLES;
+        memcpy(sorted, latencies, n * sizeof(uint64_t));
+    }
+    pthread_mutex_unlock(&latency_lock);
+    if (n == 0) return;
+
+    qsort(sorted, n, sizeof(uint64_t), compare_u64);
+    __atomic_store_n(&hedge_delay_ns, sorted[n * 95 / 100], __ATOMIC_RELAXED);
+}
+
+CURLcode upstream_perform(CURL *primary, CURL *hedge, int *winner) {
+    *winner = 0;
+    uint64_t delay = __atomic_load_n(&hedge_delay_ns, __ATOMIC_RELAXED);
+    CURLM *multi = hedge && settings.hedge && delay > 0 ? curl_multi_init() : NULL;
+    if (!multi) return curl_easy_perform(primary);
+
+    CURL *handles[2] = { primary, hedge };
+    int attached[2] = { 1, 0 };
+    int hedged = 0; // Hedge time passed
+    int hedge_slot = 0; // The hedge was sent and holds a slot
+    CURLcode result = CURLE_OK;
+    uint64_t hedge_at = metrics_now_ns() + delay;
+    curl_multi_add_handle(multi, primary);
+
+    for (;;) {
+        int running = 0;
+        int done = 0;
+        curl_multi_perform(multi, &running);
+        CURLMsg *msg;
+        int left;
+        while (!done && (msg = curl_multi_info_read(multi, &left))) {
+            if (msg->msg != CURLMSG_DONE) continue;
+            int which = msg->easy_handle == primary ? 0 : 1;
+            CURLcode res = msg->data.result;
+            long status = 0;
+            curl_easy_getinfo(handles[which], CURLINFO_RESPONSE_CODE, &status);
+            curl_multi_remove_handle(multi, handles[which]);
+            attached[which] = 0;
+            // The first good answer wins. A failed transfer, or a 429 or 5xx (the overload a hedge
+            // rides out), only ends the call if the other is not running.
+            int answered = res == CURLE_OK && status != 429 && status < 500;
+            if (answered || !attached[1 - which]) {
+                *winner = which;
+                result = res;
+                done = 1;
+            }
+        }
+        if (done) break;
+
+        uint64_t now = metrics_now_ns();
+        int timeout_ms = 1000;
+        if (!hedged && now >= hedge_at) {
+            hedged = 1; // One chance: no free slot means no hedge
+            if (try_acquire_hedge()) {
+                curl_multi_add_handle(multi, hedge);
+                attached[1] = hedge_slot = 1;
+                metrics_add(M_UPSTREAM_HEDGES, 1);
+            }
+        } else if (!hedged) {
+            uint64_t wait_ms = (hedge_at - now) / 1000000ULL + 1;
+            timeout_ms = wait_ms < 1000 ? (int)wait_ms : 1000;
+        }
+        curl_multi_poll(multi, NULL, 0, timeout_ms, NULL);
+    }
+
+    for (int i = 0; i < 2; i++) {
+        if (attached[i]) curl_multi_remove_handle(multi, handles[i]); // Cancels the loser
+    }
+    curl_multi_cleanup(multi);
+    if (hedge_slot) upstream_release(UPSTREAM_CANCELLED, 0); // The caller reports the winner's outcome
+    if (*winner == 1) metrics_add(M_UPSTREAM_HEDGE_WINS, 1);
+    return result;
+}
+
+const char* upstream_error_name(int error) {
+    return error >= 0 && error < UPSTREAM_ERROR_COUNT ? error_info[error].name : "unknown";
+}
+
+unsigned int upstream_http_status(int error) {
+    return error >= 0 && error < UPSTREAM_ERROR_COUNT ? error_info[error].status : 502;
+}
+
+void upstream_get_stats(struct UpstreamStats *stats) {
+    pthread_mutex_lock(&lock);
+    stats->limit = limit;
+    stats->inflight = inflight;
+    stats->circuit = circuit;
+    pthread_mutex_unlock(&lock);
+    stats->p95_ms = (double)__atomic_load_n(&hedge_delay_ns, __ATOMIC_RELAXED) / 1e6;
+}
@@ -0,0 +1,83 @@
+#ifndef UPSTREAM_H
+#define UPSTREAM_H
+
+#include <stdint.h>
+#include <curl/curl.h>
+#include "response_parser.h"
+
+#define UPSTREAM_CONNECT_TIMEOUT_MS 5000 // Default TCP + TLS setup bound
+#define UPSTREAM_TIMEOUT_MS 60000 // Default bound on a whole generateContent call, retries included
+#define UPSTREAM_STREAM_TIMEOUT_MS 300000 // Default bound on a whole streamed reply
+#define UPSTREAM_IDLE_TIMEOUT_MS 30000 // Default silence tolerated mid-stream
+#define UPSTREAM_RETRIES 2 // Default retries after the first attempt
+#define UPSTREAM_BACKOFF_BASE_MS 250 // First retry waits up to this long
+#define UPSTREAM_BACKOFF_MAX_MS 8000 // Longest single wait, Retry-After included
+#define UPSTREAM_QUEUE_TIMEOUT_MS 10000 // Default wait for a concurrency slot
+#define UPSTREAM_BREAKER_FAILURES 5 // Consecutive failures that open the circuit
+#define UPSTREAM_BREAKER_OPEN_MS 10000 // Time the circuit stays open before a probe
+
+// Outcome of an upstream call, also carried in AiResponse.upstream_error
+enum UpstreamError {
+    UPSTREAM_OK = 0,
+    UPSTREAM_TRANSPORT, // Connection failed or dropped (retried)
+    UPSTREAM_TIMEOUT, // Connect, idle or total timeout (retried)
+    UPSTREAM_RATE_LIMITED, // 429 (retried, shrinks the concurrency limit)
+    UPSTREAM_UNAVAILABLE, // 5xx (retried, shrinks the concurrency limit)
+    UPSTREAM_REJECTED, // Other 4xx: bad request, key or model
+    UPSTREAM_BLOCKED, // Prompt blocked by safety filters
+    UPSTREAM_BAD_RESPONSE, // Unparseable or empty reply
+    UPSTREAM_CIRCUIT_OPEN, // Failing fast while upstream recovers
+    UPSTREAM_OVERLOADED, // No concurrency slot freed up in time
+    UPSTREAM_CANCELLED, // Losing side of a hedged pair; not reported to callers
+    UPSTREAM_ERROR_COUNT
+};
+
+struct UpstreamSettings {
+    int connect_timeout_ms;
+    int timeout_ms; // JSON replies; also the retry budget
+    int stream_timeout_ms;
+    int idle_timeout_ms; // Streams only
+    int retries;
+    int limit_max; // Ceiling of the adaptive concurrency limit
+    int queue_timeout_ms;
+    int breaker_failures;
+    int breaker_open_ms;
+    int hedge; // Send a second copy of slow JSON calls after the p95 latency
+};
+
+struct UpstreamStats {
+    double limit; // Current adaptive concurrency limit
+    int inflight; // Calls holding a slot
+    int circuit; // 0 closed, 1 open, 2 half-open
+    double p95_ms; // Recent JSON latency, the hedge delay
+};
+
+void upstream_init(const struct UpstreamSettings *settings); // Function to apply settings (NULL for defaults)
+
+// Slot for one attempt: checks the circuit, then waits for the concurrency
+// limit. Returns UPSTREAM_OK, UPSTREAM_CIRCUIT_OPEN or UPSTREAM_OVERLOADED.
+int upstream_acquire();
+// Function to return the slot with the attempt's outcome, driving the limit and the circuit
+void upstream_release(int error, uint64_t latency_ns);
+
+void upstream_apply_timeouts(CURL *curl, int streaming); // Function to set connect/total/idle timeouts
+// Classify a finished transfer; parsed says whether the body was a complete document
+int upstream_classify(CURLcode res, long http_status, const struct AiResponse *r, int parsed);
+// Milliseconds to wait before retry number attempt + 1, or -1 to give up
+long upstream_retry_delay_ms(int attempt, int error, long retry_after_s, uint64_t elapsed_ms);
+// Function to fail running transfers and every later attempt, for a shutdown
+// whose drain deadline passed
+void upstream_abort();
+long upstream_retry_after(); // Seconds until an open circuit lets a probe through, 0 if closed
+
+// Run primary; with hedge (may be NULL) and hedging on, start hedge if primary
+// is still running after the recent p95. *winner is 0 or 1.
+CURLcode upstream_perform(CURL *primary, CURL *hedge, int *winner);
+int upstream_hedging(); // Function to check whether a hedge handle is worth preparing
+void upstream_observe_latency(uint64_t ns); // Function to record a successful JSON call's latency
+
+const char* upstream_error_name(int error); // Function to name an outcome for clients and logs
+unsigned int upstream_http_status(int error); // Function to pick the status a client gets for an outcome
+void upstream_get_stats(struct UpstreamStats *stats); // Function to read controller state
+
+#endif
@@ -0,0 +1,499 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "vector_index.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#define INDEX_FILE_MAGIC "GCVIDX1" // Eight bytes with the NUL
+#define INDEX_ALIGN 64 // Sections start on cache lines
+#define TRAIN_PER_LIST 32 // k-means samples per IVF list
+#define TRAIN_ROUNDS 8 // k-means iterations
+
+// Fixed-size file header; every section offset is from the start of the file
+struct IndexFileHeader {
+    char magic[8];
+    uint32_t dim;
+    uint32_t nlist;
+    uint32_t embedder_id; // Vectors from another embedder are not comparable
+    uint32_t reserved;
+    uint64_t count;
+    uint64_t text_bytes;
+    uint64_t centroid_codes_off;
+    uint64_t centroid_scales_off;
+    uint64_t list_start_off;
+    uint64_t scales_off;
+    uint64_t tags_off;
+    uint64_t text_offsets_off;
+    uint64_t codes_off;
+    uint64_t text_off;
+    uint64_t file_len;
+};
+
+// Dot product of int8 row codes with the query widened to int16
+typedef int32_t (*dot_fn)(const int8_t *row, const int16_t *query, int dim);
+
+static int32_t dot_scalar(const int8_t *row, const int16_t *query, int dim) {
+    int32_t sum = 0;
+    for (int i = 0; i < dim; i++) sum += (int32_t)row[i] * query[i];
+    return sum;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// 32 components per step: widen the row to int16 and let madd pair-sum into int32 lanes
+__attribute__((target("avx2")))
+static int32_t dot_avx2(const int8_t *row, const int16_t *query, int dim) {
+    __m256i acc0 = _mm256_setzero_si256(), acc1 = _mm256_setzero_si256();
+    int i = 0;
+    for (; i + 32 <= dim; i += 32) {
+        __m256i r0 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)(row + i)));
+        __m256i r1 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)(row + i + 16)));
+        acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(r0, _mm256_loadu_si256((const __m256i *)(query + i))));
+        acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(r1, _mm256_loadu_si256((const __m256i *)(query + i + 16))));
+    }
+    if (i < dim) { // dim is a multiple of 16
+        __m256i r0 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)(row + i)));
+        acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(r0, _mm256_loadu_si256((const __m256i *)(query + i))));
+    }
+    __m256i acc = _mm256_add_epi32(acc0, acc1);
+    __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(sum);
+}
+#endif
+
+static dot_fn dot = dot_scalar;
+static const char *kernel_name = "scalar";
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+
+static void pick_kernel() {
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2")) {
+        dot = dot_avx2;
+        kernel_name = "avx2";
+    }
+#endif
+}
+
+const char* vector_index_kernel() {
+    pthread_once(&kernel_once, pick_kernel);
+    return kernel_name;
+}
+
+// Normalize vec and quantize it to int8 codes; returns the scale back to unit length
+static float quantize(const float *vec, int dim, int8_t *codes) {
+    double norm = 0;
+    float peak = 0;
+    for (int i = 0; i < dim; i++) {
+        norm += (double)vec[i] * vec[i];
+        if (fabsf(vec[i]) > peak) peak = fabsf(vec[i]);
+    }
+    if (norm <= 0 || peak <= 0) {
+        memset(codes, 0, (size_t)dim);
+        return 0;
+    }
+    float step = peak / 127.0f; // Largest component maps to +-127
+    for (int i = 0; i < dim; i++) codes[i] = (int8_t)lrintf(vec[i] / step);
+    return (float)(step / sqrt(norm));
+}
+
+static void widen(const int8_t *codes, int dim, int16_t *out) {
+    for (int i = 0; i < dim; i++) out[i] = codes[i];
+}
+
+static size_t align_up(size_t n) {
+    return (n + INDEX_ALIGN - 1) & ~(size_t)(INDEX_ALIGN - 1);
+}
+
+struct VectorIndex* vector_index_create(int dim, size_t capacity) {
+    if (dim <= 0 || dim % 16 != 0 || dim > VECTOR_INDEX_DIM_MAX || capacity == 0) return NULL;
+    vector_index_kernel();
+    struct VectorIndex *index = calloc(1, sizeof(struct VectorIndex));
+    if (!index) return NULL;
+    index->dim = dim;
+    index->capacity = capacity;
+    index->codes = aligned_alloc(INDEX_ALIGN, align_up(capacity * (size_t)dim));
+    index->scales = calloc(capacity, sizeof(float));
+    index->tags = calloc(capacity, sizeof(uint64_t));
+    if (!index->codes || !index->scales || !index->tags) {
+        vector_index_free(index);
+        return NULL;
+    }
+    return index;
+}
+
+void vector_index_set(struct VectorIndex *index, size_t row, const float *vec, uint64_t tag) {
+    if (index->map || row >= index->capacity) return;
+    index->scales[row] = quantize(vec, index->dim, index->codes + row * (size_t)index->dim);
+    index->tags[row] = tag;
+    if (row >= index->count) index->count = row + 1;
+}
+
+void vector_index_free(struct VectorIndex *index) {
+    if (!index) return;
+    if (index->map) {
+        munmap(index->map, index->map_len);
+    } else {
+        free(index->codes);
+        free(index->scales);
+        free(index->tags);
+    }
+    free(index);
+}
+
+// Bounded min-heap keeping the best hits seen so far
+struct TopK {
+    struct VectorHit *hits;
+    size_t size;
+    size_t k;
+};
+
+static void topk_push(struct TopK *top, uint32_t row, float score) {
+    if (top->size == top->k) {
+        if (score <= top->hits[0].score) return;
+        top->hits[0] = (struct VectorHit){ row, score };
+    } else {
+        // Sift the new hit up from the end
+        size_t i = top->size++;
+        while (i > 0 && top->hits[(i - 1) / 2].score > score) {
+            top->hits[i] = top->hits[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        top->hits[i] = (struct VectorHit){ row, score };
+        return;
+    }
+    // Sift the replaced root down
+    size_t i = 0;
+    struct VectorHit moving = top->hits[0];
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= top->size) break;
+        if (child + 1 < top->size && top->hits[child + 1].score < top->hits[child].score) child++;
+        if (top->hits[child].score >= moving.score) break;
+        top->hits[i] = top->hits[child];
+        i = child;
+    }
+    top->hits[i] = moving;
+}
+
+static int compare_hits(const void *a, const void *b) {
+    float x = ((const struct VectorHit *)a)->score, y = ((const struct VectorHit *)b)->score;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static void scan_rows(const struct VectorIndex *index, const int16_t *query, uint64_t tag, size_t from, size_t to,
+                      struct TopK *top) {
+    const int dim = index->dim;
+    for (size_t row = from; row < to; row++) {
+        if (index->tags[row] != tag) continue;
+        float score = (float)dot(index->codes + row * (size_t)dim, query, dim) * index->scales[row];
+        topk_push(top, (uint32_t)row, score);
+    }
+}
+
+size_t vector_index_search(const struct VectorIndex *index, const float *query, uint64_t tag, size_t k, int nprobe,
+                           struct VectorHit *hits) {
+    int8_t query_codes[VECTOR_INDEX_DIM_MAX];
+    int16_t wide[VECTOR_INDEX_DIM_MAX];
+    if (k > VECTOR_INDEX_K_MAX) k = VECTOR_INDEX_K_MAX;
+    if (!index || index->count == 0 || k == 0) return 0;
+    float query_scale = quantize(query, index->dim, query_codes);
+    if (query_scale == 0) return 0;
+    widen(query_codes, index->dim, wide);
+
+    struct TopK top = { hits, 0, k };
+    if (index->nlist == 0) {
+        scan_rows(index, wide, tag, 0, index->count, &top);
+    } else {
+        // Nearest lists first, then every row in them
+        struct VectorHit lists[VECTOR_INDEX_K_MAX];
+        struct TopK probe = { lists, 0, nprobe < 1 ? 1 : nprobe > VECTOR_INDEX_K_MAX ? VECTOR_INDEX_K_MAX : (size_t)nprobe };
+        for (int list = 0; list < index->nlist; list++) {
+            const int8_t *centroid = index->centroid_codes + (size_t)list * index->dim;
+            topk_push(&probe, (uint32_t)list, (float)dot(centroid, wide, index->dim) * index->centroid_scales[list]);
+        }
+        for (size_t i = 0; i < probe.size; i++) {
+            uint32_t list = lists[i].row;
+            scan_rows(index, wide, tag, index->list_start[list], index->list_start[list + 1], &top);
+        }
+    }
+    for (size_t i = 0; i < top.size; i++) hits[i].score *= query_scale;
+    qsort(hits, top.size, sizeof(struct VectorHit), compare_hits);
+    return top.size;
+}
+
+const char* vector_index_text(const struct VectorIndex *index, size_t row, size_t *len) {
+    if (!index->text_offsets || row >= index->count) return NULL;
+    *len = (size_t)(index->text_offsets[row + 1] - index->text_offsets[row]) - 1; // Each snippet ends in a NUL
+    return index->text + index->text_offsets[row];
+}
+
+// Best of nlist quantized centroids for one widened vector
+static int nearest_list(const int8_t *centroids, const float *scales, int nlist, int dim, const int16_t *wide) {
+    int best = 0;
+    float best_score = -INFINITY;
+    for (int list = 0; list < nlist; list++) {
+        float score = (float)dot(centroids + (size_t)list * dim, wide, dim) * scales[list];
+        if (score > best_score) {
+            best_score = score;
+            best = list;
+        }
+    }
+    return best;
+}
+
+// Spherical k-means over a strided sample of the quantized rows; leaves
+// quantized centroids in centroids/scales. Returns 0 on allocation failure.
+static int train_lists(const int8_t *codes, const float *row_scales, size_t count, int dim, int nlist,
+                       int8_t *centroids, float *scales) {
+    size_t samples = (size_t)nlist * TRAIN_PER_LIST;
+    if (samples > count) samples = count;
+    size_t stride = count / samples;
+    float *sums = calloc((size_t)nlist * dim, sizeof(float));
+    size_t *members = calloc((size_t)nlist, sizeof(size_t));
+    int16_t *wide = malloc((size_t)dim * sizeof(int16_t));
+    float *centroid = malloc((size_t)dim * sizeof(float));
+    if (!sums || !members || !wide || !centroid) {
+        free(sums);
+        free(members);
+        free(wide);
+        free(centroid);
+        return 0;
+    }
+
+    // Seed with rows spread over the sample
+    for (int list = 0; list < nlist; list++) {
+        size_t row = (size_t)list * (samples / nlist) * stride;
+        memcpy(centroids + (size_t)list * dim, codes + row * dim, (size_t)dim);
+        scales[list] = row_scales[row];
+    }
+    for (int round = 0; round < TRAIN_ROUNDS; round++) {
+        memset(sums, 0, (size_t)nlist * dim * sizeof(float));
+        memset(members, 0, (size_t)nlist * sizeof(size_t));
+        for (size_t s = 0; s < samples; s++) {
+            const int8_t *row = codes + s * stride * dim;
+            widen(row, dim, wide);
+            int list = nearest_list(centroids, scales, nlist, dim, wide);
+            float scale = row_scales[s * stride];
+            float *sum = sums + (size_t)list * dim;
+            for (int i = 0; i < dim; i++) sum[i] += row[i] * scale;
+            members[list]++;
+        }
+        for (int list = 0; list < nlist; list++) {
+            if (members[list] == 0) {
+                // Reseed an empty list from a pseudo-random sample
+                size_t row = ((size_t)list * 2654435761u + (size_t)round) % samples * stride;
+                memcpy(centroids + (size_t)list * dim, codes + row * dim, (size_t)dim);
+                scales[list] = row_scales[row];
+                continue;
+            }
+            memcpy(centroid, sums + (size_t)list * dim, (size_t)dim * sizeof(float));
+            scales[list] = quantize(centroid, dim, centroids + (size_t)list * dim);
+        }
+    }
+    free(sums);
+    free(members);
+    free(wide);
+    free(centroid);
+    return 1;
+}
+
+static int write_section(FILE *f, uint64_t *offset, const void *data, size_t len) {
+    static const char pad[INDEX_ALIGN];
+    long at = ftell(f);
+    if (at < 0) return 0;
+    size_t padding = align_up((size_t)at) - (size_t)at;
+    if (padding && fwrite(pad, 1, padding, f) != padding) return 0;
+    *offset = (uint64_t)at + padding;
+    return len == 0 || fwrite(data, 1, len, f) == len;
+}
+
+int vector_index_write(const char *path, int dim, size_t count, const float *vectors, const uint64_t *tags,
+                       const char *const *texts, int nlist, uint32_t embedder_id) {
+    if (dim <= 0 || dim % 16 != 0 || dim > VECTOR_INDEX_DIM_MAX || count == 0 || count > UINT32_MAX) return 0;
+    vector_index_kernel();
+    if (nlist < 0 || (size_t)nlist > count) nlist = 0;
+
+    int8_t *codes = malloc(count * (size_t)dim);
+    int8_t *ordered = malloc(count * (size_t)dim);
+    float *scales = malloc(count * sizeof(float));
+    float *ordered_scales = malloc(count * sizeof(float));
+    uint64_t *ordered_tags = malloc(count * sizeof(uint64_t));
+    uint64_t *text_offsets = malloc((count + 1) * sizeof(uint64_t));
+    uint32_t *list_of = malloc(count * sizeof(uint32_t));
+    uint32_t *list_start = calloc((size_t)nlist + 2, sizeof(uint32_t));
+    int8_t *centroids = nlist ? malloc((size_t)nlist * dim) : NULL;
+    float *centroid_scales = nlist ? malloc((size_t)nlist * sizeof(float)) : NULL;
+    int16_t *wide = malloc((size_t)dim * sizeof(int16_t));
+    size_t *order = malloc(count * sizeof(size_t));
+    int ok = codes && ordered && scales && ordered_scales && ordered_tags && text_offsets && list_of && list_start &&
+             wide && order && (!nlist || (centroids && centroid_scales));
+
+    for (size_t row = 0; ok && row < count; row++) {
+        scales[row] = quantize(vectors + row * dim, dim, codes + row * dim);
+    }
+    if (ok && nlist) ok = train_lists(codes, scales, count, dim, nlist, centroids, centroid_scales);
+
+    // Counting sort by list so each list is one contiguous run of rows
+    for (size_t row = 0; ok && row < count; row++) {
+        widen(codes + row * dim, dim, wide);
+        list_of[row] = nlist ? (uint32_t)nearest_list(centroids, centroid_scales, nlist, dim, wide) : 0;
+        list_start[list_of[row] + 1]++;
+    }
+    int lists = nlist ? nlist : 1;
+    for (int list = 0; ok && list < lists; list++) list_start[list + 1] += list_start[list];
+    if (ok) {
+        uint32_t *next = calloc((size_t)lists, sizeof(uint32_t));
+        if (!next) ok = 0;
+        for (size_t row = 0; ok && row < count; row++) {
+            uint32_t list = list_of[row];
+            order[list_start[list] + next[list]++] = row;
+        }
+        free(next);
+    }
+
+    uint64_t text_bytes = 0;
+    for (size_t i = 0; ok && i < count; i++) {
+        size_t row = order[i];
+        memcpy(ordered + i * dim, codes + row * dim, (size_t)dim);
+        ordered_scales[i] = scales[row];
+        ordered_tags[i] = tags ? tags[row] : 0;
+        text_offsets[i] = text_bytes;
+        text_bytes += (texts && texts[row] ? strlen(texts[row]) : 0) + 1;
+    }
+    if (ok) text_offsets[count] = text_bytes;
+
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *f = ok ? fopen(tmp_path, "wb") : NULL;
+    struct IndexFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_FILE_MAGIC, sizeof(header.magic));
+    header.dim = (uint32_t)dim;
+    header.nlist = (uint32_t)nlist;
+    header.embedder_id = embedder_id;
+    header.count = count;
+    header.text_bytes = text_bytes;
+    if (f) {
+        ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+             write_section(f, &header.centroid_codes_off, centroids, (size_t)nlist * dim) &&
+             write_section(f, &header.centroid_scales_off, centroid_scales, (size_t)nlist * sizeof(float)) &&
+             write_section(f, &header.list_start_off, list_start, ((size_t)lists + 1) * sizeof(uint32_t)) &&
+             write_section(f, &header.scales_off, ordered_scales, count * sizeof(float)) &&
+             write_section(f, &header.tags_off, ordered_tags, count * sizeof(uint64_t)) &&
+             write_section(f, &header.text_offsets_off, text_offsets, (count + 1) * sizeof(uint64_t)) &&
+             write_section(f, &header.codes_off, ordered, count * (size_t)dim) &&
+             write_section(f, &header.text_off, NULL, 0);
+        for (size_t i = 0; ok && i < count; i++) {
+            const char *text = texts && texts[order[i]] ? texts[order[i]] : "";
+            ok = fwrite(text, 1, strlen(text) + 1, f) == strlen(text) + 1;
+        }
+        long end = ftell(f);
+        header.file_len = end > 0 ? (uint64_t)end : 0;
+        // The header goes last, so a torn write never looks complete
+        ok = ok && end > 0 && fseek(f, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, f) == 1 &&
+             fflush(f) == 0 && fsync(fileno(f)) == 0;
+        ok = fclose(f) == 0 && ok;
+        ok = ok && rename(tmp_path, path) == 0;
+        if (!ok) unlink(tmp_path);
+    } else {
+        ok = 0;
+    }
+
+    free(codes);
+    free(ordered);
+    free(scales);
+    free(ordered_scales);
+    free(ordered_tags);
+    free(text_offsets);
+    free(list_of);
+    free(list_start);
+    free(centroids);
+    free(centroid_scales);
+    free(wide);
+    free(order);
+    return ok;
+}
+
+// Whether [offset, offset + len) lies inside a file of file_len bytes
+static int section_fits(uint64_t offset, uint64_t len, uint64_t file_len) {
+    return offset <= file_len && len <= file_len - offset;
+}
+
+// Whether the list bounds and snippet offsets of a mapped file go up in order and stay inside
+// their sections, with every snippet ending in a NUL; scans and lookups trust them as given
+static int offsets_valid(const uint32_t *list_start, uint64_t lists, const uint64_t *text_offsets, uint64_t count,
+                         const char *text, uint64_t text_bytes) {
+    for (uint64_t i = 0; i < lists; i++) {
+        if (list_start[i] > list_start[i + 1] || list_start[i + 1] > count) return 0;
+    }
+    for (uint64_t i = 0; i < count; i++) {
+        if (text_offsets[i] >= text_offsets[i + 1] || text_offsets[i + 1] > text_bytes) return 0;
+        if (text[text_offsets[i + 1] - 1] != '\0') return 0;
+    }
+    return 1;
+}
+
+struct VectorIndex* vector_index_open(const char *path, uint32_t embedder_id) {
+    vector_index_kernel();
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct IndexFileHeader)) {
+        close(fd);
+        return NULL;
+    }
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); // The mapping keeps the file
+    if (map == MAP_FAILED) return NULL;
+
+    const struct IndexFileHeader *h = map;
+    uint64_t len = (uint64_t)st.st_size;
+    uint64_t lists = h->nlist ? h->nlist : 1;
+    int valid = memcmp(h->magic, INDEX_FILE_MAGIC, sizeof(h->magic)) == 0 && h->file_len == len &&
+                h->embedder_id == embedder_id && h->dim > 0 && h->dim % 16 == 0 && h->dim <= VECTOR_INDEX_DIM_MAX &&
+                h->count > 0 && h->count <= UINT32_MAX && h->nlist <= h->count &&
+                section_fits(h->centroid_codes_off, (uint64_t)h->nlist * h->dim, len) &&
+                section_fits(h->centroid_scales_off, (uint64_t)h->nlist * sizeof(float), len) &&
+                section_fits(h->list_start_off, (lists + 1) * sizeof(uint32_t), len) &&
+                section_fits(h->scales_off, h->count * sizeof(float), len) &&
+                section_fits(h->tags_off, h->count * sizeof(uint64_t), len) &&
+                section_fits(h->text_offsets_off, (h->count + 1) * sizeof(uint64_t), len) &&
+                section_fits(h->codes_off, h->count * h->dim, len) &&
+                section_fits(h->text_off, h->text_bytes, len);
+    const char *base = map;
+    if (valid) {
+        const uint32_t *list_start = (const uint32_t *)(base + h->list_start_off);
+        const uint64_t *text_offsets = (const uint64_t *)(base + h->text_offsets_off);
+        valid = list_start[lists] == h->count && text_offsets[h->count] == h->text_bytes &&
+                offsets_valid(list_start, lists, text_offsets, h->count, base + h->text_off, h->text_bytes);
+    }
+    struct VectorIndex *index = valid ? calloc(1, sizeof(struct VectorIndex)) : NULL;
+    if (!index) {
+        munmap(map, (size_t)len);
+        return NULL;
+    }
+    index->dim = (int)h->dim;
+    index->count = index->capacity = h->count;
+    index->nlist = (int)h->nlist;
+    index->codes = (int8_t *)(base + h->codes_off);
+    index->scales = (float *)(base + h->scales_off);
+    index->tags = (uint64_t *)(base + h->tags_off);
+    index->centroid_codes = (int8_t *)(base + h->centroid_codes_off);
+    index->centroid_scales = (float *)(base + h->centroid_scales_off);
+    index->list_start = (uint32_t *)(base + h->list_start_off);
+    index->text_offsets = (const uint64_t *)(base + h->text_offsets_off);
+    index->text = base + h->text_off;
+    index->map = map;
+    index->map_len = (size_t)len;
+    return index;
+}
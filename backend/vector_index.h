@@ -0,0 +1,58 @@
+#ifndef VECTOR_INDEX_H
+#define VECTOR_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define VECTOR_INDEX_K_MAX 64 // Most hits one search returns
+#define VECTOR_INDEX_NPROBE_DEFAULT 16 // IVF lists scanned per query
+#define VECTOR_INDEX_DIM_MAX 4096 // Widest vector accepted
+
+// Vectors are L2-normalized and stored as int8 codes with one float scale
+// each, so a 256-dimension vector takes 260 bytes and a scan reads 4x less
+// memory than float32. Scores approximate the cosine similarity.
+struct VectorIndex {
+    int dim; // Components per vector, a multiple of 16
+    size_t count; // Rows in use
+    size_t capacity; // Rows allocated (heap indexes)
+    int8_t *codes; // count x dim quantized components
+    float *scales; // Per-row dequantization scale
+    uint64_t *tags; // Per-row owner key; a search for tag t only sees rows tagged t
+    int nlist; // IVF lists, 0 for a flat index
+    int8_t *centroid_codes; // nlist x dim quantized list centroids
+    float *centroid_scales;
+    uint32_t *list_start; // nlist + 1 row offsets: list i holds rows [list_start[i], list_start[i + 1])
+    const uint64_t *text_offsets; // count + 1 offsets into text, NULL without payload
+    const char *text; // Snippet per row
+    void *map; // mmap of an opened index file, NULL for a heap index
+    size_t map_len;
+};
+
+struct VectorHit {
+    uint32_t row;
+    float score; // Approximate cosine similarity
+};
+
+// Function to create a heap flat index of capacity rows, NULL on failure
+struct VectorIndex* vector_index_create(int dim, size_t capacity);
+// Function to store vec (dim floats, normalized here) with its tag in row, growing count past it
+void vector_index_set(struct VectorIndex *index, size_t row, const float *vec, uint64_t tag);
+void vector_index_free(struct VectorIndex *index); // Function to release a heap or mapped index
+
+// Best k (at most VECTOR_INDEX_K_MAX) rows tagged tag by score, best first;
+// IVF indexes scan the nprobe lists nearest to the query. Returns the hit count.
+size_t vector_index_search(const struct VectorIndex *index, const float *query, uint64_t tag, size_t k, int nprobe,
+                           struct VectorHit *hits);
+const char* vector_index_text(const struct VectorIndex *index, size_t row, size_t *len); // Function to get a row's snippet
+
+// Write count vectors (dim floats each) with their tags and snippets to path,
+// clustered into nlist IVF lists (0 for flat) and laid out for mmap. Written
+// to a temporary file and renamed into place; returns 0 on failure.
+int vector_index_write(const char *path, int dim, size_t count, const float *vectors, const uint64_t *tags,
+                       const char *const *texts, int nlist, uint32_t embedder_id);
+// Map an index file read-only; NULL if it is missing, corrupt or built by another embedder
+struct VectorIndex* vector_index_open(const char *path, uint32_t embedder_id);
+
+const char* vector_index_kernel(); // Function to name the dot-product kernel in use
+
+#endif
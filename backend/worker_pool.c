@@ -0,0 +1,161 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include "worker_pool.h"
+
+struct WorkerJob {
+    worker_job_fn fn; // Job function
+    void *arg; // Job argument
+};
+
+// Ring buffer of queued jobs
+struct JobQueue {
+    struct WorkerJob *jobs; // Ring storage
+    int limit; // Capacity of the ring
+    int head; // Next job to run
+    int count; // Jobs in the ring
+};
+
+struct WorkerPool {
+    pthread_t *threads; // Worker threads
+    int thread_count; // Number of worker threads
+    struct JobQueue queue; // Request jobs, always taken first
+    struct JobQueue background; // Low-priority jobs, taken only when queue is empty
+    int running; // Jobs being executed
+    int background_running; // Background jobs being executed
+    int background_limit; // Threads background jobs may occupy at once
+    int stopping; // Set by worker_pool_destroy
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty; // Signalled when a job becomes runnable or the pool stops
+};
+
+static int queue_init(struct JobQueue *queue, int limit) {
+    queue->jobs = calloc(limit, sizeof(struct WorkerJob));
+    queue->limit = limit;
+    queue->head = queue->count = 0;
+    return queue->jobs != NULL;
+}
+
+static int queue_push(struct JobQueue *queue, worker_job_fn fn, void *arg) {
+    if (queue->count == queue->limit) return 0;
+    int tail = (queue->head + queue->count) % queue->limit;
+    queue->jobs[tail].fn = fn;
+    queue->jobs[tail].arg = arg;
+    queue->count++;
+    return 1;
+}
+
+static struct WorkerJob queue_pop(struct JobQueue *queue) {
+    struct WorkerJob job = queue->jobs[queue->head];
+    queue->head = (queue->head + 1) % queue->limit;
+    queue->count--;
+    return job;
+}
+
+static int background_runnable(const struct WorkerPool *pool) {
+    return pool->background.count > 0 && pool->background_running < pool->background_limit;
+}
+
+static void* worker_main(void *arg) {
+    struct WorkerPool *pool = (struct WorkerPool *)arg;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->queue.count == 0 && !background_runnable(pool) &&
+               !(pool->stopping && pool->background.count == 0)) {
+            pthread_cond_wait(&pool->not_empty, &pool->lock);
+        }
+        if (pool->queue.count == 0 && !background_runnable(pool)) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL; // Stopping and drained
+        }
+        int background = pool->queue.count == 0;
+        struct WorkerJob job = queue_pop(background ? &pool->background : &pool->queue);
+        pool->running++;
+        if (background) pool->background_running++;
+        pthread_mutex_unlock(&pool->lock);
+
+        job.fn(job.arg);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->running--;
+        if (background) {
+            pool->background_running--;
+            pthread_cond_broadcast(&pool->not_empty); // The next background job, or stopping workers, may proceed
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+struct WorkerPool* worker_pool_create(int threads, int queue_limit) {
+    if (threads < 1) threads = WORKER_POOL_THREADS;
+    if (queue_limit < 1) queue_limit = WORKER_POOL_QUEUE;
+
+    struct WorkerPool *pool = calloc(1, sizeof(struct WorkerPool));
+    if (!pool) return NULL;
+    pool->threads = calloc(threads, sizeof(pthread_t));
+    int queues = queue_init(&pool->queue, queue_limit);
+    queues = queue_init(&pool->background, queue_limit) && queues;
+    if (!pool->threads || !queues) {
+        free(pool->threads);
+        free(pool->queue.jobs);
+        free(pool->background.jobs);
+        free(pool);
+        return NULL;
+    }
+    pool->background_limit = threads / WORKER_POOL_BACKGROUND_SHARE;
+    if (pool->background_limit < 1) pool->background_limit = 1;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->not_empty, NULL);
+
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, worker_main, pool) != 0) break;
+        pool->thread_count++;
+    }
+    if (pool->thread_count == 0) {
+        worker_pool_destroy(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+int worker_pool_submit(struct WorkerPool *pool, worker_job_fn fn, void *arg) {
+    pthread_mutex_lock(&pool->lock);
+    int queued = !pool->stopping && queue_push(&pool->queue, fn, arg);
+    if (queued) pthread_cond_signal(&pool->not_empty);
+    pthread_mutex_unlock(&pool->lock);
+    return queued;
+}
+
+int worker_pool_submit_background(struct WorkerPool *pool, worker_job_fn fn, void *arg) {
+    pthread_mutex_lock(&pool->lock);
+    int queued = !pool->stopping && queue_push(&pool->background, fn, arg);
+    if (queued) pthread_cond_signal(&pool->not_empty);
+    pthread_mutex_unlock(&pool->lock);
+    return queued;
+}
+
+int worker_pool_pending(struct WorkerPool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    int pending = pool->queue.count + pool->background.count + pool->running;
+    pthread_mutex_unlock(&pool->lock);
+    return pending;
+}
+
+void worker_pool_destroy(struct WorkerPool *pool) {
+    if (!pool) return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->not_empty);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->thread_count; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->not_empty);
+    free(pool->threads);
+    free(pool->queue.jobs);
+    free(pool->background.jobs);
+    free(pool);
+}
@@ -0,0 +1,20 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <stddef.h>
+
+#define WORKER_POOL_THREADS 8 // Default concurrent upstream requests
+#define WORKER_POOL_QUEUE 256 // Default queued jobs before rejecting
+#define WORKER_POOL_BACKGROUND_SHARE 4 // Background jobs occupy at most 1/4 of the threads (at least one)
+
+typedef void (*worker_job_fn)(void *arg);
+
+struct WorkerPool; // Opaque pool of threads draining a bounded job queue
+
+struct WorkerPool* worker_pool_create(int threads, int queue_limit); // Function to start the pool
+int worker_pool_submit(struct WorkerPool *pool, worker_job_fn fn, void *arg); // Function to queue a job, 0 when full
+int worker_pool_submit_background(struct WorkerPool *pool, worker_job_fn fn, void *arg); // Function to queue a job that runs only when no other job waits, 0 when full
+void worker_pool_destroy(struct WorkerPool *pool); // Function to finish queued jobs and stop the threads
+int worker_pool_pending(struct WorkerPool *pool); // Function to count queued plus running jobs
+
+#endif
@@ -1,7 +1,31 @@
+// Conversation id; the server mints one on first use and it is kept per browser
+let sessionId = localStorage.getItem('sessionId') || '';
+
+function withSession(headers) {
+    if (sessionId) headers['X-Session-Id'] = sessionId;
+    return headers;
+}
+
+function rememberSession(response) {
+    const id = response.headers.get('X-Session-Id');
+    if (id && id !== sessionId) {
+        sessionId = id;
+        localStorage.setItem('sessionId', id);
+    }
+}
+
 function appendMessage(message, isUser) {
     const chatBox = document.getElementById('chatBox');
     const messageDiv = document.createElement('div');
     messageDiv.className = `message ${isUser ? 'user-message' : 'bot-message'}`;
+    renderMessage(messageDiv, message, isUser);
+
+    chatBox.appendChild(messageDiv);
+    chatBox.scrollTop = chatBox.scrollHeight;
+    return messageDiv;
+}
+
+function renderMessage(messageDiv, message, isUser) {
     if (isUser) {
         messageDiv.textContent = message;
     } else {
@@ -14,9 +38,46 @@ function appendMessage(message, isUser) {
             .replace(/\n/g, '<br>');
         messageDiv.innerHTML = html;
     }
+}
 
-    chatBox.appendChild(messageDiv);
-    chatBox.scrollTop = chatBox.scrollHeight;
+// Read the text/event-stream reply of /chat and render deltas as they arrive
+async function readChatStream(response, messageDiv) {
+    const chatBox = document.getElementById('chatBox');
+    const reader = response.body.getReader();
+    const decoder = new TextDecoder();
+    let pending = '';
+    let text = '';
+
+    for (;;) {
+        const { value, done } = await reader.read();
+        if (done) break;
+        pending += decoder.decode(value, { stream: true });
+
+        let boundary;
+        while ((boundary = pending.indexOf('\n\n')) !== -1) {
+            const rawEvent = pending.slice(0, boundary);
+            pending = pending.slice(boundary + 2);
+
+            let eventName = 'message';
+            let data = '';
+            rawEvent.split('\n').forEach(line => {
+                if (line.startsWith('event:')) eventName = line.slice(6).trim();
+                else if (line.startsWith('data:')) data += line.slice(5).trim();
+            });
+            if (eventName === 'done') return text;
+            if (!data) continue;
+            if (eventName === 'error') {
+                const failure = JSON.parse(data).error || 'The reply was interrupted';
+                return text + '\n\n*' + failure + '*';
+            }
+
+            const delta = JSON.parse(data).text || '';
+            text += delta;
+            renderMessage(messageDiv, text.replace(/^Assistant:\s*/g, ''), false);
+            chatBox.scrollTop = chatBox.scrollHeight;
+        }
+    }
+    return text;
 }
 
 async function sendMessage() {
@@ -31,13 +92,21 @@ async function sendMessage() {
     try {
         const response = await fetch('http://localhost:8080/chat', {
             method: 'POST',
-            headers: { 'Content-Type': 'application/json' },
-            body: JSON.stringify({ message: message })
+            headers: withSession({ 'Content-Type': 'application/json' }),
+            body: JSON.stringify({ message: message, stream: true })
         });
-        
-        const data = await response.json();
-        const aiText = (data.response || '').replace(/^Assistant:\s*/g, '').trim();
-        appendMessage(aiText, false);
+        rememberSession(response);
+
+        const messageDiv = appendMessage('', false);
+        if (response.body && (response.headers.get('Content-Type') || '').startsWith('text/event-stream')) {
+            const aiText = await readChatStream(response, messageDiv);
+            renderMessage(messageDiv, aiText.replace(/^Assistant:\s*/g, '').trim(), false);
+        } else {
+            const data = await response.json();
+            const aiText = (response.ok ? data.response || '' : 'Error: ' + (data.error || response.statusText))
+                .replace(/^Assistant:\s*/g, '').trim();
+            renderMessage(messageDiv, aiText, false);
+        }
     } catch (error) {
         appendMessage('Error: Could not connect to server', false);
         console.error('Error:', error);
@@ -86,7 +155,8 @@ document.getElementById('saveSettings').addEventListener('click', async () => {
 
 document.getElementById('clearHistory').addEventListener('click', async () => {
     try {
-        await fetch('http://localhost:8080/clear', { method: 'POST' });
+        const response = await fetch('http://localhost:8080/clear', { method: 'POST', headers: withSession({}) });
+        rememberSession(response);
         const chatBox = document.getElementById('chatBox');
         chatBox.innerHTML = '';
     } catch (e) {